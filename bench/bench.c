@@ -0,0 +1,413 @@
+/** End-to-end latency benchmark, run by `make bench`.
+ *
+ * This runs create/connect/destroy cycles against a helper built with the
+ * fake ip and wg programs from fake_tool.c, and measures how long each command
+ * takes from start to exit. The fakes log when each of them started and
+ * finished, from which the time taken by each step of a command is derived: a
+ * step lasts from the start of its program until that program finishes. Steps
+ * may overlap, as a command can run several programs at the same time. The
+ * time from the start of the command to the start of its first program is
+ * reported as its setup step, or until it exits if it runs none.
+ *
+ * To be able to run unprivileged, the benchmark first moves itself into a new
+ * user and network namespace, in which it is root. Commands are run with its
+ * own PID as the network namespace argument.
+ *
+ * Results are written as tab-separated values with one line per command and
+ * per step, containing the count and the 50th and 99th percentile and maximum
+ * latency in microseconds.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// Any valid key will do, the fake wg doesn't look at it
+#define BENCH_PEER_KEY "aGVsbG8gd29ybGQgaGVsbG8gd29ybGQgaGVsbG8gd28="
+#define BENCH_PEER_ENDPOINT "192.0.2.1:51820"
+
+#define BENCH_MAX_SERIES 32
+#define BENCH_MAX_NAME 64
+
+static const char * const bench_commands[] = {
+    "cwg_create", "cwg_connect", "cwg_destroy" };
+
+#define BENCH_NUM_COMMANDS 3
+
+
+typedef struct {
+    char name[BENCH_MAX_NAME];
+    int is_step;
+    uint64_t * values;
+    size_t count;
+    size_t size;
+} series_t;
+
+
+typedef struct {
+    int command;
+    uint64_t start;
+    uint64_t end;
+} span_t;
+
+
+static series_t series[BENCH_MAX_SERIES];
+static int num_series = 0;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+/** Add a measurement to the series with the given name, creating it if needed.
+ *
+ * Exits on error.
+ */
+static void record(const char * name, int is_step, uint64_t value) {
+    series_t * s = NULL;
+    uint64_t * new_values;
+    int i;
+
+    for (i = 0; i < num_series; ++i)
+        if (!strcmp(series[i].name, name))
+            s = &series[i];
+
+    if (!s) {
+        if (num_series == BENCH_MAX_SERIES) {
+            fprintf(stderr, "Too many different steps\n");
+            exit(EXIT_FAILURE);
+        }
+        s = &series[num_series++];
+        snprintf(s->name, BENCH_MAX_NAME, "%s", name);
+        s->is_step = is_step;
+    }
+
+    if (s->count == s->size) {
+        s->size = s->size ? 2 * s->size : 1024;
+        new_values = realloc(s->values, s->size * sizeof(uint64_t));
+        if (!new_values) {
+            perror("Error allocating memory");
+            exit(EXIT_FAILURE);
+        }
+        s->values = new_values;
+    }
+
+    s->values[s->count++] = value;
+}
+
+
+/** Write to a file in /proc/self, exiting on error. */
+static void write_proc_file(const char * path, const char * data) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+
+    if ((fd == -1) || (write(fd, data, strlen(data)) != (ssize_t)strlen(data)))
+    {
+        fprintf(stderr, "When writing %s\n", path);
+        perror("Error setting up namespace");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+
+/** Move into a new user and network namespace, as root. */
+static void enter_sandbox(void) {
+    char map[64];
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNET) != 0) {
+        perror("Error creating user and network namespace");
+        exit(EXIT_FAILURE);
+    }
+
+    write_proc_file("/proc/self/setgroups", "deny");
+    snprintf(map, sizeof(map), "0 %d 1\n", (int)uid);
+    write_proc_file("/proc/self/uid_map", map);
+    snprintf(map, sizeof(map), "0 %d 1\n", (int)gid);
+    write_proc_file("/proc/self/gid_map", map);
+}
+
+
+/** Run the helper and wait for it to finish, exiting on error. */
+static void run_helper(
+        const char * helper, const char * const argv[],
+        posix_spawn_file_actions_t * actions)
+{
+    pid_t pid;
+    int status;
+
+    errno = posix_spawn(
+            &pid, helper, actions, NULL, (char * const *)argv, NULL);
+    if (errno) {
+        perror("Error starting helper");
+        exit(EXIT_FAILURE);
+    }
+
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("Error waiting for helper");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+        fprintf(stderr, "Command %s failed\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/** Get the name of a step from a line in the fake tools' log.
+ *
+ * This is the program name followed by its first arguments, up to the first
+ * one with a digit in it, e.g. a device name, and at most two of them.
+ */
+static void step_name(
+        char * name, const char * command, const char * tool_line)
+{
+    int len, num_args = 0;
+    size_t arg_len;
+    const char * cur;
+
+    len = snprintf(name, BENCH_MAX_NAME, "%s", command);
+
+    cur = tool_line;
+    while ((*cur != '\0') && (num_args < 3)) {
+        arg_len = strcspn(cur, " \n");
+        if ((num_args > 0) && (strcspn(cur, "0123456789") < arg_len))
+            break;
+        if (len + arg_len + 2 > BENCH_MAX_NAME)
+            break;
+
+        len += snprintf(name + len, BENCH_MAX_NAME - len, " %.*s",
+                (int)arg_len, cur);
+        ++num_args;
+
+        cur += arg_len;
+        if (*cur == ' ')
+            ++cur;
+        else
+            break;
+    }
+}
+
+
+/** Find the command that was running at a given time.
+ *
+ * The commands run one after the other, so the spans are sorted.
+ *
+ * @return The index of the span, or -1 if no command was running.
+ */
+static int find_span(const span_t * spans, int num_spans, uint64_t time) {
+    int low = 0, high = num_spans;
+
+    // find the first span that starts after time
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+
+        if (spans[mid].start <= time)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if ((low == 0) || (spans[low - 1].end < time))
+        return -1;
+    return low - 1;
+}
+
+
+/** Derive step latencies from the fake tools' log.
+ *
+ * The log is in the order in which the programs finished, which is not the
+ * order in which they started when a command runs several at the same time.
+ */
+static void record_steps(
+        const char * log_path, const span_t * spans, int num_spans)
+{
+    char line[1024], name[BENCH_MAX_NAME];
+    unsigned long long start, end;
+    uint64_t * first_start;
+    const char * tool;
+    int i, offset;
+    FILE * log;
+
+    first_start = malloc(num_spans * sizeof(uint64_t));
+    if (!first_start) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < num_spans; ++i)
+        first_start[i] = spans[i].end;
+
+    log = fopen(log_path, "r");
+    if (!log) {
+        perror("Error opening tool log");
+        exit(EXIT_FAILURE);
+    }
+
+    while (fgets(line, sizeof(line), log)) {
+        if (sscanf(line, "%llu %llu %n", &start, &end, &offset) != 2)
+            continue;
+        tool = line + offset;
+
+        i = find_span(spans, num_spans, start);
+        if ((i == -1) || (end < start))
+            continue;
+
+        step_name(name, bench_commands[spans[i].command], tool);
+        record(name, 1, end - start);
+        if (start < first_start[i])
+            first_start[i] = start;
+    }
+
+    fclose(log);
+
+    for (i = 0; i < num_spans; ++i) {
+        snprintf(name, BENCH_MAX_NAME, "%s setup",
+                bench_commands[spans[i].command]);
+        record(name, 1, first_start[i] - spans[i].start);
+    }
+
+    free(first_start);
+}
+
+
+static int compare_u64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+/** Get a percentile of sorted values, using the nearest-rank method. */
+static uint64_t percentile(const series_t * s, int p) {
+    size_t rank = (s->count * p + 99) / 100;
+    return s->values[rank ? rank - 1 : 0];
+}
+
+
+static int compare_series(const void * a, const void * b) {
+    const series_t * x = a, * y = b;
+
+    if (x->is_step != y->is_step)
+        return x->is_step - y->is_step;
+    return strcmp(x->name, y->name);
+}
+
+
+/** Write the results, in a stable order so that they can be diffed. */
+static void write_results(
+        const char * path, int cycles, const char * settings)
+{
+    FILE * out;
+    int i;
+
+    out = fopen(path, "w");
+    if (!out) {
+        perror("Error opening output file");
+        exit(EXIT_FAILURE);
+    }
+
+    qsort(series, num_series, sizeof(series_t), compare_series);
+
+    fprintf(out, "# net-admin-helper bench, cycles=%d %s\n", cycles, settings);
+    fprintf(out, "kind\tname\tcount\tp50_us\tp99_us\tmax_us\n");
+
+    for (i = 0; i < num_series; ++i) {
+        series_t * s = &series[i];
+
+        qsort(s->values, s->count, sizeof(uint64_t), compare_u64);
+        fprintf(out, "%s\t%s\t%zu\t%.1f\t%.1f\t%.1f\n",
+                s->is_step ? "step" : "command", s->name, s->count,
+                percentile(s, 50) / 1000.0, percentile(s, 99) / 1000.0,
+                s->values[s->count - 1] / 1000.0);
+    }
+
+    if (fclose(out) != 0) {
+        perror("Error writing output file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+int main(int argc, char * argv[]) {
+    char pid[16], net[16], port[16];
+    posix_spawn_file_actions_t actions;
+    span_t * spans;
+    int cycles, c, i, n = 0;
+
+    if (argc != 6) {
+        fprintf(
+                stderr, "Usage: %s <helper> <tool_log> <cycles> <output>"
+                " <settings>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char * helper = argv[1];
+    const char * tool_log = argv[2];
+    cycles = atoi(argv[3]);
+
+    if (cycles < 1) {
+        fprintf(stderr, "Invalid number of cycles\n");
+        return EXIT_FAILURE;
+    }
+
+    spans = malloc(cycles * BENCH_NUM_COMMANDS * sizeof(span_t));
+    if (!spans) {
+        perror("Error allocating memory");
+        return EXIT_FAILURE;
+    }
+
+    enter_sandbox();
+
+    if (truncate(tool_log, 0) != 0 && errno != ENOENT) {
+        perror("Error clearing tool log");
+        return EXIT_FAILURE;
+    }
+
+    // cwg_create prints the public key, which we don't need
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(
+            &actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+
+    const char * const args[BENCH_NUM_COMMANDS][8] = {
+        { helper, "cwg_create", pid, net, "0", port, NULL },
+        { helper, "cwg_connect", pid, net, "0", BENCH_PEER_ENDPOINT,
+            BENCH_PEER_KEY, NULL },
+        { helper, "cwg_destroy", pid, net, "0", NULL } };
+
+    for (i = 0; i < cycles; ++i) {
+        snprintf(net, sizeof(net), "%d", i % (1 << 23));
+        snprintf(port, sizeof(port), "%d", 10000 + i % 50000);
+
+        for (c = 0; c < BENCH_NUM_COMMANDS; ++c) {
+            spans[n].command = c;
+            spans[n].start = now_ns();
+            run_helper(helper, args[c], &actions);
+            spans[n].end = now_ns();
+            record(bench_commands[c], 0, spans[n].end - spans[n].start);
+            ++n;
+        }
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    record_steps(tool_log, spans, n);
+    write_results(argv[4], cycles, argv[5]);
+
+    free(spans);
+    return EXIT_SUCCESS;
+}
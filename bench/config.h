@@ -0,0 +1,23 @@
+#pragma once
+
+/** Configuration used by `make bench`.
+ *
+ * This replaces the top-level config.h when building the helper for the
+ * benchmark. The fake ip and wg programs are built by the Makefile, which
+ * passes their paths in.
+ */
+#define IP BENCH_FAKE_IP
+#define WG BENCH_FAKE_WG
+
+#define USE_IP_COMMAND
+#define USE_WG_COMMAND
+
+#define TIMEOUT_STEP_MS 10000
+#define TIMEOUT_COMMAND_MS 30000
+#define TIMEOUT_KILL_GRACE_MS 1000
+
+#define CWG_PREFIX "cwg"
+
+#define ENABLE_CWG_CREATE
+#define ENABLE_CWG_CONNECT
+#define ENABLE_CWG_DESTROY
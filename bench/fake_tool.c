@@ -0,0 +1,65 @@
+/** Stand-in for the ip and wg programs, used by `make bench`.
+ *
+ * This consumes standard input, waits for a fixed time to simulate the work
+ * the real program would do, and then appends a line to a log file with the
+ * times it started and finished in nanoseconds, its name and its arguments.
+ * It always succeeds.
+ *
+ * The helper runs programs with an empty environment, so the settings are
+ * compiled in: FAKE_NAME is the name to log, FAKE_LOG the path of the log file
+ * and FAKE_DELAY_US the delay in microseconds.
+ */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+int main(int argc, char * argv[]) {
+    uint64_t start = now_ns();
+    char buf[4096];
+    int len, fd, i;
+
+    // e.g. a private key or an ip -batch script, which we ignore
+    while (read(STDIN_FILENO, buf, sizeof(buf)) > 0);
+
+    if (FAKE_DELAY_US > 0) {
+        struct timespec delay = {
+            FAKE_DELAY_US / 1000000, (FAKE_DELAY_US % 1000000) * 1000 };
+        nanosleep(&delay, NULL);
+    }
+
+    // a single write, so that lines from concurrent runs don't mix
+    len = snprintf(
+            buf, sizeof(buf), "%llu %llu %s", (unsigned long long)start,
+            (unsigned long long)now_ns(), FAKE_NAME);
+    for (i = 1; (i < argc) && (len < (int)sizeof(buf) - 1); ++i)
+        len += snprintf(buf + len, sizeof(buf) - len, " %s", argv[i]);
+    if (len > (int)sizeof(buf) - 2)
+        len = sizeof(buf) - 2;
+    buf[len++] = '\n';
+
+    fd = open(FAKE_LOG, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("Opening " FAKE_LOG);
+        return 1;
+    }
+
+    if (write(fd, buf, len) != len) {
+        perror("Writing " FAKE_LOG);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,1013 @@
+/** Microbenchmarks of the helper's building blocks, run by `make microbench`.
+ *
+ * This times single operations of the code the helper is built from, linked
+ * in directly: running programs with run() and run_check(), toggling
+ * capabilities, entering network namespaces the way cwg_set_ns() does, each
+ * of the validation functions, and each implementation of the key and
+ * endpoint parsers.
+ *
+ * Before that, Curve25519 is checked against the test vectors of RFC 7748,
+ * and the SIMD implementations of the parsers against the scalar one, and
+ * that against the validators, on a given number of random and adversarial
+ * keys and endpoints. Any difference is printed, and the benchmark fails.
+ *
+ * Each benchmark is run for a number of warm-up samples, which are discarded,
+ * and then for the given number of samples. A sample times a fixed number of
+ * operations, enough to make fast ones measurable, and the time per operation
+ * is reported as the median, 99th percentile, minimum and maximum over the
+ * samples, in nanoseconds, together with the operations per second at the
+ * median.
+ *
+ * To be able to run unprivileged, the benchmark first moves itself into a new
+ * user and network namespace, in which it is root. If that is not possible,
+ * benchmarks that need privileges fail, and are reported as skipped, with the
+ * reason, rather than stopping the others.
+ *
+ * Results are written as a single JSON object, for tracking over time:
+ *
+ *     { "suite": "net-admin-helper microbench", "samples": 1000,
+ *       "warmup": 100, "cpu": -1, "results": [
+ *         { "name": "run /bin/true", "ops_per_sample": 1,
+ *           "median_ns": ..., "p99_ns": ..., "min_ns": ..., "max_ns": ...,
+ *           "ops_per_s": ... },
+ *         { "name": "...", "skipped": "reason" }, ... ] }
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/capability.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capabilities.h"
+#include "curve25519.h"
+#include "netns.h"
+#include "parse.h"
+#include "secure.h"
+#include "subprocess.h"
+#include "validation.h"
+
+
+#define MB_MAX_RESULTS 64
+#define MB_MAX_NAME 64
+#define MB_MAX_REASON 128
+
+// Operations per sample for functions that take well under a microsecond
+#define MB_FAST_OPS 1000
+
+// Number of different inputs the parsers are timed on
+#define MB_PARSE_INPUTS 256
+
+
+/** One operation of a benchmark.
+ *
+ * @param arg The benchmark's argument.
+ * @return 0 on success, -1 on failure, in which case the benchmark is skipped.
+ */
+typedef int (*mb_op_t)(void * arg);
+
+
+typedef struct {
+    char name[MB_MAX_NAME];
+    char skipped[MB_MAX_REASON];    // empty if it ran
+    int ops;
+    double median_ns;
+    double p99_ns;
+    double min_ns;
+    double max_ns;
+} mb_result_t;
+
+
+static mb_result_t results[MB_MAX_RESULTS];
+static int num_results = 0;
+
+static int num_samples = 1000;
+static int num_warmup = 100;
+static int cpu = -1;
+static int num_checks = 3000000;
+
+// Keeps the results of validators alive
+static volatile int sink;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+/** Add a result, exiting if there are too many. */
+static mb_result_t * add_result(const char * name) {
+    mb_result_t * r;
+
+    if (num_results == MB_MAX_RESULTS) {
+        fprintf(stderr, "Too many benchmarks\n");
+        exit(EXIT_FAILURE);
+    }
+
+    r = &results[num_results++];
+    memset(r, 0, sizeof(mb_result_t));
+    snprintf(r->name, MB_MAX_NAME, "%s", name);
+    return r;
+}
+
+
+/** Record that a benchmark could not be run. */
+static void skip(const char * name, const char * reason) {
+    mb_result_t * r = add_result(name);
+
+    snprintf(r->skipped, MB_MAX_REASON, "%s", reason);
+    fprintf(stderr, "Skipping %s: %s\n", name, reason);
+}
+
+
+static int compare_double(const void * a, const void * b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/** Get a percentile of sorted values, using the nearest-rank method. */
+static double percentile(const double * values, int count, int p) {
+    int rank = (count * p + 99) / 100;
+    return values[rank ? rank - 1 : 0];
+}
+
+
+/** Run a benchmark and record its result.
+ *
+ * @param name Name of the benchmark, without quotes or backslashes.
+ * @param ops Number of operations per sample.
+ * @param op The operation.
+ * @param arg Argument to pass to op.
+ */
+static void measure(const char * name, int ops, mb_op_t op, void * arg) {
+    mb_result_t * r;
+    double * values;
+    uint64_t start;
+    int i, j;
+
+    values = malloc(num_samples * sizeof(double));
+    if (!values) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = -num_warmup; i < num_samples; ++i) {
+        start = now_ns();
+        for (j = 0; j < ops; ++j) {
+            if (op(arg) != 0) {
+                skip(name, "the operation failed, see the messages above");
+                free(values);
+                return;
+            }
+        }
+        if (i >= 0)
+            values[i] = (double)(now_ns() - start) / ops;
+    }
+
+    qsort(values, num_samples, sizeof(double), compare_double);
+
+    r = add_result(name);
+    r->ops = ops;
+    r->median_ns = percentile(values, num_samples, 50);
+    r->p99_ns = percentile(values, num_samples, 99);
+    r->min_ns = values[0];
+    r->max_ns = values[num_samples - 1];
+
+    free(values);
+}
+
+
+/** Write to a file in /proc/self.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int write_proc_file(const char * path, const char * data) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC), err = 0;
+
+    if ((fd == -1) || (write(fd, data, strlen(data)) != (ssize_t)strlen(data)))
+        err = -1;
+    if (fd != -1)
+        close(fd);
+    return err;
+}
+
+
+/** Move into a new user and network namespace, as root.
+ *
+ * Returns 0 on success, -1 on failure, in which case a message is printed.
+ */
+static int enter_sandbox(void) {
+    char map[64];
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNET) != 0) {
+        perror("Error creating user and network namespace");
+        return -1;
+    }
+
+    snprintf(map, sizeof(map), "0 %d 1\n", (int)uid);
+    if (write_proc_file("/proc/self/setgroups", "deny") != 0)
+        goto exit_error;
+    if (write_proc_file("/proc/self/uid_map", map) != 0)
+        goto exit_error;
+    snprintf(map, sizeof(map), "0 %d 1\n", (int)gid);
+    if (write_proc_file("/proc/self/gid_map", map) != 0)
+        goto exit_error;
+
+    return 0;
+
+exit_error:
+    perror("Error mapping user and group in namespace");
+    return -1;
+}
+
+
+/** Find the first of the given programs that exists, or NULL. */
+static const char * find_program(const char * first, const char * second) {
+    if (access(first, X_OK) == 0)
+        return first;
+    if (access(second, X_OK) == 0)
+        return second;
+    return NULL;
+}
+
+
+/* run() and run_check() */
+
+typedef struct {
+    const char * argv[5];
+    const char * in_buf;
+    ssize_t in_size;
+    ssize_t out_size;           // expected amount of output
+} mb_run_t;
+
+
+static int mb_run(void * arg) {
+    mb_run_t * r = (mb_run_t *)arg;
+    const char * out_buf;
+    ssize_t out_size;
+    int exit_code;
+
+    if (run(r->argv[0], r->argv, NULL, NULL, 0, &exit_code, &out_buf,
+            &out_size) != 0)
+        return -1;
+
+    secure_free((void*)out_buf);
+    return exit_code == 0 ? 0 : -1;
+}
+
+
+static int mb_run_check(void * arg) {
+    mb_run_t * r = (mb_run_t *)arg;
+    const char * out_buf;
+    ssize_t out_size;
+
+    if (run_check(
+            r->argv[0], r->argv, NULL, r->in_buf, r->in_size, &out_buf,
+            &out_size) != 0)
+        return -1;
+
+    secure_free((void*)out_buf);
+    if (out_size != r->out_size) {
+        fprintf(stderr, "Expected %zd bytes of output, got %zd\n",
+                r->out_size, out_size);
+        return -1;
+    }
+    return 0;
+}
+
+
+static void bench_run(void) {
+    // Input and output go through pipes of 64 kB, and run_start() writes all
+    // input before reading any output, so what cat echoes must fit in them.
+    static const ssize_t cat_sizes[] = { 0, 256, 4096, 32768 };
+    static const ssize_t head_sizes[] = { 4096, 65536 };
+    const char * true_prog, * cat_prog, * head_prog;
+    char name[MB_MAX_NAME], count[16];
+    char * payload;
+    mb_run_t r;
+    size_t i;
+
+    true_prog = find_program("/bin/true", "/usr/bin/true");
+    cat_prog = find_program("/bin/cat", "/usr/bin/cat");
+    head_prog = find_program("/usr/bin/head", "/bin/head");
+
+    if (secure_init() != 0) {
+        skip("run true", "no locked memory for program output");
+        return;
+    }
+
+    memset(&r, 0, sizeof(r));
+    if (true_prog) {
+        r.argv[0] = true_prog;
+        measure("run true", 1, mb_run, &r);
+    }
+    else
+        skip("run true", "true not found");
+
+    payload = calloc(1, cat_sizes[3]);
+    if (!payload) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < sizeof(cat_sizes) / sizeof(cat_sizes[0]); ++i) {
+        snprintf(name, sizeof(name), "run_check cat in=out=%zd", cat_sizes[i]);
+        if (!cat_prog) {
+            skip(name, "cat not found");
+            continue;
+        }
+
+        memset(&r, 0, sizeof(r));
+        r.argv[0] = cat_prog;
+        r.in_buf = payload;
+        r.in_size = cat_sizes[i];
+        r.out_size = cat_sizes[i];
+        measure(name, 1, mb_run_check, &r);
+    }
+
+    free(payload);
+
+    for (i = 0; i < sizeof(head_sizes) / sizeof(head_sizes[0]); ++i) {
+        snprintf(name, sizeof(name), "run_check head out=%zd", head_sizes[i]);
+        if (!head_prog) {
+            skip(name, "head not found");
+            continue;
+        }
+
+        snprintf(count, sizeof(count), "%zd", head_sizes[i]);
+        memset(&r, 0, sizeof(r));
+        r.argv[0] = head_prog;
+        r.argv[1] = "-c";
+        r.argv[2] = count;
+        r.argv[3] = "/dev/zero";
+        r.out_size = head_sizes[i];
+        measure(name, 1, mb_run_check, &r);
+    }
+}
+
+
+/* Capabilities */
+
+static int mb_cap_toggle(void * arg) {
+    (void)arg;
+
+    if (enable_cap(CAP_NET_ADMIN) != 0)
+        return -1;
+    return disable_cap(CAP_NET_ADMIN);
+}
+
+
+static void bench_caps(void) {
+    // the first call reads the sets, which is not what we want to time
+    if (disable_cap(CAP_NET_ADMIN) != 0) {
+        skip("enable_cap+disable_cap", "CAP_NET_ADMIN is not permitted");
+        return;
+    }
+
+    measure("enable_cap+disable_cap", MB_FAST_OPS / 10, mb_cap_toggle, NULL);
+}
+
+
+/* Network namespaces */
+
+typedef struct {
+    char specs[2][16];
+    int next;
+} mb_netns_t;
+
+
+/** Enter the other namespace, like cwg_set_ns() does. */
+static int mb_set_ns(void * arg) {
+    mb_netns_t * n = (mb_netns_t *)arg;
+    netns_t * ns = netns_get(n->specs[n->next]);
+
+    n->next ^= 1;
+    if (!ns)
+        return -1;
+    return netns_enter(ns);
+}
+
+
+/** Start a process that waits in our network namespace, or a new one.
+ *
+ * Returns its PID, or -1 on failure, in which case a message is printed.
+ */
+static pid_t start_ns_holder(int new_netns) {
+    int fds[2];
+    char ok = 0;
+    pid_t pid;
+
+    if (pipe(fds) != 0) {
+        perror("Error creating pipe");
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (!new_netns || (unshare(CLONE_NEWNET) == 0))
+            ok = 1;
+        else
+            perror("Error creating network namespace");
+        if (write(fds[1], &ok, 1) != 1)
+            _exit(EXIT_FAILURE);
+        close(fds[1]);
+        if (ok)
+            pause();
+        _exit(EXIT_FAILURE);
+    }
+
+    close(fds[1]);
+    if ((pid == -1) || (read(fds[0], &ok, 1) != 1) || !ok) {
+        if (pid == -1)
+            perror("Error starting process");
+        else
+            waitpid(pid, NULL, 0);
+        pid = -1;
+    }
+    close(fds[0]);
+    return pid;
+}
+
+
+static void bench_netns(void) {
+    const char * name = "cwg_set_ns pid";
+    pid_t pids[2];
+    mb_netns_t n;
+    int i;
+
+    pids[0] = start_ns_holder(0);
+    pids[1] = (pids[0] == -1) ? -1 : start_ns_holder(1);
+    if (pids[1] == -1) {
+        skip(name, "could not create a network namespace");
+        goto exit_kill;
+    }
+
+    for (i = 0; i < 2; ++i)
+        snprintf(n.specs[i], sizeof(n.specs[i]), "%d", (int)pids[i]);
+    n.next = 1;
+
+    // alternate between the two namespaces, ending up back in ours
+    measure(name, 2, mb_set_ns, &n);
+    netns_close_all();
+
+exit_kill:
+    for (i = 0; i < 2; ++i) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGKILL);
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+}
+
+
+/* Validation */
+
+typedef struct {
+    const char * name;
+    int (*validate)(const char * cur, const char ** next);
+    const char * input;
+} mb_validator_t;
+
+
+static int mb_validate_end(const char * cur, const char ** next) {
+    (void)next;
+    return validate_end(cur);
+}
+
+
+static int mb_validate_literal(const char * cur, const char ** next) {
+    return validate_literal(':', cur, next);
+}
+
+
+static int mb_validate_number(const char * cur, const char ** next) {
+    return validate_number(5, cur, next);
+}
+
+
+static int mb_validate(void * arg) {
+    const mb_validator_t * v = (const mb_validator_t *)arg;
+    const char * next;
+
+    sink = v->validate(v->input, &next);
+    return sink ? -1 : 0;
+}
+
+
+static void bench_validation(void) {
+    static const mb_validator_t validators[] = {
+        { "validate_end", mb_validate_end, "" },
+        { "validate_literal", mb_validate_literal, ":" },
+        { "validate_letter", validate_letter, "a" },
+        { "validate_digit", validate_digit, "7" },
+        { "validate_number", mb_validate_number, "51820" },
+        { "validate_dev", validate_dev, "wg12345" },
+        { "validate_ip", validate_ip, "192.168.100.200" },
+        { "validate_network", validate_network, "10.100.0.0/16" },
+        { "validate_endpoint", validate_endpoint, "192.0.2.1:51820" },
+        {
+            "validate_wireguard_key", validate_wireguard_key,
+            "aGVsbG8gd29ybGQgaGVsbG8gd29ybGQgaGVsbG8gd28=" } };
+    size_t i;
+
+    for (i = 0; i < sizeof(validators) / sizeof(validators[0]); ++i)
+        measure(
+                validators[i].name, MB_FAST_OPS, mb_validate,
+                (void *)&validators[i]);
+}
+
+
+/* Curve25519 */
+
+/** Decode a key given in hex. */
+static void from_hex(uint8_t key[CURVE25519_KEY_LEN], const char * hex) {
+    int i;
+
+    for (i = 0; i < CURVE25519_KEY_LEN; ++i)
+        sscanf(hex + 2 * i, "%2hhx", &key[i]);
+}
+
+
+/** Compare a key with the expected one given in hex, printing any difference.
+ *
+ * @return 0 if they are the same, 1 otherwise.
+ */
+static int check_key(
+        const char * what, const uint8_t key[CURVE25519_KEY_LEN],
+        const char * hex)
+{
+    uint8_t expected[CURVE25519_KEY_LEN];
+    int i;
+
+    from_hex(expected, hex);
+    if (!memcmp(key, expected, CURVE25519_KEY_LEN))
+        return 0;
+
+    fprintf(stderr, "curve25519: %s is ", what);
+    for (i = 0; i < CURVE25519_KEY_LEN; ++i)
+        fprintf(stderr, "%02x", key[i]);
+    fprintf(stderr, ", expected %s\n", hex);
+    return 1;
+}
+
+
+/** Check Curve25519 against the test vectors in RFC 7748.
+ *
+ * These are the two vectors in section 5.2, the result of 1 and 1000
+ * iterations from the same section, and the key pairs and shared secret of
+ * the Diffie-Hellman example in section 6.1.
+ *
+ * Returns 0 if all of them match, -1 otherwise.
+ */
+static int check_curve25519(void) {
+    static const char * const vectors[][3] = {
+        { "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4",
+          "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c",
+          "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552" },
+        { "4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d",
+          "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493",
+          "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957" }
+    };
+    uint8_t scalar[CURVE25519_KEY_LEN], point[CURVE25519_KEY_LEN];
+    uint8_t out[CURVE25519_KEY_LEN], alice[CURVE25519_KEY_LEN];
+    uint8_t bob[CURVE25519_KEY_LEN], alice_public[CURVE25519_KEY_LEN];
+    uint8_t bob_public[CURVE25519_KEY_LEN];
+    int num_bad = 0, i;
+
+    for (i = 0; i < 2; ++i) {
+        from_hex(scalar, vectors[i][0]);
+        from_hex(point, vectors[i][1]);
+        curve25519(out, scalar, point);
+        num_bad += check_key("section 5.2 vector", out, vectors[i][2]);
+    }
+
+    // k = u = 9, then k = X25519(k, u) and u = the old k
+    memset(scalar, 0, sizeof(scalar));
+    scalar[0] = 9;
+    memcpy(point, scalar, sizeof(point));
+    for (i = 1; i <= 1000; ++i) {
+        curve25519(out, scalar, point);
+        memcpy(point, scalar, sizeof(point));
+        memcpy(scalar, out, sizeof(scalar));
+
+        if (i == 1)
+            num_bad += check_key(
+                    "1 iteration", scalar, "422c8e7a6227d7bca1350b3e2bb7279f"
+                    "7897b87bb6854b783c60e80311ae3079");
+    }
+    num_bad += check_key(
+            "1000 iterations", scalar, "684cf59ba83309552800ef566f2f4d3c"
+            "1c3887c49360e3875f2eb94d99532c51");
+
+    from_hex(
+            alice, "77076d0a7318a57d3c16c17251b26645"
+            "df4c2f87ebc0992ab177fba51db92c2a");
+    from_hex(
+            bob, "5dab087e624a8a4b79e17f8b83800ee6"
+            "6f3bb1292618b6fd1c2f8b27ff88e0eb");
+    curve25519_generate_public(alice_public, alice);
+    curve25519_generate_public(bob_public, bob);
+    num_bad += check_key(
+            "Alice's public key", alice_public,
+            "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a");
+    num_bad += check_key(
+            "Bob's public key", bob_public,
+            "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f");
+
+    curve25519(out, alice, bob_public);
+    num_bad += check_key(
+            "Alice's shared secret", out,
+            "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+    curve25519(out, bob, alice_public);
+    num_bad += check_key(
+            "Bob's shared secret", out,
+            "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+
+    fprintf(
+            stderr, "Checked curve25519 against RFC 7748: %s\n",
+            num_bad ? "it differs" : "all match");
+    return num_bad ? -1 : 0;
+}
+
+
+/* Parsers */
+
+// Inputs for timing one implementation, which go round in turn
+typedef struct {
+    parse_impl_t impl;
+    int next;
+    char keys[MB_PARSE_INPUTS][45];
+    char endpoints[MB_PARSE_INPUTS][22];
+} mb_parse_t;
+
+
+static const char b64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Fixed, so that a failed check can be reproduced
+static uint64_t rng_state = UINT64_C(0x9e3779b97f4a7c15);
+
+
+/** Get a pseudo-random number in [0, n), with xorshift64*. */
+static int rng_below(int n) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (int)(((rng_state * UINT64_C(0x2545f4914f6cdd1d)) >> 33) % n);
+}
+
+
+/** Make a random valid key. */
+static void make_key(char b64[45]) {
+    int i;
+
+    for (i = 0; i < 42; ++i)
+        b64[i] = b64_chars[rng_below(64)];
+    b64[42] = b64_chars[rng_below(16) * 4];     // the unused bits are zero
+    b64[43] = '=';
+    b64[44] = '\0';
+}
+
+
+/** Make a random valid endpoint. */
+static void make_endpoint(char * endpoint, size_t size) {
+    snprintf(
+            endpoint, size, "%d.%d.%d.%d:%d", rng_below(256), rng_below(256),
+            rng_below(256), rng_below(256), 1 + rng_below(65535));
+}
+
+
+/** Make a key that is valid, or has one of the flaws parsers must catch. */
+static void make_test_key(char b64[45]) {
+    static const char near[] = "=+/-_.09AZaz@[`{ ";
+
+    make_key(b64);
+    switch (rng_below(5)) {
+        case 0:
+            break;
+        case 1:     // any byte anywhere, including a null
+            b64[rng_below(44)] = (char)rng_below(256);
+            break;
+        case 2:     // characters next to the base64 ones
+            b64[rng_below(44)] = near[rng_below(sizeof(near) - 1)];
+            break;
+        case 3:     // unused bits set, or no = at the end
+            b64[42] = b64_chars[rng_below(64)];
+            b64[43] = rng_below(2) ? '=' : b64_chars[rng_below(64)];
+            break;
+        case 4:     // bytes with the high bit set, which are negative chars
+            b64[rng_below(44)] = (char)(128 + rng_below(128));
+            break;
+    }
+}
+
+
+/** Make an endpoint that is valid, or only nearly so. */
+static void make_test_endpoint(char endpoint[32]) {
+    static const char * const numbers[] = {
+        "", "0", "1", "9", "00", "01", "10", "99", "100", "199", "249", "250",
+        "255", "256", "300", "999", "0255", "1000", "65535", "65536", "99999",
+        "100000", "4294967297" };
+    static const char chars[] = "0123456789.:";
+    const int num_numbers = sizeof(numbers) / sizeof(numbers[0]);
+    int len, i;
+
+    switch (rng_below(4)) {
+        case 0:
+            make_endpoint(endpoint, 32);
+            break;
+        case 1:     // numbers at and around the limits
+            snprintf(
+                    endpoint, 32, "%s.%s.%s.%s:%s",
+                    numbers[rng_below(num_numbers)],
+                    numbers[rng_below(num_numbers)],
+                    numbers[rng_below(num_numbers)],
+                    numbers[rng_below(num_numbers)],
+                    numbers[rng_below(num_numbers)]);
+            break;
+        case 2:     // the right characters in any order, up to 31 of them
+            len = rng_below(32);
+            for (i = 0; i < len; ++i)
+                endpoint[i] = chars[rng_below(sizeof(chars) - 1)];
+            endpoint[len] = '\0';
+            break;
+        case 3:     // a valid one with one byte changed, or cut short
+            make_endpoint(endpoint, 32);
+            len = strlen(endpoint);
+            i = rng_below(len);
+            if (rng_below(2))
+                endpoint[i] = (char)(1 + rng_below(255));
+            else
+                endpoint[i] = '\0';
+            break;
+    }
+}
+
+
+/** Print an input in hex, ending the line. */
+static void print_input(const char * input, int len) {
+    int i;
+
+    for (i = 0; i < len; ++i)
+        fprintf(stderr, " %02x", (unsigned char)input[i]);
+    fprintf(stderr, "\n");
+}
+
+
+/** Print an input that the implementations disagree on. */
+static void print_mismatch(
+        const char * parser, parse_impl_t impl, const char * input, int len)
+{
+    fprintf(
+            stderr, "%s: %s differs from scalar on", parser,
+            parse_impl_name(impl));
+    print_input(input, len);
+}
+
+
+/** Print an input that a parser accepts but its validator rejects. */
+static void print_rejected(
+        const char * validator, const char * input, int len)
+{
+    fprintf(stderr, "%s rejects what the parser accepts:", validator);
+    print_input(input, len);
+}
+
+
+/** Check that all supported implementations agree with the scalar one.
+ *
+ * What the scalar parsers accept must also pass validate_wireguard_key() and
+ * validate_endpoint(), which check the same arguments of other commands.
+ *
+ * Returns 0 if they do, -1 otherwise, in which case the inputs they disagree
+ * on are printed.
+ */
+static int check_parsers(void) {
+    parse_impl_t best = parse_best_impl();
+    struct sockaddr_in ref_addr, addr;
+    uint8_t ref_key[32], key[32];
+    char b64[45], endpoint[32];
+    int num_valid_keys = 0, num_valid_endpoints = 0, num_bad = 0;
+    int i, impl, ref, ret;
+
+    for (i = 0; (i < num_checks) && (num_bad < 10); ++i) {
+        make_test_key(b64);
+        ref = parse_key_base64_impl(PARSE_SCALAR, ref_key, b64);
+        num_valid_keys += ref == 0;
+
+        if ((ref == 0) && (validate_wireguard_key(b64, NULL) != 0)) {
+            print_rejected("validate_wireguard_key", b64, 44);
+            ++num_bad;
+        }
+
+        for (impl = PARSE_SCALAR + 1; impl <= (int)best; ++impl) {
+            memset(key, 0x55, sizeof(key));
+            ret = parse_key_base64_impl(impl, key, b64);
+            if ((ret != ref) || memcmp(key, ref_key, sizeof(key))) {
+                print_mismatch("parse_key_base64", impl, b64, 44);
+                ++num_bad;
+            }
+        }
+
+        make_test_endpoint(endpoint);
+        ref = parse_endpoint_impl(PARSE_SCALAR, endpoint, &ref_addr);
+        num_valid_endpoints += ref == 0;
+
+        if ((ref == 0) && (validate_endpoint(endpoint, NULL) != 0)) {
+            print_rejected("validate_endpoint", endpoint, strlen(endpoint));
+            ++num_bad;
+        }
+
+        for (impl = PARSE_SCALAR + 1; impl <= (int)best; ++impl) {
+            ret = parse_endpoint_impl(impl, endpoint, &addr);
+            if ((ret != ref) || ((ret == 0) && (
+                    (addr.sin_addr.s_addr != ref_addr.sin_addr.s_addr) ||
+                    (addr.sin_port != ref_addr.sin_port))))
+            {
+                print_mismatch(
+                        "parse_endpoint", impl, endpoint, strlen(endpoint));
+                ++num_bad;
+            }
+        }
+    }
+
+    fprintf(
+            stderr, "Checked the parsers up to %s on %d keys (%d valid) and "
+            "%d endpoints (%d valid): %s\n", parse_impl_name(best), i,
+            num_valid_keys, i, num_valid_endpoints,
+            num_bad ? "they differ" : "all agree");
+    return num_bad ? -1 : 0;
+}
+
+
+static int mb_parse_key(void * arg) {
+    mb_parse_t * p = (mb_parse_t *)arg;
+    uint8_t key[32];
+
+    sink = parse_key_base64_impl(
+            p->impl, key, p->keys[p->next++ % MB_PARSE_INPUTS]);
+    return sink ? -1 : 0;
+}
+
+
+static int mb_parse_endpoint(void * arg) {
+    mb_parse_t * p = (mb_parse_t *)arg;
+    struct sockaddr_in addr;
+
+    sink = parse_endpoint_impl(
+            p->impl, p->endpoints[p->next++ % MB_PARSE_INPUTS], &addr);
+    return sink ? -1 : 0;
+}
+
+
+static void bench_parse(void) {
+    static mb_parse_t p;
+    char name[MB_MAX_NAME];
+    int impl, i;
+
+    for (i = 0; i < MB_PARSE_INPUTS; ++i) {
+        make_key(p.keys[i]);
+        make_endpoint(p.endpoints[i], sizeof(p.endpoints[i]));
+    }
+
+    for (impl = PARSE_SCALAR; impl <= PARSE_AVX2; ++impl) {
+        p.impl = impl;
+
+        snprintf(name, sizeof(name), "parse_key_base64 %s",
+                parse_impl_name(impl));
+        if (impl > (int)parse_best_impl())
+            skip(name, "not supported by this CPU");
+        else
+            measure(name, MB_FAST_OPS, mb_parse_key, &p);
+
+        snprintf(name, sizeof(name), "parse_endpoint %s",
+                parse_impl_name(impl));
+        if (impl > (int)parse_best_impl())
+            skip(name, "not supported by this CPU");
+        else
+            measure(name, MB_FAST_OPS, mb_parse_endpoint, &p);
+    }
+}
+
+
+/** Write the results as JSON. */
+static void write_results(const char * path) {
+    const mb_result_t * r;
+    FILE * out;
+    int i;
+
+    out = fopen(path, "w");
+    if (!out) {
+        perror("Error opening output file");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(out,
+            "{\n  \"suite\": \"net-admin-helper microbench\",\n"
+            "  \"samples\": %d,\n  \"warmup\": %d,\n  \"cpu\": %d,\n"
+            "  \"results\": [\n", num_samples, num_warmup, cpu);
+
+    for (i = 0; i < num_results; ++i) {
+        r = &results[i];
+        if (r->skipped[0])
+            fprintf(out, "    { \"name\": \"%s\", \"skipped\": \"%s\" }",
+                    r->name, r->skipped);
+        else
+            fprintf(out,
+                    "    { \"name\": \"%s\", \"ops_per_sample\": %d,"
+                    " \"median_ns\": %.1f, \"p99_ns\": %.1f,"
+                    " \"min_ns\": %.1f, \"max_ns\": %.1f,"
+                    " \"ops_per_s\": %.0f }",
+                    r->name, r->ops, r->median_ns, r->p99_ns, r->min_ns,
+                    r->max_ns, r->median_ns > 0 ? 1e9 / r->median_ns : 0);
+        fprintf(out, "%s\n", i + 1 < num_results ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+
+    if (fclose(out) != 0) {
+        perror("Error writing output file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/** Parse a numeric option, exiting if it is invalid. */
+static int parse_option(const char * arg, const char * prefix, int min) {
+    const char * value = arg + strlen(prefix);
+    char * end;
+    long n;
+
+    errno = 0;
+    n = strtol(value, &end, 10);
+    if (errno || (end == value) || *end || (n < min) || (n > 1000000000)) {
+        fprintf(stderr, "Invalid option %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return (int)n;
+}
+
+
+int main(int argc, char * argv[]) {
+    cpu_set_t cpus;
+    int i;
+
+    for (i = 1; i < argc - 1; ++i) {
+        if (!strncmp(argv[i], "--samples=", 10))
+            num_samples = parse_option(argv[i], "--samples=", 1);
+        else if (!strncmp(argv[i], "--warmup=", 9))
+            num_warmup = parse_option(argv[i], "--warmup=", 0);
+        else if (!strncmp(argv[i], "--cpu=", 6))
+            cpu = parse_option(argv[i], "--cpu=", -1);
+        else if (!strncmp(argv[i], "--check=", 8))
+            num_checks = parse_option(argv[i], "--check=", 0);
+        else
+            break;
+    }
+
+    if (i != argc - 1) {
+        fprintf(
+                stderr, "Usage: %s [--samples=<n>] [--warmup=<n>]"
+                " [--cpu=<cpu>] [--check=<n>] <output>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // pin before starting any processes, so that they stay on it too
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            perror("Error pinning to CPU");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((check_curve25519() != 0) || (check_parsers() != 0))
+        return EXIT_FAILURE;
+
+    bench_validation();
+    bench_parse();
+
+    if (enter_sandbox() != 0)
+        fprintf(stderr, "Continuing without privileges\n");
+
+    bench_caps();
+    bench_run();
+    bench_netns();
+
+    write_results(argv[argc - 1]);
+    return EXIT_SUCCESS;
+}
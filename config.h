@@ -0,0 +1,55 @@
+#pragma once
+
+/** Paths to helper programs.
+ *
+ * net-admin-helper does not search the PATH for reasons of security, so the
+ * paths to the helper applications need to be configured explicitly (and they
+ * must be installed, obviously). This is done here. The given paths should work
+ * in most cases (Debian, Red Hat, and derivatives).
+ */
+#define IP "/sbin/ip"
+#define WG "/tmp/fakewg"
+
+
+/** Settings for container WireGuard */
+
+// Device name prefix, use e.g. your application name
+#define CWG_PREFIX "cwg"
+
+// To enable a task, remove the `// ` at the start of its line.
+#define ENABLE_CWG_CREATE
+#define ENABLE_CWG_CONNECT
+#define ENABLE_CWG_DESTROY
+#define ENABLE_CWG_CREATE_MANY
+#define ENABLE_CWG_DESTROY_MANY
+#define CWG_MANY_THREADS 8
+
+
+#define SERVE_SOCKET "/tmp/nah/helper.sock"
+#define SERVE_ALLOWED_UIDS 0
+#define SERVE_ALLOWED_GIDS
+#define SERVE_SPARE_WORKERS 2
+#define SERVE_MAX_WORKERS 16
+#define ENABLE_SERVE
+#define ENABLE_CWG_APPLY
+#define ENABLE_CWG_STATS
+#define ENABLE_CWG_DESTROY_ALL
+#define ENABLE_CWG_CONNECT_MANY
+#define ENABLE_CWG_ALLOC
+#define ENABLE_CWG_FREE
+#define CWG_STATE_DIR "/tmp/nahstate"
+#define CWG_PORT_MIN 51820
+#define CWG_PORT_MAX 51830
+
+#define TIMEOUT_STEP_MS 10000
+#define TIMEOUT_COMMAND_MS 30000
+#define TIMEOUT_KILL_GRACE_MS 1000
+
+#define METRICS_DIR "/tmp/nah-metrics"
+#define ENABLE_STATS_DUMP
+
+#define ENABLE_CWG_POOL_FILL
+#define ENABLE_CWG_ATTACH
+#define CWG_POOL_NETNS "/run/netns/cwg-pool"
+#define CWG_POOL_SIZE 4
+#define CWG_POOL_LOW_WATER 2
@@ -0,0 +1,307 @@
+/** Allocating numbers from a fixed range, with a persistent index. */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc.h"
+
+
+// "nahalloc" followed by the format version
+#define ALLOC_MAGIC UINT64_C(0x6e6168616c6c6f01)
+
+// The header has a page to itself, so that it can be synced separately
+#define ALLOC_HEADER_SIZE 4096
+
+
+struct alloc_header {
+    uint64_t magic;
+    uint32_t num_items;
+    uint32_t num_used;
+    uint32_t dirty;             // set while the bitmaps are being changed
+};
+
+
+/** Compute the sizes and offsets of the levels, and the size of the file.
+ *
+ * @param index The index to set num_levels and level_words of.
+ * @param num_items The size of the range.
+ * @param offsets (out) The offset of each level in the file.
+ * @return The size of the file.
+ */
+static size_t alloc_layout(
+        alloc_index_t * index, uint32_t num_items, size_t offsets[])
+{
+    size_t offset = ALLOC_HEADER_SIZE;
+    uint64_t num_bits = num_items;
+    int level = 0;
+
+    do {
+        index->level_words[level] = (num_bits + 63) / 64;
+        offsets[level] = offset;
+        offset += index->level_words[level] * sizeof(uint64_t);
+        num_bits = index->level_words[level];
+        ++level;
+    } while ((num_bits > 1) && (level < ALLOC_MAX_LEVELS));
+
+    index->num_levels = level;
+    return offset;
+}
+
+
+/** Set the bits past the end of a level, so that they're never free. */
+static void alloc_pad(uint64_t * words, uint32_t num_words, uint64_t num_bits) {
+    if (num_bits % 64)
+        words[num_words - 1] |= ~UINT64_C(0) << (num_bits % 64);
+}
+
+
+/** Recompute the summary levels from the bitmap of numbers. */
+static void alloc_rebuild(alloc_index_t * index) {
+    uint64_t * below, * above;
+    uint32_t num_used = 0, i;
+    int level;
+
+    alloc_pad(
+            index->levels[0], index->level_words[0],
+            index->header->num_items);
+
+    for (i = 0; i < index->level_words[0]; ++i)
+        num_used += __builtin_popcountll(index->levels[0][i]);
+    num_used -= index->level_words[0] * 64 - index->header->num_items;
+
+    for (level = 1; level < index->num_levels; ++level) {
+        below = index->levels[level - 1];
+        above = index->levels[level];
+        memset(above, 0, index->level_words[level] * sizeof(uint64_t));
+        for (i = 0; i < index->level_words[level - 1]; ++i)
+            if (below[i] == ~UINT64_C(0))
+                above[i / 64] |= UINT64_C(1) << (i % 64);
+        alloc_pad(
+                above, index->level_words[level],
+                index->level_words[level - 1]);
+    }
+
+    index->header->num_used = num_used;
+}
+
+
+/** Write changes to disk.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int alloc_sync(alloc_index_t * index, size_t size) {
+    if (msync(index->map, size, MS_SYNC) != 0) {
+        perror("Error writing allocation index");
+        return -1;
+    }
+    return 0;
+}
+
+
+/** Start changing the bitmaps.
+ *
+ * The dirty flag is on disk before anything else changes, so that a crash
+ * part way through is noticed when the index is next opened.
+ */
+static int alloc_begin(alloc_index_t * index) {
+    index->header->dirty = 1;
+    return alloc_sync(index, ALLOC_HEADER_SIZE);
+}
+
+
+/** Finish changing the bitmaps, and write them to disk. */
+static int alloc_commit(alloc_index_t * index) {
+    if (alloc_sync(index, index->map_size))
+        return -1;
+
+    // if this doesn't make it to disk, we'll just rebuild the summaries
+    index->header->dirty = 0;
+    return 0;
+}
+
+
+/** Open an index, creating it if needed. */
+int alloc_open(alloc_index_t * index, const char * path, uint32_t num_items) {
+    size_t offsets[ALLOC_MAX_LEVELS];
+    struct stat st;
+    int level;
+
+    if ((num_items == 0) || (num_items > (UINT32_C(1) << 30))) {
+        fprintf(stderr, "Invalid allocation range size %u\n", num_items);
+        return -1;
+    }
+
+    index->map_size = alloc_layout(index, num_items, offsets);
+
+    index->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (index->fd == -1) {
+        fprintf(
+                stderr, "Error opening allocation index %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    // held until alloc_close()
+    while (flock(index->fd, LOCK_EX) != 0) {
+        if (errno == EINTR) continue;
+        perror("Error locking allocation index");
+        goto exit_fd;
+    }
+
+    if (fstat(index->fd, &st) != 0) {
+        perror("Error reading allocation index");
+        goto exit_fd;
+    }
+
+    // a new file, or one left empty by a crash while creating it
+    if (st.st_size == 0) {
+        if (ftruncate(index->fd, index->map_size) != 0) {
+            perror("Error creating allocation index");
+            goto exit_fd;
+        }
+    }
+    else if ((size_t)st.st_size != index->map_size) {
+        fprintf(
+                stderr, "Allocation index %s has the wrong size for a range "
+                "of %u, remove it to start over\n", path, num_items);
+        goto exit_fd;
+    }
+
+    index->map = mmap(
+            NULL, index->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            index->fd, 0);
+    if (index->map == MAP_FAILED) {
+        perror("Error mapping allocation index");
+        goto exit_fd;
+    }
+
+    index->header = (alloc_header_t *)index->map;
+    for (level = 0; level < index->num_levels; ++level)
+        index->levels[level] = (uint64_t *)(index->map + offsets[level]);
+
+    if (index->header->magic == 0) {
+        // all numbers are free in a zero-filled file
+        index->header->num_items = num_items;
+        index->header->dirty = 1;
+    }
+    else if (
+            (index->header->magic != ALLOC_MAGIC) ||
+            (index->header->num_items != num_items))
+    {
+        fprintf(
+                stderr, "Allocation index %s is not for a range of %u, "
+                "remove it to start over\n", path, num_items);
+        goto exit_map;
+    }
+
+    if (index->header->dirty) {
+        alloc_rebuild(index);
+        index->header->magic = ALLOC_MAGIC;
+        if (alloc_commit(index))
+            goto exit_map;
+    }
+
+    return 0;
+
+exit_map:
+    munmap(index->map, index->map_size);
+
+exit_fd:
+    close(index->fd);
+    return -1;
+}
+
+
+/** Close an index and release its lock. */
+void alloc_close(alloc_index_t * index) {
+    munmap(index->map, index->map_size);
+    close(index->fd);
+}
+
+
+/** Find the lowest free number by going down the levels.
+ *
+ * Returns 0 on success, 1 if all are in use, -1 if the summaries are wrong.
+ */
+static int alloc_find(alloc_index_t * index, uint32_t * item) {
+    uint64_t word = 0, pos = 0;
+    int level;
+
+    for (level = index->num_levels - 1; level >= 0; --level) {
+        word = index->levels[level][pos];
+        if (word == ~UINT64_C(0))
+            return level == index->num_levels - 1 ? 1 : -1;
+        pos = pos * 64 + __builtin_ctzll(~word);
+    }
+
+    *item = (uint32_t)pos;
+    return 0;
+}
+
+
+/** Allocate the lowest free number. */
+int alloc_get(alloc_index_t * index, uint32_t * item) {
+    uint64_t * word;
+    uint32_t pos;
+    int ret, level;
+
+    ret = alloc_find(index, item);
+    if (ret == -1) {
+        // can only happen if the file was changed behind our back
+        alloc_rebuild(index);
+        ret = alloc_find(index, item);
+    }
+    if (ret != 0)
+        return ret == 1 ? 1 : -1;
+
+    if (alloc_begin(index))
+        return -1;
+
+    // mark it, and any words that are now full in the levels above
+    pos = *item;
+    for (level = 0; level < index->num_levels; ++level) {
+        word = &index->levels[level][pos / 64];
+        *word |= UINT64_C(1) << (pos % 64);
+        if (*word != ~UINT64_C(0))
+            break;
+        pos /= 64;
+    }
+    ++index->header->num_used;
+
+    return alloc_commit(index);
+}
+
+
+/** Free a number. */
+int alloc_put(alloc_index_t * index, uint32_t item) {
+    uint64_t * word;
+    uint32_t pos = item;
+    int was_full, level;
+
+    if (item >= index->header->num_items)
+        return 1;
+
+    if (!(index->levels[0][item / 64] & (UINT64_C(1) << (item % 64))))
+        return 1;
+
+    if (alloc_begin(index))
+        return -1;
+
+    // unmark it, and any words that are no longer full in the levels above
+    for (level = 0; level < index->num_levels; ++level) {
+        word = &index->levels[level][pos / 64];
+        was_full = *word == ~UINT64_C(0);
+        *word &= ~(UINT64_C(1) << (pos % 64));
+        if (!was_full)
+            break;
+        pos /= 64;
+    }
+    --index->header->num_used;
+
+    return alloc_commit(index);
+}
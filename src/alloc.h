@@ -0,0 +1,77 @@
+/** Allocating numbers from a fixed range, with a persistent index.
+ *
+ * An index keeps track of which numbers in [0, num_items) are in use. It is
+ * stored in a file, which is memory-mapped while the index is open, and locked
+ * with flock() so that several processes can use it at the same time.
+ *
+ * The index is a bitmap with one bit per number, plus a hierarchy of summary
+ * bitmaps in which each bit says whether a whole 64-bit word of the level below
+ * is in use. Finding a free number takes one look at a word per level, so it
+ * does not get slower as the range fills up. For 2^23 numbers there are four
+ * levels, and the file is just over 1 MiB.
+ *
+ * Changes are written to disk before alloc_get() and alloc_put() return. The
+ * bitmap of numbers is authoritative, and the summaries are rebuilt from it if
+ * a change was interrupted by a crash.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Maximum number of levels, enough for 2^30 numbers. */
+#define ALLOC_MAX_LEVELS 5
+
+
+typedef struct alloc_header alloc_header_t;
+
+typedef struct {
+    int fd;
+    char * map;
+    size_t map_size;
+    alloc_header_t * header;
+    int num_levels;
+    uint64_t * levels[ALLOC_MAX_LEVELS];   // 0 is the bitmap of numbers
+    uint32_t level_words[ALLOC_MAX_LEVELS];
+} alloc_index_t;
+
+
+/** Open an index, creating it if needed.
+ *
+ * The index stays locked until it is closed, so keep it open briefly.
+ *
+ * @param index The index object to initialise.
+ * @param path The file to store the index in.
+ * @param num_items The size of the range. Must match that of an existing file.
+ * @return 0 on success, -1 on failure, in which case a message is printed.
+ */
+int alloc_open(alloc_index_t * index, const char * path, uint32_t num_items);
+
+
+/** Close an index and release its lock.
+ *
+ * @param index The index to close.
+ */
+void alloc_close(alloc_index_t * index);
+
+
+/** Allocate the lowest free number.
+ *
+ * @param index The index to allocate from.
+ * @param item (out) The allocated number.
+ * @return 0 on success, 1 if all numbers are in use, -1 on failure, in which
+ *          case a message is printed.
+ */
+int alloc_get(alloc_index_t * index, uint32_t * item);
+
+
+/** Free a number.
+ *
+ * @param index The index to free it in.
+ * @param item The number to free.
+ * @return 0 on success, 1 if the number was not in use or is out of range,
+ *          -1 on failure, in which case a message is printed.
+ */
+int alloc_put(alloc_index_t * index, uint32_t item);
+
@@ -1,130 +1,173 @@
 /* Functions for manipulating capabilities. */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <sys/capability.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 
 #include "capabilities.h"
+#include "probes.h"
 
 
-/** Set ambient capabilities.
- *
- * This sets up the ambient capabilities set. Normal capabilities (in the
- * Inherited, Permitted and Effective sets) do not survive a call to execve().
- * In order to pass on some of our capabilities across an execve() call, we need
- * to add them to the Ambient set. This function does that, specifically for the
- * CAP_NET_ADMIN capability.
- *
- * Note that CAP_NET_ADMIN needs to be added to the Inherited and Permitted sets
- * for this executable using setcap (8), as we can only pass on capabilities we
- * have, not add new ones.
- *
- * @return 0 on success, -1 on failure.
- */
-int set_ambient_capabilities() {
-    cap_t caps;
-    cap_value_t cap_list[] = {CAP_NET_ADMIN};
+// The kernel's interface to capget() and capset(), declared here because
+// libcap's headers don't reliably mix with the kernel's.
+#define CAPS_VERSION_3 0x20080522
+#define CAPS_WORDS 2
 
-    caps = cap_get_proc();
-    if (caps == NULL) {
-        perror("Error getting capabilities");
-        goto exit_0;
-    }
+typedef struct {
+    uint32_t version;
+    int pid;
+} caps_header_t;
 
-    if (cap_set_flag(caps, CAP_EFFECTIVE, 1, cap_list, CAP_SET) != 0) {
-        perror("Error setting effective capabilities");
-        goto exit_0;
-    }
+typedef struct {
+    uint32_t effective;
+    uint32_t permitted;
+    uint32_t inheritable;
+} caps_data_t;
 
-    if (cap_set_flag(caps, CAP_INHERITABLE, 1, cap_list, CAP_SET) != 0) {
-        perror("Error setting inheritable capabilities");
-        goto exit_0;
-    }
 
-    if (cap_set_proc(caps) != 0) {
-        perror("Error setting capabilities");
-        goto exit_0;
-    }
+// Capabilities to pass on to programs we run
+static cap_value_t ambient_caps[] = {CAP_NET_ADMIN};
 
-    if (cap_free(caps) != 0) {
-        perror("Error freeing capabilities");
-        goto exit_0;
-    }
 
-    if (prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE, CAP_NET_ADMIN, 0, 0) != 0)
-    {
-        perror("Error setting ambient capabilities");
-        goto exit_0;
-    }
+// Capabilities belong to threads, and a new thread starts out with those of
+// the thread that created it. So each thread keeps its own copy of its sets,
+// which is read when first needed and kept up to date when they are changed.
+static _Thread_local struct {
+    int loaded;
+    int ambient_raised;
+    caps_data_t data[CAPS_WORDS];
+} caps_state;
 
-    return 0;
-
-exit_0:
-    return -1;
-}
 
+/** Read the calling thread's capability sets, unless we have them already.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int caps_load(void) {
+    caps_header_t header = {CAPS_VERSION_3, 0};
 
-/** Enable a specific capability. */
-int enable_cap(cap_value_t cap) {
-    cap_t caps;
+    if (caps_state.loaded)
+        return 0;
 
-    caps = cap_get_proc();
-    if (caps == NULL) {
+    if (syscall(SYS_capget, &header, caps_state.data) != 0) {
         perror("Error getting capabilities");
-        goto exit_0;
+        return -1;
     }
 
-    if (cap_set_flag(caps, CAP_EFFECTIVE, 1, &cap, CAP_SET) != 0) {
-        perror("Error setting effective capabilities");
-        goto exit_0;
-    }
+    caps_state.loaded = 1;
+    return 0;
+}
 
-    if (cap_set_proc(caps) != 0) {
-        perror("Error setting capabilities");
-        goto exit_0;
+
+/** Set or clear capabilities in one of the calling thread's sets.
+ *
+ * This makes a single capset() call, or none if nothing changes.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int caps_set_flag(
+        cap_flag_t flag, int num_caps, const cap_value_t caps[], int value)
+{
+    caps_header_t header = {CAPS_VERSION_3, 0};
+    caps_data_t old[CAPS_WORDS];
+    caps_data_t * data;
+    uint32_t * word, bit;
+    int i;
+
+    if (caps_load() != 0)
+        return -1;
+
+    memcpy(old, caps_state.data, sizeof(old));
+
+    for (i = 0; i < num_caps; ++i) {
+        if ((caps[i] < 0) || (caps[i] >= 32 * CAPS_WORDS)) {
+            fprintf(stderr, "Invalid capability %d\n", (int)caps[i]);
+            goto exit_restore;
+        }
+
+        data = &caps_state.data[caps[i] / 32];
+        if (flag == CAP_EFFECTIVE)
+            word = &data->effective;
+        else if (flag == CAP_PERMITTED)
+            word = &data->permitted;
+        else
+            word = &data->inheritable;
+
+        bit = UINT32_C(1) << (caps[i] % 32);
+        *word = value ? (*word | bit) : (*word & ~bit);
     }
 
-    if (cap_free(caps) != 0) {
-        perror("Error freeing capabilities");
-        goto exit_0;
+    if (memcmp(old, caps_state.data, sizeof(old)) == 0)
+        return 0;
+
+    if (syscall(SYS_capset, &header, caps_state.data) != 0) {
+        perror("Error setting capabilities");
+        goto exit_restore;
     }
 
+    PROBE4(caps_set, (int)flag, (int)caps[0], num_caps, value);
     return 0;
 
-exit_0:
+exit_restore:
+    memcpy(caps_state.data, old, sizeof(old));
     return -1;
 }
 
 
-/** Disable a specific capability. */
-int disable_cap(cap_value_t cap) {
-    cap_t caps;
-
-    caps = cap_get_proc();
-    if (caps == NULL) {
-        perror("Error getting capabilities");
-        goto exit_0;
-    }
+/** Prepare for passing on capabilities to programs we run.
+ *
+ * Normal capabilities (in the Inherited, Permitted and Effective sets) do not
+ * survive a call to execve(). In order to pass on some of our capabilities
+ * across an execve() call, we need to add them to the Ambient set, which in
+ * turn requires them to be in the Inherited set. This function does both,
+ * specifically for the CAP_NET_ADMIN capability.
+ *
+ * The Ambient set is copied to child processes, and only takes effect when
+ * they call execve(), so raising it here gives us no extra privileges. Doing
+ * it once per thread rather than in every child saves system calls on each
+ * program we start.
+ *
+ * Note that CAP_NET_ADMIN needs to be added to the Inherited and Permitted sets
+ * for this executable using setcap (8), as we can only pass on capabilities we
+ * have, not add new ones.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int prepare_ambient_capabilities() {
+    int num_caps = sizeof(ambient_caps) / sizeof(cap_value_t), i;
 
-    if (cap_set_flag(caps, CAP_EFFECTIVE, 1, &cap, CAP_CLEAR) != 0) {
-        perror("Error setting effective capabilities");
-        goto exit_0;
-    }
+    if (caps_state.ambient_raised)
+        return 0;
 
-    if (cap_set_proc(caps) != 0) {
-        perror("Error setting capabilities");
-        goto exit_0;
-    }
+    if (caps_set_flag(CAP_INHERITABLE, num_caps, ambient_caps, 1) != 0)
+        return -1;
 
-    if (cap_free(caps) != 0) {
-        perror("Error freeing capabilities");
-        goto exit_0;
+    for (i = 0; i < num_caps; ++i) {
+        if (prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE, ambient_caps[i], 0, 0))
+        {
+            perror("Error setting ambient capabilities");
+            return -1;
+        }
     }
 
+    caps_state.ambient_raised = 1;
     return 0;
+}
 
-exit_0:
-    return -1;
+
+/** Enable a specific capability. */
+int enable_cap(cap_value_t cap) {
+    return caps_set_flag(CAP_EFFECTIVE, 1, &cap, 1);
+}
+
+
+/** Disable a specific capability. */
+int disable_cap(cap_value_t cap) {
+    return caps_set_flag(CAP_EFFECTIVE, 1, &cap, 0);
 }
 
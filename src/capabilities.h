@@ -3,17 +3,23 @@
 #include <sys/capability.h>
 
 
-/** Set ambient capabilities.
+/** Prepare for passing on capabilities to programs we run.
  *
- * This sets up ambient capabilities for use by an about-to-be execve()'d
- * program.
+ * This must be called before starting a child process that will execve() a
+ * program. The child inherits the prepared Ambient set, so it need not do
+ * anything itself. Only the first call in each thread makes system calls.
  *
  * @return 0 on success, -1 on failure.
  */
-int set_ambient_capabilities();
+int prepare_ambient_capabilities();
 
 
 /** Enable the given capability.
+ *
+ * Capabilities are per thread, and so is the effect of this function. Each
+ * thread reads its capability sets once, after which enabling or disabling a
+ * capability takes a single system call, or none if it is already in that
+ * state.
  *
  * @return 0 on success, -1 on failure.
  */
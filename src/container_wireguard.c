@@ -1,418 +1,3248 @@
-#include <fcntl.h>
+#include <arpa/inet.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <net/if.h>
 #include <sched.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/capability.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "capabilities.h"
-#include "subprocess.h"
-#include "validation.h"
+#include "alloc.h"
+#include "capabilities.h"
+#include "curve25519.h"
+#include "netlink.h"
+#include "netns.h"
+#include "parallel.h"
+#include "parse.h"
+#include "probes.h"
+#include "rtnetlink.h"
+#include "secure.h"
+#include "steps.h"
+#include "subprocess.h"
+#include "trace.h"
+#include "validation.h"
+#include "wireguard.h"
+
+#include "config.h"
+#include "container_wireguard.h"
+
+
+// Largest network number, they are 23 bits
+#define CWG_MAX_NET ((1 << 23) - 1)
+
+// Largest index of a pool device
+#define CWG_MAX_POOL_INDEX 999999
+
+// Exit code of cwg_attach if there is no device in the pool
+#define CWG_POOL_EMPTY 2
+
+
+/** Kinds of arguments, see cwg_parse_args(). */
+typedef enum {
+    CWG_ARG_END,
+    CWG_ARG_NETNS,
+    CWG_ARG_NET,
+    CWG_ARG_HOST,
+    CWG_ARG_PORT,
+    CWG_ARG_ENDPOINT,
+    CWG_ARG_KEY,
+    CWG_ARG_ENDPOINT_OR_NONE,   // - for none
+    CWG_ARG_KEY_OR_NONE         // - for none
+} cwg_arg_t;
+
+
+/** The parsed arguments of a task, and what is derived from them.
+ *
+ * Fields for kinds of arguments that a schema doesn't have are not set, apart
+ * from the peer strings, which are NULL if there is no peer.
+ */
+typedef struct {
+    const char * netns;
+    int net;
+    int host;
+    int port;
+    const char * peer_endpoint;
+    const char * peer_key;
+    struct sockaddr_in endpoint;        // parsed peer_endpoint
+    wg_key_t key;                       // parsed peer_key
+
+    char dev[IFNAMSIZ];
+    uint32_t network_ip;                // in host byte order
+    uint32_t host_ip;
+#if defined(USE_IP_COMMAND) || defined(USE_WG_COMMAND)
+    char network_ip_nm[19];             // as a.b.c.d/31
+#endif
+#ifdef USE_IP_COMMAND
+    char host_ip_str[16];               // as a.b.c.d
+#endif
+} cwg_args_t;
+
+
+// The arguments of each task, and the fields of each kind of input record
+static const cwg_arg_t cwg_create_schema[] = {
+    CWG_ARG_NETNS, CWG_ARG_NET, CWG_ARG_HOST, CWG_ARG_PORT, CWG_ARG_END };
+
+static const cwg_arg_t cwg_connect_schema[] = {
+    CWG_ARG_NETNS, CWG_ARG_NET, CWG_ARG_HOST, CWG_ARG_ENDPOINT, CWG_ARG_KEY,
+    CWG_ARG_END };
+
+static const cwg_arg_t cwg_destroy_schema[] = {
+    CWG_ARG_NETNS, CWG_ARG_NET, CWG_ARG_HOST, CWG_ARG_END };
+
+static const cwg_arg_t cwg_connect_many_schema[] = {
+    CWG_ARG_NET, CWG_ARG_HOST, CWG_ARG_ENDPOINT, CWG_ARG_KEY, CWG_ARG_END };
+
+#ifdef ENABLE_CWG_APPLY
+static const cwg_arg_t cwg_apply_schema[] = {
+    CWG_ARG_NET, CWG_ARG_HOST, CWG_ARG_PORT, CWG_ARG_ENDPOINT_OR_NONE,
+    CWG_ARG_KEY_OR_NONE, CWG_ARG_END };
+#endif
+
+/** The number of arguments in a schema. */
+#define CWG_NUM_ARGS(schema) ((int)(sizeof(schema) / sizeof(schema[0]) - 1))
+
+
+// The longest device name is <prefix>-8388607-1
+_Static_assert(
+        sizeof(CWG_PREFIX) + 10 <= IFNAMSIZ,
+        "CWG_PREFIX is too long for a device name");
+
+#if defined(ENABLE_CWG_POOL_FILL) || defined(ENABLE_CWG_ATTACH)
+
+// Pool devices are called <prefix>-p<index>, which is shorter
+_Static_assert(
+        (0 < CWG_POOL_LOW_WATER) && (CWG_POOL_LOW_WATER <= CWG_POOL_SIZE) &&
+        (CWG_POOL_SIZE <= CWG_MAX_POOL_INDEX + 1),
+        "CWG_POOL_LOW_WATER or CWG_POOL_SIZE out of range");
+
+#endif
+
+
+/** Parse a decimal number of at most max_digits digits.
+ *
+ * Returns 0 on success, 1 if the string is not such a number.
+ */
+static int cwg_parse_uint(const char * str, int max_digits, int * value) {
+    int result = 0, i;
+
+    for (i = 0; str[i] != '\0'; ++i) {
+        if ((i == max_digits) || (str[i] < '0') || ('9' < str[i]))
+            return 1;
+        result = result * 10 + (str[i] - '0');
+    }
+
+    if (i == 0)
+        return 1;
+
+    *value = result;
+    return 0;
+}
+
+
+/** Make the name of the device for a net and host. */
+static void cwg_format_device_name(char dev[IFNAMSIZ], int net, int host) {
+    snprintf(dev, IFNAMSIZ, "%s-%d-%d", CWG_PREFIX, net, host);
+}
+
+
+#if defined(USE_IP_COMMAND) || defined(USE_WG_COMMAND)
+
+/** Format an IPv4 address in host byte order as a dotted quad. */
+static void cwg_format_ip(char * buf, size_t size, uint32_t ip) {
+    snprintf(
+            buf, size, "%"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32,
+            ip >> 24, ip >> 16 & 0xff, ip >> 8 & 0xff, ip & 0xff);
+}
+
+#endif
+
+
+/** Parse one argument into args.
+ *
+ * Returns NULL on success, or an error message.
+ */
+static const char * cwg_parse_arg(
+        cwg_arg_t kind, const char * arg, cwg_args_t * args)
+{
+    int none = !strcmp(arg, "-");
+
+    switch (kind) {
+    case CWG_ARG_NETNS:
+        if (netns_validate(arg))
+            return "Invalid network namespace";
+        args->netns = arg;
+        break;
+
+    case CWG_ARG_NET:
+        if (cwg_parse_uint(arg, 7, &args->net))
+            return "Invalid network number";
+        if (CWG_MAX_NET < args->net)
+            return "Network number out of range [0, 8388607]";
+        break;
+
+    case CWG_ARG_HOST:
+        if (cwg_parse_uint(arg, 1, &args->host))
+            return "Invalid host number";
+        if (1 < args->host)
+            return "Host number must be 0 or 1";
+        break;
+
+    case CWG_ARG_PORT:
+        if (cwg_parse_uint(arg, 5, &args->port))
+            return "Invalid listen port";
+        if ((args->port < 1) || (65535 < args->port))
+            return "Port number out of range [1, 65535]";
+        break;
+
+    case CWG_ARG_ENDPOINT_OR_NONE:
+    case CWG_ARG_ENDPOINT:
+        if (none && (kind == CWG_ARG_ENDPOINT_OR_NONE)) {
+            args->peer_endpoint = NULL;
+            break;
+        }
+        if (parse_endpoint(arg, &args->endpoint))
+            return "Invalid endpoint";
+        args->peer_endpoint = arg;
+        break;
+
+    case CWG_ARG_KEY_OR_NONE:
+    case CWG_ARG_KEY:
+        if (none && (kind == CWG_ARG_KEY_OR_NONE)) {
+            args->peer_key = NULL;
+            break;
+        }
+        if (
+                (strlen(arg) != WG_KEY_B64_LEN) ||
+                wg_key_from_base64(&args->key, arg))
+            return "Invalid key";
+        args->peer_key = arg;
+        break;
+
+    case CWG_ARG_END:
+        break;
+    }
+
+    return NULL;
+}
+
+
+/** Parse and check arguments according to a schema, all in one go.
+ *
+ * Each argument is parsed once, after which the device name and addresses
+ * are derived from the net and host, which every schema has. Nothing is
+ * allocated, so this is cheap enough to do for each record of a list.
+ *
+ * @param schema The kinds of the arguments, ending with CWG_ARG_END.
+ * @param argv The arguments, at least as many as in the schema.
+ * @param args (out) The parsed arguments.
+ * @return NULL on success, or an error message.
+ */
+static const char * cwg_parse_args(
+        const cwg_arg_t schema[], char * argv[], cwg_args_t * args)
+{
+    const char * error;
+    int i;
+
+    args->peer_endpoint = NULL;
+    args->peer_key = NULL;
+
+    for (i = 0; schema[i] != CWG_ARG_END; ++i) {
+        error = cwg_parse_arg(schema[i], argv[i], args);
+        if (error)
+            return error;
+    }
+
+    // only the _OR_NONE kinds can leave out one of them
+    if (!args->peer_endpoint != !args->peer_key)
+        return "Give both the peer endpoint and key, or neither";
+
+    cwg_format_device_name(args->dev, args->net, args->host);
+    args->network_ip = (10u << 24) | (args->net << 1);
+    args->host_ip = args->network_ip | args->host;
+
+#if defined(USE_IP_COMMAND) || defined(USE_WG_COMMAND)
+    cwg_format_ip(
+            args->network_ip_nm, sizeof(args->network_ip_nm),
+            args->network_ip);
+    strcat(args->network_ip_nm, "/31");
+#endif
+#ifdef USE_IP_COMMAND
+    cwg_format_ip(args->host_ip_str, sizeof(args->host_ip_str), args->host_ip);
+#endif
+
+    return NULL;
+}
+
+
+/** Parse and check arguments, see cwg_parse_args().
+ *
+ * Returns 0 if valid, 1 if not, in which case an error message is printed.
+ */
+static int cwg_check_args(
+        const cwg_arg_t schema[], char * argv[], cwg_args_t * args)
+{
+    const char * error = cwg_parse_args(schema, argv, args);
+
+    if (error) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    return 0;
+}
+
+
+/** Switch to the target ns for the device.
+ *
+ * Returns 0 on success, 1 on failure.
+ *
+ * */
+static int cwg_set_ns(const char * netns) {
+    netns_t * ns = netns_get(netns);
+    if (!ns) return 1;
+
+    return netns_enter(ns) ? 1 : 0;
+}
+
+
+/** A device of ours found in the target namespace, see cwg_link_list(). */
+typedef struct {
+    char name[IFNAMSIZ];
+    int net;
+    int host;
+    int wanted;                 // whether cwg_apply() was asked for it
+    int failed;                 // set if cwg_link_delete_all() failed for it
+    wg_device_info_t wg;        // filled in by cwg_wg_dump()
+} cwg_device_t;
+
+
+/** A list of devices, see cwg_link_list(). */
+typedef struct {
+    cwg_device_t * devices;
+    int num_devices;
+    int size;
+    int pool;                   // list pool devices instead, net is -1
+} cwg_devices_t;
+
+
+/** Get the net and host from a device name made by cwg_format_device_name().
+ *
+ * Returns 0 on success, 1 if the name is not one of ours.
+ */
+static int cwg_parse_device_name(const char * name, int * net, int * host) {
+    char expected[IFNAMSIZ];
+
+    if (sscanf(name, CWG_PREFIX "-%d-%d", net, host) != 2)
+        return 1;
+
+    if ((*net < 0) || (CWG_MAX_NET < *net) || (*host < 0) || (1 < *host))
+        return 1;
+
+    // rejects leading zeros and trailing characters
+    cwg_format_device_name(expected, *net, *host);
+    return strcmp(name, expected) ? 1 : 0;
+}
+
+
+/** Format the name of the pool device with the given index. */
+static void cwg_format_pool_name(char dev[IFNAMSIZ], int index) {
+    snprintf(dev, IFNAMSIZ, "%s-p%d", CWG_PREFIX, index);
+}
+
+
+/** Get the index of a pool device from its name.
+ *
+ * Returns 0 on success, 1 if the name is not that of a pool device.
+ */
+static int cwg_parse_pool_name(const char * name, int * index) {
+    char expected[IFNAMSIZ];
+
+    if (sscanf(name, CWG_PREFIX "-p%d", index) != 1)
+        return 1;
+
+    if ((*index < 0) || (CWG_MAX_POOL_INDEX < *index))
+        return 1;
+
+    cwg_format_pool_name(expected, *index);
+    return strcmp(name, expected) ? 1 : 0;
+}
+
+
+/** Add a device to the list if it is one of ours.
+ *
+ * @param devs The list to add to.
+ * @param name The name of the device.
+ * @param dev (out) The new entry, zeroed apart from the name, net and host,
+ *          or NULL if the device is not ours. For pool devices, host is the
+ *          index in the pool.
+ * @return 0 on success, 1 on failure, in which case a message is printed.
+ */
+static int cwg_devices_add(
+        cwg_devices_t * devs, const char * name, cwg_device_t ** dev)
+{
+    cwg_device_t * new_devices;
+    int net = -1, host, size;
+
+    *dev = NULL;
+    if (devs->pool ? cwg_parse_pool_name(name, &host) :
+            cwg_parse_device_name(name, &net, &host))
+        return 0;
+
+    if (devs->num_devices == devs->size) {
+        size = devs->size ? 2 * devs->size : 16;
+        new_devices = realloc(devs->devices, size * sizeof(cwg_device_t));
+        if (!new_devices) {
+            perror("Error allocating device list");
+            return 1;
+        }
+        devs->devices = new_devices;
+        devs->size = size;
+    }
+
+    *dev = &devs->devices[devs->num_devices++];
+    memset(*dev, 0, sizeof(cwg_device_t));
+    strcpy((*dev)->name, name);
+    (*dev)->net = net;
+    (*dev)->host = host;
+    return 0;
+}
+
+
+#ifdef USE_IP_COMMAND
+
+/** Check the result of an `ip -batch -` run.
+ *
+ * If one of the commands failed, ip stops and reports the number of the
+ * failed line, which is used to print the corresponding error message.
+ *
+ * @param exit_code The exit code of ip.
+ * @param out_buf The output of ip.
+ * @param out_size The size of the output.
+ * @param whats Error messages for each command, followed by NULL.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_ip_batch_check(
+        int exit_code, const char * out_buf, ssize_t out_size,
+        const char * const whats[])
+{
+    const char * const failed_str = "Command failed -:";
+    const char * failed;
+    int line = 0, num_whats = 0;
+
+    if (exit_code == 0)
+        return 0;
+
+    fprintf(stderr, "%s returned an error:\n", IP);
+    print_error_output(out_buf, out_size);
+
+    // ip reports e.g. "Command failed -:3" if the third line failed
+    failed = memmem(out_buf, out_size, failed_str, strlen(failed_str));
+    if (failed) {
+        failed += strlen(failed_str);
+        while (
+                (failed < out_buf + out_size) && (line < 1000) &&
+                ('0' <= *failed) && (*failed <= '9'))
+            line = line * 10 + (*failed++ - '0');
+    }
+
+    while (whats[num_whats])
+        ++num_whats;
+
+    if ((1 <= line) && (line <= num_whats))
+        fprintf(stderr, "%s\n", whats[line - 1]);
+
+    return 1;
+}
+
+
+/** Remove the device.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_link_delete(const char * dev) {
+    const char * const delete_args[] = { IP, "link", "delete", dev, NULL };
+    return run_check2(IP, delete_args);
+}
+
+
+/** List our WireGuard devices in the current namespace.
+ *
+ * @param devs The list to add them to.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_link_list(cwg_devices_t * devs) {
+    const char * const list_args[] = {
+        IP, "-brief", "link", "show", "type", "wireguard", NULL };
+    const char * out_buf = NULL, * line, * end;
+    char name[IFNAMSIZ];
+    cwg_device_t * dev;
+    ssize_t out_size = 0;
+    size_t len;
+    int ret = 0;
+
+    if (run_check(IP, list_args, NULL, NULL, 0, &out_buf, &out_size))
+        return 1;
+
+    // one device per line, starting with its name
+    for (line = out_buf; !ret && (line < out_buf + out_size); line = end + 1) {
+        end = memchr(line, '\n', out_buf + out_size - line);
+        if (!end)
+            end = out_buf + out_size;
+
+        len = strcspn(line, " @\n");
+        if ((len == 0) || (len >= IFNAMSIZ) || (line + len > end))
+            continue;
+
+        memcpy(name, line, len);
+        name[len] = '\0';
+        ret = cwg_devices_add(devs, name, &dev);
+    }
+
+    secure_free((void*)out_buf);
+    return ret;
+}
+
+
+/** Remove some devices at once.
+ *
+ * This runs `ip -force -batch -`, which keeps going after a failure and
+ * reports the number of each failed line.
+ *
+ * @param devs The devices, failed is set for those that remain.
+ * @param first The index of the first device to remove.
+ * @param num The number of devices to remove, whose commands must be shorter
+ *          than PIPE_BUF.
+ * @return 0 if all were removed, 1 otherwise.
+ */
+static int cwg_link_delete_batch(cwg_devices_t * devs, int first, int num) {
+    const char * const batch_args[] = { IP, "-force", "-batch", "-", NULL };
+    const char * const failed_str = "Command failed -:";
+    const char * out_buf = NULL, * failed;
+    char commands[PIPE_BUF];
+    size_t len = 0;
+    ssize_t out_size = 0;
+    int exit_code = 255, line, num_failed = 0, i;
+
+    for (i = first; i < first + num; ++i)
+        len += sprintf(
+                commands + len, "link delete %s\n", devs->devices[i].name);
+
+    if (run(IP, batch_args, NULL, commands, len, &exit_code, &out_buf,
+                &out_size))
+    {
+        fprintf(stderr, "Error running %s\n", IP);
+        goto exit_all_failed;
+    }
+
+    if (exit_code == 0) {
+        secure_free((void*)out_buf);
+        return 0;
+    }
+
+    fprintf(stderr, "%s returned an error:\n", IP);
+    print_error_output(out_buf, out_size);
+
+    // ip reports e.g. "Command failed -:3" for each line that failed
+    failed = out_buf;
+    while ((failed = memmem(
+                    failed, out_buf + out_size - failed, failed_str,
+                    strlen(failed_str))))
+    {
+        failed += strlen(failed_str);
+        line = 0;
+        while (
+                (failed < out_buf + out_size) && (line <= num)
+                && ('0' <= *failed) && (*failed <= '9'))
+            line = line * 10 + (*failed++ - '0');
+
+        if ((1 <= line) && (line <= num)) {
+            devs->devices[first + line - 1].failed = 1;
+            ++num_failed;
+        }
+    }
+
+    secure_free((void*)out_buf);
+
+    // if we can't tell which ones failed, assume they all did
+    if (num_failed == 0)
+        goto exit_all_failed;
+    return 1;
+
+exit_all_failed:
+    for (i = first; i < first + num; ++i)
+        devs->devices[i].failed = 1;
+    return 1;
+}
+
+
+/** Remove many devices at once.
+ *
+ * The commands are written to ip before it reads them, so they are split into
+ * batches that fit into a pipe buffer, of which PIPE_BUF is the least, and ip
+ * is run once per batch.
+ *
+ * @param devs The devices to remove, failed is set for those that remain.
+ * @return 0 if all were removed, 1 otherwise.
+ */
+static int cwg_link_delete_all(cwg_devices_t * devs) {
+    const size_t command_len = strlen("link delete \n");
+    size_t len;
+    int first, num, ret = 0;
+
+    for (first = 0; first < devs->num_devices; first += num) {
+        // leave room for the null that sprintf() adds
+        len = 0;
+        for (num = 0; first + num < devs->num_devices; ++num) {
+            len += command_len + strlen(devs->devices[first + num].name);
+            if (len >= PIPE_BUF)
+                break;
+        }
+
+        ret |= cwg_link_delete_batch(devs, first, num);
+    }
+
+    return ret;
+}
+
+
+/** Convert a namespace specification to an argument for ip.
+ *
+ * ip takes a PID or a path, and we can't pass it our pidfd.
+ *
+ * @param netns The namespace, see netns.h.
+ * @param buf Buffer of 32 chars for the path of an fd.
+ * @return The argument, netns itself or buf.
+ */
+static const char * cwg_ip_netns(const char * netns, char buf[32]) {
+    if (strncmp(netns, "fd:", 3))
+        return netns;
+
+    snprintf(buf, 32, "/proc/self/fd/%s", netns + 3);
+    return buf;
+}
+
+
+/** Create the device inside the target namespace.
+ *
+ * The device is created from the current namespace, so that its socket is
+ * there, but is placed into the target namespace directly. So on failure, no
+ * device is left behind.
+ *
+ * Returns STEP_RUNNING if ip was started in proc, 1 on failure.
+ */
+static int cwg_link_create(
+        const char * dev, const char * netns, run_t * proc)
+{
+    char netns_fd_path[32];
+
+    netns = cwg_ip_netns(netns, netns_fd_path);
+
+    const char * const create_dev_args[] = {
+        IP, "link", "add", dev, "netns", netns, "type", "wireguard", NULL };
+    if (run_start(proc, IP, create_dev_args, NULL, NULL, 0)) {
+        fprintf(stderr, "Error running %s\n", IP);
+        return 1;
+    }
+
+    return STEP_RUNNING;
+}
+
+
+#ifdef ENABLE_CWG_ATTACH
+
+/** Move a pool device into the target namespace under the device's name.
+ *
+ * This must be called from within the pool's namespace. ip sends a single
+ * request for both, so if another cwg_attach takes the device first, it can't
+ * be found any more.
+ *
+ * Returns 0 on success, 1 on failure, or CWG_POOL_EMPTY if the device is gone.
+ */
+static int cwg_link_claim(const char * pool_dev, const cwg_args_t * args) {
+    char netns_fd_path[32];
+    const char * out_buf;
+    ssize_t out_size;
+    int exit_code, ret = 1;
+
+    const char * const claim_args[] = {
+        IP, "link", "set", "dev", pool_dev, "netns",
+        cwg_ip_netns(args->netns, netns_fd_path), "name", args->dev, NULL };
+    if (run(IP, claim_args, NULL, NULL, 0, &exit_code, &out_buf, &out_size))
+    {
+        fprintf(stderr, "Error running %s\n", IP);
+        return 1;
+    }
+
+    if (exit_code == 0)
+        ret = 0;
+    else if (memmem(out_buf, out_size, "Cannot find device", 18))
+        ret = CWG_POOL_EMPTY;
+    else {
+        fprintf(stderr, "%s returned an error:\n", IP);
+        print_error_output(out_buf, out_size);
+        fprintf(stderr, "Error moving device out of the pool\n");
+    }
+
+    secure_free((void*)out_buf);
+    return ret;
+}
+
+#endif
+
+
+// Error messages for the commands run by cwg_link_configure()
+static const char * const cwg_link_configure_whats[] = {
+    "Error setting IP address",
+    "Error bringing up interface",
+    "Error adding route",
+    NULL };
+
+
+/** Set the device's address, bring it up and add a route for the network.
+ *
+ * This must be called from within the device's namespace. It runs all three
+ * commands using a single `ip -batch -`, use cwg_link_configure_finish() to
+ * check the result.
+ *
+ * Returns STEP_RUNNING if ip was started in proc, 1 on failure.
+ */
+static int cwg_link_configure(const cwg_args_t * args, run_t * proc) {
+    const char * const batch_args[] = { IP, "-batch", "-", NULL };
+    const char * dev = args->dev;
+    char commands[256];
+
+    snprintf(
+            commands, sizeof(commands),
+            "addr add %s dev %s\n"
+            "link set %s up\n"
+            "route add %s dev %s\n",
+            args->host_ip_str, dev, dev, args->network_ip_nm, dev);
+
+    if (run_start(proc, IP, batch_args, NULL, commands, strlen(commands))) {
+        fprintf(stderr, "Error running %s\n", IP);
+        return 1;
+    }
+
+    return STEP_RUNNING;
+}
+
+
+/** Check the result of cwg_link_configure(), see step_t::finish. */
+static int cwg_link_configure_finish(
+        void * arg, int exit_code, const char * out_buf, ssize_t out_size)
+{
+    (void)arg;
+    return cwg_ip_batch_check(
+            exit_code, out_buf, out_size, cwg_link_configure_whats);
+}
+
+#else
+
+// Socket in our original namespace, if opened in advance by cwg_warm_up().
+// Sockets cannot be shared between threads, so each thread has its own.
+static _Thread_local nl_sock_t cwg_host_rtnl = { -1, 0 };
+
+
+/** Send a batch of rtnetlink requests.
+ *
+ * This opens a socket in the current namespace, sends the batch, and closes
+ * the socket again, with CAP_NET_ADMIN enabled while needed.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_rtnl_send(nl_batch_t * batch) {
+    nl_sock_t sock;
+    int ret = 1;
+
+    enable_cap(CAP_NET_ADMIN);
+
+    if (nl_open(&sock, NETLINK_ROUTE))
+        goto exit_cap;
+
+    ret = nl_batch_send(&sock, batch);
+    nl_close(&sock);
+
+exit_cap:
+    disable_cap(CAP_NET_ADMIN);
+    return ret;
+}
+
+
+/** Remove the device.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_link_delete(const char * dev) {
+    nl_batch_t batch;
+
+    nl_batch_init(&batch);
+    rtnl_link_delete(&batch, dev, "Error removing device");
+    return cwg_rtnl_send(&batch);
+}
+
+
+/** Add the WireGuard devices from a list of links, see nl_reply_cb_t. */
+static int cwg_link_list_cb(int index, const struct nlmsghdr * nlh, void * arg)
+{
+    cwg_devices_t * devs = (cwg_devices_t *)arg;
+    rtnl_link_info_t info;
+    cwg_device_t * dev;
+
+    (void)index;
+
+    if (rtnl_link_parse(nlh, &info))
+        return 1;
+
+    if (!info.name || !info.kind || strcmp(info.kind, "wireguard"))
+        return 0;
+
+    return cwg_devices_add(devs, info.name, &dev);
+}
+
+
+/** List our WireGuard devices in the current namespace.
+ *
+ * This uses a single dump request for all devices.
+ *
+ * @param devs The list to add them to.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_link_list(cwg_devices_t * devs) {
+    nl_batch_t batch;
+    nl_sock_t sock;
+    int ret = 1;
+
+    enable_cap(CAP_NET_ADMIN);
+
+    if (nl_open(&sock, NETLINK_ROUTE))
+        goto exit_cap;
+
+    nl_batch_init(&batch);
+    rtnl_link_dump(&batch, "Error listing devices");
+    ret = nl_batch_send_cb(&sock, &batch, cwg_link_list_cb, devs);
+    nl_close(&sock);
+
+exit_cap:
+    disable_cap(CAP_NET_ADMIN);
+    return ret;
+}
+
+
+/** Remove many devices at once.
+ *
+ * The requests are sent in batches of NL_BATCH_MAX_MSGS over a single socket.
+ * The kernel keeps going after a failure, and acknowledges each one.
+ *
+ * @param devs The devices to remove, failed is set for those that remain.
+ * @return 0 if all were removed, 1 otherwise.
+ */
+static int cwg_link_delete_all(cwg_devices_t * devs) {
+    nl_batch_t batch;
+    nl_sock_t sock;
+    int ret = 0, first, i;
+
+    enable_cap(CAP_NET_ADMIN);
+
+    if (nl_open(&sock, NETLINK_ROUTE)) {
+        for (i = 0; i < devs->num_devices; ++i)
+            devs->devices[i].failed = 1;
+        ret = 1;
+        goto exit_cap;
+    }
+
+    for (first = 0; first < devs->num_devices; first += NL_BATCH_MAX_MSGS) {
+        nl_batch_init(&batch);
+        for (
+                i = first;
+                (i < devs->num_devices) && (i < first + NL_BATCH_MAX_MSGS);
+                ++i)
+            rtnl_link_delete(
+                    &batch, devs->devices[i].name, "Error removing device");
+
+        if (nl_batch_send(&sock, &batch) == 0)
+            continue;
+
+        ret = 1;
+        for (i = first; i < first + batch.num_msgs; ++i)
+            if (batch.error[i - first])
+                devs->devices[i].failed = 1;
+    }
+
+    nl_close(&sock);
+
+exit_cap:
+    disable_cap(CAP_NET_ADMIN);
+    return ret;
+}
+
+
+/** Create the device and move it into the target namespace.
+ *
+ * The kernel can do both in a single request. On failure, no device is left
+ * behind.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_link_create(
+        const char * dev, const char * netns, run_t * proc)
+{
+    nl_batch_t batch;
+    netns_t * ns;
+    int ns_fd, ret;
+
+    (void)proc;
+
+    ns = netns_get(netns);
+    if (!ns) return 1;
+
+    ns_fd = netns_fd(ns);
+    if (ns_fd == -1) return 1;
+
+    nl_batch_init(&batch);
+    rtnl_link_add(
+            &batch, dev, "wireguard", ns_fd, "Error creating device");
+
+    if (cwg_host_rtnl.fd == -1)
+        return cwg_rtnl_send(&batch);
+
+    enable_cap(CAP_NET_ADMIN);
+    ret = nl_batch_send(&cwg_host_rtnl, &batch);
+    disable_cap(CAP_NET_ADMIN);
+    return ret;
+}
+
+
+/** Set the device's address, bring it up and add a route for the network.
+ *
+ * This must be called from within the device's namespace. All three are done
+ * in a single round trip to the kernel.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_link_configure(const cwg_args_t * args, run_t * proc) {
+    nl_batch_t batch;
+
+    (void)proc;
+
+    int ifindex = if_nametoindex(args->dev);
+    if (ifindex == 0) {
+        perror("Error looking up device");
+        return 1;
+    }
+
+    nl_batch_init(&batch);
+    rtnl_addr_add(
+            &batch, ifindex, args->host_ip, 32, "Error setting IP address");
+    rtnl_link_set_up(&batch, ifindex, "Error bringing up interface");
+    rtnl_route_add(
+            &batch, ifindex, args->network_ip, 31, "Error adding route");
+    return cwg_rtnl_send(&batch);
+}
+
+// cwg_link_configure() does not start a program here, so there's no result
+#define cwg_link_configure_finish NULL
+
+
+#ifdef ENABLE_CWG_ATTACH
+
+/** Move a pool device into the target namespace under the device's name.
+ *
+ * This must be called from within the pool's namespace. The kernel does both
+ * in a single request, so if another cwg_attach takes the device first, it
+ * can't be found any more.
+ *
+ * Returns 0 on success, 1 on failure, or CWG_POOL_EMPTY if the device is gone.
+ */
+static int cwg_link_claim(const char * pool_dev, const cwg_args_t * args) {
+    nl_batch_t batch;
+    netns_t * ns;
+    int ifindex, ns_fd;
+
+    ns = netns_get(args->netns);
+    if (!ns) return 1;
+
+    ns_fd = netns_fd(ns);
+    if (ns_fd == -1) return 1;
+
+    ifindex = if_nametoindex(pool_dev);
+    if (ifindex == 0)
+        return CWG_POOL_EMPTY;
+
+    // losing the race is not an error, so the kernel's answer is checked here
+    nl_batch_init(&batch);
+    rtnl_link_move(&batch, ifindex, ns_fd, args->dev, NULL);
+    batch.error[0] = 0;
+    if (cwg_rtnl_send(&batch) == 0)
+        return 0;
+
+    if (batch.error[0] == -ENODEV)
+        return CWG_POOL_EMPTY;
+
+    // otherwise the socket could not be opened, and that was reported
+    if (batch.error[0])
+        fprintf(
+                stderr, "Error moving device out of the pool: %s\n",
+                strerror(-batch.error[0]));
+    return 1;
+}
+
+#endif
+
+#endif
+
+
+#if !defined(USE_WG_COMMAND) || defined(ENABLE_CWG_APPLY)
+
+/** Build the description of a peer from parsed arguments.
+ *
+ * The peer's allowed IPs are the network, and it refers to args for its key,
+ * so args must have a peer and outlive it.
+ */
+static void cwg_make_peer(const cwg_args_t * args, wg_peer_t * peer) {
+    peer->public_key = &args->key;
+    peer->endpoint = args->endpoint;
+    peer->allowed_ip = args->network_ip;
+    peer->allowed_ip_cidr = 31;
+}
+
+#endif
+
+
+// Limits on the input of commands that read a list
+#define CWG_MAX_LINE 256
+#define CWG_MAX_RECORDS 4096
+
+
+/** A line of input to a command that reads a list. */
+typedef char cwg_line_t[CWG_MAX_LINE];
+
+
+/** Read all lines from standard input.
+ *
+ * The lines are read in full before anything points into them, as the
+ * buffer may move while it grows.
+ *
+ * @param max_lines The maximum number of lines to accept.
+ * @param num_lines (out) The number of lines read.
+ * @return The lines, to be freed by the caller, or NULL on failure, in which
+ *          case a message is printed.
+ */
+static cwg_line_t * cwg_read_lines(int max_lines, int * num_lines) {
+    cwg_line_t * lines = NULL, * new_lines;
+    int size = 0;
+
+    *num_lines = 0;
+
+    for (;;) {
+        if (*num_lines == size) {
+            if (size == max_lines) {
+                fprintf(stderr, "Too many lines, max is %d\n", size);
+                goto exit_lines;
+            }
+            size = size ? 2 * size : 16;
+            if (size > max_lines)
+                size = max_lines;
+
+            new_lines = realloc(lines, size * sizeof(cwg_line_t));
+            if (!new_lines) {
+                perror("Error allocating input");
+                goto exit_lines;
+            }
+            lines = new_lines;
+        }
+
+        if (!fgets(lines[*num_lines], CWG_MAX_LINE, stdin))
+            break;
+
+        if (!strchr(lines[*num_lines], '\n') && !feof(stdin)) {
+            fprintf(stderr, "Line %d is too long\n", *num_lines + 1);
+            goto exit_lines;
+        }
+
+        ++*num_lines;
+    }
+
+    if (ferror(stdin)) {
+        perror("Error reading input");
+        goto exit_lines;
+    }
+
+    return lines;
+
+exit_lines:
+    free(lines);
+    return NULL;
+}
+
+
+/** Split a line into whitespace-separated fields, in place.
+ *
+ * Returns the number of fields, or max + 1 if there are more than max.
+ */
+static int cwg_split_line(char * line, char * fields[], int max) {
+    char * save, * field;
+    int num_fields = 0;
+
+    for (
+            field = strtok_r(line, " \t\n", &save);
+            field && (num_fields <= max);
+            field = strtok_r(NULL, " \t\n", &save))
+    {
+        if (num_fields < max)
+            fields[num_fields] = field;
+        ++num_fields;
+    }
+
+    return num_fields;
+}
+
+// Size of the error message buffer of a cwg_connect_many record
+#define CWG_MAX_ERROR 128
+
+
+/** A record of cwg_connect_many. */
+typedef struct {
+    cwg_args_t args;            // see cwg_connect_many_schema
+    int failed;
+    char error[CWG_MAX_ERROR];  // set if failed
+} cwg_connect_record_t;
+
+
+/** Print the cwg_stats line for a device.
+ *
+ * @param dev The device, with its configuration in wg.
+ * @param now The current time, in seconds since the epoch.
+ */
+static void cwg_stats_print(const cwg_device_t * dev, int64_t now) {
+    const wg_device_info_t * wg = &dev->wg;
+    char key[WG_KEY_B64_LEN + 1], endpoint[INET_ADDRSTRLEN + 6];
+
+    if (wg->num_peers == 0) {
+        printf("%d %d - - 0 0 -\n", dev->net, dev->host);
+        return;
+    }
+
+    wg_key_to_base64(key, &wg->peer_key);
+
+    if (wg->peer_endpoint.sin_family == AF_INET) {
+        inet_ntop(
+                AF_INET, &wg->peer_endpoint.sin_addr, endpoint,
+                INET_ADDRSTRLEN);
+        sprintf(
+                endpoint + strlen(endpoint), ":%u",
+                ntohs(wg->peer_endpoint.sin_port));
+    }
+    else
+        strcpy(endpoint, "-");
+
+    printf(
+            "%d %d %s %s %" PRIu64 " %" PRIu64, dev->net, dev->host, key,
+            endpoint, wg->peer_rx_bytes, wg->peer_tx_bytes);
+
+    if (wg->peer_last_handshake == 0)
+        printf(" -\n");
+    else if (wg->peer_last_handshake < now)
+        printf(" %" PRId64 "\n", now - wg->peer_last_handshake);
+    else
+        printf(" 0\n");
+}
+
+
+#ifdef USE_WG_COMMAND
+
+/** Set the listen port and private key of the device.
+ *
+ * This must be called from within the device's namespace.
+ *
+ * Returns STEP_RUNNING if wg was started in proc, 1 on failure.
+ */
+static int cwg_wg_set_key(
+        const cwg_args_t * args, const wg_key_t * private_key, run_t * proc)
+{
+    char * private_key_b64 = secure_alloc(WG_KEY_B64_LEN + 1);
+    char port[6];
+    int ret = STEP_RUNNING;
+
+    if (!private_key_b64)
+        return 1;
+
+    wg_key_to_base64(private_key_b64, private_key);
+    snprintf(port, sizeof(port), "%d", args->port);
+
+    const char * const set_key_args[] = {
+        WG, "set", args->dev, "listen-port", port, "private-key",
+        "/dev/stdin", NULL };
+    if (run_start(
+                proc, WG, set_key_args, NULL, private_key_b64,
+                WG_KEY_B64_LEN)) {
+        fprintf(stderr, "Error running %s\n", WG);
+        ret = 1;
+    }
+
+    secure_free(private_key_b64);
+    return ret;
+}
+
+
+/** Add the peer to the device, with the network as its allowed IPs.
+ *
+ * This must be called from within the device's namespace.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_wg_set_peer(const cwg_args_t * args) {
+    const char * const add_args[] = {
+        WG, "set", args->dev, "peer", args->peer_key, "allowed-ips",
+        args->network_ip_nm, "endpoint", args->peer_endpoint, NULL };
+
+    return run_check2(WG, add_args);
+}
+
+
+/** Add the peers of many records, one device at a time.
+ *
+ * wg can only configure a single device per run, so this runs it once for
+ * each record. This must be called from within the devices' namespace.
+ *
+ * @param recs The records to process, failed and error are set.
+ * @param num_recs The number of records.
+ * @return 0 if all peers were added, 1 otherwise.
+ */
+static int cwg_wg_set_peers(cwg_connect_record_t * recs[], int num_recs) {
+    int ret = 0, i;
+
+    for (i = 0; i < num_recs; ++i) {
+        if (cwg_wg_set_peer(&recs[i]->args)) {
+            recs[i]->failed = 1;
+            strcpy(recs[i]->error, "Error adding peer");
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+
+/** Split a string into fields, in place.
+ *
+ * Returns the number of fields, or max + 1 if there are more than max.
+ */
+static int cwg_split(char * str, char sep, char * fields[], int max) {
+    int num_fields = 0;
+
+    for (;;) {
+        if (num_fields == max)
+            return max + 1;
+
+        fields[num_fields++] = str;
+        str = strchr(str, sep);
+        if (!str)
+            return num_fields;
+        *str++ = '\0';
+    }
+}
+
+
+/** Add a peer line of `wg show all dump` to the device's description.
+ *
+ * The fields are the device, public key, preshared key, endpoint, allowed
+ * IPs, latest handshake, received and sent bytes, and keepalive interval.
+ */
+static void cwg_wg_dump_peer(wg_device_info_t * wg, char * fields[]) {
+    char * ip, * slash, * save;
+    uint32_t addr;
+
+    if (++wg->num_peers != 1)
+        return;
+
+    if (strlen(fields[1]) == WG_KEY_B64_LEN)
+        wg_key_from_base64(&wg->peer_key, fields[1]);
+
+    if (
+            strcmp(fields[3], "(none)") &&
+            parse_endpoint(fields[3], &wg->peer_endpoint))
+        memset(&wg->peer_endpoint, 0, sizeof(wg->peer_endpoint));
+
+    wg->peer_last_handshake = strtoll(fields[5], NULL, 10);
+    wg->peer_rx_bytes = strtoull(fields[6], NULL, 10);
+    wg->peer_tx_bytes = strtoull(fields[7], NULL, 10);
+
+    if (!strcmp(fields[4], "(none)"))
+        return;
+
+    for (
+            ip = strtok_r(fields[4], ",", &save); ip;
+            ip = strtok_r(NULL, ",", &save))
+    {
+        if (++wg->peer_num_allowed_ips != 1)
+            continue;
+
+        slash = strchr(ip, '/');
+        if (!slash)
+            continue;
+        *slash = '\0';
+
+        if (inet_pton(AF_INET, ip, &addr) == 1) {
+            wg->peer_allowed_ip = ntohl(addr);
+            wg->peer_allowed_ip_cidr = atoi(slash + 1);
+        }
+    }
+}
+
+
+#ifdef ENABLE_CWG_APPLY
+
+/** Get our devices in the current namespace and their configuration.
+ *
+ * This runs `wg show all dump` once for all devices. Its output includes the
+ * private keys of the devices, so it is processed line by line as it comes
+ * in, as for cwg_wg_stats(), and only the part not processed yet is kept in
+ * the secure arena. Lines that are not part of the dump are passed on to
+ * standard error.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_wg_dump(cwg_devices_t * devs) {
+    const char * const dump_args[] = { WG, "show", "all", "dump", NULL };
+    const char * out_buf = NULL;
+    ssize_t out_size = 0;
+    char * line, * end, * fields[9];
+    cwg_device_t * dev = NULL;
+    int exit_code = 255, num_fields, ret = 0, err;
+    run_t proc;
+
+    if (run_start(&proc, WG, dump_args, NULL, NULL, 0))
+        return 1;
+
+    do {
+        err = run_read_timed(&proc);
+        if (proc.out_size == 0)
+            continue;
+
+        line = proc.out_buf;
+        while (
+                (end = memchr(
+                    line, '\n', proc.out_buf + proc.out_size - line)))
+        {
+            *end = '\0';
+            num_fields = cwg_split(line, '\t', fields, 9);
+
+            // a device line, followed by the lines of its peers
+            if (num_fields == 5) {
+                dev = NULL;
+                if (!ret)
+                    ret = cwg_devices_add(devs, fields[0], &dev);
+                if (dev)
+                    dev->wg.listen_port = atoi(fields[3]);
+            }
+            else if (num_fields == 9) {
+                if (dev && !strcmp(fields[0], dev->name))
+                    cwg_wg_dump_peer(&dev->wg, fields);
+            }
+            else
+                fprintf(stderr, "%s\n", line);
+
+            line = end + 1;
+        }
+
+        // keep the start of the next line
+        proc.out_size -= line - proc.out_buf;
+        memmove(proc.out_buf, line, proc.out_size);
+    } while (err == 0);
+
+    if (
+            run_finish(&proc, &exit_code, &out_buf, &out_size) ||
+            (err == -1) || exit_code)
+    {
+        fprintf(stderr, "%s returned an error:\n", WG);
+        print_error_output(out_buf, out_size);
+        ret = 1;
+    }
+
+    secure_free((void*)out_buf);
+    return ret;
+}
+
+#endif
+
+
+/** Print the statistics of our devices in the current namespace.
+ *
+ * This runs `wg show all dump` once for all devices, and prints each device
+ * once its lines have been read. Lines are dropped from the buffer as they
+ * are processed, so only the output not processed yet is kept in memory.
+ * Lines that are not part of the dump, e.g. error messages, are passed on to
+ * standard error.
+ *
+ * @param now The current time, in seconds since the epoch.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_wg_stats(int64_t now) {
+    const char * const dump_args[] = { WG, "show", "all", "dump", NULL };
+    const char * out_buf = NULL;
+    ssize_t out_size = 0;
+    char * line, * end, * fields[9];
+    cwg_device_t dev;
+    int have_dev = 0, exit_code = 255, num_fields, err;
+    run_t proc;
+
+    if (run_start(&proc, WG, dump_args, NULL, NULL, 0))
+        return 1;
+
+    do {
+        err = run_read_timed(&proc);
+        if (proc.out_size == 0)
+            continue;
+
+        line = proc.out_buf;
+        while (
+                (end = memchr(
+                    line, '\n', proc.out_buf + proc.out_size - line)))
+        {
+            *end = '\0';
+            num_fields = cwg_split(line, '\t', fields, 9);
+
+            // a device line, followed by the lines of its peers
+            if (num_fields == 5) {
+                if (have_dev)
+                    cwg_stats_print(&dev, now);
+
+                memset(&dev, 0, sizeof(dev));
+                have_dev = !cwg_parse_device_name(
+                        fields[0], &dev.net, &dev.host);
+                if (have_dev)
+                    strcpy(dev.name, fields[0]);
+            }
+            else if (num_fields == 9) {
+                if (have_dev && !strcmp(fields[0], dev.name))
+                    cwg_wg_dump_peer(&dev.wg, fields);
+            }
+            else
+                fprintf(stderr, "%s\n", line);
+
+            line = end + 1;
+        }
+
+        // keep the start of the next line
+        proc.out_size -= line - proc.out_buf;
+        memmove(proc.out_buf, line, proc.out_size);
+    } while (err == 0);
+
+    if (have_dev)
+        cwg_stats_print(&dev, now);
+
+    if (
+            run_finish(&proc, &exit_code, &out_buf, &out_size) ||
+            (err == -1) || exit_code)
+    {
+        fprintf(stderr, "%s returned an error:\n", WG);
+        print_error_output(out_buf, out_size);
+        err = -1;
+    }
+
+    secure_free((void*)out_buf);
+    return err == -1 ? 1 : 0;
+}
+
+
+#ifdef ENABLE_CWG_APPLY
+
+/** Update the listen port and the peer of an existing device.
+ *
+ * This must be called from within the device's namespace. If the device has
+ * a peer other than the new one, it is removed. Our devices have at most one.
+ *
+ * @param args The device's arguments, with its new peer, if any.
+ * @param set_port Whether to set the listen port to that of args.
+ * @param current The current configuration of the device.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_wg_update(
+        const cwg_args_t * args, int set_port,
+        const wg_device_info_t * current)
+{
+    char old_key_b64[WG_KEY_B64_LEN + 1], port[6];
+    const char * update_args[16];
+    int num_args = 0;
+
+    update_args[num_args++] = WG;
+    update_args[num_args++] = "set";
+    update_args[num_args++] = args->dev;
+
+    if (set_port) {
+        snprintf(port, sizeof(port), "%d", args->port);
+        update_args[num_args++] = "listen-port";
+        update_args[num_args++] = port;
+    }
+
+    if (current->num_peers > 0) {
+        wg_key_to_base64(old_key_b64, &current->peer_key);
+        if (!args->peer_key || strcmp(old_key_b64, args->peer_key)) {
+            update_args[num_args++] = "peer";
+            update_args[num_args++] = old_key_b64;
+            update_args[num_args++] = "remove";
+        }
+    }
+
+    if (args->peer_key) {
+        update_args[num_args++] = "peer";
+        update_args[num_args++] = args->peer_key;
+        update_args[num_args++] = "allowed-ips";
+        update_args[num_args++] = args->network_ip_nm;
+        update_args[num_args++] = "endpoint";
+        update_args[num_args++] = args->peer_endpoint;
+    }
+
+    update_args[num_args] = NULL;
+    return run_check2(WG, update_args);
+}
+
+#endif
+
+
+#ifdef ENABLE_CWG_ATTACH
+
+/** Set the listen port of the device.
+ *
+ * This must be called from within the device's namespace.
+ *
+ * Returns STEP_RUNNING if wg was started in proc, 1 on failure.
+ */
+static int cwg_wg_set_port(const cwg_args_t * args, run_t * proc) {
+    char port[6];
+
+    snprintf(port, sizeof(port), "%d", args->port);
+
+    const char * const set_port_args[] = {
+        WG, "set", args->dev, "listen-port", port, NULL };
+    if (run_start(proc, WG, set_port_args, NULL, NULL, 0)) {
+        fprintf(stderr, "Error running %s\n", WG);
+        return 1;
+    }
+
+    return STEP_RUNNING;
+}
+
+
+/** Get the public key of the device.
+ *
+ * This must be called from within the device's namespace.
+ *
+ * @param dev The device.
+ * @param public_key_b64 (out) Buffer of WG_KEY_B64_LEN + 1 chars.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_wg_get_public_key(const char * dev, char * public_key_b64) {
+    const char * const show_args[] = { WG, "show", dev, "public-key", NULL };
+    const char * out_buf = NULL;
+    ssize_t out_size = 0;
+    wg_key_t key;
+    int ret = 0;
+
+    if (run_check(WG, show_args, NULL, NULL, 0, &out_buf, &out_size))
+        return 1;
+
+    // a single line, or "(none)" if the device has no key
+    if ((out_size < WG_KEY_B64_LEN) ||
+            (out_size > WG_KEY_B64_LEN && out_buf[WG_KEY_B64_LEN] != '\n'))
+        ret = 1;
+    else {
+        memcpy(public_key_b64, out_buf, WG_KEY_B64_LEN);
+        public_key_b64[WG_KEY_B64_LEN] = '\0';
+        ret = wg_key_from_base64(&key, public_key_b64) ? 1 : 0;
+    }
+
+    if (ret)
+        fprintf(stderr, "Device has no valid public key\n");
+
+    secure_free((void*)out_buf);
+    return ret;
+}
+
+#endif
+
+#else
+
+/** Send a batch of WireGuard requests.
+ *
+ * This opens a socket in the current namespace, sends the batch, and closes
+ * the socket again, with CAP_NET_ADMIN enabled while needed. The batch is
+ * wiped afterwards, as it may contain a private key.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_wg_send(nl_batch_t * batch) {
+    nl_sock_t sock;
+    int ret = 1;
+
+    enable_cap(CAP_NET_ADMIN);
+
+    if (wg_open(&sock))
+        goto exit_cap;
+
+    ret = nl_batch_send(&sock, batch);
+    nl_close(&sock);
+
+exit_cap:
+    disable_cap(CAP_NET_ADMIN);
+    explicit_bzero(batch, sizeof(*batch));
+    return ret;
+}
+
+
+/** Set the listen port and private key of the device.
+ *
+ * This must be called from within the device's namespace.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_wg_set_key(
+        const cwg_args_t * args, const wg_key_t * private_key, run_t * proc)
+{
+    nl_batch_t * batch = secure_alloc(sizeof(nl_batch_t));
+    int ret;
+
+    (void)proc;
+
+    if (!batch)
+        return 1;
+
+    nl_batch_init(batch);
+    wg_set_device(
+            batch, args->dev, args->port, private_key,
+            "Error setting port and key");
+    ret = cwg_wg_send(batch);
+
+    secure_free(batch);
+    return ret;
+}
+
+
+/** Add the peer to the device, with the network as its allowed IPs.
+ *
+ * This must be called from within the device's namespace.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_wg_set_peer(const cwg_args_t * args) {
+    nl_batch_t batch;
+    wg_peer_t peer;
+
+    cwg_make_peer(args, &peer);
+
+    nl_batch_init(&batch);
+    wg_set_peer(&batch, args->dev, &peer, "Error adding peer");
+    return cwg_wg_send(&batch);
+}
+
+
+/** Add the peers of many records.
+ *
+ * The requests for up to NL_BATCH_MAX_MSGS devices are sent together, over a
+ * single socket. This must be called from within the devices' namespace.
+ *
+ * @param recs The records to process, failed and error are set.
+ * @param num_recs The number of records.
+ * @return 0 if all peers were added, 1 otherwise.
+ */
+static int cwg_wg_set_peers(cwg_connect_record_t * recs[], int num_recs) {
+    const char * const what = "Error adding peer";
+    cwg_connect_record_t * rec;
+    nl_batch_t batch;
+    nl_sock_t sock;
+    wg_peer_t peer;
+    int ret = 0, first, i;
+
+    enable_cap(CAP_NET_ADMIN);
+
+    if (wg_open(&sock)) {
+        for (i = 0; i < num_recs; ++i) {
+            recs[i]->failed = 1;
+            strcpy(recs[i]->error, "Error connecting to WireGuard");
+        }
+        ret = 1;
+        goto exit_cap;
+    }
+
+    for (first = 0; first < num_recs; first += NL_BATCH_MAX_MSGS) {
+        nl_batch_init(&batch);
+        for (i = first; (i < num_recs) && (i < first + NL_BATCH_MAX_MSGS); ++i)
+        {
+            cwg_make_peer(&recs[i]->args, &peer);
+            wg_set_peer(&batch, recs[i]->args.dev, &peer, what);
+        }
+
+        if (nl_batch_send(&sock, &batch) == 0)
+            continue;
+
+        ret = 1;
+        for (i = 0; i < batch.num_msgs; ++i) {
+            if (batch.error[i] == 0)
+                continue;
+            rec = recs[first + i];
+            rec->failed = 1;
+            snprintf(
+                    rec->error, CWG_MAX_ERROR, "%s: %s", what,
+                    strerror(-batch.error[i]));
+        }
+    }
+
+    nl_close(&sock);
+
+exit_cap:
+    disable_cap(CAP_NET_ADMIN);
+    return ret;
+}
+
+
+/** Add a device's configuration to its description, see nl_reply_cb_t. */
+static int cwg_wg_get_cb(int index, const struct nlmsghdr * nlh, void * arg) {
+    (void)index;
+    return wg_device_parse(nlh, (wg_device_info_t *)arg);
+}
+
+
+#ifdef ENABLE_CWG_APPLY
+
+/** Get our devices in the current namespace and their configuration.
+ *
+ * This lists the devices with cwg_link_list(), and then gets the
+ * configuration of each of ours over a single WireGuard socket.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_wg_dump(cwg_devices_t * devs) {
+    nl_batch_t batch;
+    nl_sock_t sock;
+    int ret = 1, i;
+
+    if (cwg_link_list(devs))
+        return 1;
+
+    if (devs->num_devices == 0)
+        return 0;
+
+    enable_cap(CAP_NET_ADMIN);
+
+    if (wg_open(&sock))
+        goto exit_cap;
+
+    ret = 0;
+    for (i = 0; !ret && (i < devs->num_devices); ++i) {
+        nl_batch_init(&batch);
+        wg_get_device(
+                &batch, devs->devices[i].name,
+                "Error getting device configuration");
+        ret = nl_batch_send_cb(
+                &sock, &batch, cwg_wg_get_cb, &devs->devices[i].wg);
+    }
+
+    nl_close(&sock);
+
+exit_cap:
+    disable_cap(CAP_NET_ADMIN);
+    return ret;
+}
+
+#endif
+
+
+/** State of cwg_wg_stats(). */
+typedef struct {
+    nl_sock_t sock;             // WireGuard socket
+    int64_t now;
+    int failed;
+} cwg_stats_state_t;
+
+
+/** Print the statistics of a device from a list of links, see nl_reply_cb_t.
+ *
+ * The list arrives on a different socket, so we can ask for the configuration
+ * of the device while it is still coming in.
+ */
+static int cwg_wg_stats_cb(int index, const struct nlmsghdr * nlh, void * arg)
+{
+    cwg_stats_state_t * st = (cwg_stats_state_t *)arg;
+    rtnl_link_info_t info;
+    cwg_device_t dev;
+    nl_batch_t batch;
+
+    (void)index;
+
+    if (rtnl_link_parse(nlh, &info))
+        return 1;
+
+    if (!info.name || !info.kind || strcmp(info.kind, "wireguard"))
+        return 0;
+
+    memset(&dev, 0, sizeof(dev));
+    if (cwg_parse_device_name(info.name, &dev.net, &dev.host))
+        return 0;
+
+    nl_batch_init(&batch);
+    wg_get_device(&batch, info.name, "Error getting device statistics");
+    if (nl_batch_send_cb(&st->sock, &batch, cwg_wg_get_cb, &dev.wg)) {
+        // removed since it was listed, that's fine
+        if (batch.error[0] != -ENODEV)
+            st->failed = 1;
+        return 0;
+    }
+
+    cwg_stats_print(&dev, st->now);
+    return 0;
+}
+
+
+/** Print the statistics of our devices in the current namespace.
+ *
+ * This makes a single dump request for the list of devices, and gets the
+ * statistics of each of ours as soon as it is listed, over a single
+ * WireGuard socket. Each is printed straight away, so nothing is kept in
+ * memory.
+ *
+ * @param now The current time, in seconds since the epoch.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_wg_stats(int64_t now) {
+    cwg_stats_state_t st;
+    nl_batch_t batch;
+    nl_sock_t rtnl;
+    int ret = 1;
+
+    st.now = now;
+    st.failed = 0;
+
+    enable_cap(CAP_NET_ADMIN);
+
+    if (nl_open(&rtnl, NETLINK_ROUTE))
+        goto exit_cap;
+
+    if (wg_open(&st.sock))
+        goto exit_rtnl;
+
+    nl_batch_init(&batch);
+    rtnl_link_dump(&batch, "Error listing devices");
+    ret = nl_batch_send_cb(&rtnl, &batch, cwg_wg_stats_cb, &st) || st.failed;
+
+    nl_close(&st.sock);
+
+exit_rtnl:
+    nl_close(&rtnl);
+
+exit_cap:
+    disable_cap(CAP_NET_ADMIN);
+    return ret;
+}
+
+
+#ifdef ENABLE_CWG_APPLY
+
+/** Update the listen port and the peer of an existing device.
+ *
+ * This must be called from within the device's namespace. Any peers other
+ * than the new one are removed, in the same request.
+ *
+ * @param args The device's arguments, with its new peer, if any.
+ * @param set_port Whether to set the listen port to that of args.
+ * @param current The current configuration of the device.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_wg_update(
+        const cwg_args_t * args, int set_port,
+        const wg_device_info_t * current)
+{
+    nl_batch_t batch;
+    wg_peer_t peer;
+
+    (void)current;
+
+    if (args->peer_key)
+        cwg_make_peer(args, &peer);
+
+    nl_batch_init(&batch);
+    wg_update_device(
+            &batch, args->dev, set_port ? args->port : 0,
+            args->peer_key ? &peer : NULL, "Error updating device");
+    return cwg_wg_send(&batch);
+}
+
+#endif
+
+
+#ifdef ENABLE_CWG_ATTACH
+
+/** Set the listen port of the device.
+ *
+ * This must be called from within the device's namespace.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_wg_set_port(const cwg_args_t * args, run_t * proc) {
+    nl_batch_t batch;
+
+    (void)proc;
+
+    nl_batch_init(&batch);
+    wg_update_device(&batch, args->dev, args->port, NULL, "Error setting port");
+    return cwg_wg_send(&batch);
+}
+
+
+/** Get the public key of the device.
+ *
+ * This must be called from within the device's namespace.
+ *
+ * @param dev The device.
+ * @param public_key_b64 (out) Buffer of WG_KEY_B64_LEN + 1 chars.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_wg_get_public_key(const char * dev, char * public_key_b64) {
+    static const wg_key_t no_key;
+    wg_device_info_t info;
+    nl_batch_t batch;
+    nl_sock_t sock;
+    int ret = 1;
+
+    memset(&info, 0, sizeof(info));
+
+    enable_cap(CAP_NET_ADMIN);
+
+    if (wg_open(&sock))
+        goto exit_cap;
+
+    nl_batch_init(&batch);
+    wg_get_device(&batch, dev, "Error getting public key");
+    ret = nl_batch_send_cb(&sock, &batch, cwg_wg_get_cb, &info);
+    nl_close(&sock);
+
+exit_cap:
+    disable_cap(CAP_NET_ADMIN);
+
+    if (!ret && !memcmp(info.public_key.key, no_key.key, WG_KEY_LEN)) {
+        fprintf(stderr, "Device has no public key\n");
+        ret = 1;
+    }
+
+    if (!ret)
+        wg_key_to_base64(public_key_b64, &info.public_key);
+    return ret;
+}
+
+#endif
+
+#endif
+
+
+/** Validate and parse the input for the cwg_create command. */
+static void cwg_create_validate(int argc, char * argv[], cwg_args_t * args) {
+    if (argc != CWG_NUM_ARGS(cwg_create_schema)) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
+        goto exit_usage;
+    }
+
+    if (cwg_check_args(cwg_create_schema, argv, args))
+        goto exit_usage;
+
+    return;
+
+exit_usage:
+    fprintf(stderr, "Usage: " SYNOPSIS_CWG_CREATE);
+    exit(EXIT_FAILURE);
+}
+
+
+/** State shared by the steps of cwg_create_one(). */
+typedef struct {
+    const cwg_args_t * args;
+    wg_key_t * private_key;     // in the secure arena
+    char * public_key_b64;
+    int in_netns;               // whether we entered the target namespace
+} cwg_create_t;
+
+
+/** Generate the key pair, see step_t::start. */
+static int cwg_create_keygen(void * arg, run_t * proc) {
+    cwg_create_t * c = (cwg_create_t *)arg;
+    wg_key_t public_key;
+
+    (void)proc;
+
+    if (curve25519_generate_private(c->private_key->key)) {
+        fprintf(stderr, "Error generating private key\n");
+        return 1;
+    }
+
+    curve25519_generate_public(public_key.key, c->private_key->key);
+    wg_key_to_base64(c->public_key_b64, &public_key);
+    return 0;
+}
+
+
+/** Create the device, see step_t::start. */
+static int cwg_create_link_add(void * arg, run_t * proc) {
+    cwg_create_t * c = (cwg_create_t *)arg;
+    return cwg_link_create(c->args->dev, c->args->netns, proc);
+}
+
+
+/** Remove the device again, see step_t::undo. */
+static void cwg_create_link_delete(void * arg) {
+    cwg_create_t * c = (cwg_create_t *)arg;
+
+    // the device is in the target namespace, don't touch ours
+    if (!c->in_netns && cwg_set_ns(c->args->netns))
+        return;
+
+    trace_begin("link_delete");
+    trace_end(cwg_link_delete(c->args->dev));
+}
+
+
+/** Enter the target namespace, see step_t::start. */
+static int cwg_create_setns(void * arg, run_t * proc) {
+    cwg_create_t * c = (cwg_create_t *)arg;
+
+    (void)proc;
+
+    if (cwg_set_ns(c->args->netns))
+        return 1;
+
+    c->in_netns = 1;
+    return 0;
+}
+
+
+/** Set the port and private key, see step_t::start. */
+static int cwg_create_set_key(void * arg, run_t * proc) {
+    cwg_create_t * c = (cwg_create_t *)arg;
+    return cwg_wg_set_key(c->args, c->private_key, proc);
+}
+
+
+/** Set the address, bring the link up and add the route, see step_t::start.
+ */
+static int cwg_create_configure(void * arg, run_t * proc) {
+    cwg_create_t * c = (cwg_create_t *)arg;
+    return cwg_link_configure(c->args, proc);
+}
+
+
+/** Create a WireGuard device from validated cwg_create arguments.
+ *
+ * Creating the device runs in our own namespace, while the key is generated
+ * and we enter the target namespace. Setting the key and configuring the
+ * device then go in parallel. With the ip and wg commands, these are separate
+ * programs, which run concurrently.
+ *
+ * This leaves the calling thread in the target namespace.
+ *
+ * @param args The arguments, see cwg_create_schema.
+ * @param public_key_b64 (out) Buffer of WG_KEY_B64_LEN + 1 chars which
+ *          receives the public key of the new device.
+ * @return 0 on success, 1 on failure, in which case an error message is
+ *          printed.
+ */
+static int cwg_create_one(const cwg_args_t * args, char * public_key_b64) {
+    cwg_create_t c;
+    int ret;
+
+    // link_add must come before setns, as it runs in our namespace
+    const step_t steps[] = {
+        {
+            "link_add", 0, cwg_create_link_add, NULL,
+            "Error creating device", cwg_create_link_delete },
+        { "keygen", 0, cwg_create_keygen, NULL, NULL, NULL },
+        { "setns", 0, cwg_create_setns, NULL, NULL, NULL },
+        {
+            "set_key", STEP_DEP(0) | STEP_DEP(1) | STEP_DEP(2),
+            cwg_create_set_key, NULL, "Error setting port and key", NULL },
+        {
+            "configure", STEP_DEP(0) | STEP_DEP(2), cwg_create_configure,
+            cwg_link_configure_finish, NULL, NULL } };
+
+    c.args = args;
+    c.public_key_b64 = public_key_b64;
+    c.in_netns = 0;
+
+    c.private_key = secure_alloc(sizeof(wg_key_t));
+    if (!c.private_key)
+        return 1;
+
+    trace_task_begin(args->dev);
+    ret = steps_run(steps, sizeof(steps) / sizeof(steps[0]), &c);
+    trace_task_end(ret);
+
+    secure_free(c.private_key);
+    return ret;
+}
+
+
+int cwg_create(int argc, char * argv[]) {
+    char public_key_b64[WG_KEY_B64_LEN + 1];
+    cwg_args_t args;
+
+    // get inputs
+    cwg_create_validate(argc, argv, &args);
+
+    if (cwg_create_one(&args, public_key_b64))
+        return EXIT_FAILURE;
+
+    // produce output
+    printf("%s\n", public_key_b64);
+    return EXIT_SUCCESS;
+}
+
+
+/** Validate and parse the input for the cwg_connect command. */
+static void cwg_connect_validate(int argc, char * argv[], cwg_args_t * args) {
+    if (argc != CWG_NUM_ARGS(cwg_connect_schema)) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
+        goto exit_usage;
+    }
+
+    if (cwg_check_args(cwg_connect_schema, argv, args))
+        goto exit_usage;
+    return;
+
+exit_usage:
+    fprintf(stderr, "Usage: " SYNOPSIS_CWG_CONNECT);
+    exit(EXIT_FAILURE);
+}
+
+
+int cwg_connect(int argc, char * argv[]) {
+    cwg_args_t args;
+    int err;
+
+    // get inputs
+    cwg_connect_validate(argc, argv, &args);
+
+    // add peer
+    trace_task_begin(args.dev);
+
+    trace_begin("setns");
+    err = cwg_set_ns(args.netns);
+    trace_end(err);
+
+    if (!err) {
+        trace_begin("set_peer");
+        err = cwg_wg_set_peer(&args);
+        trace_end(err);
+    }
+
+    trace_task_end(err ? 1 : 0);
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+int cwg_connect_many(int argc, char * argv[]) {
+    cwg_connect_record_t * recs, ** valid, * rec;
+    const int num_args = CWG_NUM_ARGS(cwg_connect_many_schema);
+    cwg_line_t * lines;
+    char * fields[CWG_NUM_ARGS(cwg_connect_many_schema)];
+    const char * error;
+    int num_lines, num_recs = 0, num_valid = 0, num_fields, err, i;
+    int ret = EXIT_FAILURE;
+
+    if (argc != 1) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
+        goto exit_usage;
+    }
+
+    if (netns_validate(argv[0])) {
+        fprintf(stderr, "Invalid network namespace\n");
+        goto exit_usage;
+    }
+
+    lines = cwg_read_lines(CWG_MAX_RECORDS, &num_lines);
+    if (!lines)
+        return EXIT_FAILURE;
+
+    recs = calloc(num_lines ? num_lines : 1, sizeof(cwg_connect_record_t));
+    valid = malloc((num_lines ? num_lines : 1) * sizeof(*valid));
+    if (!recs || !valid) {
+        perror("Error allocating records");
+        goto exit_records;
+    }
+
+    for (i = 0; i < num_lines; ++i) {
+        num_fields = cwg_split_line(lines[i], fields, num_args);
+        if (num_fields == 0)
+            continue;
+
+        rec = &recs[num_recs++];
+        rec->args.netns = argv[0];
+        if (num_fields != num_args) {
+            rec->failed = 1;
+            snprintf(
+                    rec->error, CWG_MAX_ERROR, "Expected %d fields, got %d",
+                    num_args, num_fields);
+        }
+        else if ((error = cwg_parse_args(
+                        cwg_connect_many_schema, fields, &rec->args)))
+        {
+            rec->failed = 1;
+            snprintf(rec->error, CWG_MAX_ERROR, "%s", error);
+        }
+        else
+            valid[num_valid++] = rec;
+    }
+
+    trace_begin("setns");
+    err = cwg_set_ns(argv[0]);
+    trace_end(err);
+
+    if (err) {
+        for (i = 0; i < num_valid; ++i) {
+            valid[i]->failed = 1;
+            strcpy(valid[i]->error, "Error entering network namespace");
+        }
+    }
+    else if (num_valid > 0) {
+        trace_begin("set_peers");
+        err = cwg_wg_set_peers(valid, num_valid);
+        trace_end(err);
+    }
+
+    ret = EXIT_SUCCESS;
+    for (i = 0; i < num_recs; ++i) {
+        if (recs[i].failed) {
+            printf("error %s\n", recs[i].error);
+            ret = EXIT_FAILURE;
+        }
+        else
+            printf("ok\n");
+    }
+
+exit_records:
+    free(valid);
+    free(recs);
+    free(lines);
+    return ret;
+
+exit_usage:
+    fprintf(stderr, "Usage: " SYNOPSIS_CWG_CONNECT_MANY);
+    return EXIT_FAILURE;
+}
+
+
+/** Remove the device for validated cwg_destroy arguments.
+ *
+ * This leaves the calling thread in the target namespace.
+ *
+ * Returns 0 on success, 1 on failure, in which case an error message is
+ * printed.
+ */
+static int cwg_destroy_one(const cwg_args_t * args) {
+    int err;
 
-#include "config.h"
-#include "container_wireguard.h"
+    trace_task_begin(args->dev);
 
+    trace_begin("setns");
+    err = cwg_set_ns(args->netns);
+    trace_end(err);
 
-#define WG_KEY_SIZE 44l
+    if (!err) {
+        trace_begin("link_delete");
+        err = cwg_link_delete(args->dev);
+        trace_end(err);
+    }
+
+    trace_task_end(err ? 1 : 0);
+    return err ? 1 : 0;
+}
 
 
-/** Validate the pid, net and host inputs each command has.
- *
- * This assumes that there are at least three arguments, do check that first.
- **/
-static void cwg_validate_pid_net_host(char * argv[]) {
-    int value = -1;
+int cwg_destroy(int argc, char * argv[]) {
+    cwg_args_t args;
 
-    if (validate_number(7, argv[0], NULL)) {
-        fprintf(stderr, "Invalid network namespace PID\n");
+    if (argc != CWG_NUM_ARGS(cwg_destroy_schema)) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
         goto exit_usage;
     }
 
-    if (validate_number(7, argv[1], NULL)) {
-        fprintf(stderr, "Invalid network number\n");
+    if (cwg_check_args(cwg_destroy_schema, argv, &args))
         goto exit_usage;
+
+    if (cwg_destroy_one(&args))
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+
+exit_usage:
+    fprintf(stderr, "Usage: " SYNOPSIS_CWG_DESTROY);
+    return EXIT_FAILURE;
+}
+
+
+/** Parse a network number argument.
+ *
+ * Returns 0 if valid, 1 if not, in which case an error message is printed.
+ */
+static int cwg_parse_net(const char * arg, int * net) {
+    cwg_args_t args;
+    const char * error = cwg_parse_arg(CWG_ARG_NET, arg, &args);
+
+    if (error) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
     }
 
-    value = atoi(argv[0]);
+    *net = args.net;
+    return 0;
+}
+
+
+int cwg_destroy_all(int argc, char * argv[]) {
+    cwg_devices_t devs = { NULL, 0, 0, 0 };
+    int first_net = 0, last_net = CWG_MAX_NET;
+    int num_removed = 0, err, i, j;
+    int ret = EXIT_FAILURE;
 
-    if ((value < 0) || ((1 << 23) <= value)) {
-        fprintf(stderr, "Network number out of range [0, %d]\n", (1 << 23) - 1);
+    if ((argc != 1) && (argc != 3)) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
         goto exit_usage;
     }
 
-    if (validate_number(1, argv[2], NULL)) {
-        fprintf(stderr, "Invalid host number\n");
+    if (netns_validate(argv[0])) {
+        fprintf(stderr, "Invalid network namespace\n");
         goto exit_usage;
     }
 
-    value = atoi(argv[2]);
+    if (argc == 3) {
+        if (
+                cwg_parse_net(argv[1], &first_net) ||
+                cwg_parse_net(argv[2], &last_net))
+            goto exit_usage;
+
+        if (first_net > last_net) {
+            fprintf(stderr, "Empty network range\n");
+            goto exit_usage;
+        }
+    }
+
+    trace_begin("setns");
+    err = cwg_set_ns(argv[0]);
+    trace_end(err);
+    if (err) return EXIT_FAILURE;
+
+    trace_begin("link_list");
+    err = cwg_link_list(&devs);
+    trace_end(err);
+    if (err) goto exit_devices;
+
+    // keep only those in the range, in order
+    for (i = 0, j = 0; i < devs.num_devices; ++i)
+        if (
+                (first_net <= devs.devices[i].net) &&
+                (devs.devices[i].net <= last_net))
+            devs.devices[j++] = devs.devices[i];
+    devs.num_devices = j;
+
+    trace_begin("link_delete");
+    err = cwg_link_delete_all(&devs);
+    trace_end(err);
+
+    for (i = 0; i < devs.num_devices; ++i) {
+        if (devs.devices[i].failed)
+            printf(
+                    "failed %d %d\n", devs.devices[i].net,
+                    devs.devices[i].host);
+        else
+            ++num_removed;
+    }
+    printf("removed %d\n", num_removed);
+
+    ret = err ? EXIT_FAILURE : EXIT_SUCCESS;
+
+exit_devices:
+    free(devs.devices);
+    return ret;
+
+exit_usage:
+    fprintf(stderr, "Usage: " SYNOPSIS_CWG_DESTROY_ALL);
+    return EXIT_FAILURE;
+}
+
 
-    if ((value < 0) || (1 < value)) {
-        fprintf(stderr, "Host number must be 0 or 1\n");
+int cwg_stats(int argc, char * argv[]) {
+    int err;
+
+    if (argc != 1) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
         goto exit_usage;
     }
 
-    return;
+    if (netns_validate(argv[0])) {
+        fprintf(stderr, "Invalid network namespace\n");
+        goto exit_usage;
+    }
+
+    trace_begin("setns");
+    err = cwg_set_ns(argv[0]);
+    trace_end(err);
+    if (err) return EXIT_FAILURE;
+
+    trace_begin("wg_stats");
+    err = cwg_wg_stats((int64_t)time(NULL));
+    trace_end(err);
+
+    if (fflush(stdout) != 0) {
+        perror("Error writing output");
+        err = 1;
+    }
+
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
 
 exit_usage:
-    fprintf(stderr, "Usage: " SYNOPSIS_CWG_CREATE);
-    exit(EXIT_FAILURE);
+    fprintf(stderr, "Usage: " SYNOPSIS_CWG_STATS);
+    return EXIT_FAILURE;
 }
 
 
-/** Compute the device name from net and host.
+#if defined(ENABLE_CWG_APPLY) || defined(ENABLE_CWG_POOL_FILL)
+
+/** Return the calling thread to a namespace opened earlier.
  *
- * Caller owns the returned buffer and needs to free() it. Returns NULL on
- * error.
+ * Returns 0 on success, 1 on failure.
  */
-static const char * cwg_device_name(char * argv[]) {
-    int net = atoi(argv[1]);
-    int host = atoi(argv[2]);
+static int cwg_return_ns(int ns_fd) {
+    int err;
 
-    const size_t dev_buf_size = strlen(CWG_PREFIX) + 11;
-    char * dev = (char *)malloc(dev_buf_size);
-    if (!dev) return NULL;
-    snprintf(dev, dev_buf_size, "%s-%u-%u", CWG_PREFIX, net, host);
-    return dev;
+    PROBE1(setns_start, "");
+    enable_cap(CAP_SYS_ADMIN);
+    err = setns(ns_fd, CLONE_NEWNET);
+    disable_cap(CAP_SYS_ADMIN);
+    PROBE2(setns_done, "", err);
+
+    if (err)
+        perror("Error returning to original network namespace");
+    return err ? 1 : 0;
 }
 
+#endif
 
-/** Compute network IP. */
-static uint32_t cwg_network_ip(char * argv[]) {
-    int net = atoi(argv[1]);
 
-    return (10u << 24) | (net << 1);
-}
+#ifdef ENABLE_CWG_APPLY
 
+/** A tunnel in the desired state given to cwg_apply. */
+typedef struct {
+    cwg_args_t args;            // see cwg_apply_schema
+    cwg_device_t * device;      // the existing device, if any
+} cwg_tunnel_t;
 
-/** Compute host IP. */
-static uint32_t cwg_host_ip(char * argv[]) {
-    int host = atoi(argv[2]);
 
-    return cwg_network_ip(argv) | host;
+/** Order tunnels and devices by net and host, for qsort() and bsearch(). */
+static int cwg_compare_net_host(int net1, int host1, int net2, int host2) {
+    if (net1 != net2)
+        return (net1 > net2) - (net1 < net2);
+    return (host1 > host2) - (host1 < host2);
 }
 
 
-/** Compute network IP/netmask and return as dotted-quad/nm.
- *
- * Caller owns the returned buffer and needs to free() it. Returns NULL on
- * error.
- */
-static const char * cwg_network_ip_nm(char * argv[]) {
-    uint32_t ip = cwg_network_ip(argv);
-    char * ips = (char *)malloc(19);
-    if (!ips) return NULL;
-    snprintf(
-            ips, 19, "%"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32"/31",
-            ip >> 24, ip >> 16 & 0xff, ip >> 8 & 0xff, ip & 0xff);
-    return ips;
+static int cwg_compare_tunnels(const void * a, const void * b) {
+    const cwg_tunnel_t * x = a, * y = b;
+    return cwg_compare_net_host(
+            x->args.net, x->args.host, y->args.net, y->args.host);
 }
 
 
-/** Compute device IP address and return as dotted-quad.
- *
- * Caller owns the returned buffer and needs to free() it. Returns NULL on
- * error.
- */
-static const char * cwg_device_ip(char * argv[]) {
-    uint32_t ip = cwg_host_ip(argv);
-    char * ips = (char *)malloc(16);
-    if (!ips) return NULL;
-    snprintf(
-            ips, 16, "%"PRIu32".%"PRIu32".%"PRIu32".%"PRIu32,
-            ip >> 24, ip >> 16 & 0xff, ip >> 8 & 0xff, ip & 0xff);
-    return ips;
+static int cwg_compare_devices(const void * a, const void * b) {
+    const cwg_device_t * x = a, * y = b;
+    return cwg_compare_net_host(x->net, x->host, y->net, y->host);
 }
 
 
-/** Switch to the target ns for the device.
+/** Read the desired tunnels from standard input.
  *
- * Returns 0 on success, 1 on failure.
+ * All of them are validated, and the result is sorted by net and host.
  *
- * */
-static int cwg_set_ns(const char * netns_pid) {
-
+ * @param netns The namespace argument, to put into each tunnel's args.
+ * @param lines (out) The input lines, which the tunnels point into, to be
+ *          freed by the caller.
+ * @param tunnels (out) The tunnels, to be freed by the caller.
+ * @param num_tunnels (out) The number of tunnels.
+ * @return 0 on success, 1 on failure, in which case a message is printed and
+ *          there is nothing to free.
+ */
+static int cwg_apply_read(
+        char * netns, cwg_line_t ** lines, cwg_tunnel_t ** tunnels,
+        int * num_tunnels)
+{
+    cwg_tunnel_t * t;
+    char * fields[CWG_NUM_ARGS(cwg_apply_schema)];
+    int num_lines, num_fields, i;
+
+    *num_tunnels = 0;
+
+    *lines = cwg_read_lines(CWG_MAX_RECORDS, &num_lines);
+    if (!*lines)
+        return 1;
+
+    *tunnels = malloc((num_lines ? num_lines : 1) * sizeof(cwg_tunnel_t));
+    if (!*tunnels) {
+        perror("Error allocating tunnels");
+        goto exit_lines;
+    }
 
-    char netns_path[32];
-    snprintf(netns_path, 32, "/proc/%s/ns/net", netns_pid);
+    for (i = 0; i < num_lines; ++i) {
+        num_fields = cwg_split_line(
+                (*lines)[i], fields, CWG_NUM_ARGS(cwg_apply_schema));
+        if (num_fields == 0)
+            continue;
+
+        t = &(*tunnels)[*num_tunnels];
+        t->args.netns = netns;
+        if (
+                (num_fields != CWG_NUM_ARGS(cwg_apply_schema)) ||
+                cwg_check_args(cwg_apply_schema, fields, &t->args))
+        {
+            fprintf(stderr, "Invalid tunnel on line %d\n", i + 1);
+            goto exit_tunnels;
+        }
+        t->device = NULL;
+
+        ++*num_tunnels;
+    }
 
-    enable_cap(CAP_SYS_PTRACE);
-    int netns_fd = open(netns_path, O_RDONLY | O_NONBLOCK);
-    disable_cap(CAP_SYS_PTRACE);
+    qsort(*tunnels, *num_tunnels, sizeof(cwg_tunnel_t), cwg_compare_tunnels);
 
-    if (netns_fd == -1) {
-        fprintf(stderr, "When opening %s\n", netns_path);
-        perror("Could not open network namespace\n");
-        goto exit_fail;
+    for (i = 1; i < *num_tunnels; ++i) {
+        t = &(*tunnels)[i];
+        if (!cwg_compare_tunnels(t - 1, t)) {
+            fprintf(
+                    stderr, "Tunnel for net %d host %d given twice\n",
+                    t->args.net, t->args.host);
+            goto exit_tunnels;
+        }
     }
 
-    enable_cap(CAP_SYS_ADMIN);
-    int err = setns(netns_fd, CLONE_NEWNET);
-    disable_cap(CAP_SYS_ADMIN);
+    return 0;
 
-    if (err) {
-        fprintf(stderr, "Could not enter namespace\n");
-        perror(NULL);
-        goto exit_fd;
+exit_tunnels:
+    free(*tunnels);
+
+exit_lines:
+    free(*lines);
+    return 1;
+}
+
+
+/** Check whether a device's peer is the one the tunnel asks for. */
+static int cwg_apply_peer_ok(cwg_tunnel_t * t, const wg_device_info_t * wg) {
+    wg_peer_t peer;
+
+    if (!t->args.peer_key)
+        return wg->num_peers == 0;
+
+    cwg_make_peer(&t->args, &peer);
+
+    return
+            (wg->num_peers == 1) && (wg->peer_num_allowed_ips == 1) &&
+            (wg->peer_allowed_ip == peer.allowed_ip) &&
+            (wg->peer_allowed_ip_cidr == peer.allowed_ip_cidr) &&
+            (wg->peer_endpoint.sin_addr.s_addr ==
+                peer.endpoint.sin_addr.s_addr) &&
+            (wg->peer_endpoint.sin_port == peer.endpoint.sin_port) &&
+            !memcmp(peer.public_key->key, wg->peer_key.key, WG_KEY_LEN);
+}
+
+
+/** Create the device for a tunnel, and connect it if it has a peer.
+ *
+ * This must be called from our original namespace, and leaves the calling
+ * thread in the target namespace. If the peer cannot be set, the device is
+ * removed again.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_apply_create(cwg_tunnel_t * t) {
+    char public_key_b64[WG_KEY_B64_LEN + 1];
+    int err;
+
+    if (cwg_create_one(&t->args, public_key_b64))
+        return 1;
+
+    if (t->args.peer_key) {
+        trace_begin("set_peer");
+        err = cwg_wg_set_peer(&t->args);
+        trace_end(err);
+
+        // a device without its peer would count as neither created nor failed
+        if (err) {
+            trace_begin("link_delete");
+            trace_end(cwg_link_delete(t->args.dev));
+            return 1;
+        }
     }
 
-    close(netns_fd);
+    printf("created %d %d %s\n", t->args.net, t->args.host, public_key_b64);
     return 0;
+}
 
-exit_fd:
-    close(netns_fd);
 
-exit_fail:
-    return 1;
+/** Bring an existing device in line with its tunnel.
+ *
+ * This must be called from within the target namespace.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int cwg_apply_update(cwg_tunnel_t * t) {
+    const wg_device_info_t * wg = &t->device->wg;
+    int set_port = wg->listen_port != t->args.port;
+    int err;
+
+    if (!set_port && cwg_apply_peer_ok(t, wg))
+        return 0;
+
+    trace_task_begin(t->args.dev);
+    trace_begin("update");
+    err = cwg_wg_update(&t->args, set_port, wg);
+    trace_end(err);
+    trace_task_end(err ? 1 : 0);
+
+    if (!err)
+        printf("updated %d %d\n", t->args.net, t->args.host);
+    return err;
 }
 
 
-/** Validate the input for the cwg_create command. */
-static void cwg_create_validate(int argc, char * argv[]) {
-    int value = -1;
+int cwg_apply(int argc, char * argv[]) {
+    cwg_devices_t devs = { NULL, 0, 0, 0 };
+    cwg_tunnel_t * tunnels, * t;
+    cwg_line_t * lines;
+    cwg_device_t * dev, key;
+    int num_tunnels, host_ns, err, i;
+    int ret = EXIT_FAILURE;
 
-    if (argc != 4) {
+    if (argc != 1) {
         fprintf(stderr, "Incorrect number of command line arguments\n");
         goto exit_usage;
     }
 
-    cwg_validate_pid_net_host(argv);
-
-    if (validate_number(5, argv[3], NULL)) {
-        fprintf(stderr, "Invalid listen port\n");
+    if (netns_validate(argv[0])) {
+        fprintf(stderr, "Invalid network namespace\n");
         goto exit_usage;
     }
 
-    value = atoi(argv[3]);
+    if (cwg_apply_read(argv[0], &lines, &tunnels, &num_tunnels))
+        return EXIT_FAILURE;
 
-    if ((value < 1) || (65536 <= value)) {
-        fprintf(stderr, "Port number of out of range [1, 65535]\n");
-        goto exit_usage;
+    cwg_warm_up();
+
+    // new devices are created from here, see cwg_create_one()
+    host_ns = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (host_ns == -1) {
+        perror("Error opening current network namespace");
+        goto exit_tunnels;
+    }
+
+    trace_begin("setns");
+    err = cwg_set_ns(argv[0]);
+    trace_end(err);
+    if (err) goto exit_host_ns;
+
+    trace_begin("dump");
+    err = cwg_wg_dump(&devs);
+    trace_end(err);
+    if (err) goto exit_devices;
+
+    qsort(devs.devices, devs.num_devices, sizeof(cwg_device_t),
+            cwg_compare_devices);
+
+    for (i = 0; i < num_tunnels; ++i) {
+        t = &tunnels[i];
+        key.net = t->args.net;
+        key.host = t->args.host;
+        t->device = bsearch(
+                &key, devs.devices, devs.num_devices, sizeof(cwg_device_t),
+                cwg_compare_devices);
+        if (t->device)
+            t->device->wanted = 1;
+    }
+
+    // Keep going after errors, so that one bad tunnel doesn't hold up the
+    // others. Removing goes first, as it may free up ports for new devices.
+    ret = EXIT_SUCCESS;
+
+    for (i = 0; i < devs.num_devices; ++i) {
+        dev = &devs.devices[i];
+        if (dev->wanted)
+            continue;
+
+        trace_begin("link_delete");
+        err = cwg_link_delete(dev->name);
+        trace_end(err);
+
+        if (err) {
+            printf("failed %d %d\n", dev->net, dev->host);
+            ret = EXIT_FAILURE;
+        }
+        else
+            printf("removed %d %d\n", dev->net, dev->host);
     }
-    return;
+
+    for (i = 0; i < num_tunnels; ++i) {
+        t = &tunnels[i];
+        if (t->device && cwg_apply_update(t)) {
+            printf("failed %d %d\n", t->args.net, t->args.host);
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < num_tunnels; ++i) {
+        t = &tunnels[i];
+        if (t->device)
+            continue;
+
+        if (cwg_return_ns(host_ns)) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        if (cwg_apply_create(t)) {
+            printf("failed %d %d\n", t->args.net, t->args.host);
+            ret = EXIT_FAILURE;
+        }
+    }
+
+exit_devices:
+    free(devs.devices);
+
+exit_host_ns:
+    close(host_ns);
+
+exit_tunnels:
+    free(tunnels);
+    free(lines);
+    return ret;
 
 exit_usage:
-    fprintf(stderr, "Usage: " SYNOPSIS_CWG_CREATE);
-    exit(EXIT_FAILURE);
+    fprintf(stderr, "Usage: " SYNOPSIS_CWG_APPLY);
+    return EXIT_FAILURE;
 }
 
+#endif
 
-int cwg_create(int argc, char * argv[]) {
-    const char * private_key = NULL, * public_key = NULL;
-    ssize_t public_key_size = 0l, private_key_size = 0l;
 
-    // get inputs
-    cwg_create_validate(argc, argv);
+#if defined(ENABLE_CWG_POOL_FILL) || defined(ENABLE_CWG_ATTACH)
+
+/** List the devices in the pool.
+ *
+ * This must be called from within the pool's namespace.
+ *
+ * @param devs (out) The devices, to be freed by the caller.
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_pool_list(cwg_devices_t * devs) {
+    int err;
 
-    const char * netns_pid = argv[0];
+    memset(devs, 0, sizeof(*devs));
+    devs->pool = 1;
 
-    const char * dev = cwg_device_name(argv);
-    if (!dev) goto exit_fail;
+    trace_begin("pool_list");
+    err = cwg_link_list(devs);
+    trace_end(err);
+    return err;
+}
 
-    const char * ips = cwg_device_ip(argv);
-    if (!ips) goto exit_dev;
+#endif
 
-    const char * vpn_ip_nm = cwg_network_ip_nm(argv);
-    if (!vpn_ip_nm) goto exit_ips;
 
-    const char * port = argv[3];
+#ifdef ENABLE_CWG_POOL_FILL
 
-    // create endpoint
-    const char * const genkey_args[] = { WG, "genkey", NULL };
-    if (run_check(
-                WG, genkey_args, NULL, NULL, 0l,
-                &private_key, &private_key_size)) {
-        fprintf(stderr, "Error generating private key\n");
-        goto exit_vpn_ip_nm;
+/** Create a device in the pool, with a key but no port.
+ *
+ * This is cwg_create_one() without the configuration, which depends on the
+ * target. Like there, the device is created from our own namespace, so that
+ * its socket is there.
+ *
+ * @param index The index of the device, see cwg_format_pool_name().
+ * @return 0 on success, 1 on failure.
+ */
+static int cwg_pool_create_one(int index) {
+    char public_key_b64[WG_KEY_B64_LEN + 1];
+    cwg_args_t args;
+    cwg_create_t c;
+    int ret;
+
+    const step_t steps[] = {
+        {
+            "link_add", 0, cwg_create_link_add, NULL,
+            "Error creating device", cwg_create_link_delete },
+        { "keygen", 0, cwg_create_keygen, NULL, NULL, NULL },
+        { "setns", 0, cwg_create_setns, NULL, NULL, NULL },
+        {
+            "set_key", STEP_DEP(0) | STEP_DEP(1) | STEP_DEP(2),
+            cwg_create_set_key, NULL, "Error setting key", NULL } };
+
+    // the port is set by cwg_attach, 0 lets the kernel pick one until then
+    memset(&args, 0, sizeof(args));
+    args.netns = CWG_POOL_NETNS;
+    cwg_format_pool_name(args.dev, index);
+
+    c.args = &args;
+    c.public_key_b64 = public_key_b64;
+    c.in_netns = 0;
+
+    c.private_key = secure_alloc(sizeof(wg_key_t));
+    if (!c.private_key)
+        return 1;
+
+    trace_task_begin(args.dev);
+    ret = steps_run(steps, sizeof(steps) / sizeof(steps[0]), &c);
+    trace_task_end(ret);
+
+    secure_free(c.private_key);
+    return ret;
+}
+
+
+/** Check whether the pool has a device with the given index. */
+static int cwg_pool_has(const cwg_devices_t * devs, int index) {
+    int i;
+
+    for (i = 0; i < devs->num_devices; ++i)
+        if (devs->devices[i].host == index)
+            return 1;
+    return 0;
+}
+
+
+int cwg_pool_fill(int argc, char * argv[]) {
+    cwg_devices_t devs;
+    int lock_fd, host_ns, num_devices, target, err, i;
+    int ret = EXIT_FAILURE;
+
+    (void)argv;
+
+    if (argc != 0) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
+        fprintf(stderr, "Usage: " SYNOPSIS_CWG_POOL_FILL);
+        return EXIT_FAILURE;
     }
 
-    const char * const pubkey_args[] = { WG, "pubkey", NULL };
-    if (run_check(
-                WG, pubkey_args, NULL, private_key, WG_KEY_SIZE,
-                &public_key, &public_key_size)) {
-        fprintf(stderr, "Error calculating public key\n");
-        goto exit_private_key;
+    // concurrent fills would pick the same free indexes
+    if ((mkdir(CWG_STATE_DIR, 0700) != 0) && (errno != EEXIST)) {
+        perror("Error creating state directory " CWG_STATE_DIR);
+        return EXIT_FAILURE;
     }
 
-    const char * const create_dev_args[] = {
-        IP, "link", "add", dev, "type", "wireguard", NULL };
-    if (run_check2(IP, create_dev_args)) {
-        fprintf(stderr, "Error creating device\n");
-        goto exit_public_key;
+    lock_fd = open(
+            CWG_STATE_DIR "/pool.lock", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd == -1) {
+        perror("Error opening " CWG_STATE_DIR "/pool.lock");
+        return EXIT_FAILURE;
     }
 
-    const char * const move_dev_args[] = {
-        IP, "link", "set", dev, "netns", netns_pid, NULL };
-    if (run_check2(IP, move_dev_args)) {
-        fprintf(stderr, "Error moving device into namespace\n");
-        goto exit_if;
+    while (flock(lock_fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            perror("Error locking " CWG_STATE_DIR "/pool.lock");
+            goto exit_lock;
+        }
     }
 
-    if (cwg_set_ns(netns_pid))
-        goto exit_if;
+    cwg_warm_up();
 
-    const char * const set_addr_args[] = {
-        IP, "addr", "add", ips, "dev", dev, NULL };
-    if (run_check2(IP, set_addr_args)) {
-        fprintf(stderr, "Error setting IP address\n");
-        goto exit_if;
+    // new devices are created from here, see cwg_pool_create_one()
+    host_ns = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (host_ns == -1) {
+        perror("Error opening current network namespace");
+        goto exit_lock;
     }
 
-    const char * const set_key_args[] = {
-        WG, "set", dev, "listen-port", port, "private-key", "/dev/stdin",
-        NULL };
-    if (run_check(
-                WG, set_key_args, NULL, private_key, WG_KEY_SIZE,
-                NULL, NULL)) {
-        fprintf(stderr, "Error setting port and key\n");
-        goto exit_if;
-    }
+    trace_begin("setns");
+    err = cwg_set_ns(CWG_POOL_NETNS);
+    trace_end(err);
+    if (err) goto exit_host_ns;
 
-    const char * const ifup_args[] = { IP, "link", "set", dev, "up", NULL };
-    if (run_check2(IP, ifup_args)) {
-        fprintf(stderr, "Error bringing up interface\n");
-        goto exit_if;
-    }
+    if (cwg_pool_list(&devs))
+        goto exit_devices;
+
+    ret = EXIT_SUCCESS;
+    num_devices = devs.num_devices;
+
+    // devices are made in bulk, not for every one cwg_attach takes
+    target = num_devices < CWG_POOL_LOW_WATER ? CWG_POOL_SIZE : num_devices;
+    for (i = 0; num_devices < target; ++i) {
+        if (cwg_pool_has(&devs, i))
+            continue;
 
-    const char * const route_args[] = {
-        IP, "route", "add", vpn_ip_nm, "dev", dev, NULL };
-    if (run_check2(IP, route_args)) {
-        fprintf(stderr, "Error adding route\n");
-        goto exit_if;
+        if (cwg_return_ns(host_ns) || cwg_pool_create_one(i)) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+        ++num_devices;
     }
 
-    // produce output
-    printf("%s\n", public_key);
+    printf("%d\n", num_devices);
+
+exit_devices:
+    free(devs.devices);
 
-    // clean up
-    explicit_bzero((void*)public_key, public_key_size);
-    free((void*)public_key);
+exit_host_ns:
+    close(host_ns);
 
-    explicit_bzero((void*)private_key, private_key_size);
-    free((void*)private_key);
+exit_lock:
+    close(lock_fd);
+    return ret;
+}
 
-    free((void*)vpn_ip_nm);
-    free((void*)ips);
-    free((void*)dev);
+#endif
 
-    return EXIT_SUCCESS;
 
-exit_if:;
-    const char * const destroy_dev_args[] = { IP, "link", "delete", dev, NULL };
-    run_check2(IP, destroy_dev_args);
+#ifdef ENABLE_CWG_ATTACH
+
+/** Take a device from the pool, trying them in turn until one is ours.
+ *
+ * This must be called from within the pool's namespace. Several cwg_attach
+ * may run at once, so each starts at a different device, and those that
+ * another one took in the meantime are skipped.
+ *
+ * Returns 0 on success, 1 on failure, or CWG_POOL_EMPTY if none were left.
+ */
+static int cwg_pool_claim(const cwg_devices_t * devs, const cwg_args_t * args)
+{
+    int first, i, err = CWG_POOL_EMPTY;
+
+    if (devs->num_devices == 0)
+        return CWG_POOL_EMPTY;
+
+    first = getpid() % devs->num_devices;
+    for (i = 0; (err == CWG_POOL_EMPTY) && (i < devs->num_devices); ++i) {
+        trace_begin("claim");
+        err = cwg_link_claim(
+                devs->devices[(first + i) % devs->num_devices].name, args);
+        trace_end(err);
+    }
+
+    return err;
+}
+
 
-exit_public_key:
-    explicit_bzero((void*)public_key, public_key_size);
-    free((void*)public_key);
+/** State shared by the steps of cwg_attach(). */
+typedef struct {
+    const cwg_args_t * args;
+    char * public_key_b64;
+} cwg_attach_t;
 
-exit_private_key:
-    explicit_bzero((void*)private_key, private_key_size);
-    free((void*)private_key);
 
-exit_vpn_ip_nm:
-    free((void*)vpn_ip_nm);
+/** Set the listen port, see step_t::start. */
+static int cwg_attach_set_port(void * arg, run_t * proc) {
+    cwg_attach_t * a = (cwg_attach_t *)arg;
+    return cwg_wg_set_port(a->args, proc);
+}
 
-exit_ips:
-    free((void*)ips);
 
-exit_dev:
-    free((void*)dev);
+/** Set the address, bring the link up and add the route, see step_t::start.
+ */
+static int cwg_attach_configure(void * arg, run_t * proc) {
+    cwg_attach_t * a = (cwg_attach_t *)arg;
+    return cwg_link_configure(a->args, proc);
+}
 
-exit_fail:
-    return EXIT_FAILURE;
+
+/** Read back the public key, see step_t::start. */
+static int cwg_attach_get_key(void * arg, run_t * proc) {
+    cwg_attach_t * a = (cwg_attach_t *)arg;
+
+    (void)proc;
+
+    return cwg_wg_get_public_key(a->args->dev, a->public_key_b64);
 }
 
 
-/** Validate the input for the cwg_connect command. */
-static void cwg_connect_validate(int argc, char * argv[]) {
-    if (argc != 5) {
+int cwg_attach(int argc, char * argv[]) {
+    char public_key_b64[WG_KEY_B64_LEN + 1];
+    cwg_devices_t devs;
+    cwg_attach_t a;
+    cwg_args_t args;
+    int err;
+
+    // the key was set by cwg_pool_fill(), so only its public half is read
+    const step_t steps[] = {
+        {
+            "set_port", 0, cwg_attach_set_port, NULL,
+            "Error setting port", NULL },
+        {
+            "configure", 0, cwg_attach_configure, cwg_link_configure_finish,
+            NULL, NULL },
+        { "get_key", 0, cwg_attach_get_key, NULL, NULL, NULL } };
+
+    // get inputs, which are those of cwg_create
+    if (argc != CWG_NUM_ARGS(cwg_create_schema)) {
         fprintf(stderr, "Incorrect number of command line arguments\n");
         goto exit_usage;
     }
 
-    cwg_validate_pid_net_host(argv);
-
-    if (validate_endpoint(argv[3], NULL)) {
-        fprintf(stderr, "Invalid endpoint\n");
+    if (cwg_check_args(cwg_create_schema, argv, &args))
         goto exit_usage;
+
+    trace_task_begin(args.dev);
+
+    // The kernel moves a device before renaming it, so if the name were
+    // taken, the device would end up in the target under its pool name.
+    trace_begin("setns");
+    err = cwg_set_ns(args.netns);
+    trace_end(err);
+    if (err) goto exit_task;
+
+    if (if_nametoindex(args.dev) != 0) {
+        fprintf(stderr, "Device %s exists already\n", args.dev);
+        err = 1;
+        goto exit_task;
     }
 
-    if (validate_wireguard_key(argv[4], NULL)) {
-        fprintf(stderr, "Invalid key\n");
-        goto exit_usage;
+    trace_begin("setns");
+    err = cwg_set_ns(CWG_POOL_NETNS);
+    trace_end(err);
+    if (err) goto exit_task;
+
+    err = cwg_pool_list(&devs);
+    if (!err) {
+        err = cwg_pool_claim(&devs, &args);
+        free(devs.devices);
+    }
+
+    if (err == CWG_POOL_EMPTY)
+        fprintf(stderr, "No interfaces left in the pool\n");
+    if (err) goto exit_task;
+
+    trace_begin("setns");
+    err = cwg_set_ns(args.netns);
+    trace_end(err);
+    if (err) goto exit_task;
+
+    a.args = &args;
+    a.public_key_b64 = public_key_b64;
+    err = steps_run(steps, sizeof(steps) / sizeof(steps[0]), &a);
+
+    // the device has left the pool, so it is not left half set up either
+    if (err) {
+        trace_begin("link_delete");
+        trace_end(cwg_link_delete(args.dev));
     }
-    return;
+
+exit_task:
+    trace_task_end(err ? 1 : 0);
+    if (err)
+        return err == CWG_POOL_EMPTY ? CWG_POOL_EMPTY : EXIT_FAILURE;
+
+    // produce output
+    printf("%s\n", public_key_b64);
+    return EXIT_SUCCESS;
 
 exit_usage:
-    fprintf(stderr, "Usage: " SYNOPSIS_CWG_CONNECT);
-    exit(EXIT_FAILURE);
+    fprintf(stderr, "Usage: " SYNOPSIS_CWG_ATTACH);
+    return EXIT_FAILURE;
 }
 
+#endif
 
-int cwg_connect(int argc, char * argv[]) {
-    // get inputs
-    cwg_connect_validate(argc, argv);
 
-    const char * netns_pid = argv[0];
+#if defined(ENABLE_CWG_ALLOC) || defined(ENABLE_CWG_FREE)
+
+/** Open the index of network numbers or listen ports.
+ *
+ * Network number n is item n, port p is item p - CWG_PORT_MIN.
+ *
+ * @param kind "net" or "port".
+ * @param index (out) The index to open.
+ * @param first (out) The number of item 0.
+ * @return 0 on success, 1 on failure, in which case an error message is
+ *          printed.
+ */
+static int cwg_alloc_open(const char * kind, alloc_index_t * index, int * first)
+{
+    const char * path;
+    uint32_t num_items;
+
+    if (strcmp(kind, "net") == 0) {
+        path = CWG_STATE_DIR "/nets";
+        num_items = UINT32_C(1) << 23;
+        *first = 0;
+    }
+    else if (strcmp(kind, "port") == 0) {
+        path = CWG_STATE_DIR "/ports";
+        num_items = CWG_PORT_MAX - CWG_PORT_MIN + 1;
+        *first = CWG_PORT_MIN;
+    }
+    else {
+        fprintf(stderr, "Invalid kind of number, must be net or port\n");
+        return 1;
+    }
 
-    const char * dev = cwg_device_name(argv);
-    if (!dev) goto exit_fail;
+    if ((mkdir(CWG_STATE_DIR, 0700) != 0) && (errno != EEXIST)) {
+        perror("Error creating state directory " CWG_STATE_DIR);
+        return 1;
+    }
 
-    const char * vpn_ip_nm = cwg_network_ip_nm(argv);
-    if (!vpn_ip_nm) goto exit_dev;
+    return alloc_open(index, path, num_items) ? 1 : 0;
+}
 
-    const char * peer_endpoint = argv[3];
-    const char * peer_key = argv[4];
+#endif
 
-    // add peer
-    if (cwg_set_ns(netns_pid))
-        goto exit_ip;
 
-    const char * const add_args[] = {
-        WG, "set", dev, "peer", peer_key, "allowed-ips", vpn_ip_nm, "endpoint",
-        peer_endpoint, NULL };
+#ifdef ENABLE_CWG_ALLOC
 
-    if (run_check2(WG, add_args))
-        goto exit_ip;
+int cwg_alloc(int argc, char * argv[]) {
+    alloc_index_t index;
+    uint32_t item;
+    int first, ret;
 
-    return EXIT_SUCCESS;
+    if (argc != 1) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
+        fprintf(stderr, "Usage: " SYNOPSIS_CWG_ALLOC);
+        return EXIT_FAILURE;
+    }
 
-exit_ip:
-    free((void*)vpn_ip_nm);
+    if (cwg_alloc_open(argv[0], &index, &first))
+        return EXIT_FAILURE;
 
-exit_dev:
-    free((void*)dev);
+    ret = alloc_get(&index, &item);
+    alloc_close(&index);
 
-exit_fail:
-    return EXIT_FAILURE;
+    if (ret == 1)
+        fprintf(stderr, "All %ss are in use\n", argv[0]);
+    if (ret != 0)
+        return EXIT_FAILURE;
+
+    printf("%" PRIu32 "\n", first + item);
+    return EXIT_SUCCESS;
 }
 
+#endif
 
-int cwg_destroy(int argc, char * argv[]) {
-    if (argc != 3) {
+
+#ifdef ENABLE_CWG_FREE
+
+int cwg_free(int argc, char * argv[]) {
+    alloc_index_t index;
+    int first, number, ret;
+
+    if (argc != 2) {
         fprintf(stderr, "Incorrect number of command line arguments\n");
         goto exit_usage;
     }
-    cwg_validate_pid_net_host(argv);
 
-    const char * netns_pid = argv[0];
-    cwg_set_ns(netns_pid);
+    if (strcmp(argv[0], "port") == 0) {
+        if (cwg_parse_uint(argv[1], 5, &number)) {
+            fprintf(stderr, "Invalid port number\n");
+            goto exit_usage;
+        }
+    }
+    else if (cwg_parse_net(argv[1], &number))
+        goto exit_usage;
+
+    if (cwg_alloc_open(argv[0], &index, &first))
+        return EXIT_FAILURE;
 
-    const char * dev = cwg_device_name(argv);
-    const char * const delete_args[] = { IP, "link", "delete", dev, NULL };
-    int err = run_check2(IP, delete_args);
+    ret = number < first ? 1 : alloc_put(&index, number - first);
+    alloc_close(&index);
 
-    free((void*)dev);
-    if (err) return EXIT_FAILURE;
-    return EXIT_SUCCESS;
+    if (ret == 1)
+        fprintf(stderr, "%s %d is not allocated\n", argv[0], number);
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 
 exit_usage:
-    fprintf(stderr, "Usage: " SYNOPSIS_CWG_DESTROY);
+    fprintf(stderr, "Usage: " SYNOPSIS_CWG_FREE);
     return EXIT_FAILURE;
 }
 
+#endif
+
+
+#if defined(ENABLE_CWG_CREATE_MANY) || defined(ENABLE_CWG_DESTROY_MANY)
+
+/** Run one record of cwg_create_many, see par_task_t. */
+static int cwg_create_many_task(char * argv[], char * output) {
+    cwg_args_t args;
+
+    if (cwg_check_args(cwg_create_schema, argv, &args))
+        return 1;
+
+    return cwg_create_one(&args, output);
+}
+
+
+int cwg_create_many(int argc, char * argv[]) {
+    (void)argv;
+
+    if (argc != 0) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
+        fprintf(stderr, "Usage: " SYNOPSIS_CWG_CREATE_MANY);
+        return EXIT_FAILURE;
+    }
+
+    cwg_warm_up();
+    return par_run(
+            CWG_NUM_ARGS(cwg_create_schema), cwg_create_many_task,
+            CWG_MANY_THREADS);
+}
+
+
+/** Run one record of cwg_destroy_many, see par_task_t. */
+static int cwg_destroy_many_task(char * argv[], char * output) {
+    cwg_args_t args;
+
+    (void)output;
+
+    if (cwg_check_args(cwg_destroy_schema, argv, &args))
+        return 1;
+
+    return cwg_destroy_one(&args);
+}
+
+
+int cwg_destroy_many(int argc, char * argv[]) {
+    (void)argv;
+
+    if (argc != 0) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
+        fprintf(stderr, "Usage: " SYNOPSIS_CWG_DESTROY_MANY);
+        return EXIT_FAILURE;
+    }
+
+    cwg_warm_up();
+    return par_run(
+            CWG_NUM_ARGS(cwg_destroy_schema), cwg_destroy_many_task,
+            CWG_MANY_THREADS);
+}
+
+#endif
+
+
+#if defined(ENABLE_CWG_CREATE) || defined(ENABLE_CWG_CONNECT) || \
+    defined(ENABLE_CWG_DESTROY) || defined(ENABLE_CWG_CREATE_MANY) || \
+    defined(ENABLE_CWG_CONNECT_MANY) || defined(ENABLE_CWG_DESTROY_MANY) || \
+    defined(ENABLE_CWG_DESTROY_ALL) || defined(ENABLE_CWG_APPLY) || \
+    defined(ENABLE_CWG_STATS) || defined(ENABLE_CWG_POOL_FILL) || \
+    defined(ENABLE_CWG_ATTACH)
+
+void cwg_warm_up(void) {
+#ifndef USE_WG_COMMAND
+    nl_sock_t sock;
+
+    // looks up the WireGuard family id, which is then remembered
+    if (wg_open(&sock) == 0)
+        nl_close(&sock);
+#endif
+
+#ifndef USE_IP_COMMAND
+    // devices are created from here, before we enter the target namespace
+    if (cwg_host_rtnl.fd == -1) {
+        enable_cap(CAP_NET_ADMIN);
+        nl_open(&cwg_host_rtnl, NETLINK_ROUTE);
+        disable_cap(CAP_NET_ADMIN);
+    }
+#endif
+}
+
+#endif
@@ -6,7 +6,7 @@
 
 #ifdef ENABLE_CWG_CREATE
 
-#define SYNOPSIS_CWG_CREATE "cwg_create <pid> <net> <host> <port>\n"
+#define SYNOPSIS_CWG_CREATE "cwg_create <netns> <net> <host> <port>\n"
 
 #define USAGE_CWG_CREATE \
     "--------------------------------------------------------------------\n"\
@@ -16,7 +16,9 @@
     "SYNOPSIS\n"                                                            \
     "    " SYNOPSIS_CWG_CREATE "\n"                                         \
     "ARGUMENTS:\n"                                                          \
-    "    pid: PID of the network namespace to put the device into.\n"       \
+    "    netns: Network namespace to put the device into, given as\n"       \
+    "            the PID of a process in it, as fd:<n> for an open\n"       \
+    "            namespace file descriptor, or as /run/netns/<name>.\n"     \
     "    net: Number of the network to use, in [0, 8388607].\n"             \
     "    host: Number of this host on that network, 0 or 1.\n"              \
     "    port: The local IP port to listen on for incoming connections.\n\n"\
@@ -44,7 +46,7 @@ int cwg_create(int argc, char * argv[]);
 #ifdef ENABLE_CWG_CONNECT
 
 #define SYNOPSIS_CWG_CONNECT \
-    "cwg_connect <pid> <net> <host> <peer_endpoint> <peer_key>\n"
+    "cwg_connect <netns> <net> <host> <peer_endpoint> <peer_key>\n"
 
 #define USAGE_CWG_CONNECT \
     "--------------------------------------------------------------------\n"\
@@ -54,7 +56,9 @@ int cwg_create(int argc, char * argv[]);
     "SYNOPSIS\n"                                                            \
     "    " SYNOPSIS_CWG_CONNECT "\n"                                        \
     "ARGUMENTS:\n"                                                          \
-    "    pid: PID of the network namespace the device is in.\n"             \
+    "    netns: Network namespace the device is in, given as the PID\n"     \
+    "            of a process in it, as fd:<n> for an open namespace\n"     \
+    "            file descriptor, or as /run/netns/<name>.\n"               \
     "    net: Network of the local interface device to connect.\n"          \
     "    host: Host of the local interface device to connect.\n"            \
     "    peer_endpoint: IPv4 endpoint of the peer, in dotted-quad\n"        \
@@ -83,7 +87,7 @@ int cwg_connect(int argc, char * argv[]);
 
 #ifdef ENABLE_CWG_DESTROY
 
-#define SYNOPSIS_CWG_DESTROY "cwg_destroy <pid> <net> <host>\n"
+#define SYNOPSIS_CWG_DESTROY "cwg_destroy <netns> <net> <host>\n"
 
 #define USAGE_CWG_DESTROY \
     "--------------------------------------------------------------------\n"\
@@ -93,7 +97,9 @@ int cwg_connect(int argc, char * argv[]);
     "SYNOPSIS\n"                                                            \
     "    " SYNOPSIS_CWG_DESTROY "\n"                                        \
     "ARGUMENTS:\n"                                                          \
-    "    pid: PID of the network namespace the device is in.\n"             \
+    "    netns: Network namespace the device is in, given as the PID\n"     \
+    "            of a process in it, as fd:<n> for an open namespace\n"     \
+    "            file descriptor, or as /run/netns/<name>.\n"               \
     "    net: Network of the network device to remove.\n"                   \
     "    host: Host of the network device to remove.\n"                     \
     "OUTPUT:\n"                                                             \
@@ -115,6 +121,392 @@ int cwg_destroy(int argc, char * argv[]);
 #endif
 
 
+#ifdef ENABLE_CWG_CREATE_MANY
+
+#define SYNOPSIS_CWG_CREATE_MANY "cwg_create_many\n"
+
+#define USAGE_CWG_CREATE_MANY \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_create_many - Creates many WireGuard interfaces.\n\n"          \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_CREATE_MANY "\n"                                    \
+    "INPUT:\n"                                                              \
+    "    One interface per line on standard input, given as\n"              \
+    "    <netns> <net> <host> <port>, see cwg_create. Interfaces are\n"     \
+    "    created in parallel.\n\n"                                          \
+    "OUTPUT:\n"                                                             \
+    "    One line per input line, in input order. This is `ok` followed\n"  \
+    "    by the public key for the new interface, or `error` followed by\n" \
+    "    the error messages on a single line.\n\n"                          \
+    "EXIT CODE:\n"                                                          \
+    "    0 if all interfaces were created, 1 otherwise.\n\n"
+
+#define DISPATCH_CWG_CREATE_MANY(CMD) DISPATCH(cwg_create_many, CMD)
+
+int cwg_create_many(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_CREATE_MANY ""
+#define USAGE_CWG_CREATE_MANY ""
+#define DISPATCH_CWG_CREATE_MANY(CMD)
+
+#endif
+
+
+#ifdef ENABLE_CWG_CONNECT_MANY
+
+#define SYNOPSIS_CWG_CONNECT_MANY "cwg_connect_many <netns>\n"
+
+#define USAGE_CWG_CONNECT_MANY \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_connect_many - Connect many interfaces to their peers.\n\n"    \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_CONNECT_MANY "\n"                                   \
+    "ARGUMENTS:\n"                                                          \
+    "    netns: Network namespace of the interfaces, see cwg_create.\n\n"   \
+    "INPUT:\n"                                                              \
+    "    One peer per line on standard input, given as\n"                   \
+    "    <net> <host> <peer_endpoint> <peer_key>, see cwg_connect. The\n"   \
+    "    peers are added in as few kernel requests as possible.\n\n"        \
+    "OUTPUT:\n"                                                             \
+    "    One line per input line, in input order. This is `ok`, or\n"       \
+    "    `error` followed by an error message.\n\n"                         \
+    "EXIT CODE:\n"                                                          \
+    "    0 if all peers were added, 1 otherwise.\n\n"
+
+#define DISPATCH_CWG_CONNECT_MANY(CMD) DISPATCH(cwg_connect_many, CMD)
+
+int cwg_connect_many(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_CONNECT_MANY ""
+#define USAGE_CWG_CONNECT_MANY ""
+#define DISPATCH_CWG_CONNECT_MANY(CMD)
+
+#endif
+
+
+#ifdef ENABLE_CWG_DESTROY_MANY
+
+#define SYNOPSIS_CWG_DESTROY_MANY "cwg_destroy_many\n"
+
+#define USAGE_CWG_DESTROY_MANY \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_destroy_many - Remove many network interfaces.\n\n"            \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_DESTROY_MANY "\n"                                   \
+    "INPUT:\n"                                                              \
+    "    One interface per line on standard input, given as\n"              \
+    "    <netns> <net> <host>, see cwg_destroy. Interfaces are removed\n"   \
+    "    in parallel.\n\n"                                                  \
+    "OUTPUT:\n"                                                             \
+    "    One line per input line, in input order. This is `ok`, or\n"       \
+    "    `error` followed by the error messages on a single line.\n\n"      \
+    "EXIT CODE:\n"                                                          \
+    "    0 if all interfaces were removed, 1 otherwise.\n\n"
+
+#define DISPATCH_CWG_DESTROY_MANY(CMD) DISPATCH(cwg_destroy_many, CMD)
+
+int cwg_destroy_many(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_DESTROY_MANY ""
+#define USAGE_CWG_DESTROY_MANY ""
+#define DISPATCH_CWG_DESTROY_MANY(CMD)
+
+#endif
+
+
+#ifdef ENABLE_CWG_DESTROY_ALL
+
+#define SYNOPSIS_CWG_DESTROY_ALL \
+    "cwg_destroy_all <netns> [<first_net> <last_net>]\n"
+
+#define USAGE_CWG_DESTROY_ALL \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_destroy_all - Remove all interfaces in a namespace.\n\n"       \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_DESTROY_ALL "\n"                                    \
+    "ARGUMENTS:\n"                                                          \
+    "    netns: Network namespace the interfaces are in, see cwg_create.\n" \
+    "    first_net: Only remove interfaces with a network number of at\n"   \
+    "            least this, in [0, 8388607]. Default 0.\n"                 \
+    "    last_net: Only remove interfaces with a network number of at\n"    \
+    "            most this, in [first_net, 8388607]. Default 8388607.\n\n"  \
+    "OUTPUT:\n"                                                             \
+    "    A line `failed <net> <host>` for each interface that could not\n"  \
+    "    be removed, followed by a line `removed <count>`. Errors are\n"    \
+    "    printed on standard error.\n\n"                                    \
+    "EXIT CODE:\n"                                                          \
+    "    0 if all interfaces were removed, 1 otherwise.\n\n"
+
+#define DISPATCH_CWG_DESTROY_ALL(CMD) DISPATCH(cwg_destroy_all, CMD)
+
+int cwg_destroy_all(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_DESTROY_ALL ""
+#define USAGE_CWG_DESTROY_ALL ""
+#define DISPATCH_CWG_DESTROY_ALL(CMD)
+
+#endif
+
+
+#ifdef ENABLE_CWG_APPLY
+
+#define SYNOPSIS_CWG_APPLY "cwg_apply <netns>\n"
+
+#define USAGE_CWG_APPLY \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_apply - Make the interfaces in a namespace match a list.\n\n"  \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_APPLY "\n"                                          \
+    "ARGUMENTS:\n"                                                          \
+    "    netns: Network namespace to manage, see cwg_create.\n\n"           \
+    "INPUT:\n"                                                              \
+    "    One interface per line on standard input, given as\n"              \
+    "    <net> <host> <port> <peer_endpoint> <peer_key>, see cwg_create\n"  \
+    "    and cwg_connect. Use - for both peer fields if the interface is\n" \
+    "    not connected yet. Interfaces in the namespace that are not\n"     \
+    "    listed are removed, missing ones are created, and existing ones\n" \
+    "    are updated if their port or peer differ. The current state is\n"  \
+    "    read from the kernel once, up front.\n\n"                          \
+    "OUTPUT:\n"                                                             \
+    "    One line per change, `created <net> <host> <public_key>`,\n"       \
+    "    `updated <net> <host>` or `removed <net> <host>`, and\n"           \
+    "    `failed <net> <host>` for interfaces that could not be changed.\n" \
+    "    Errors are printed on standard error. Invalid input is rejected\n" \
+    "    before any change is made.\n\n"                                    \
+    "EXIT CODE:\n"                                                          \
+    "    0 if the namespace matches the list, 1 otherwise.\n\n"
+
+#define DISPATCH_CWG_APPLY(CMD) DISPATCH(cwg_apply, CMD)
+
+int cwg_apply(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_APPLY ""
+#define USAGE_CWG_APPLY ""
+#define DISPATCH_CWG_APPLY(CMD)
+
+#endif
+
+
+#ifdef ENABLE_CWG_STATS
+
+#define SYNOPSIS_CWG_STATS "cwg_stats <netns>\n"
+
+#define USAGE_CWG_STATS \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_stats - Show traffic and handshakes of all interfaces.\n\n"    \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_STATS "\n"                                          \
+    "ARGUMENTS:\n"                                                          \
+    "    netns: Network namespace to read, see cwg_create.\n\n"             \
+    "OUTPUT:\n"                                                             \
+    "    One line per interface, given as <net> <host> <peer_key>\n"        \
+    "    <peer_endpoint> <rx_bytes> <tx_bytes> <handshake_age>, with the\n" \
+    "    age of the last handshake in seconds. The peer fields and the\n"   \
+    "    age are - if the interface is not connected or has not had a\n"    \
+    "    handshake yet. Lines are printed as the interfaces are read, so\n" \
+    "    the output may be incomplete if there is an error, which is\n"     \
+    "    printed on standard error.\n\n"                                    \
+    "EXIT CODE:\n"                                                          \
+    "    0 on success, 1 on failure.\n\n"
+
+#define DISPATCH_CWG_STATS(CMD) DISPATCH(cwg_stats, CMD)
+
+int cwg_stats(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_STATS ""
+#define USAGE_CWG_STATS ""
+#define DISPATCH_CWG_STATS(CMD)
+
+#endif
+
+
+#ifdef ENABLE_CWG_ALLOC
+
+#define SYNOPSIS_CWG_ALLOC "cwg_alloc <kind>\n"
+
+#define USAGE_CWG_ALLOC \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_alloc - Allocate a network number or listen port.\n\n"         \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_ALLOC "\n"                                          \
+    "ARGUMENTS:\n"                                                          \
+    "    kind: Either net for a network number in [0, 8388607], or port\n"  \
+    "            for a port in the configured range.\n\n"                   \
+    "OUTPUT:\n"                                                             \
+    "    The lowest number that is not in use, which is then marked as\n"   \
+    "    in use until it is freed with cwg_free. In case of failure, or\n"  \
+    "    if all numbers are in use, an error is printed on standard\n"      \
+    "    error.\n\n"                                                        \
+    "EXIT CODE:\n"                                                          \
+    "    0 on success, 1 on failure.\n\n"
+
+#define DISPATCH_CWG_ALLOC(CMD) DISPATCH(cwg_alloc, CMD)
+
+int cwg_alloc(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_ALLOC ""
+#define USAGE_CWG_ALLOC ""
+#define DISPATCH_CWG_ALLOC(CMD)
+
+#endif
+
+
+#ifdef ENABLE_CWG_FREE
+
+#define SYNOPSIS_CWG_FREE "cwg_free <kind> <number>\n"
+
+#define USAGE_CWG_FREE \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_free - Free a network number or listen port.\n\n"              \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_FREE "\n"                                           \
+    "ARGUMENTS:\n"                                                          \
+    "    kind: Either net or port, see cwg_alloc.\n"                        \
+    "    number: The network number or port to free.\n\n"                   \
+    "OUTPUT:\n"                                                             \
+    "    None on success, an error message on stderr in case of\n"          \
+    "    failure, or if the number was not allocated.\n\n"                  \
+    "EXIT CODE:\n"                                                          \
+    "    0 on success, 1 on failure.\n\n"
+
+#define DISPATCH_CWG_FREE(CMD) DISPATCH(cwg_free, CMD)
+
+int cwg_free(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_FREE ""
+#define USAGE_CWG_FREE ""
+#define DISPATCH_CWG_FREE(CMD)
+
+#endif
+
+
+#ifdef ENABLE_CWG_POOL_FILL
+
+#define SYNOPSIS_CWG_POOL_FILL "cwg_pool_fill\n"
+
+#define USAGE_CWG_POOL_FILL \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_pool_fill - Refills the pool of ready interfaces.\n\n"         \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_POOL_FILL "\n"                                      \
+    "DESCRIPTION:\n"                                                        \
+    "    If the pool holds fewer than CWG_POOL_LOW_WATER interfaces, new\n" \
+    "    ones are created until it holds CWG_POOL_SIZE, for cwg_attach to\n"\
+    "    use. They are created with a key, and kept down in the network\n"  \
+    "    namespace CWG_POOL_NETNS, which must exist. Run this after\n"      \
+    "    cwg_attach, or periodically.\n\n"                                  \
+    "OUTPUT:\n"                                                             \
+    "    The number of interfaces in the pool. In case of failure, an\n"    \
+    "    error will be printed on standard error.\n\n"                      \
+    "EXIT CODE:\n"                                                          \
+    "    0 on success, 1 on failure.\n\n"
+
+#define DISPATCH_CWG_POOL_FILL(CMD) DISPATCH(cwg_pool_fill, CMD)
+
+int cwg_pool_fill(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_POOL_FILL ""
+#define USAGE_CWG_POOL_FILL ""
+#define DISPATCH_CWG_POOL_FILL(CMD)
+
+#endif
+
+
+#ifdef ENABLE_CWG_ATTACH
+
+#define SYNOPSIS_CWG_ATTACH "cwg_attach <netns> <net> <host> <port>\n"
+
+#define USAGE_CWG_ATTACH \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    cwg_attach - Creates a WireGuard interface from the pool.\n\n"     \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_CWG_ATTACH "\n"                                         \
+    "ARGUMENTS:\n"                                                          \
+    "    As for cwg_create.\n\n"                                            \
+    "DESCRIPTION:\n"                                                        \
+    "    Does the same as cwg_create, but takes an interface that was\n"    \
+    "    made ready by cwg_pool_fill, and only moves it into the target\n"  \
+    "    namespace, renames it and configures it, which is quicker.\n\n"    \
+    "OUTPUT:\n"                                                             \
+    "    The public key for the new interface will be printed on standard\n"\
+    "    output. In case of failure, an error will be printed on standard\n"\
+    "    error.\n\n"                                                        \
+    "EXIT CODE:\n"                                                          \
+    "    0 on success, 2 if the pool is empty, 1 on other failures.\n\n"
+
+#define DISPATCH_CWG_ATTACH(CMD) DISPATCH(cwg_attach, CMD)
+
+int cwg_attach(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_CWG_ATTACH ""
+#define USAGE_CWG_ATTACH ""
+#define DISPATCH_CWG_ATTACH(CMD)
+
+#endif
+
+
+#if defined(ENABLE_CWG_CREATE) || defined(ENABLE_CWG_CONNECT) || \
+    defined(ENABLE_CWG_DESTROY) || defined(ENABLE_CWG_CREATE_MANY) || \
+    defined(ENABLE_CWG_CONNECT_MANY) || defined(ENABLE_CWG_DESTROY_MANY) || \
+    defined(ENABLE_CWG_DESTROY_ALL) || defined(ENABLE_CWG_APPLY) || \
+    defined(ENABLE_CWG_STATS) || defined(ENABLE_CWG_POOL_FILL) || \
+    defined(ENABLE_CWG_ATTACH)
+
+#define WARM_UP_CWG() cwg_warm_up()
+
+/** Prepare for running container WireGuard tasks.
+ *
+ * See warm_up() in dispatch.h.
+ */
+void cwg_warm_up(void);
+
+#else
+
+#define WARM_UP_CWG()
+
+#endif
+
+
 #define DISPATCH_CWG_CREATE_NS(CMD) DISPATCH(cwg_create_ns, CMD)
 
 int cwg_create_ns(int arcg, char * argv[]);
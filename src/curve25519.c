@@ -0,0 +1,353 @@
+/** Curve25519 Diffie-Hellman functions (X25519, RFC 7748).
+ *
+ * Field elements are represented as five 51-bit limbs, least significant
+ * first, and multiplied using 128-bit intermediates. The scalar
+ * multiplication is a Montgomery ladder with conditional swaps, so that there
+ * are no secret-dependent branches or memory accesses.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "curve25519.h"
+
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+typedef uint64_t fe[5];
+
+static const uint64_t mask51 = (UINT64_C(1) << 51) - 1;
+
+
+/** Load a little-endian 64-bit number. */
+static uint64_t load64(const uint8_t * src) {
+    uint64_t ret = 0;
+    int i;
+
+    for (i = 7; i >= 0; --i)
+        ret = (ret << 8) | src[i];
+    return ret;
+}
+
+
+/** Store a little-endian 64-bit number. */
+static void store64(uint8_t * dst, uint64_t val) {
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        dst[i] = val & 0xff;
+        val >>= 8;
+    }
+}
+
+
+/** Load a field element, ignoring the top bit as per RFC 7748. */
+static void fe_frombytes(fe h, const uint8_t * s) {
+    h[0] = load64(s) & mask51;
+    h[1] = (load64(s + 6) >> 3) & mask51;
+    h[2] = (load64(s + 12) >> 6) & mask51;
+    h[3] = (load64(s + 19) >> 1) & mask51;
+    h[4] = (load64(s + 24) >> 12) & mask51;
+}
+
+
+/** Propagate carries so that all limbs are below 2^51 (plus a bit). */
+static void fe_carry(fe h) {
+    h[1] += h[0] >> 51; h[0] &= mask51;
+    h[2] += h[1] >> 51; h[1] &= mask51;
+    h[3] += h[2] >> 51; h[2] &= mask51;
+    h[4] += h[3] >> 51; h[3] &= mask51;
+    h[0] += 19 * (h[4] >> 51); h[4] &= mask51;
+}
+
+
+/** Store a field element, fully reduced modulo p = 2^255 - 19. */
+static void fe_tobytes(uint8_t * s, const fe f) {
+    fe h;
+    uint64_t q;
+
+    memcpy(h, f, sizeof(fe));
+    fe_carry(h);
+    fe_carry(h);
+
+    // q is 1 if h >= p, and 0 otherwise
+    q = (h[0] + 19) >> 51;
+    q = (h[1] + q) >> 51;
+    q = (h[2] + q) >> 51;
+    q = (h[3] + q) >> 51;
+    q = (h[4] + q) >> 51;
+
+    // subtract q * p by adding 19q and dropping bit 255
+    h[0] += 19 * q;
+    h[1] += h[0] >> 51; h[0] &= mask51;
+    h[2] += h[1] >> 51; h[1] &= mask51;
+    h[3] += h[2] >> 51; h[2] &= mask51;
+    h[4] += h[3] >> 51; h[3] &= mask51;
+    h[4] &= mask51;
+
+    store64(s, h[0] | (h[1] << 51));
+    store64(s + 8, (h[1] >> 13) | (h[2] << 38));
+    store64(s + 16, (h[2] >> 26) | (h[3] << 25));
+    store64(s + 24, (h[3] >> 39) | (h[4] << 12));
+
+    explicit_bzero(h, sizeof(h));
+}
+
+
+/** Set h = f + g. */
+static void fe_add(fe h, const fe f, const fe g) {
+    int i;
+
+    for (i = 0; i < 5; ++i)
+        h[i] = f[i] + g[i];
+}
+
+
+/** Set h = f - g.
+ *
+ * 2p is added first to avoid underflow, which works as long as the limbs of g
+ * are below 2^52, as they are after a multiplication.
+ */
+static void fe_sub(fe h, const fe f, const fe g) {
+    h[0] = f[0] + UINT64_C(0xfffffffffffda) - g[0];
+    h[1] = f[1] + UINT64_C(0xffffffffffffe) - g[1];
+    h[2] = f[2] + UINT64_C(0xffffffffffffe) - g[2];
+    h[3] = f[3] + UINT64_C(0xffffffffffffe) - g[3];
+    h[4] = f[4] + UINT64_C(0xffffffffffffe) - g[4];
+}
+
+
+/** Reduce a product and store it in h. */
+static void fe_reduce(fe h, uint128_t r[5]) {
+    uint64_t c;
+
+    c = (uint64_t)(r[0] >> 51); r[1] += c; h[0] = (uint64_t)r[0] & mask51;
+    c = (uint64_t)(r[1] >> 51); r[2] += c; h[1] = (uint64_t)r[1] & mask51;
+    c = (uint64_t)(r[2] >> 51); r[3] += c; h[2] = (uint64_t)r[2] & mask51;
+    c = (uint64_t)(r[3] >> 51); r[4] += c; h[3] = (uint64_t)r[3] & mask51;
+    c = (uint64_t)(r[4] >> 51);            h[4] = (uint64_t)r[4] & mask51;
+
+    h[0] += c * 19;
+    h[1] += h[0] >> 51;
+    h[0] &= mask51;
+}
+
+
+/** Set h = f * g. */
+static void fe_mul(fe h, const fe f, const fe g) {
+    uint128_t r[5];
+    uint64_t g1_19 = g[1] * 19, g2_19 = g[2] * 19;
+    uint64_t g3_19 = g[3] * 19, g4_19 = g[4] * 19;
+
+    r[0] = (uint128_t)f[0] * g[0] + (uint128_t)f[1] * g4_19
+         + (uint128_t)f[2] * g3_19 + (uint128_t)f[3] * g2_19
+         + (uint128_t)f[4] * g1_19;
+    r[1] = (uint128_t)f[0] * g[1] + (uint128_t)f[1] * g[0]
+         + (uint128_t)f[2] * g4_19 + (uint128_t)f[3] * g3_19
+         + (uint128_t)f[4] * g2_19;
+    r[2] = (uint128_t)f[0] * g[2] + (uint128_t)f[1] * g[1]
+         + (uint128_t)f[2] * g[0] + (uint128_t)f[3] * g4_19
+         + (uint128_t)f[4] * g3_19;
+    r[3] = (uint128_t)f[0] * g[3] + (uint128_t)f[1] * g[2]
+         + (uint128_t)f[2] * g[1] + (uint128_t)f[3] * g[0]
+         + (uint128_t)f[4] * g4_19;
+    r[4] = (uint128_t)f[0] * g[4] + (uint128_t)f[1] * g[3]
+         + (uint128_t)f[2] * g[2] + (uint128_t)f[3] * g[1]
+         + (uint128_t)f[4] * g[0];
+
+    fe_reduce(h, r);
+    explicit_bzero(r, sizeof(r));
+}
+
+
+/** Set h = f^2. */
+static void fe_sq(fe h, const fe f) {
+    fe_mul(h, f, f);
+}
+
+
+/** Set h = f^(2^n). */
+static void fe_sq_n(fe h, const fe f, int n) {
+    int i;
+
+    fe_sq(h, f);
+    for (i = 1; i < n; ++i)
+        fe_sq(h, h);
+}
+
+
+/** Set h = f * 121665. */
+static void fe_mul_a24(fe h, const fe f) {
+    uint128_t r[5];
+    int i;
+
+    for (i = 0; i < 5; ++i)
+        r[i] = (uint128_t)f[i] * 121665;
+
+    fe_reduce(h, r);
+    explicit_bzero(r, sizeof(r));
+}
+
+
+/** Set h = 1/z = z^(p - 2). */
+static void fe_invert(fe h, const fe z) {
+    fe z2, z9, z11, z_5_0, z_10_0, z_20_0, z_50_0, z_100_0, t;
+
+    fe_sq(z2, z);                   // 2
+    fe_sq_n(t, z2, 2);              // 8
+    fe_mul(z9, t, z);               // 9
+    fe_mul(z11, z9, z2);            // 11
+    fe_sq(t, z11);                  // 22
+    fe_mul(z_5_0, t, z9);           // 2^5 - 2^0 = 31
+
+    fe_sq_n(t, z_5_0, 5);
+    fe_mul(z_10_0, t, z_5_0);       // 2^10 - 2^0
+    fe_sq_n(t, z_10_0, 10);
+    fe_mul(z_20_0, t, z_10_0);      // 2^20 - 2^0
+    fe_sq_n(t, z_20_0, 20);
+    fe_mul(t, t, z_20_0);           // 2^40 - 2^0
+    fe_sq_n(t, t, 10);
+    fe_mul(z_50_0, t, z_10_0);      // 2^50 - 2^0
+    fe_sq_n(t, z_50_0, 50);
+    fe_mul(z_100_0, t, z_50_0);     // 2^100 - 2^0
+    fe_sq_n(t, z_100_0, 100);
+    fe_mul(t, t, z_100_0);          // 2^200 - 2^0
+    fe_sq_n(t, t, 50);
+    fe_mul(t, t, z_50_0);           // 2^250 - 2^0
+    fe_sq_n(t, t, 5);               // 2^255 - 2^5
+    fe_mul(h, t, z11);              // 2^255 - 21
+
+    explicit_bzero(z2, sizeof(z2));
+    explicit_bzero(z9, sizeof(z9));
+    explicit_bzero(z11, sizeof(z11));
+    explicit_bzero(z_5_0, sizeof(z_5_0));
+    explicit_bzero(z_10_0, sizeof(z_10_0));
+    explicit_bzero(z_20_0, sizeof(z_20_0));
+    explicit_bzero(z_50_0, sizeof(z_50_0));
+    explicit_bzero(z_100_0, sizeof(z_100_0));
+    explicit_bzero(t, sizeof(t));
+}
+
+
+/** Swap f and g if swap is 1, leave them if it is 0, in constant time. */
+static void fe_cswap(fe f, fe g, uint64_t swap) {
+    uint64_t mask = (uint64_t)0 - swap;
+    uint64_t x;
+    int i;
+
+    for (i = 0; i < 5; ++i) {
+        x = mask & (f[i] ^ g[i]);
+        f[i] ^= x;
+        g[i] ^= x;
+    }
+}
+
+
+/** Calculate the X25519 function. */
+void curve25519(
+        uint8_t out[CURVE25519_KEY_LEN],
+        const uint8_t scalar[CURVE25519_KEY_LEN],
+        const uint8_t point[CURVE25519_KEY_LEN])
+{
+    uint8_t k[CURVE25519_KEY_LEN];
+    fe x1, x2, z2, x3, z3, a, aa, b, bb, e, c, d, da, cb;
+    uint64_t swap = 0, bit;
+    int t;
+
+    memcpy(k, scalar, sizeof(k));
+    k[0] &= 248;
+    k[31] &= 127;
+    k[31] |= 64;
+
+    fe_frombytes(x1, point);
+    memset(x2, 0, sizeof(fe)); x2[0] = 1;
+    memset(z2, 0, sizeof(fe));
+    memcpy(x3, x1, sizeof(fe));
+    memset(z3, 0, sizeof(fe)); z3[0] = 1;
+
+    for (t = 254; t >= 0; --t) {
+        bit = (k[t >> 3] >> (t & 7)) & 1;
+        swap ^= bit;
+        fe_cswap(x2, x3, swap);
+        fe_cswap(z2, z3, swap);
+        swap = bit;
+
+        fe_add(a, x2, z2);
+        fe_sq(aa, a);
+        fe_sub(b, x2, z2);
+        fe_sq(bb, b);
+        fe_sub(e, aa, bb);
+        fe_add(c, x3, z3);
+        fe_sub(d, x3, z3);
+        fe_mul(da, d, a);
+        fe_mul(cb, c, b);
+
+        fe_add(x3, da, cb);
+        fe_sq(x3, x3);
+        fe_sub(z3, da, cb);
+        fe_sq(z3, z3);
+        fe_mul(z3, z3, x1);
+
+        fe_mul(x2, aa, bb);
+        fe_mul_a24(z2, e);
+        fe_add(z2, z2, aa);
+        fe_mul(z2, z2, e);
+    }
+    fe_cswap(x2, x3, swap);
+    fe_cswap(z2, z3, swap);
+
+    fe_invert(z2, z2);
+    fe_mul(x2, x2, z2);
+    fe_tobytes(out, x2);
+
+    explicit_bzero(k, sizeof(k));
+    explicit_bzero(x1, sizeof(x1));
+    explicit_bzero(x2, sizeof(x2));
+    explicit_bzero(z2, sizeof(z2));
+    explicit_bzero(x3, sizeof(x3));
+    explicit_bzero(z3, sizeof(z3));
+    explicit_bzero(a, sizeof(a));
+    explicit_bzero(aa, sizeof(aa));
+    explicit_bzero(b, sizeof(b));
+    explicit_bzero(bb, sizeof(bb));
+    explicit_bzero(e, sizeof(e));
+    explicit_bzero(c, sizeof(c));
+    explicit_bzero(d, sizeof(d));
+    explicit_bzero(da, sizeof(da));
+    explicit_bzero(cb, sizeof(cb));
+    explicit_bzero(&swap, sizeof(swap));
+    explicit_bzero(&bit, sizeof(bit));
+}
+
+
+/** Calculate the public key for a private key. */
+void curve25519_generate_public(
+        uint8_t public_key[CURVE25519_KEY_LEN],
+        const uint8_t private_key[CURVE25519_KEY_LEN])
+{
+    static const uint8_t base_point[CURVE25519_KEY_LEN] = { 9 };
+
+    curve25519(public_key, private_key, base_point);
+}
+
+
+/** Generate a new private key. */
+int curve25519_generate_private(uint8_t private_key[CURVE25519_KEY_LEN]) {
+    ssize_t num_read;
+
+    do {
+        num_read = getrandom(private_key, CURVE25519_KEY_LEN, 0);
+    } while (num_read == -1 && errno == EINTR);
+
+    if (num_read != CURVE25519_KEY_LEN) {
+        perror("Error getting random bytes");
+        explicit_bzero(private_key, CURVE25519_KEY_LEN);
+        return -1;
+    }
+
+    private_key[0] &= 248;
+    private_key[31] &= 127;
+    private_key[31] |= 64;
+    return 0;
+}
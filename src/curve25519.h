@@ -0,0 +1,49 @@
+/** Curve25519 Diffie-Hellman functions (X25519, RFC 7748).
+ *
+ * These are used to generate WireGuard key pairs without calling `wg genkey`
+ * and `wg pubkey`. All functions run in constant time with respect to secret
+ * data, and wipe their intermediate values before returning.
+ */
+#pragma once
+
+#include <stdint.h>
+
+
+/** Size of a Curve25519 key in bytes. */
+#define CURVE25519_KEY_LEN 32
+
+
+/** Generate a new private key.
+ *
+ * This takes 32 bytes from the kernel's random number generator, and clamps
+ * them as described in RFC 7748.
+ *
+ * @param private_key (out) Buffer to store the key in.
+ * @return 0 on success, -1 on error.
+ */
+int curve25519_generate_private(uint8_t private_key[CURVE25519_KEY_LEN]);
+
+
+/** Calculate the public key for a private key.
+ *
+ * @param public_key (out) Buffer to store the public key in.
+ * @param private_key The private key.
+ */
+void curve25519_generate_public(
+        uint8_t public_key[CURVE25519_KEY_LEN],
+        const uint8_t private_key[CURVE25519_KEY_LEN]);
+
+
+/** Calculate the X25519 function.
+ *
+ * This multiplies the point with u-coordinate `point` by `scalar`, which is
+ * clamped first.
+ *
+ * @param out (out) The u-coordinate of the result.
+ * @param scalar The scalar to multiply by.
+ * @param point The u-coordinate of the point to multiply.
+ */
+void curve25519(
+        uint8_t out[CURVE25519_KEY_LEN],
+        const uint8_t scalar[CURVE25519_KEY_LEN],
+        const uint8_t point[CURVE25519_KEY_LEN]);
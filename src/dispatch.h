@@ -1,5 +1,41 @@
 #pragma once
 
+// Runs the command if it is CMD, and sets command to its name
 #define DISPATCH(FUNC, CMD) \
-    if (!strcmp(CMD, #FUNC)) return FUNC(argc - 2, argv + 2)
+    if (!strcmp(CMD, #FUNC)) \
+        return (*command = #FUNC, FUNC(argc - 2, argv + 2))
 
+
+/** Run a command.
+ *
+ * This takes arguments in the same form as main(), i.e. argv[0] is the name
+ * of the program, argv[1] the command, and any further arguments are passed
+ * to the command. The command's time limit starts when this is called, see
+ * run_begin_command(), and it is counted in the metrics, see metrics.h.
+ *
+ * @return The exit code for the command, which is RUN_TIMEOUT_EXIT_CODE if it
+ *          failed because a program it ran took too long.
+ */
+int dispatch(int argc, char * argv[]);
+
+
+/** Parse a time limit option, --timeout=<ms> or --step-timeout=<ms>.
+ *
+ * @param opt The option.
+ * @param step_ms (in/out) The limit for each program, set if opt is
+ *          --step-timeout.
+ * @param command_ms (in/out) The limit for the command, set if opt is
+ *          --timeout.
+ * @return 0 on success, 1 if the limit is invalid, -1 if opt is not a time
+ *          limit option.
+ */
+int dispatch_parse_limit(const char * opt, int * step_ms, int * command_ms);
+
+
+/** Prepare for running commands.
+ *
+ * This sets up any state that commands can reuse, e.g. sockets, so that it
+ * does not need to be done while a command is running. It is called by
+ * long-lived modes before they wait for requests. Calling it is optional.
+ */
+void warm_up(void);
@@ -1,48 +1,207 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/capability.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 
 #include "config.h"
 
-#include "capabilities.h"
 #include "container_wireguard.h"
+#include "dispatch.h"
+#include "metrics.h"
+#include "probes.h"
+#include "secure.h"
+#include "serve.h"
+#include "subprocess.h"
+#include "trace.h"
+#include "validation.h"
 
 
 void usage(const char * cmd) {
-    fprintf(stderr, "Usage: %s <command> <arguments>\n\n", cmd);
+    fprintf(
+            stderr, "Usage: %s [<options>] <command> <arguments>\n\n",
+            cmd);
+
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    --trace-fd=<fd>: Write a record for each step of\n");
+    fprintf(stderr, "            the command to the given open file\n");
+    fprintf(stderr, "            descriptor, see src/trace.h.\n");
+    fprintf(stderr, "    --timeout=<ms>: Stop the command if the programs\n");
+    fprintf(stderr, "            it runs take longer than this in total,\n");
+    fprintf(stderr, "            0 for no limit. Default %d.\n",
+            TIMEOUT_COMMAND_MS);
+    fprintf(stderr, "    --step-timeout=<ms>: Stop the command if a\n");
+    fprintf(stderr, "            program it runs takes longer than this,\n");
+    fprintf(stderr, "            0 for no limit. Default %d.\n\n",
+            TIMEOUT_STEP_MS);
+    fprintf(stderr, "A command that was stopped because it took too long\n");
+    fprintf(stderr, "exits with code %d, after rolling back.\n\n",
+            RUN_TIMEOUT_EXIT_CODE);
 
     fprintf(stderr, "Available commands:\n");
     fprintf(stderr, "    %s", SYNOPSIS_CWG_CREATE);
     fprintf(stderr, "    %s", SYNOPSIS_CWG_CONNECT);
     fprintf(stderr, "    %s", SYNOPSIS_CWG_DESTROY);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_CREATE_MANY);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_CONNECT_MANY);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_DESTROY_MANY);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_DESTROY_ALL);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_APPLY);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_STATS);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_POOL_FILL);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_ATTACH);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_ALLOC);
+    fprintf(stderr, "    %s", SYNOPSIS_CWG_FREE);
+    fprintf(stderr, "    %s", SYNOPSIS_SERVE);
+    fprintf(stderr, "    %s", SYNOPSIS_STATS_DUMP);
     fprintf(stderr, "\n");
 
     fprintf(stderr, "%s", USAGE_CWG_CREATE);
     fprintf(stderr, "%s", USAGE_CWG_CONNECT);
     fprintf(stderr, "%s", USAGE_CWG_DESTROY);
+    fprintf(stderr, "%s", USAGE_CWG_CREATE_MANY);
+    fprintf(stderr, "%s", USAGE_CWG_CONNECT_MANY);
+    fprintf(stderr, "%s", USAGE_CWG_DESTROY_MANY);
+    fprintf(stderr, "%s", USAGE_CWG_DESTROY_ALL);
+    fprintf(stderr, "%s", USAGE_CWG_APPLY);
+    fprintf(stderr, "%s", USAGE_CWG_STATS);
+    fprintf(stderr, "%s", USAGE_CWG_POOL_FILL);
+    fprintf(stderr, "%s", USAGE_CWG_ATTACH);
+    fprintf(stderr, "%s", USAGE_CWG_ALLOC);
+    fprintf(stderr, "%s", USAGE_CWG_FREE);
+    fprintf(stderr, "%s", USAGE_SERVE);
+    fprintf(stderr, "%s", USAGE_STATS_DUMP);
+}
+
+
+static int dispatch_command(
+        int argc, char * argv[], const char ** command)
+{
+    // unused if no commands are enabled
+    (void)argc;
+    (void)command;
+
+    DISPATCH_CWG_CREATE(argv[1]);
+    DISPATCH_CWG_CONNECT(argv[1]);
+    DISPATCH_CWG_DESTROY(argv[1]);
+    DISPATCH_CWG_CREATE_MANY(argv[1]);
+    DISPATCH_CWG_CONNECT_MANY(argv[1]);
+    DISPATCH_CWG_DESTROY_MANY(argv[1]);
+    DISPATCH_CWG_DESTROY_ALL(argv[1]);
+    DISPATCH_CWG_APPLY(argv[1]);
+    DISPATCH_CWG_STATS(argv[1]);
+    DISPATCH_CWG_POOL_FILL(argv[1]);
+    DISPATCH_CWG_ATTACH(argv[1]);
+    DISPATCH_CWG_ALLOC(argv[1]);
+    DISPATCH_CWG_FREE(argv[1]);
+    DISPATCH_SERVE(argv[1]);
+    DISPATCH_STATS_DUMP(argv[1]);
+
+    fprintf(stderr, "Unknown command %s\n", argv[1]);
+    return EXIT_FAILURE;
+}
+
+
+int dispatch(int argc, char * argv[]) {
+    const char * command = NULL;
+    uint64_t start_ns;
+    int ret;
+
+    metrics_open();
+    start_ns = metrics_now_ns();
+
+    PROBE1(command_start, argv[1]);
+    run_begin_command();
+    ret = dispatch_command(argc, argv, &command);
+
+    if ((ret != EXIT_SUCCESS) && run_timed_out())
+        ret = RUN_TIMEOUT_EXIT_CODE;
+    PROBE2(command_done, argv[1], ret);
+
+    // unknown commands are not counted, so that they can't fill the table
+    if (command)
+        metrics_command(command, metrics_now_ns() - start_ns, ret);
+
+    return ret;
+}
+
+
+void warm_up(void) {
+    WARM_UP_CWG();
+}
+
+
+/** Parse a time limit option.
+ *
+ * @param value The value of the option.
+ * @param ms (out) The time limit in milliseconds.
+ * @return 0 on success, 1 if it is not a valid time limit.
+ */
+static int parse_ms(const char * value, int * ms) {
+    if (validate_number(7, value, NULL)) {
+        fprintf(stderr, "Invalid time limit %s\n", value);
+        return 1;
+    }
+    *ms = atoi(value);
+    return 0;
+}
+
+
+int dispatch_parse_limit(const char * opt, int * step_ms, int * command_ms) {
+    const char * timeout_opt = "--timeout=";
+    const char * step_timeout_opt = "--step-timeout=";
+
+    if (!strncmp(opt, timeout_opt, strlen(timeout_opt)))
+        return parse_ms(opt + strlen(timeout_opt), command_ms);
+    if (!strncmp(opt, step_timeout_opt, strlen(step_timeout_opt)))
+        return parse_ms(opt + strlen(step_timeout_opt), step_ms);
+    return -1;
 }
 
 
 int main(int argc, char * argv[]) {
+    const char * trace_opt = "--trace-fd=";
+    int step_ms = -1, command_ms = -1, err;
+
+    while ((argc >= 2) && !strncmp(argv[1], "--", 2)) {
+        const char * opt = argv[1];
+
+        if (!strncmp(opt, trace_opt, strlen(trace_opt))) {
+            const char * fd = opt + strlen(trace_opt);
+
+            if (validate_number(4, fd, NULL)) {
+                fprintf(stderr, "Invalid trace file descriptor\n");
+                return EXIT_FAILURE;
+            }
+
+            if (trace_open(atoi(fd)))
+                return EXIT_FAILURE;
+        }
+        else {
+            err = dispatch_parse_limit(opt, &step_ms, &command_ms);
+            if (err < 0)
+                fprintf(stderr, "Unknown option %s\n", opt);
+            if (err)
+                return EXIT_FAILURE;
+        }
+
+        // the command expects its name in argv[1]
+        argv[1] = argv[0];
+        --argc;
+        ++argv;
+    }
+
     if (argc < 2) {
         usage(argv[0]);
         return EXIT_FAILURE;
     }
 
+    run_set_limits(step_ms, command_ms);
+
     // Ensure private keys and the like don't get swapped out to a potentially
     // unencrypted swap partition.
-    enable_cap(CAP_IPC_LOCK);
-    mlockall(MCL_CURRENT | MCL_FUTURE);
-    disable_cap(CAP_IPC_LOCK);
-
-    DISPATCH_CWG_CREATE(argv[1]);
-    DISPATCH_CWG_CONNECT(argv[1]);
-    DISPATCH_CWG_DESTROY(argv[1]);
+    if (secure_init())
+        return EXIT_FAILURE;
 
-    fprintf(stderr, "Unknown command %s\n", argv[1]);
-    return EXIT_FAILURE;
+    return dispatch(argc, argv);
 }
 
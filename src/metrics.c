@@ -0,0 +1,437 @@
+/** Operational metrics, shared by all invocations. */
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "subprocess.h"
+
+
+// "nahmetr" followed by the format version
+#define METRICS_MAGIC UINT64_C(0x6e61686d65747201)
+
+#define METRICS_NAME_LEN 32
+#define METRICS_MAX_COMMANDS 64
+#define METRICS_MAX_STEPS 128
+
+// Upper bounds of the histogram buckets in microseconds, plus one for +Inf
+#define METRICS_NUM_BUCKETS 18
+
+static const uint64_t metrics_bucket_us[METRICS_NUM_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    500000, 1000000, 2500000, 5000000, 10000000, 30000000 };
+
+// States of a series
+#define METRICS_FREE 0
+#define METRICS_CLAIMED 1       // being named by whoever claimed it
+#define METRICS_READY 2
+
+// Time after which a claimed series is given up on, in ns
+#define METRICS_CLAIM_WAIT_NS 5000
+
+
+// The file is shared between processes, so these must not need locks
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "Need lock-free atomic ints");
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Need lock-free atomic longs");
+
+
+/** Counts and a latency histogram for a command or step. */
+typedef struct {
+    _Atomic uint32_t state;
+    char name[METRICS_NAME_LEN];
+    _Atomic uint64_t failures;
+    _Atomic uint64_t timeouts;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t buckets[METRICS_NUM_BUCKETS];
+} metrics_series_t;
+
+
+/** Layout of the file. */
+typedef struct {
+    _Atomic uint64_t magic;
+    _Atomic uint64_t counters[METRICS_NUM_COUNTERS];
+    metrics_series_t commands[METRICS_MAX_COMMANDS];
+    metrics_series_t steps[METRICS_MAX_STEPS];
+} metrics_file_t;
+
+
+// The mapped file, or NULL if metrics are disabled
+static metrics_file_t * metrics_file = NULL;
+
+
+/** Get the current time, for measuring durations. */
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+/** Open the metrics file, creating it if needed. */
+void metrics_open(void) {
+#ifdef METRICS_DIR
+    const char * path = METRICS_DIR "/metrics";
+    uint64_t magic = 0;
+    metrics_file_t * file;
+    struct stat st;
+    int fd;
+
+    if (metrics_file)
+        return;
+
+    if ((mkdir(METRICS_DIR, 0700) != 0) && (errno != EEXIST))
+        return;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return;
+
+    // A new file is all zeros, which is a valid empty set of metrics. If two
+    // of us create it at the same time, both set the same size.
+    if (fstat(fd, &st) != 0)
+        goto exit_fd;
+
+    if (st.st_size == 0) {
+        if (ftruncate(fd, sizeof(metrics_file_t)) != 0)
+            goto exit_fd;
+    }
+    else if ((size_t)st.st_size != sizeof(metrics_file_t))
+        goto exit_fd;
+
+    file = mmap(
+            NULL, sizeof(metrics_file_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    if (file == MAP_FAILED)
+        goto exit_fd;
+
+    if (
+            !atomic_compare_exchange_strong(
+                &file->magic, &magic, METRICS_MAGIC) &&
+            (magic != METRICS_MAGIC))
+    {
+        munmap(file, sizeof(metrics_file_t));
+        goto exit_fd;
+    }
+
+    metrics_file = file;
+
+exit_fd:
+    close(fd);
+#endif
+}
+
+
+/** Check whether metrics are being collected. */
+int metrics_enabled(void) {
+    return metrics_file != NULL;
+}
+
+
+/** Find the series for a name, adding it if needed.
+ *
+ * Names are truncated to METRICS_NAME_LEN - 1 characters.
+ *
+ * @param table The table to look in.
+ * @param size The number of series in the table.
+ * @param name The name to look for.
+ * @return The series, or NULL if the table is full.
+ */
+static metrics_series_t * metrics_series(
+        metrics_series_t table[], uint32_t size, const char * name)
+{
+    const char * c;
+    metrics_series_t * series;
+    uint32_t hash = 2166136261u, state, i;
+    uint64_t deadline_ns;
+
+    // FNV-1a
+    for (c = name; *c && (c - name < METRICS_NAME_LEN - 1); ++c)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+
+    for (i = 0; i < size; ++i) {
+        series = &table[(hash + i) % size];
+        state = atomic_load_explicit(&series->state, memory_order_acquire);
+
+        if (state == METRICS_FREE) {
+            if (atomic_compare_exchange_strong_explicit(
+                    &series->state, &state, METRICS_CLAIMED,
+                    memory_order_acquire, memory_order_acquire))
+            {
+                strncpy(series->name, name, METRICS_NAME_LEN - 1);
+                atomic_store_explicit(
+                        &series->state, METRICS_READY, memory_order_release);
+                return series;
+            }
+        }
+
+        // Someone else is adding this or another name, which won't take
+        // long, unless they crashed doing so. That leaves the series claimed
+        // for good, so wait for a bounded time, not a number of tries: every
+        // later lookup that passes it pays for the wait.
+        if (state == METRICS_CLAIMED) {
+            deadline_ns = metrics_now_ns() + METRICS_CLAIM_WAIT_NS;
+            do {
+                sched_yield();
+                state = atomic_load_explicit(
+                        &series->state, memory_order_acquire);
+            } while (
+                    (state == METRICS_CLAIMED) &&
+                    (metrics_now_ns() < deadline_ns));
+        }
+
+        if (
+                (state == METRICS_READY) &&
+                !strncmp(series->name, name, METRICS_NAME_LEN - 1))
+            return series;
+    }
+
+    return NULL;
+}
+
+
+/** Add a duration to a series. */
+static void metrics_observe(metrics_series_t * series, uint64_t duration_ns) {
+    uint64_t duration_us = duration_ns / 1000;
+    int bucket = 0;
+
+    while (
+            (bucket < METRICS_NUM_BUCKETS - 1) &&
+            (duration_us > metrics_bucket_us[bucket]))
+        ++bucket;
+
+    atomic_fetch_add_explicit(
+            &series->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(
+            &series->sum_ns, duration_ns, memory_order_relaxed);
+}
+
+
+/** Count a command that has finished. */
+void metrics_command(const char * command, uint64_t duration_ns, int exit_code)
+{
+    metrics_series_t * series;
+
+    if (!metrics_file)
+        return;
+
+    series = metrics_series(
+            metrics_file->commands, METRICS_MAX_COMMANDS, command);
+    if (!series)
+        return;
+
+    if (exit_code == RUN_TIMEOUT_EXIT_CODE)
+        atomic_fetch_add_explicit(&series->timeouts, 1, memory_order_relaxed);
+    else if (exit_code != 0)
+        atomic_fetch_add_explicit(&series->failures, 1, memory_order_relaxed);
+
+    metrics_observe(series, duration_ns);
+}
+
+
+/** Count a step of a command that has finished. */
+void metrics_step(const char * step, uint64_t duration_ns, int exit_code) {
+    metrics_series_t * series;
+
+    if (!metrics_file)
+        return;
+
+    series = metrics_series(metrics_file->steps, METRICS_MAX_STEPS, step);
+    if (!series)
+        return;
+
+    if (exit_code != 0)
+        atomic_fetch_add_explicit(&series->failures, 1, memory_order_relaxed);
+
+    metrics_observe(series, duration_ns);
+}
+
+
+/** Increment a counter. */
+void metrics_count(metrics_counter_t counter) {
+    if (metrics_file)
+        atomic_fetch_add_explicit(
+                &metrics_file->counters[counter], 1, memory_order_relaxed);
+}
+
+
+#ifdef ENABLE_STATS_DUMP
+
+#define METRICS_PREFIX "net_admin_helper_"
+
+
+/** Print a label value, escaped as Prometheus requires. */
+static void metrics_print_label(const char * value) {
+    const char * c;
+
+    for (c = value; *c && (c - value < METRICS_NAME_LEN - 1); ++c) {
+        if ((*c == '\\') || (*c == '"'))
+            printf("\\%c", *c);
+        else if (*c == '\n')
+            printf("\\n");
+        else
+            putchar(*c);
+    }
+}
+
+
+/** Print the metrics of the series in a table.
+ *
+ * @param table The table to print.
+ * @param size The number of series in the table.
+ * @param kind What the series are, "command" or "step".
+ */
+static void metrics_print_table(
+        metrics_series_t table[], uint32_t size, const char * kind)
+{
+    // results, as the count is the sum of the buckets
+    const char * result_names[] = { "success", "failure", "timeout" };
+    uint64_t results[3], count, sum_ns;
+    metrics_series_t * series;
+    uint32_t i;
+    int j;
+
+    printf(
+            "# HELP " METRICS_PREFIX "%ss_total Number of %ss run, by"
+            " result.\n", kind, kind);
+    printf("# TYPE " METRICS_PREFIX "%ss_total counter\n", kind);
+
+    for (i = 0; i < size; ++i) {
+        series = &table[i];
+        if (atomic_load(&series->state) != METRICS_READY)
+            continue;
+
+        count = 0;
+        for (j = 0; j < METRICS_NUM_BUCKETS; ++j)
+            count += atomic_load_explicit(
+                    &series->buckets[j], memory_order_relaxed);
+
+        results[1] = atomic_load_explicit(
+                &series->failures, memory_order_relaxed);
+        results[2] = atomic_load_explicit(
+                &series->timeouts, memory_order_relaxed);
+        results[0] = count - results[1] - results[2];
+
+        // a failure may be counted before its duration, so don't go negative
+        if (results[1] + results[2] > count)
+            results[0] = 0;
+
+        for (j = 0; j < 3; ++j) {
+            if ((j == 2) && !strcmp(kind, "step"))
+                break;
+            printf(METRICS_PREFIX "%ss_total{%s=\"", kind, kind);
+            metrics_print_label(series->name);
+            printf(
+                    "\",result=\"%s\"} %llu\n", result_names[j],
+                    (unsigned long long)results[j]);
+        }
+    }
+
+    printf(
+            "# HELP " METRICS_PREFIX "%s_duration_seconds Time taken by"
+            " %ss.\n", kind, kind);
+    printf("# TYPE " METRICS_PREFIX "%s_duration_seconds histogram\n", kind);
+
+    for (i = 0; i < size; ++i) {
+        series = &table[i];
+        if (atomic_load(&series->state) != METRICS_READY)
+            continue;
+
+        count = 0;
+        for (j = 0; j < METRICS_NUM_BUCKETS; ++j) {
+            count += atomic_load_explicit(
+                    &series->buckets[j], memory_order_relaxed);
+
+            printf(
+                    METRICS_PREFIX "%s_duration_seconds_bucket{%s=\"",
+                    kind, kind);
+            metrics_print_label(series->name);
+            if (j < METRICS_NUM_BUCKETS - 1)
+                printf("\",le=\"%g\"} ", metrics_bucket_us[j] / 1e6);
+            else
+                printf("\",le=\"+Inf\"} ");
+            printf("%llu\n", (unsigned long long)count);
+        }
+
+        sum_ns = atomic_load_explicit(&series->sum_ns, memory_order_relaxed);
+        printf(METRICS_PREFIX "%s_duration_seconds_sum{%s=\"", kind, kind);
+        metrics_print_label(series->name);
+        printf("\"} %.9f\n", sum_ns / 1e9);
+
+        printf(METRICS_PREFIX "%s_duration_seconds_count{%s=\"", kind, kind);
+        metrics_print_label(series->name);
+        printf("\"} %llu\n", (unsigned long long)count);
+    }
+}
+
+
+int stats_dump(int argc, char * argv[]) {
+    static const struct {
+        const char * name;
+        const char * help;
+    } counters[METRICS_NUM_COUNTERS] = {
+        { "subprocess_spawns_total", "Number of programs started." },
+        {
+            "subprocess_spawn_failures_total",
+            "Number of programs that could not be started." },
+        {
+            "subprocess_timeouts_total",
+            "Number of programs stopped because they took too long." },
+        { "subprocess_kills_total", "Number of programs sent SIGKILL." },
+        {
+            "subprocess_abandoned_total",
+            "Number of programs that did not exit when killed." }
+    };
+    int i;
+
+    (void)argv;
+
+    if (argc != 0) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
+        fprintf(stderr, "Usage: " SYNOPSIS_STATS_DUMP);
+        return EXIT_FAILURE;
+    }
+
+    if (!metrics_file) {
+#ifdef METRICS_DIR
+        fprintf(
+                stderr, "Could not open " METRICS_DIR "/metrics, if it is"
+                " from a different version, remove it to start over\n");
+#else
+        fprintf(stderr, "Metrics are disabled, set METRICS_DIR to enable\n");
+#endif
+        return EXIT_FAILURE;
+    }
+
+    metrics_print_table(
+            metrics_file->commands, METRICS_MAX_COMMANDS, "command");
+    metrics_print_table(metrics_file->steps, METRICS_MAX_STEPS, "step");
+
+    for (i = 0; i < METRICS_NUM_COUNTERS; ++i) {
+        printf(
+                "# HELP " METRICS_PREFIX "%s %s\n", counters[i].name,
+                counters[i].help);
+        printf("# TYPE " METRICS_PREFIX "%s counter\n", counters[i].name);
+        printf(
+                METRICS_PREFIX "%s %llu\n", counters[i].name,
+                (unsigned long long)atomic_load_explicit(
+                    &metrics_file->counters[i], memory_order_relaxed));
+    }
+
+    if (fflush(stdout) != 0) {
+        perror("Error writing output");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif
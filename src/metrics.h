@@ -0,0 +1,117 @@
+/** Operational metrics, shared by all invocations.
+ *
+ * Each run of the helper is short, so metrics are kept in a file in
+ * METRICS_DIR, which every invocation maps into memory and updates with
+ * atomic operations, without taking any locks. This covers the number of
+ * commands run and their results, latency histograms for commands and for
+ * each of their steps (as traced with trace.h), and counts of programs
+ * started, timed out and killed. The stats_dump command prints them in the
+ * Prometheus text format.
+ *
+ * Commands and steps are found by name in fixed-size hash tables in the file,
+ * and new names are added as they are first seen. If a table is full, further
+ * names are not counted. If METRICS_DIR is not set, or the file cannot be
+ * opened, metrics are silently disabled, as they must never make a command
+ * fail.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "config.h"
+#include "dispatch.h"
+
+
+/** Counters that are not specific to a command or step. */
+typedef enum {
+    METRICS_SPAWNS,             // programs started
+    METRICS_SPAWN_FAILURES,     // programs that could not be started
+    METRICS_TIMEOUTS,           // programs stopped because of a time limit
+    METRICS_KILLS,              // programs sent SIGKILL
+    METRICS_ABANDONED,          // programs we stopped waiting for
+    METRICS_NUM_COUNTERS
+} metrics_counter_t;
+
+
+/** Open the metrics file, creating it if needed.
+ *
+ * This does nothing if it is open already, and disables metrics if it cannot
+ * be opened. It must be called before any threads are started, and the file
+ * stays mapped in child processes created with fork().
+ */
+void metrics_open(void);
+
+
+/** Check whether metrics are being collected.
+ *
+ * @return 1 if the metrics file is open, 0 otherwise.
+ */
+int metrics_enabled(void);
+
+
+/** Get the current time, for measuring durations.
+ *
+ * @return CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t metrics_now_ns(void);
+
+
+/** Count a command that has finished.
+ *
+ * @param command The name of the command.
+ * @param duration_ns The time it took.
+ * @param exit_code Its exit code.
+ */
+void metrics_command(const char * command, uint64_t duration_ns, int exit_code);
+
+
+/** Count a step of a command that has finished.
+ *
+ * @param step The name of the step.
+ * @param duration_ns The time it took.
+ * @param exit_code Its exit code, see trace.h.
+ */
+void metrics_step(const char * step, uint64_t duration_ns, int exit_code);
+
+
+/** Increment a counter.
+ *
+ * @param counter The counter to increment.
+ */
+void metrics_count(metrics_counter_t counter);
+
+
+#ifdef ENABLE_STATS_DUMP
+
+#define SYNOPSIS_STATS_DUMP "stats_dump\n"
+
+#define USAGE_STATS_DUMP \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    stats_dump - Print metrics of all commands run so far.\n\n"        \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_STATS_DUMP "\n"                                         \
+    "DESCRIPTION:\n"                                                        \
+    "    Every run of the helper counts the commands it runs and their\n"   \
+    "    results, how long they and each of their steps take, and how\n"    \
+    "    many programs were started, timed out or killed. They are kept\n"  \
+    "    in a shared file in METRICS_DIR.\n\n"                              \
+    "OUTPUT:\n"                                                             \
+    "    The metrics in Prometheus text format, for an exporter to pass\n"  \
+    "    on when scraped. Counters and histograms only go up, they are\n"   \
+    "    reset by removing the file.\n\n"                                   \
+    "EXIT CODE:\n"                                                          \
+    "    0 on success, 1 if metrics are not available.\n\n"
+
+#define DISPATCH_STATS_DUMP(CMD) DISPATCH(stats_dump, CMD)
+
+int stats_dump(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_STATS_DUMP ""
+#define USAGE_STATS_DUMP ""
+#define DISPATCH_STATS_DUMP(CMD)
+
+#endif
@@ -0,0 +1,394 @@
+/** Functions for talking to the kernel over netlink. */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "netlink.h"
+#include "secure.h"
+#include "trace.h"
+
+
+// Flags used by the kernel for extended acknowledgements. These are in
+// linux/netlink.h for kernels >= 4.12, but older headers may lack them.
+#ifndef NLM_F_CAPPED
+#define NLM_F_CAPPED 0x100
+#endif
+
+#ifndef NLM_F_ACK_TLVS
+#define NLM_F_ACK_TLVS 0x200
+#endif
+
+
+/** Open a netlink socket. */
+int nl_open(nl_sock_t * sock, int protocol) {
+    const int one = 1;
+    struct sockaddr_nl addr;
+
+    sock->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+    if (sock->fd == -1) {
+        perror("Error opening netlink socket");
+        goto exit_0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (bind(sock->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Error binding netlink socket");
+        goto exit_1;
+    }
+
+    // Ask for error messages rather than just error numbers, and don't have
+    // the kernel echo our whole request back to us with every error. These
+    // are optional, so we ignore failures on older kernels.
+    setsockopt(sock->fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one));
+    setsockopt(sock->fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+
+    sock->seq = 0;
+    return 0;
+
+exit_1:
+    close(sock->fd);
+
+exit_0:
+    sock->fd = -1;
+    return -1;
+}
+
+
+/** Close a netlink socket. */
+void nl_close(nl_sock_t * sock) {
+    if (sock->fd != -1)
+        close(sock->fd);
+    sock->fd = -1;
+}
+
+
+/** Start a new, empty batch. */
+void nl_batch_init(nl_batch_t * batch) {
+    batch->len = 0;
+    batch->cur = 0;
+    batch->num_msgs = 0;
+    batch->overflow = 0;
+    batch->secret = 0;
+}
+
+
+/** Reserve space at the end of the batch.
+ *
+ * Sets the overflow flag and returns NULL if there is not enough space.
+ */
+static void * nl_batch_reserve(nl_batch_t * batch, size_t size) {
+    void * space;
+
+    if (batch->overflow || (NL_BATCH_SIZE - batch->len < NLMSG_ALIGN(size))) {
+        batch->overflow = 1;
+        return NULL;
+    }
+
+    space = batch->buf + batch->len;
+    memset(space, 0, NLMSG_ALIGN(size));
+    batch->len += NLMSG_ALIGN(size);
+    ((struct nlmsghdr *)(batch->buf + batch->cur))->nlmsg_len =
+        batch->len - batch->cur;
+    return space;
+}
+
+
+/** Start a new message in the batch. */
+void nl_msg_begin(
+        nl_batch_t * batch, uint16_t type, uint16_t flags,
+        const void * hdr, size_t hdr_size, const char * what)
+{
+    struct nlmsghdr * nlh;
+    void * payload;
+
+    if (batch->num_msgs == NL_BATCH_MAX_MSGS) {
+        batch->overflow = 1;
+        return;
+    }
+
+    batch->cur = batch->len;
+    nlh = (struct nlmsghdr *)nl_batch_reserve(batch, NLMSG_HDRLEN);
+    if (!nlh) return;
+
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    batch->what[batch->num_msgs++] = what;
+
+    payload = nl_batch_reserve(batch, hdr_size);
+    if (payload)
+        memcpy(payload, hdr, hdr_size);
+}
+
+
+/** Add an attribute to the current message. */
+void nl_attr_put(
+        nl_batch_t * batch, uint16_t type, const void * data, size_t len)
+{
+    struct nlattr * attr;
+
+    attr = (struct nlattr *)nl_batch_reserve(batch, NLA_HDRLEN + len);
+    if (!attr) return;
+
+    attr->nla_type = type;
+    attr->nla_len = NLA_HDRLEN + len;
+    memcpy((char *)attr + NLA_HDRLEN, data, len);
+}
+
+
+/** Add an 8-bit unsigned integer attribute to the current message. */
+void nl_attr_put_u8(nl_batch_t * batch, uint16_t type, uint8_t value) {
+    nl_attr_put(batch, type, &value, sizeof(value));
+}
+
+
+/** Add a 16-bit unsigned integer attribute to the current message. */
+void nl_attr_put_u16(nl_batch_t * batch, uint16_t type, uint16_t value) {
+    nl_attr_put(batch, type, &value, sizeof(value));
+}
+
+
+/** Add a 32-bit unsigned integer attribute to the current message. */
+void nl_attr_put_u32(nl_batch_t * batch, uint16_t type, uint32_t value) {
+    nl_attr_put(batch, type, &value, sizeof(value));
+}
+
+
+/** Add a null-terminated string attribute to the current message. */
+void nl_attr_put_str(nl_batch_t * batch, uint16_t type, const char * str) {
+    nl_attr_put(batch, type, str, strlen(str) + 1);
+}
+
+
+/** Start a nested attribute. */
+size_t nl_nest_begin(nl_batch_t * batch, uint16_t type) {
+    size_t nest = batch->len;
+    struct nlattr * attr;
+
+    attr = (struct nlattr *)nl_batch_reserve(batch, NLA_HDRLEN);
+    if (!attr) return 0;
+
+    attr->nla_type = type | NLA_F_NESTED;
+    return nest;
+}
+
+
+/** Finish a nested attribute. */
+void nl_nest_end(nl_batch_t * batch, size_t nest) {
+    if (batch->overflow) return;
+    ((struct nlattr *)(batch->buf + nest))->nla_len = batch->len - nest;
+}
+
+
+/** Print the error message for a failed request.
+ *
+ * @param what Description of the failed operation.
+ * @param nlh The error message received from the kernel.
+ */
+static void nl_print_error(const char * what, const struct nlmsghdr * nlh) {
+    const struct nlmsgerr * err = (const struct nlmsgerr *)NLMSG_DATA(nlh);
+    const struct nlattr * attr;
+    size_t offset, len;
+
+    fprintf(stderr, "%s: %s\n", what, strerror(-err->error));
+
+    if (!(nlh->nlmsg_flags & NLM_F_ACK_TLVS))
+        return;
+
+    // skip the struct nlmsgerr and the (possibly capped) original request
+    offset = NLMSG_HDRLEN + sizeof(struct nlmsgerr);
+    if (!(nlh->nlmsg_flags & NLM_F_CAPPED))
+        offset += err->msg.nlmsg_len - NLMSG_HDRLEN;
+    offset = NLMSG_ALIGN(offset);
+
+    while (offset + NLA_HDRLEN <= nlh->nlmsg_len) {
+        attr = (const struct nlattr *)((const char *)nlh + offset);
+        len = attr->nla_len;
+        if (len < NLA_HDRLEN || offset + len > nlh->nlmsg_len)
+            break;
+
+        if (attr->nla_type == NLMSGERR_ATTR_MSG && len > NLA_HDRLEN)
+            fprintf(
+                    stderr, "%.*s\n", (int)(len - NLA_HDRLEN - 1),
+                    (const char *)attr + NLA_HDRLEN);
+
+        offset += NLA_ALIGN(len);
+    }
+}
+
+
+/** Send a batch and wait for the kernel to process it. */
+int nl_batch_send_cb(
+        nl_sock_t * sock, nl_batch_t * batch, nl_reply_cb_t cb, void * arg)
+{
+    // Dumps use larger messages if we offer a large buffer, which saves
+    // system calls, and messages that don't fit would be truncated. Replies
+    // with private keys go into locked memory, and either way the part we
+    // used is wiped afterwards.
+    _Alignas(struct nlmsghdr) char stack_buf[NL_RECV_SIZE];
+    char * buf = stack_buf;
+    struct sockaddr_nl addr;
+    struct nlmsghdr * nlh;
+    const struct nlmsgerr * err;
+    uint32_t first_seq, index;
+    int num_done = 0, ret = 0, len, error;
+    ssize_t num_received, num_sent, total_received = 0, max_received = 0;
+    size_t offset;
+
+    // updated as the acknowledgements come in
+    for (index = 0; index < (uint32_t)batch->num_msgs; ++index)
+        batch->error[index] = -EIO;
+
+    if (batch->overflow) {
+        fprintf(stderr, "Netlink request too large\n");
+        return 1;
+    }
+
+    if (batch->secret) {
+        buf = secure_alloc(NL_RECV_SIZE);
+        if (!buf)
+            return 1;
+    }
+
+    // number the messages
+    first_seq = sock->seq + 1;
+    for (offset = 0; offset < batch->len; offset += nlh->nlmsg_len) {
+        nlh = (struct nlmsghdr *)(batch->buf + offset);
+        nlh->nlmsg_seq = ++sock->seq;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+
+    do {
+        num_sent = sendto(
+                sock->fd, batch->buf, batch->len, 0,
+                (struct sockaddr *)&addr, sizeof(addr));
+    } while (num_sent == -1 && errno == EINTR);
+
+    if (num_sent != (ssize_t)batch->len) {
+        perror("Error sending netlink request");
+        ret = 1;
+        goto exit_buf;
+    }
+
+    while (num_done < batch->num_msgs) {
+        num_received = recv(sock->fd, buf, NL_RECV_SIZE, 0);
+        if (num_received == -1) {
+            if (errno == EINTR) continue;
+            perror("Error receiving netlink reply");
+            ret = 1;
+            break;
+        }
+        total_received += num_received;
+        if (num_received > max_received)
+            max_received = num_received;
+
+        len = (int)num_received;
+        for (
+                nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+                nlh = NLMSG_NEXT(nlh, len))
+        {
+            index = nlh->nlmsg_seq - first_seq;
+            if (index >= (uint32_t)batch->num_msgs)
+                continue;   // stale reply to an earlier request
+
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                // acknowledgement or error, this request is done
+                err = (const struct nlmsgerr *)NLMSG_DATA(nlh);
+                if (err->error != 0) {
+                    if (batch->what[index])
+                        nl_print_error(batch->what[index], nlh);
+                    ret = 1;
+                }
+                batch->error[index] = err->error;
+                ++num_done;
+            }
+            else if (nlh->nlmsg_type == NLMSG_DONE) {
+                // end of a dump, which may carry an error code
+                error = 0;
+                if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(error)))
+                    memcpy(&error, NLMSG_DATA(nlh), sizeof(error));
+                if (error < 0) {
+                    if (batch->what[index])
+                        fprintf(
+                                stderr, "%s: %s\n", batch->what[index],
+                                strerror(-error));
+                    ret = 1;
+                }
+                batch->error[index] = error < 0 ? error : 0;
+                ++num_done;
+            }
+            else if (cb && !ret) {
+                if (cb(index, nlh, arg) != 0)
+                    ret = 1;
+            }
+        }
+    }
+
+    trace_note(ret, total_received);
+
+exit_buf:
+    if (buf != stack_buf)
+        secure_free(buf);
+    else
+        explicit_bzero(buf, max_received);
+    return ret;
+}
+
+
+/** Send a batch and wait for the kernel to process it. */
+int nl_batch_send(nl_sock_t * sock, nl_batch_t * batch) {
+    return nl_batch_send_cb(sock, batch, NULL, NULL);
+}
+
+
+/** Parse the attributes in a message. */
+void nl_attr_parse(
+        const void * data, size_t len, const struct nlattr * tb[], int max)
+{
+    const struct nlattr * attr;
+    size_t offset = 0;
+    int type;
+
+    memset(tb, 0, (max + 1) * sizeof(tb[0]));
+
+    while (offset + NLA_HDRLEN <= len) {
+        attr = (const struct nlattr *)((const char *)data + offset);
+        if (attr->nla_len < NLA_HDRLEN || offset + attr->nla_len > len)
+            break;
+
+        type = attr->nla_type & NLA_TYPE_MASK;
+        if (type <= max)
+            tb[type] = attr;
+
+        offset += NLA_ALIGN(attr->nla_len);
+    }
+}
+
+
+/** Parse the attributes of a message, after the given protocol header. */
+void nl_msg_parse(
+        const struct nlmsghdr * nlh, size_t hdr_size,
+        const struct nlattr * tb[], int max)
+{
+    size_t offset = NLMSG_HDRLEN + NLMSG_ALIGN(hdr_size);
+
+    if (nlh->nlmsg_len < offset) {
+        memset(tb, 0, (max + 1) * sizeof(tb[0]));
+        return;
+    }
+
+    nl_attr_parse(
+            (const char *)nlh + offset, nlh->nlmsg_len - offset, tb, max);
+}
+
+
+/** Parse the attributes nested in an attribute. */
+void nl_nest_parse(
+        const struct nlattr * nest, const struct nlattr * tb[], int max)
+{
+    nl_attr_parse(nl_attr_data(nest), nl_attr_len(nest), tb, max);
+}
@@ -0,0 +1,247 @@
+/** Functions for talking to the kernel over netlink.
+ *
+ * Netlink requests are built up in a batch, which can contain several
+ * messages. The whole batch is sent to the kernel in a single system call,
+ * after which the acknowledgements for all messages are collected. Each
+ * message carries a description of what it does, which is used to produce an
+ * error message if the kernel rejects it, so that errors read the same as
+ * they do for the subprocess-based code.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <linux/netlink.h>
+
+
+/** Maximum total size of the messages in a batch. */
+#define NL_BATCH_SIZE 4096
+
+/** Maximum number of messages in a batch. */
+#define NL_BATCH_MAX_MSGS 16
+
+/** Size of the buffer replies are received into. */
+#define NL_RECV_SIZE 32768
+
+
+typedef struct {
+    int fd;
+    uint32_t seq;
+} nl_sock_t;
+
+
+/** Callback for handling replies.
+ *
+ * This is called for each data message the kernel sends in reply to a
+ * request, which for a dump may be many.
+ *
+ * @param index Index of the request in the batch that this is a reply to.
+ * @param nlh The received message.
+ * @param arg User-supplied argument.
+ * @return 0 on success, nonzero on error.
+ */
+typedef int (*nl_reply_cb_t)(
+        int index, const struct nlmsghdr * nlh, void * arg);
+
+
+typedef struct {
+    _Alignas(struct nlmsghdr) char buf[NL_BATCH_SIZE];
+    size_t len;
+
+    // current message, offset into buf
+    size_t cur;
+
+    int num_msgs;
+    const char * what[NL_BATCH_MAX_MSGS];
+
+    // set if we ran out of space while building
+    int overflow;
+    // set if replies may contain private keys, so that they are received
+    // into the secure arena, see secure.h
+    int secret;
+    // set by nl_batch_send_cb(), 0 for each message that succeeded, else a
+    // negative errno value, -EIO if there was no reply
+    int error[NL_BATCH_MAX_MSGS];
+} nl_batch_t;
+
+
+/** Open a netlink socket.
+ *
+ * The socket will be in the network namespace the calling thread is in at the
+ * time of the call, and will stay there even if the thread moves elsewhere.
+ *
+ * @param sock The socket object to initialise.
+ * @param protocol The netlink protocol, e.g. NETLINK_ROUTE.
+ * @return 0 on success, -1 on error.
+ */
+int nl_open(nl_sock_t * sock, int protocol);
+
+
+/** Close a netlink socket.
+ *
+ * @param sock The socket to close.
+ */
+void nl_close(nl_sock_t * sock);
+
+
+/** Start a new, empty batch.
+ *
+ * @param batch The batch to initialise.
+ */
+void nl_batch_init(nl_batch_t * batch);
+
+
+/** Start a new message in the batch.
+ *
+ * The message will be sent with NLM_F_REQUEST and NLM_F_ACK set in addition
+ * to the given flags.
+ *
+ * @param batch The batch to add the message to.
+ * @param type The message type, e.g. RTM_NEWLINK.
+ * @param flags Additional message flags, e.g. NLM_F_CREATE.
+ * @param hdr Protocol header to put at the start of the payload.
+ * @param hdr_size Size of the protocol header.
+ * @param what Description of the operation, used for error messages, or NULL
+ *          if the caller checks batch->error itself and prints nothing.
+ */
+void nl_msg_begin(
+        nl_batch_t * batch, uint16_t type, uint16_t flags,
+        const void * hdr, size_t hdr_size, const char * what);
+
+
+/** Add an attribute to the current message.
+ *
+ * @param batch The batch to add to.
+ * @param type The attribute type.
+ * @param data The attribute value.
+ * @param len The size of the value.
+ */
+void nl_attr_put(
+        nl_batch_t * batch, uint16_t type, const void * data, size_t len);
+
+
+/** Add an 8-bit unsigned integer attribute to the current message. */
+void nl_attr_put_u8(nl_batch_t * batch, uint16_t type, uint8_t value);
+
+
+/** Add a 16-bit unsigned integer attribute to the current message. */
+void nl_attr_put_u16(nl_batch_t * batch, uint16_t type, uint16_t value);
+
+
+/** Add a 32-bit unsigned integer attribute to the current message. */
+void nl_attr_put_u32(nl_batch_t * batch, uint16_t type, uint32_t value);
+
+
+/** Add a null-terminated string attribute to the current message. */
+void nl_attr_put_str(nl_batch_t * batch, uint16_t type, const char * str);
+
+
+/** Start a nested attribute.
+ *
+ * @return A handle to pass to nl_nest_end().
+ */
+size_t nl_nest_begin(nl_batch_t * batch, uint16_t type);
+
+
+/** Finish a nested attribute.
+ *
+ * @param nest The handle returned by nl_nest_begin().
+ */
+void nl_nest_end(nl_batch_t * batch, size_t nest);
+
+
+/** Send a batch and wait for the kernel to process it.
+ *
+ * As nl_batch_send(), but any data messages the kernel sends in reply are
+ * passed to the given callback. This can be used to retrieve objects, and for
+ * dumps (messages sent with NLM_F_DUMP), which may return many of them.
+ *
+ * If the callback returns an error for a message, then the remaining replies
+ * are still received, but not passed to the callback, and 1 is returned.
+ *
+ * The result of each message is recorded in batch->error, so that callers
+ * that send many independent requests can tell which ones to report.
+ *
+ * @param sock The socket to send on.
+ * @param batch The batch to send.
+ * @param cb The function to call for each data message received.
+ * @param arg Argument to pass to the callback.
+ * @return 0 if all messages succeeded, 1 on error.
+ */
+int nl_batch_send_cb(
+        nl_sock_t * sock, nl_batch_t * batch, nl_reply_cb_t cb, void * arg);
+
+
+/** Send a batch and wait for the kernel to process it.
+ *
+ * The kernel processes the messages in order, and keeps going if one of them
+ * fails. All acknowledgements are collected, and for each failed message an
+ * error is printed on stderr, using its description.
+ *
+ * @param sock The socket to send on.
+ * @param batch The batch to send.
+ * @return 0 if all messages succeeded, 1 on error.
+ */
+int nl_batch_send(nl_sock_t * sock, nl_batch_t * batch);
+
+
+/** Parse the attributes in a message.
+ *
+ * Attributes of type larger than max are ignored. If an attribute occurs more
+ * than once, the last occurrence is used.
+ *
+ * @param data Pointer to the first attribute.
+ * @param len Total size of the attributes.
+ * @param tb (out) Array of max + 1 pointers, set to point to the attribute of
+ *          the corresponding type, or to NULL if it is absent.
+ * @param max Largest attribute type to store.
+ */
+void nl_attr_parse(
+        const void * data, size_t len, const struct nlattr * tb[], int max);
+
+
+/** Parse the attributes of a message, after the given protocol header.
+ *
+ * See nl_attr_parse().
+ *
+ * @param nlh The message to parse.
+ * @param hdr_size Size of the protocol header after the netlink header.
+ */
+void nl_msg_parse(
+        const struct nlmsghdr * nlh, size_t hdr_size,
+        const struct nlattr * tb[], int max);
+
+
+/** Parse the attributes nested in an attribute.
+ *
+ * See nl_attr_parse().
+ */
+void nl_nest_parse(
+        const struct nlattr * nest, const struct nlattr * tb[], int max);
+
+
+/** Get a pointer to the value of an attribute. */
+static inline const void * nl_attr_data(const struct nlattr * attr) {
+    return (const char *)attr + NLA_HDRLEN;
+}
+
+
+/** Get the size of the value of an attribute. */
+static inline size_t nl_attr_len(const struct nlattr * attr) {
+    return attr->nla_len - NLA_HDRLEN;
+}
+
+
+/** Iterate over the attributes nested in an attribute. */
+#define nl_nest_for_each(attr, nest)                                        \
+    for (                                                                   \
+            attr = (const struct nlattr *)nl_attr_data(nest);               \
+            (const char *)attr + NLA_HDRLEN <=                              \
+                (const char *)(nest) + (nest)->nla_len &&                   \
+            attr->nla_len >= NLA_HDRLEN &&                                  \
+            (const char *)attr + attr->nla_len <=                           \
+                (const char *)(nest) + (nest)->nla_len;                     \
+            attr = (const struct nlattr *)(                                 \
+                (const char *)attr + NLA_ALIGN(attr->nla_len)))
@@ -0,0 +1,323 @@
+/** Handles for network namespaces. */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/capability.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/nsfs.h>
+
+#include "capabilities.h"
+#include "netns.h"
+#include "probes.h"
+#include "validation.h"
+
+
+// Not every C library has this yet. New system calls have the same number on
+// all architectures, so this is safe.
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+// Added in Linux 6.11, see linux/pidfd.h
+#ifndef PIDFD_GET_NET_NAMESPACE
+#define PIDFD_GET_NET_NAMESPACE _IO(0xFF, 4)
+#endif
+
+
+// Cached handles, unused entries have an empty spec
+static _Thread_local netns_t netns_cache[NETNS_CACHE_SIZE];
+
+// Entry to replace next if the cache is full
+static _Thread_local int netns_cache_next = 0;
+
+
+/** Validate a network namespace specification. */
+int netns_validate(const char * spec) {
+    const char * cur;
+
+    if (strlen(spec) >= NETNS_SPEC_MAX)
+        return 1;
+
+    if (!validate_number(7, spec, NULL))
+        return 0;
+
+    if (!strncmp(spec, "fd:", 3))
+        return validate_number(4, spec + 3, NULL);
+
+    if (strncmp(spec, NETNS_RUN_DIR, strlen(NETNS_RUN_DIR)))
+        return 1;
+
+    // a name in that directory, which excludes . and ..
+    cur = spec + strlen(NETNS_RUN_DIR);
+    if ((*cur == '\0') || (*cur == '.'))
+        return 1;
+
+    while (*cur != '\0') {
+        if (
+                validate_letter(cur, &cur) && validate_digit(cur, &cur) &&
+                validate_literal('-', cur, &cur) &&
+                validate_literal('_', cur, &cur) &&
+                validate_literal('.', cur, &cur))
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/** Check that an fd refers to a network namespace.
+ *
+ * Returns 0 if it does, -1 if not.
+ */
+static int netns_check_type(int fd, const char * spec) {
+    int type = ioctl(fd, NS_GET_NSTYPE);
+
+    if (type == CLONE_NEWNET)
+        return 0;
+
+    if (type == -1) {
+        fprintf(stderr, "When checking %s\n", spec);
+        perror("Not a namespace");
+    }
+    else
+        fprintf(stderr, "%s is not a network namespace\n", spec);
+    return -1;
+}
+
+
+/** Check whether the process a handle was resolved to is still running.
+ *
+ * This only works for handles with a pidfd. The pidfd becomes readable when
+ * the process exits.
+ */
+static int netns_process_alive(const netns_t * ns) {
+    struct pollfd pfd;
+
+    pfd.fd = ns->pidfd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+
+/** Open /proc/<pid>/ns/net for a handle specified by PID.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int netns_open_proc(netns_t * ns) {
+    char path[32];
+
+    snprintf(path, sizeof(path), "/proc/%d/ns/net", (int)ns->pid);
+
+    enable_cap(CAP_SYS_PTRACE);
+    ns->fd = open(path, O_RDONLY | O_CLOEXEC);
+    disable_cap(CAP_SYS_PTRACE);
+
+    if (ns->fd == -1) {
+        fprintf(stderr, "When opening %s\n", path);
+        perror("Could not open network namespace");
+        return -1;
+    }
+
+    ns->owns_fd = 1;
+    return 0;
+}
+
+
+/** Close a handle's file descriptors and mark it unused. */
+static void netns_release(netns_t * ns) {
+    if (ns->spec[0] == '\0')
+        return;
+
+    if (ns->owns_fd && (ns->fd != -1))
+        close(ns->fd);
+
+    if (ns->pidfd != -1)
+        close(ns->pidfd);
+
+    ns->spec[0] = '\0';
+}
+
+
+/** Open a handle for a valid namespace specification.
+ *
+ * Returns 0 on success, -1 on failure. The handle needs to be released in
+ * either case.
+ */
+static int netns_open(netns_t * ns, const char * spec) {
+    strcpy(ns->spec, spec);
+    ns->pid = 0;
+    ns->pidfd = -1;
+    ns->fd = -1;
+    ns->owns_fd = 0;
+
+    if (!strncmp(spec, "fd:", 3)) {
+        ns->fd = atoi(spec + 3);
+        return netns_check_type(ns->fd, spec);
+    }
+
+    if (spec[0] == '/') {
+        ns->fd = open(spec, O_RDONLY | O_CLOEXEC);
+        if (ns->fd == -1) {
+            fprintf(stderr, "When opening %s\n", spec);
+            perror("Could not open network namespace");
+            return -1;
+        }
+        ns->owns_fd = 1;
+        return netns_check_type(ns->fd, spec);
+    }
+
+    ns->pid = atoi(spec);
+    ns->pidfd = syscall(SYS_pidfd_open, ns->pid, 0);
+    if (ns->pidfd != -1)
+        return 0;
+
+    if (errno != ENOSYS) {
+        fprintf(stderr, "When looking up process %d\n", (int)ns->pid);
+        perror("Could not find network namespace");
+        return -1;
+    }
+
+    // Linux before 5.3 has no pidfds, so this is the best we can do
+    return netns_open_proc(ns);
+}
+
+
+/** Get a handle for a network namespace. */
+netns_t * netns_get(const char * spec) {
+    netns_t * ns = NULL;
+    int i;
+
+    for (i = 0; i < NETNS_CACHE_SIZE; ++i) {
+        if (!strcmp(netns_cache[i].spec, spec)) {
+            ns = &netns_cache[i];
+            if ((ns->pidfd == -1) || netns_process_alive(ns))
+                return ns;
+
+            // The process has exited, the PID may now be someone else's
+            netns_release(ns);
+            break;
+        }
+    }
+
+    for (i = 0; !ns && (i < NETNS_CACHE_SIZE); ++i)
+        if (netns_cache[i].spec[0] == '\0')
+            ns = &netns_cache[i];
+
+    if (!ns) {
+        ns = &netns_cache[netns_cache_next];
+        netns_cache_next = (netns_cache_next + 1) % NETNS_CACHE_SIZE;
+        netns_release(ns);
+    }
+
+    if (netns_open(ns, spec)) {
+        netns_release(ns);
+        return NULL;
+    }
+
+    return ns;
+}
+
+
+/** Get a file descriptor for the namespace. */
+int netns_fd(netns_t * ns) {
+    int fd;
+
+    if (ns->fd != -1)
+        return ns->fd;
+
+    // Only handles with a pidfd get here. Linux 6.11 and later can give us
+    // the namespace directly.
+    enable_cap(CAP_SYS_PTRACE);
+    fd = ioctl(ns->pidfd, PIDFD_GET_NET_NAMESPACE, 0);
+    disable_cap(CAP_SYS_PTRACE);
+
+    if (fd != -1) {
+        ns->fd = fd;
+        ns->owns_fd = 1;
+        return fd;
+    }
+
+    if (errno != ENOTTY) {
+        fprintf(
+                stderr, "When opening namespace of process %d\n",
+                (int)ns->pid);
+        perror("Could not open network namespace");
+        return -1;
+    }
+
+    // Otherwise we go via /proc, and then check that the process is still
+    // there. If it is, then the PID still referred to it when we opened it.
+    if (netns_open_proc(ns))
+        return -1;
+
+    if (!netns_process_alive(ns)) {
+        fprintf(stderr, "Process %d exited\n", (int)ns->pid);
+        close(ns->fd);
+        ns->fd = -1;
+        return -1;
+    }
+
+    return ns->fd;
+}
+
+
+/** Move the calling thread into the namespace. */
+int netns_enter(netns_t * ns) {
+    int err;
+
+    PROBE1(setns_start, ns->spec);
+
+    if (ns->fd == -1) {
+        // setns() checks that we may ptrace the process for a pidfd
+        enable_cap(CAP_SYS_PTRACE);
+        enable_cap(CAP_SYS_ADMIN);
+        err = setns(ns->pidfd, CLONE_NEWNET);
+        disable_cap(CAP_SYS_ADMIN);
+        disable_cap(CAP_SYS_PTRACE);
+
+        if (!err)
+            goto exit_done;
+
+        // Linux before 5.8 doesn't support pidfds here
+        if (errno != EINVAL)
+            goto exit_error;
+
+        if (netns_fd(ns) == -1) {
+            err = -1;
+            goto exit_done;
+        }
+    }
+
+    enable_cap(CAP_SYS_ADMIN);
+    err = setns(ns->fd, CLONE_NEWNET);
+    disable_cap(CAP_SYS_ADMIN);
+
+    if (!err)
+        goto exit_done;
+
+exit_error:
+    fprintf(stderr, "When entering %s\n", ns->spec);
+    perror("Could not enter network namespace");
+    err = -1;
+
+exit_done:
+    PROBE2(setns_done, ns->spec, err);
+    return err;
+}
+
+
+/** Close all cached handles. */
+void netns_close_all(void) {
+    int i;
+
+    for (i = 0; i < NETNS_CACHE_SIZE; ++i)
+        netns_release(&netns_cache[i]);
+}
+
@@ -0,0 +1,86 @@
+/** Handles for network namespaces.
+ *
+ * A network namespace can be specified in one of three ways:
+ *
+ * - As the PID of a process inside it, e.g. "1234"
+ * - As an already open namespace file descriptor, e.g. "fd:3"
+ * - As a namespace bind-mounted by `ip netns add`, e.g. "/run/netns/name"
+ *
+ * A PID is resolved to a pidfd once, and all further operations go through
+ * the pidfd, so that the handle cannot end up referring to a different process
+ * if the PID is reused. On kernels without pidfd support, /proc/<pid>/ns/net is
+ * used instead.
+ *
+ * Handles are cached, so that a process that works with the same namespace
+ * several times only resolves it once. Each thread has its own cache, as
+ * threads may have their own file descriptor tables.
+ */
+#pragma once
+
+#include <sys/types.h>
+
+
+/** Directory where `ip netns` keeps named namespaces. */
+#define NETNS_RUN_DIR "/run/netns/"
+
+/** Maximum length of a namespace specification. */
+#define NETNS_SPEC_MAX 64
+
+/** Number of handles to cache. */
+#define NETNS_CACHE_SIZE 16
+
+
+typedef struct {
+    char spec[NETNS_SPEC_MAX];  // how the namespace was specified
+    pid_t pid;                  // PID, or 0 if not specified by PID
+    int pidfd;                  // pidfd for the PID, or -1
+    int fd;                     // namespace fd, or -1 if not opened yet
+    int owns_fd;                // whether we opened fd and must close it
+} netns_t;
+
+
+/** Validate a network namespace specification.
+ *
+ * This checks the syntax only, it does not open anything.
+ *
+ * @param spec The specification to check.
+ * @return 0 if valid, 1 otherwise.
+ */
+int netns_validate(const char * spec);
+
+
+/** Get a handle for a network namespace.
+ *
+ * This returns a cached handle if there is one, and opens a new one otherwise.
+ * Cached handles for processes that have since exited are reopened. The
+ * returned handle is owned by the cache, and remains valid until the next
+ * call to netns_get() or netns_close_all().
+ *
+ * @param spec A valid namespace specification, see above.
+ * @return The handle, or NULL on error, in which case a message is printed.
+ */
+netns_t * netns_get(const char * spec);
+
+
+/** Get a file descriptor for the namespace.
+ *
+ * For handles specified by PID, this opens the namespace on first use.
+ *
+ * @param ns The handle to get a file descriptor for.
+ * @return The fd, which is owned by the handle, or -1 on error, in which case
+ *          a message is printed.
+ */
+int netns_fd(netns_t * ns);
+
+
+/** Move the calling thread into the namespace.
+ *
+ * @param ns The namespace to enter.
+ * @return 0 on success, -1 on error, in which case a message is printed.
+ */
+int netns_enter(netns_t * ns);
+
+
+/** Close all of the calling thread's cached handles. */
+void netns_close_all(void);
+
@@ -0,0 +1,346 @@
+/** Running a task for many records in parallel. */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/capability.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "capabilities.h"
+#include "netns.h"
+#include "parallel.h"
+#include "probes.h"
+
+
+// Stack size for worker threads, which need much less than the default
+#define PAR_STACK_SIZE (256 * 1024)
+
+// Maximum number of characters of error output to keep per record
+#define PAR_MAX_ERROR 1000
+
+
+typedef struct {
+    char line[PAR_MAX_LINE];
+    char * fields[PAR_MAX_FIELDS];
+    int num_fields;             // -1 if the line was too long
+    int done;
+    int failed;
+    char output[PAR_MAX_OUTPUT];
+    char error[PAR_MAX_ERROR];
+} par_record_t;
+
+
+typedef struct {
+    par_record_t * records;
+    int num_records;
+    int num_fields;
+    par_task_t task;
+
+    pthread_mutex_t lock;
+    pthread_cond_t record_done;
+    int next;                   // next record to hand out
+} par_state_t;
+
+
+/** Read records from standard input.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int par_read_records(par_state_t * state) {
+    par_record_t * rec, * new_records;
+    int size = 0, c;
+    char * save;
+
+    state->records = NULL;
+    state->num_records = 0;
+
+    for (;;) {
+        if (state->num_records == size) {
+            if (size == PAR_MAX_RECORDS) {
+                fprintf(stderr, "Too many records, max is %d\n", size);
+                goto exit_records;
+            }
+            size = size ? 2 * size : 16;
+            if (size > PAR_MAX_RECORDS)
+                size = PAR_MAX_RECORDS;
+
+            new_records = realloc(state->records, size * sizeof(par_record_t));
+            if (!new_records) {
+                perror("Error allocating records");
+                goto exit_records;
+            }
+            state->records = new_records;
+        }
+
+        rec = &state->records[state->num_records];
+        if (!fgets(rec->line, PAR_MAX_LINE, stdin))
+            break;
+
+        rec->num_fields = 0;
+        rec->done = 0;
+        rec->failed = 0;
+        rec->output[0] = '\0';
+        rec->error[0] = '\0';
+
+        if (!strchr(rec->line, '\n') && !feof(stdin)) {
+            // skip the rest of the line
+            do c = getchar(); while ((c != '\n') && (c != EOF));
+            rec->num_fields = -1;
+        }
+        else {
+            rec->fields[0] = strtok_r(rec->line, " \t\n", &save);
+            while (rec->fields[rec->num_fields]) {
+                if (++rec->num_fields == PAR_MAX_FIELDS)
+                    break;
+                rec->fields[rec->num_fields] = strtok_r(NULL, " \t\n", &save);
+            }
+            if (rec->num_fields == 0)
+                continue;
+        }
+
+        ++state->num_records;
+    }
+
+    if (ferror(stdin)) {
+        perror("Error reading records");
+        goto exit_records;
+    }
+
+    return 0;
+
+exit_records:
+    free(state->records);
+    return -1;
+}
+
+
+/** Set up a worker thread.
+ *
+ * This gives the thread a private copy of the file descriptor table, and
+ * redirects standard error to an in-memory file. It also opens the thread's
+ * current network namespace, so that it can return there.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int par_worker_setup(int * netns_fd) {
+    int err_fd;
+
+    if (unshare(CLONE_FILES) != 0) {
+        perror("Error unsharing file descriptors");
+        goto exit_0;
+    }
+
+    *netns_fd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (*netns_fd == -1) {
+        perror("Error opening current network namespace");
+        goto exit_0;
+    }
+
+    err_fd = memfd_create("errors", MFD_CLOEXEC);
+    if (err_fd == -1) {
+        perror("Error creating error buffer");
+        goto exit_1;
+    }
+
+    if (dup2(err_fd, STDERR_FILENO) == -1) {
+        perror("Error redirecting standard error");
+        close(err_fd);
+        goto exit_1;
+    }
+
+    close(err_fd);
+    return 0;
+
+exit_1:
+    close(*netns_fd);
+
+exit_0:
+    return -1;
+}
+
+
+/** Collect the errors printed while processing a record.
+ *
+ * This takes what has been written to standard error since the last call,
+ * and puts it into the record as a single line.
+ */
+static void par_collect_errors(par_record_t * rec) {
+    off_t size = lseek(STDERR_FILENO, 0, SEEK_CUR);
+    ssize_t len = 0, i;
+
+    if (size > 0) {
+        if (size > PAR_MAX_ERROR - 1)
+            size = PAR_MAX_ERROR - 1;
+        len = pread(STDERR_FILENO, rec->error, size, 0);
+        if (len < 0)
+            len = 0;
+    }
+
+    // remove trailing newlines, and join lines with semicolons
+    while ((len > 0) && (rec->error[len - 1] == '\n'))
+        --len;
+    rec->error[len] = '\0';
+
+    for (i = 0; i < len; ++i)
+        if (rec->error[i] == '\n')
+            rec->error[i] = ';';
+
+    if (ftruncate(STDERR_FILENO, 0) == 0)
+        lseek(STDERR_FILENO, 0, SEEK_SET);
+}
+
+
+/** Process a single record on a worker thread.
+ *
+ * Returns 0 if the thread can continue, -1 if it could not return to its
+ * original namespace.
+ */
+static int par_process(
+        par_state_t * state, par_record_t * rec, int netns_fd)
+{
+    int err;
+
+    rec->failed = 1;
+
+    if (rec->num_fields == -1)
+        fprintf(stderr, "Line too long\n");
+    else if (rec->num_fields != state->num_fields)
+        fprintf(
+                stderr, "Expected %d fields, got %d\n", state->num_fields,
+                rec->num_fields);
+    else
+        rec->failed = state->task(rec->fields, rec->output) != 0;
+
+    PROBE1(setns_start, "");
+    enable_cap(CAP_SYS_ADMIN);
+    err = setns(netns_fd, CLONE_NEWNET);
+    disable_cap(CAP_SYS_ADMIN);
+    PROBE2(setns_done, "", err);
+
+    if (err)
+        perror("Error returning to original network namespace");
+
+    par_collect_errors(rec);
+    if (!rec->failed)
+        rec->error[0] = '\0';
+
+    return err ? -1 : 0;
+}
+
+
+/** Main function for the worker threads. */
+static void * par_worker(void * arg) {
+    par_state_t * state = (par_state_t *)arg;
+    int netns_fd = -1, ok, i;
+    par_record_t * rec;
+
+    ok = par_worker_setup(&netns_fd) == 0;
+
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        i = state->next++;
+        pthread_mutex_unlock(&state->lock);
+
+        if (i >= state->num_records)
+            break;
+
+        rec = &state->records[i];
+        if (ok) {
+            ok = par_process(state, rec, netns_fd) == 0;
+        }
+        else {
+            rec->failed = 1;
+            strcpy(rec->error, "Worker thread unavailable, see earlier error");
+        }
+
+        pthread_mutex_lock(&state->lock);
+        rec->done = 1;
+        pthread_cond_broadcast(&state->record_done);
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    netns_close_all();
+    if (netns_fd != -1)
+        close(netns_fd);
+
+    return NULL;
+}
+
+
+/** Run a task for each record on standard input. */
+int par_run(int num_fields, par_task_t task, int max_threads) {
+    pthread_t threads[max_threads];
+    int num_threads = 0, ret = EXIT_SUCCESS, i;
+    pthread_attr_t attr;
+    par_state_t state;
+    par_record_t * rec;
+
+    if (par_read_records(&state))
+        goto exit_0;
+
+    state.num_fields = num_fields;
+    state.task = task;
+    state.next = 0;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.record_done, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PAR_STACK_SIZE);
+
+    while ((num_threads < max_threads) && (num_threads < state.num_records)) {
+        errno = pthread_create(
+                &threads[num_threads], &attr, par_worker, &state);
+        if (errno) {
+            perror("Error starting worker thread");
+            break;
+        }
+        ++num_threads;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if ((num_threads == 0) && (state.num_records > 0))
+        goto exit_1;
+
+    for (i = 0; i < state.num_records; ++i) {
+        rec = &state.records[i];
+
+        pthread_mutex_lock(&state.lock);
+        while (!rec->done)
+            pthread_cond_wait(&state.record_done, &state.lock);
+        pthread_mutex_unlock(&state.lock);
+
+        if (rec->failed) {
+            printf("error %s\n", rec->error);
+            ret = EXIT_FAILURE;
+        }
+        else if (rec->output[0] != '\0')
+            printf("ok %s\n", rec->output);
+        else
+            printf("ok\n");
+        fflush(stdout);
+
+        explicit_bzero(rec->output, sizeof(rec->output));
+    }
+
+    for (i = 0; i < num_threads; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&state.record_done);
+    pthread_mutex_destroy(&state.lock);
+    free(state.records);
+    return ret;
+
+exit_1:
+    pthread_cond_destroy(&state.record_done);
+    pthread_mutex_destroy(&state.lock);
+    free(state.records);
+
+exit_0:
+    return EXIT_FAILURE;
+}
+
@@ -0,0 +1,62 @@
+/** Running a task for many records in parallel.
+ *
+ * Some commands read a list of records from standard input, one per line,
+ * and do the same thing for each of them. The records are processed by a pool
+ * of worker threads, and for each record a line with the result is printed on
+ * standard output, in input order. Each line is printed as soon as that record
+ * and all the ones before it are done.
+ *
+ * A result line is either `ok`, optionally followed by a space and the output
+ * of the task, or `error` followed by a space and the error messages printed
+ * by the task, with newlines replaced by semicolons. A failed record does not
+ * affect the others.
+ *
+ * Each worker thread has its own file descriptor table with standard error
+ * redirected to a buffer, so that error messages can be attributed to the
+ * record that caused them. Tasks may move the thread into another network
+ * namespace; it is moved back to the original one after each record.
+ */
+#pragma once
+
+
+/** Maximum length of an input line, including the newline. */
+#define PAR_MAX_LINE 256
+
+/** Maximum number of fields in a record. */
+#define PAR_MAX_FIELDS 8
+
+/** Maximum number of records to read. */
+#define PAR_MAX_RECORDS 4096
+
+/** Size of the output buffer for a record. */
+#define PAR_MAX_OUTPUT 64
+
+
+/** Processes a single record.
+ *
+ * This is called on a worker thread, so it must not call exit() or write to
+ * standard output, and anything it uses must be safe to use from several
+ * threads at once.
+ *
+ * @param argv The fields of the record.
+ * @param output (out) Buffer of PAR_MAX_OUTPUT chars to put a null-terminated
+ *          result string into. It contains an empty string initially.
+ * @return 0 on success, 1 on failure, in which case an error message must
+ *          have been printed on standard error.
+ */
+typedef int (*par_task_t)(char * argv[], char * output);
+
+
+/** Run a task for each record on standard input.
+ *
+ * Records with the wrong number of fields produce an error result, as do
+ * records whose lines are too long. Empty lines are skipped.
+ *
+ * @param num_fields Number of whitespace-separated fields per record.
+ * @param task The task to run for each record.
+ * @param max_threads Maximum number of worker threads to use.
+ * @return EXIT_SUCCESS if all records were processed successfully,
+ *          EXIT_FAILURE otherwise.
+ */
+int par_run(int num_fields, par_task_t task, int max_threads);
+
@@ -0,0 +1,555 @@
+/** Parsing of WireGuard keys and endpoints, vectorised where possible. */
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parse.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define PARSE_X86
+#include <immintrin.h>
+#endif
+
+
+// The longest endpoint is 255.255.255.255:65535
+#define PARSE_ENDPOINT_MAX 21
+
+
+
+/** Get the fastest implementation supported by this CPU. */
+parse_impl_t parse_best_impl(void) {
+#ifdef PARSE_X86
+    // SSE2 is part of x86-64, AVX2 is not
+    if (__builtin_cpu_supports("avx2"))
+        return PARSE_AVX2;
+    return PARSE_SSE2;
+#else
+    return PARSE_SCALAR;
+#endif
+}
+
+
+/** Get the name of an implementation. */
+const char * parse_impl_name(parse_impl_t impl) {
+    switch (impl) {
+        case PARSE_SCALAR: return "scalar";
+        case PARSE_SSE2: return "sse2";
+        case PARSE_AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+
+/** Decode a single base64 character.
+ *
+ * This runs in constant time, so as not to leak information about private
+ * keys through timing.
+ *
+ * @return The decoded value in [0, 63], or -1 if c is not a base64 character.
+ */
+static int parse_b64_decode_char(int c) {
+    int ret = -1;
+
+    ret += (((0x40 - c) & (c - 0x5b)) >> 8) & (c - 64);     // A-Z
+    ret += (((0x60 - c) & (c - 0x7b)) >> 8) & (c - 70);     // a-z
+    ret += (((0x2f - c) & (c - 0x3a)) >> 8) & (c + 5);      // 0-9
+    ret += (((0x2a - c) & (c - 0x2c)) >> 8) & 63;           // +
+    ret += (((0x2e - c) & (c - 0x30)) >> 8) & 64;           // /
+    return ret;
+}
+
+
+/** Decode a base64-encoded key, one character at a time. */
+static int parse_key_base64_scalar(uint8_t * key, const char * b64) {
+    int i, j, c, bad = 0;
+    uint32_t val;
+
+    // 10 groups of 4 characters make 30 bytes
+    for (i = 0; i < 10; ++i) {
+        val = 0;
+        for (j = 0; j < 4; ++j) {
+            c = parse_b64_decode_char(b64[i * 4 + j]);
+            bad |= c;   // negative if any character was invalid
+            val = (val << 6) | (c & 63);
+        }
+        key[i * 3 + 0] = (val >> 16) & 0xff;
+        key[i * 3 + 1] = (val >> 8) & 0xff;
+        key[i * 3 + 2] = val & 0xff;
+    }
+
+    // a last group of three characters and a = makes the final two bytes
+    val = 0;
+    for (j = 0; j < 3; ++j) {
+        c = parse_b64_decode_char(b64[40 + j]);
+        bad |= c;
+        val = (val << 6) | (c & 63);
+    }
+    key[30] = (val >> 10) & 0xff;
+    key[31] = (val >> 2) & 0xff;
+
+    // the two unused bits must be zero for the encoding to be canonical
+    bad |= -(int)(val & 3);
+    bad |= -(int)((unsigned char)b64[43] ^ '=');
+    val = 0;
+
+    if (bad < 0) {
+        explicit_bzero(key, 32);
+        return -1;
+    }
+    return 0;
+}
+
+
+/** Parse a port, a decimal number of one to five digits in [1, 65535].
+ *
+ * Returns 0 on success, 1 if the string is not such a number.
+ */
+static int parse_port_scalar(const char * str, int * port) {
+    int result = 0, i;
+
+    for (i = 0; str[i] != '\0'; ++i) {
+        if ((i == 5) || (str[i] < '0') || ('9' < str[i]))
+            return 1;
+        result = result * 10 + (str[i] - '0');
+    }
+
+    if ((i == 0) || (result < 1) || (65535 < result))
+        return 1;
+
+    *port = result;
+    return 0;
+}
+
+
+/** Parse an endpoint with inet_pton(). */
+static int parse_endpoint_scalar(
+        const char * endpoint, struct sockaddr_in * addr)
+{
+    char ip[16];
+    const char * colon = strchr(endpoint, ':');
+    int port;
+
+    if (!colon || (colon - endpoint) >= (ptrdiff_t)sizeof(ip))
+        return 1;
+
+    memcpy(ip, endpoint, colon - endpoint);
+    ip[colon - endpoint] = '\0';
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    if (inet_pton(AF_INET, ip, &addr->sin_addr) != 1)
+        return 1;
+
+    if (parse_port_scalar(colon + 1, &port))
+        return 1;
+    addr->sin_port = htons(port);
+
+    return 0;
+}
+
+
+#ifdef PARSE_X86
+
+/** Map 16 base64 characters to their values.
+ *
+ * Lanes of ok are cleared for characters that are not base64.
+ */
+static inline __m128i parse_b64_values_sse2(__m128i c, __m128i * ok) {
+    __m128i upper, lower, digit, plus, slash, offset;
+
+    upper = _mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+    lower = _mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+    digit = _mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+    slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+
+    *ok = _mm_and_si128(*ok, _mm_or_si128(
+            _mm_or_si128(upper, lower),
+            _mm_or_si128(digit, _mm_or_si128(plus, slash))));
+
+    offset = _mm_or_si128(
+            _mm_or_si128(
+                    _mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                    _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+            _mm_or_si128(
+                    _mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                    _mm_or_si128(
+                            _mm_and_si128(plus, _mm_set1_epi8(62 - '+')),
+                            _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+
+    return _mm_add_epi8(c, offset);
+}
+
+
+/** Load the last 16 characters of a key, with the final = decoded as 0.
+ *
+ * Whether it really was a = is checked separately.
+ */
+static inline __m128i parse_b64_load_tail(const char * b64) {
+    const __m128i last = _mm_set_epi8(
+            -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i c = _mm_loadu_si128((const __m128i *)(b64 + 28));
+
+    return _mm_or_si128(
+            _mm_andnot_si128(last, c),
+            _mm_and_si128(last, _mm_set1_epi8('A')));
+}
+
+
+/** Combine each group of four 6-bit values into a 24-bit value.
+ *
+ * The result has one group per 32-bit lane.
+ */
+static inline __m128i parse_b64_combine_sse2(__m128i v) {
+    // a, b, c, d -> (a << 6) | b, (c << 6) | d
+    v = _mm_or_si128(
+            _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 6),
+            _mm_srli_epi16(v, 8));
+    // -> (a << 18) | (b << 12) | (c << 6) | d
+    return _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+}
+
+
+/** Decode a base64-encoded key, 16 characters at a time.
+ *
+ * SSE2 can't shuffle bytes, so the groups are written out one by one.
+ */
+static int parse_key_base64_sse2(uint8_t * key, const char * b64) {
+    __m128i ok = _mm_set1_epi8(-1), v;
+    uint32_t groups[11], bad;
+    int i;
+
+    // groups 0-3, 4-7 and 7-10
+    v = parse_b64_values_sse2(
+            _mm_loadu_si128((const __m128i *)b64), &ok);
+    _mm_storeu_si128((__m128i *)groups, parse_b64_combine_sse2(v));
+    v = parse_b64_values_sse2(
+            _mm_loadu_si128((const __m128i *)(b64 + 16)), &ok);
+    _mm_storeu_si128((__m128i *)(groups + 4), parse_b64_combine_sse2(v));
+    v = parse_b64_values_sse2(parse_b64_load_tail(b64), &ok);
+    _mm_storeu_si128((__m128i *)(groups + 7), parse_b64_combine_sse2(v));
+
+    for (i = 0; i < 10; ++i) {
+        key[i * 3 + 0] = (groups[i] >> 16) & 0xff;
+        key[i * 3 + 1] = (groups[i] >> 8) & 0xff;
+        key[i * 3 + 2] = groups[i] & 0xff;
+    }
+    key[30] = (groups[10] >> 16) & 0xff;
+    key[31] = (groups[10] >> 8) & 0xff;
+
+    // as for the scalar version, the unused bits must be zero
+    bad = (_mm_movemask_epi8(ok) ^ 0xffff) | (groups[10] & 0xff);
+    bad |= (unsigned char)b64[43] ^ '=';
+    explicit_bzero(groups, sizeof(groups));
+
+    if (bad) {
+        explicit_bzero(key, 32);
+        return -1;
+    }
+    return 0;
+}
+
+
+/** Map 32 base64 characters to their values, see parse_b64_values_sse2(). */
+__attribute__((target("avx2")))
+static inline __m256i parse_b64_values_avx2(__m256i c, __m256i * ok) {
+    __m256i upper, lower, digit, plus, slash, offset;
+
+    upper = _mm256_and_si256(
+            _mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c));
+    lower = _mm256_and_si256(
+            _mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+    digit = _mm256_and_si256(
+            _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    plus = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('+'));
+    slash = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('/'));
+
+    *ok = _mm256_and_si256(*ok, _mm256_or_si256(
+            _mm256_or_si256(upper, lower),
+            _mm256_or_si256(digit, _mm256_or_si256(plus, slash))));
+
+    offset = _mm256_or_si256(
+            _mm256_or_si256(
+                    _mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                    _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+            _mm256_or_si256(
+                    _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+                    _mm256_or_si256(
+                            _mm256_and_si256(
+                                    plus, _mm256_set1_epi8(62 - '+')),
+                            _mm256_and_si256(
+                                    slash, _mm256_set1_epi8(63 - '/')))));
+
+    return _mm256_add_epi8(c, offset);
+}
+
+
+/** Decode a base64-encoded key, 32 characters at a time. */
+__attribute__((target("avx2")))
+static int parse_key_base64_avx2(uint8_t * key, const char * b64) {
+    // the three bytes of each 24-bit group, most significant first
+    const __m256i order = _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    __m256i ok = _mm256_set1_epi8(-1), v;
+    __m128i tail_ok = _mm_set1_epi8(-1), t;
+    uint8_t out[48];
+    uint32_t bad;
+
+    // groups 0-7
+    v = parse_b64_values_avx2(
+            _mm256_loadu_si256((const __m256i *)b64), &ok);
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, order);
+    _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *)(out + 12), _mm256_extracti128_si256(v, 1));
+
+    // groups 7-10
+    t = parse_b64_values_sse2(parse_b64_load_tail(b64), &tail_ok);
+    t = _mm_maddubs_epi16(t, _mm_set1_epi32(0x01400140));
+    t = _mm_madd_epi16(t, _mm_set1_epi32(0x00011000));
+    t = _mm_shuffle_epi8(t, _mm256_castsi256_si128(order));
+    _mm_storeu_si128((__m128i *)(out + 21), t);
+
+    memcpy(key, out, 32);
+
+    // as for the scalar version, the unused bits must be zero
+    bad = ~(uint32_t)_mm256_movemask_epi8(ok);
+    bad |= (_mm_movemask_epi8(tail_ok) ^ 0xffff) | out[32];
+    bad |= (unsigned char)b64[43] ^ '=';
+    explicit_bzero(out, sizeof(out));
+
+    if (bad) {
+        explicit_bzero(key, 32);
+        return -1;
+    }
+    return 0;
+}
+
+
+/** Copy an endpoint into 32 bytes padded with zeros, for loading at once.
+ *
+ * Reading the string itself past its end would be quicker, but sanitizers
+ * rightly flag that. At most one character more than the longest endpoint is
+ * copied, which is enough for a longer one to be rejected.
+ */
+static inline void parse_endpoint_copy(const char * endpoint, char copy[32]) {
+    memset(copy, 0, 32);
+    memcpy(copy, endpoint, strnlen(endpoint, PARSE_ENDPOINT_MAX + 1));
+}
+
+
+/** Get the value of the digits from start to end, eight at a time.
+ *
+ * The eight bytes before end are taken from the words of the endpoint, those
+ * before start are masked off, and the digits are combined in pairs, then
+ * fours, then eights. This has no branches, as the lengths of the numbers are
+ * unpredictable. At most eight digits are used.
+ *
+ * @param words The endpoint, after a word of zeros.
+ */
+static inline uint32_t parse_number(
+        const uint64_t words[5], int start, int end)
+{
+    uint64_t word;
+    int num_digits = end - start, shift = 8 * (end % 8);
+
+    num_digits = num_digits < 1 ? 1 : num_digits > 8 ? 8 : num_digits;
+
+    // whole words are read, as they were stored, so that the loads can be
+    // served from the store buffer
+    word = words[end / 8] >> shift;
+    word |= words[end / 8 + 1] << 1 << (63 - shift);
+    word &= UINT64_C(0x0f0f0f0f0f0f0f0f) << (8 * (8 - num_digits));
+
+    word = (word * 10 + (word >> 8)) & UINT64_C(0x00ff00ff00ff00ff);
+    word = (word * 100 + (word >> 16)) & UINT64_C(0x0000ffff0000ffff);
+    return (uint32_t)(word * 10000 + (word >> 32));
+}
+
+
+/** Parse an endpoint given bitmasks of where its digits, dots and colons are.
+ *
+ * @param words The endpoint, after a word of zeros.
+ * @return 0 on success, 1 if it is not a valid endpoint.
+ */
+static int parse_endpoint_fields(
+        const uint64_t words[5], uint32_t nuls, uint32_t digits,
+        uint32_t dots, uint32_t colons, struct sockaddr_in * addr)
+{
+    const char * chars = (const char *)(words + 1);
+    uint32_t all, seps, ip = 0, value, bad;
+    int ends[5], len, field, start, num_digits;
+
+    if (nuls == 0)
+        return 1;
+    len = __builtin_ctz(nuls);
+    if (len > PARSE_ENDPOINT_MAX)
+        return 1;
+
+    // only digits, three dots and then a colon, which is a higher bit
+    all = (UINT32_C(1) << len) - 1;
+    dots &= all;
+    colons &= all;
+    seps = dots & (dots - 1);
+    seps &= seps - 1;
+    bad = ((digits | dots | colons) & all) != all;
+    bad |= (seps == 0) | ((seps & (seps - 1)) != 0);
+    bad |= (colons == 0) | ((colons & (colons - 1)) != 0) | (dots > colons);
+    if (bad)
+        return 1;
+
+    // find all the numbers first, so that they can be parsed in parallel
+    seps = dots | colons;
+    for (field = 0; field < 4; ++field) {
+        ends[field] = __builtin_ctz(seps);
+        seps &= seps - 1;
+    }
+    ends[4] = len;
+
+    // four numbers of one to three digits, without leading zeros as for
+    // inet_pton()
+    for (field = 0; field < 4; ++field) {
+        start = field ? ends[field - 1] + 1 : 0;
+        num_digits = ends[field] - start;
+        value = parse_number(words, start, ends[field]);
+        bad |= (num_digits < 1) | (num_digits > 3) | (value > 255);
+        bad |= (chars[start] == '0') & (num_digits > 1);
+        ip = (ip << 8) | value;
+    }
+
+    // and one of one to five digits
+    num_digits = len - ends[3] - 1;
+    value = parse_number(words, ends[3] + 1, len);
+    bad |= (num_digits < 1) | (num_digits > 5) | (value < 1) | (65535 < value);
+
+    if (bad)
+        return 1;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(ip);
+    addr->sin_port = htons(value);
+    return 0;
+}
+
+
+/** Get a bitmask of the characters in [lo, hi] in 16 characters. */
+static inline uint32_t parse_range_sse2(__m128i c, char lo, char hi) {
+    return _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1))));
+}
+
+
+/** Get a bitmask of the occurrences of a character in 16 characters. */
+static inline uint32_t parse_find_sse2(__m128i c, char ch) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(ch)));
+}
+
+
+/** Parse an endpoint, classifying 16 characters at a time. */
+static int parse_endpoint_sse2(
+        const char * endpoint, struct sockaddr_in * addr)
+{
+    char src[32];
+    uint64_t words[5] = {0};
+    __m128i lo, hi;
+
+    parse_endpoint_copy(endpoint, src);
+    lo = _mm_loadu_si128((const __m128i *)src);
+    hi = _mm_loadu_si128((const __m128i *)(src + 16));
+    _mm_storeu_si128((__m128i *)(words + 1), lo);
+    _mm_storeu_si128((__m128i *)(words + 3), hi);
+
+    return parse_endpoint_fields(
+            words,
+            parse_find_sse2(lo, '\0') | (parse_find_sse2(hi, '\0') << 16),
+            parse_range_sse2(lo, '0', '9') |
+                    (parse_range_sse2(hi, '0', '9') << 16),
+            parse_find_sse2(lo, '.') | (parse_find_sse2(hi, '.') << 16),
+            parse_find_sse2(lo, ':') | (parse_find_sse2(hi, ':') << 16),
+            addr);
+}
+
+
+/** Get a bitmask of the occurrences of a character in 32 characters. */
+__attribute__((target("avx2")))
+static inline uint32_t parse_find_avx2(__m256i c, char ch) {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(ch)));
+}
+
+
+/** Parse an endpoint, classifying all of its characters at once. */
+__attribute__((target("avx2")))
+static int parse_endpoint_avx2(
+        const char * endpoint, struct sockaddr_in * addr)
+{
+    char src[32];
+    uint64_t words[5] = {0};
+    uint32_t digits;
+    __m256i c;
+
+    parse_endpoint_copy(endpoint, src);
+    c = _mm256_loadu_si256((const __m256i *)src);
+    _mm256_storeu_si256((__m256i *)(words + 1), c);
+
+    digits = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c)));
+
+    return parse_endpoint_fields(
+            words, parse_find_avx2(c, '\0'), digits,
+            parse_find_avx2(c, '.'), parse_find_avx2(c, ':'), addr);
+}
+
+#endif
+
+
+/** Decode a base64-encoded WireGuard key. */
+int parse_key_base64_impl(parse_impl_t impl, uint8_t * key, const char * b64) {
+    switch (impl) {
+#ifdef PARSE_X86
+        case PARSE_SSE2: return parse_key_base64_sse2(key, b64);
+        case PARSE_AVX2: return parse_key_base64_avx2(key, b64);
+#endif
+        default: return parse_key_base64_scalar(key, b64);
+    }
+}
+
+
+/** Parse an endpoint. */
+int parse_endpoint_impl(
+        parse_impl_t impl, const char * endpoint, struct sockaddr_in * addr)
+{
+    switch (impl) {
+#ifdef PARSE_X86
+        case PARSE_SSE2: return parse_endpoint_sse2(endpoint, addr);
+        case PARSE_AVX2: return parse_endpoint_avx2(endpoint, addr);
+#endif
+        default: return parse_endpoint_scalar(endpoint, addr);
+    }
+}
+
+
+/** Decode a base64-encoded key with the fastest implementation. */
+int parse_key_base64(uint8_t * key, const char * b64) {
+    return parse_key_base64_impl(parse_best_impl(), key, b64);
+}
+
+
+/** Parse an endpoint with the scalar implementation, the fastest one. */
+int parse_endpoint(const char * endpoint, struct sockaddr_in * addr) {
+    return parse_endpoint_scalar(endpoint, addr);
+}
+
@@ -0,0 +1,79 @@
+/** Parsing of WireGuard keys and endpoints, vectorised where possible.
+ *
+ * Keys and endpoints arrive in bulk with connect_many and apply, so decoding
+ * them is worth doing quickly. Each parser has a scalar implementation, which
+ * is the reference, and on x86-64 SSE2 and AVX2 implementations that classify
+ * all of the characters at once. All of them accept exactly the same inputs
+ * and give the same results, which `make microbench` checks, and time.
+ *
+ * Keys are decoded with the fastest implementation the CPU supports.
+ * Endpoints are parsed with the scalar one, which measures faster than the
+ * vector ones: these are too short for the setup to pay off. The vector
+ * endpoint parsers are kept only as benchmarks, so that a change to them or
+ * to the scalar one can be measured, and nothing else calls them.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+
+/** An implementation of the parsers. */
+typedef enum {
+    PARSE_SCALAR,
+    PARSE_SSE2,
+    PARSE_AVX2
+} parse_impl_t;
+
+
+/** Get the fastest implementation supported by this CPU. */
+parse_impl_t parse_best_impl(void);
+
+
+/** Get the name of an implementation, for benchmarks and diagnostics. */
+const char * parse_impl_name(parse_impl_t impl);
+
+
+/** Decode a base64-encoded WireGuard key.
+ *
+ * The input must be 44 characters long and end in =, with the two unused bits
+ * of the last character zero, so that each key has a single encoding. It need
+ * not be null-terminated. This runs in constant time, so as not to leak
+ * information about private keys through timing.
+ *
+ * @param impl The implementation to use, which the CPU must support.
+ * @param key (out) The 32-byte key, which is zeroed on failure.
+ * @param b64 The 44 characters to decode.
+ * @return 0 on success, -1 if the input is not a valid key.
+ */
+int parse_key_base64_impl(parse_impl_t impl, uint8_t * key, const char * b64);
+
+
+/** Parse an endpoint, an IPv4 address and port like 192.0.2.1:51820.
+ *
+ * The address must be a dotted quad as accepted by inet_pton(), and the port
+ * a decimal number of one to five digits in [1, 65535].
+ *
+ * @param impl The implementation to use, which the CPU must support.
+ * @param endpoint The null-terminated endpoint.
+ * @param addr (out) The socket address.
+ * @return 0 on success, 1 if it is not a valid endpoint.
+ */
+int parse_endpoint_impl(
+        parse_impl_t impl, const char * endpoint, struct sockaddr_in * addr);
+
+
+/** Decode a base64-encoded key with the fastest implementation.
+ *
+ * See parse_key_base64_impl().
+ */
+int parse_key_base64(uint8_t * key, const char * b64);
+
+
+/** Parse an endpoint with the scalar implementation, the fastest one.
+ *
+ * See parse_endpoint_impl().
+ */
+int parse_endpoint(const char * endpoint, struct sockaddr_in * addr);
+
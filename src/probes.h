@@ -0,0 +1,74 @@
+/** Static probes for tracing the helper with bpftrace, perf or SystemTap.
+ *
+ * If ENABLE_USDT_PROBES is set in config.h, the points below are marked with
+ * USDT probes from <sys/sdt.h>, which is part of SystemTap (the
+ * systemtap-sdt-dev or systemtap-sdt-devel package). A probe is a single nop
+ * instruction plus a note in the ELF file describing where its arguments are,
+ * so it costs nothing while no tracer is attached. Without ENABLE_USDT_PROBES,
+ * the macros compile to nothing at all.
+ *
+ * All probes belong to the provider net_admin_helper, and strings are null-
+ * terminated. Devices, steps and programs all belong to the thread that fires
+ * the probes, so probes can be matched up by thread id.
+ *
+ *     command_start(command)
+ *     command_done(command, exit_code)
+ *          A command as given on the command line or to serve mode.
+ *
+ *     task_start(device)
+ *     task_done(device, result)
+ *          Creating, connecting or removing one device. result is 0 on
+ *          success, 1 on failure.
+ *
+ *     step_start(device, step)
+ *     step_done(device, step, exit_code)
+ *          A step as traced with trace.h, with exit_code as described there.
+ *          device is "" outside of a task. Steps that run programs overlap,
+ *          but on any one thread each step name is in progress only once.
+ *
+ *     spawn_start(filename)
+ *     spawn_exec(filename, pid)
+ *     spawn_eof(pid, out_bytes)
+ *     spawn_done(pid, exit_code)
+ *          Starting a program, its execve() having succeeded, the end of its
+ *          output and having reaped it. exit_code is -signal if it was killed.
+ *          If it could not be started, spawn_start is followed by
+ *          spawn_failed(filename) instead.
+ *
+ *     caps_set(flag, cap, num_caps, value)
+ *          A capset() call that changes the thread's capabilities, with flag
+ *          a cap_flag_t, cap the first of num_caps capabilities changed, and
+ *          value 1 if they were raised and 0 if they were lowered.
+ *
+ *     setns_start(netns)
+ *     setns_done(netns, result)
+ *          Entering a network namespace, with netns as described in netns.h,
+ *          or "" when returning to our own. result is 0 on success and -1 on
+ *          failure.
+ *
+ * See bpftrace/ for examples.
+ */
+#pragma once
+
+#include "config.h"
+
+
+#ifdef ENABLE_USDT_PROBES
+
+#include <sys/sdt.h>
+
+#define PROBE1(NAME, A) DTRACE_PROBE1(net_admin_helper, NAME, A)
+#define PROBE2(NAME, A, B) DTRACE_PROBE2(net_admin_helper, NAME, A, B)
+#define PROBE3(NAME, A, B, C) DTRACE_PROBE3(net_admin_helper, NAME, A, B, C)
+#define PROBE4(NAME, A, B, C, D) \
+    DTRACE_PROBE4(net_admin_helper, NAME, A, B, C, D)
+
+#else
+
+// sizeof() does not evaluate the arguments, but they count as used
+#define PROBE1(NAME, A) ((void)sizeof(A))
+#define PROBE2(NAME, A, B) (PROBE1(NAME, A), (void)sizeof(B))
+#define PROBE3(NAME, A, B, C) (PROBE2(NAME, A, B), (void)sizeof(C))
+#define PROBE4(NAME, A, B, C, D) (PROBE3(NAME, A, B, C), (void)sizeof(D))
+
+#endif
@@ -0,0 +1,182 @@
+/** Functions for managing network devices via rtnetlink. */
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <string.h>
+
+#include <linux/if_addr.h>
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+
+#include "netlink.h"
+#include "rtnetlink.h"
+
+
+/** Create a network device. */
+void rtnl_link_add(
+        nl_batch_t * batch, const char * dev, const char * kind,
+        int netns_fd, const char * what)
+{
+    struct ifinfomsg ifi;
+    size_t linkinfo;
+
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+
+    nl_msg_begin(
+            batch, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL,
+            &ifi, sizeof(ifi), what);
+    nl_attr_put_str(batch, IFLA_IFNAME, dev);
+
+    linkinfo = nl_nest_begin(batch, IFLA_LINKINFO);
+    nl_attr_put_str(batch, IFLA_INFO_KIND, kind);
+    nl_nest_end(batch, linkinfo);
+
+    // Note that the device is created in the namespace of the socket and
+    // then moved, so that for WireGuard the UDP socket stays outside.
+    if (netns_fd >= 0)
+        nl_attr_put_u32(batch, IFLA_NET_NS_FD, netns_fd);
+}
+
+
+/** Remove a network device. */
+void rtnl_link_delete(nl_batch_t * batch, const char * dev, const char * what) {
+    struct ifinfomsg ifi;
+
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+
+    nl_msg_begin(batch, RTM_DELLINK, 0, &ifi, sizeof(ifi), what);
+    nl_attr_put_str(batch, IFLA_IFNAME, dev);
+}
+
+
+/** Bring up a network device. */
+void rtnl_link_set_up(nl_batch_t * batch, int ifindex, const char * what) {
+    struct ifinfomsg ifi;
+
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = ifindex;
+    ifi.ifi_flags = IFF_UP;
+    ifi.ifi_change = IFF_UP;
+
+    nl_msg_begin(batch, RTM_NEWLINK, 0, &ifi, sizeof(ifi), what);
+}
+
+
+/** Move a network device into another namespace, renaming it on the way. */
+void rtnl_link_move(
+        nl_batch_t * batch, int ifindex, int netns_fd, const char * new_name,
+        const char * what)
+{
+    struct ifinfomsg ifi;
+
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = ifindex;
+
+    nl_msg_begin(batch, RTM_NEWLINK, 0, &ifi, sizeof(ifi), what);
+    nl_attr_put_u32(batch, IFLA_NET_NS_FD, netns_fd);
+    nl_attr_put_str(batch, IFLA_IFNAME, new_name);
+}
+
+
+/** Add an IPv4 address to a network device. */
+void rtnl_addr_add(
+        nl_batch_t * batch, int ifindex, uint32_t addr, uint8_t prefixlen,
+        const char * what)
+{
+    struct ifaddrmsg ifa;
+    uint32_t addr_n = htonl(addr);
+
+    memset(&ifa, 0, sizeof(ifa));
+    ifa.ifa_family = AF_INET;
+    ifa.ifa_prefixlen = prefixlen;
+    ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+    ifa.ifa_index = ifindex;
+
+    nl_msg_begin(
+            batch, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL,
+            &ifa, sizeof(ifa), what);
+    nl_attr_put(batch, IFA_LOCAL, &addr_n, sizeof(addr_n));
+    nl_attr_put(batch, IFA_ADDRESS, &addr_n, sizeof(addr_n));
+}
+
+
+/** Add a route to a network via a network device. */
+void rtnl_route_add(
+        nl_batch_t * batch, int ifindex, uint32_t dst, uint8_t dst_len,
+        const char * what)
+{
+    struct rtmsg rtm;
+    uint32_t dst_n = htonl(dst);
+
+    memset(&rtm, 0, sizeof(rtm));
+    rtm.rtm_family = AF_INET;
+    rtm.rtm_dst_len = dst_len;
+    rtm.rtm_table = RT_TABLE_MAIN;
+    rtm.rtm_protocol = RTPROT_BOOT;
+    rtm.rtm_scope = RT_SCOPE_LINK;
+    rtm.rtm_type = RTN_UNICAST;
+
+    nl_msg_begin(
+            batch, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL,
+            &rtm, sizeof(rtm), what);
+    nl_attr_put(batch, RTA_DST, &dst_n, sizeof(dst_n));
+    nl_attr_put_u32(batch, RTA_OIF, ifindex);
+}
+
+
+/** Add a request for a list of all network devices in the namespace. */
+void rtnl_link_dump(nl_batch_t * batch, const char * what) {
+    struct ifinfomsg ifi;
+
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+
+    nl_msg_begin(batch, RTM_GETLINK, NLM_F_DUMP, &ifi, sizeof(ifi), what);
+}
+
+
+/** Get a null-terminated string attribute, or NULL if it isn't one. */
+static const char * rtnl_attr_str(const struct nlattr * attr) {
+    const char * str;
+    size_t len;
+
+    if (!attr)
+        return NULL;
+
+    str = nl_attr_data(attr);
+    len = nl_attr_len(attr);
+    if ((len == 0) || (str[len - 1] != '\0'))
+        return NULL;
+
+    return str;
+}
+
+
+/** Extract information about a device from an RTM_NEWLINK message. */
+int rtnl_link_parse(const struct nlmsghdr * nlh, rtnl_link_info_t * info) {
+    const struct nlattr * tb[IFLA_MAX + 1];
+    const struct nlattr * linkinfo[IFLA_INFO_MAX + 1];
+    const struct ifinfomsg * ifi;
+
+    if (
+            (nlh->nlmsg_type != RTM_NEWLINK) ||
+            (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi))))
+        return 1;
+
+    ifi = (const struct ifinfomsg *)NLMSG_DATA(nlh);
+    nl_msg_parse(nlh, sizeof(*ifi), tb, IFLA_MAX);
+
+    info->ifindex = ifi->ifi_index;
+    info->name = rtnl_attr_str(tb[IFLA_IFNAME]);
+    info->kind = NULL;
+
+    if (tb[IFLA_LINKINFO]) {
+        nl_nest_parse(tb[IFLA_LINKINFO], linkinfo, IFLA_INFO_MAX);
+        info->kind = rtnl_attr_str(linkinfo[IFLA_INFO_KIND]);
+    }
+
+    return 0;
+}
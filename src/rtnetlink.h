@@ -0,0 +1,120 @@
+/** Functions for managing network devices via rtnetlink.
+ *
+ * These add requests to a netlink batch (see netlink.h), which must then be
+ * sent on a NETLINK_ROUTE socket using nl_batch_send(). Requests refer to
+ * devices in the network namespace of the socket they are sent on.
+ *
+ * IP addresses are IPv4 addresses in host byte order.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "netlink.h"
+
+
+/** Create a network device.
+ *
+ * @param batch The batch to add the request to.
+ * @param dev Name of the device to create.
+ * @param kind Kind of device to create, e.g. "wireguard".
+ * @param netns_fd File descriptor of the network namespace to put the device
+ *          into, or -1 to leave it in the namespace of the socket.
+ * @param what Description to use in error messages.
+ */
+void rtnl_link_add(
+        nl_batch_t * batch, const char * dev, const char * kind,
+        int netns_fd, const char * what);
+
+
+/** Remove a network device.
+ *
+ * @param batch The batch to add the request to.
+ * @param dev Name of the device to remove.
+ * @param what Description to use in error messages.
+ */
+void rtnl_link_delete(nl_batch_t * batch, const char * dev, const char * what);
+
+
+/** Move a network device into another namespace, renaming it on the way.
+ *
+ * The kernel moves the device first and then renames it, so if the name is
+ * taken in the target namespace, the device ends up there under its old
+ * name. If two requests race for the same device, the second fails with
+ * ENODEV.
+ *
+ * @param batch The batch to add the request to.
+ * @param ifindex Index of the device to move.
+ * @param netns_fd File descriptor of the network namespace to move it to.
+ * @param new_name Name of the device in the target namespace.
+ * @param what Description to use in error messages.
+ */
+void rtnl_link_move(
+        nl_batch_t * batch, int ifindex, int netns_fd, const char * new_name,
+        const char * what);
+
+
+/** Bring up a network device.
+ *
+ * @param batch The batch to add the request to.
+ * @param ifindex Index of the device to bring up.
+ * @param what Description to use in error messages.
+ */
+void rtnl_link_set_up(nl_batch_t * batch, int ifindex, const char * what);
+
+
+/** Add an IPv4 address to a network device.
+ *
+ * @param batch The batch to add the request to.
+ * @param ifindex Index of the device to add the address to.
+ * @param addr The address to add.
+ * @param prefixlen Length of the network prefix, 32 for a single address.
+ * @param what Description to use in error messages.
+ */
+void rtnl_addr_add(
+        nl_batch_t * batch, int ifindex, uint32_t addr, uint8_t prefixlen,
+        const char * what);
+
+
+/** Add a route to a network via a network device.
+ *
+ * @param batch The batch to add the request to.
+ * @param ifindex Index of the device to route via.
+ * @param dst The destination network address.
+ * @param dst_len Length of the destination network prefix.
+ * @param what Description to use in error messages.
+ */
+void rtnl_route_add(
+        nl_batch_t * batch, int ifindex, uint32_t dst, uint8_t dst_len,
+        const char * what);
+
+
+/** Information about a network device, see rtnl_link_parse().
+ *
+ * The strings point into the message they were parsed from.
+ */
+typedef struct {
+    int ifindex;
+    const char * name;          // NULL if not given
+    const char * kind;          // NULL if not given, e.g. for loopback
+} rtnl_link_info_t;
+
+
+/** Add a request for a list of all network devices in the namespace.
+ *
+ * Send it with nl_batch_send_cb(), which passes an RTM_NEWLINK message for
+ * each device to the callback. Use rtnl_link_parse() to read them.
+ *
+ * @param batch The batch to add the request to.
+ * @param what Description to use in error messages.
+ */
+void rtnl_link_dump(nl_batch_t * batch, const char * what);
+
+
+/** Extract information about a device from an RTM_NEWLINK message.
+ *
+ * @param nlh The message to parse.
+ * @param info (out) The information found.
+ * @return 0 on success, 1 if the message is not a valid RTM_NEWLINK.
+ */
+int rtnl_link_parse(const struct nlmsghdr * nlh, rtnl_link_info_t * info);
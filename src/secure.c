@@ -0,0 +1,264 @@
+/** Locked memory for secrets and program output. */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/capability.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "capabilities.h"
+#include "secure.h"
+
+
+#define SECURE_NUM_BLOCKS (SECURE_ARENA_SIZE / SECURE_BLOCK_SIZE)
+
+// Added in Linux 4.14, older kernels fail with EINVAL
+#ifndef MADV_WIPEONFORK
+#define MADV_WIPEONFORK 18
+#endif
+
+
+// Start of the usable part of the arena, after the leading guard page
+static char * secure_arena = NULL;
+
+// One bit per block, set if the block is in use
+static uint64_t secure_used[SECURE_NUM_BLOCKS / 64];
+
+// For the first block of each allocation, its number of blocks, else 0
+static uint16_t secure_length[SECURE_NUM_BLOCKS];
+
+static pthread_mutex_t secure_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** Check whether a block is in use. */
+static int secure_is_used(size_t block) {
+    return (secure_used[block / 64] >> (block % 64)) & 1;
+}
+
+
+/** Mark a range of blocks as used (1) or free (0). */
+static void secure_mark(size_t first, size_t num_blocks, int used) {
+    size_t i;
+
+    for (i = first; i < first + num_blocks; ++i) {
+        if (used)
+            secure_used[i / 64] |= UINT64_C(1) << (i % 64);
+        else
+            secure_used[i / 64] &= ~(UINT64_C(1) << (i % 64));
+    }
+}
+
+
+/** Find the first run of free blocks of the given length.
+ *
+ * Returns the index of its first block, or SECURE_NUM_BLOCKS if there is none.
+ */
+static size_t secure_find(size_t num_blocks) {
+    size_t i = 0, run = 0;
+
+    while (i < SECURE_NUM_BLOCKS) {
+        if ((i % 64 == 0) && (secure_used[i / 64] == UINT64_MAX)) {
+            run = 0;
+            i += 64;
+        }
+        else if (secure_is_used(i)) {
+            run = 0;
+            ++i;
+        }
+        else {
+            ++i;
+            if (++run == num_blocks)
+                return i - num_blocks;
+        }
+    }
+    return SECURE_NUM_BLOCKS;
+}
+
+
+/** Get the number of blocks needed for an allocation, or 0 if too large. */
+static size_t secure_num_blocks(size_t size) {
+    if (size > SECURE_ARENA_SIZE)
+        return 0;
+    if (size == 0)
+        return 1;
+    return (size + SECURE_BLOCK_SIZE - 1) / SECURE_BLOCK_SIZE;
+}
+
+
+/** Get the index of the first block of an allocation. */
+static size_t secure_block_of(const void * ptr) {
+    return ((const char *)ptr - secure_arena) / SECURE_BLOCK_SIZE;
+}
+
+
+/** Wipe the whole arena, at exit. */
+static void secure_wipe(void) {
+    explicit_bzero(secure_arena, SECURE_ARENA_SIZE);
+}
+
+
+/** Lock the arena into memory.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int secure_lock_arena(void) {
+    int ret;
+
+    enable_cap(CAP_IPC_LOCK);
+    ret = mlock(secure_arena, SECURE_ARENA_SIZE);
+    disable_cap(CAP_IPC_LOCK);
+
+    if (ret != 0)
+        perror("Error locking secure memory");
+    return ret;
+}
+
+
+/** Set up the arena. */
+int secure_init(void) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    char * mem;
+
+    // the guard pages are left inaccessible
+    mem = mmap(
+            NULL, SECURE_ARENA_SIZE + 2 * page_size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("Error allocating secure memory");
+        goto exit_0;
+    }
+
+    if (mprotect(mem + page_size, SECURE_ARENA_SIZE, PROT_READ | PROT_WRITE)) {
+        perror("Error allocating secure memory");
+        goto exit_1;
+    }
+
+    if (madvise(mem + page_size, SECURE_ARENA_SIZE, MADV_DONTDUMP) != 0) {
+        perror("Error excluding secure memory from core dumps");
+        goto exit_1;
+    }
+
+    // forked processes get a zeroed arena, if the kernel supports it
+    if (
+            (madvise(mem + page_size, SECURE_ARENA_SIZE, MADV_WIPEONFORK) != 0)
+            && (errno != EINVAL))
+    {
+        perror("Error excluding secure memory from forks");
+        goto exit_1;
+    }
+
+    secure_arena = mem + page_size;
+    if (secure_lock_arena() != 0)
+        goto exit_1;
+
+    if (atexit(secure_wipe) != 0) {
+        fprintf(stderr, "Error registering secure memory cleanup\n");
+        goto exit_1;
+    }
+
+    return 0;
+
+exit_1:
+    secure_arena = NULL;
+    munmap(mem, SECURE_ARENA_SIZE + 2 * page_size);
+
+exit_0:
+    return -1;
+}
+
+
+/** Lock the arena into memory again in a forked child. */
+int secure_relock(void) {
+    // without MADV_WIPEONFORK, the parent's data is still there
+    secure_wipe();
+    memset(secure_used, 0, sizeof(secure_used));
+    memset(secure_length, 0, sizeof(secure_length));
+
+    return secure_lock_arena();
+}
+
+
+/** Allocate zeroed memory from the arena. */
+void * secure_alloc(size_t size) {
+    size_t num_blocks = secure_num_blocks(size), first;
+
+    pthread_mutex_lock(&secure_lock);
+    first = num_blocks ? secure_find(num_blocks) : SECURE_NUM_BLOCKS;
+    if (first < SECURE_NUM_BLOCKS) {
+        secure_mark(first, num_blocks, 1);
+        secure_length[first] = num_blocks;
+    }
+    pthread_mutex_unlock(&secure_lock);
+
+    if (first == SECURE_NUM_BLOCKS) {
+        fprintf(stderr, "Out of secure memory\n");
+        return NULL;
+    }
+
+    // freed memory is wiped already
+    return secure_arena + first * SECURE_BLOCK_SIZE;
+}
+
+
+/** Change the size of an allocation. */
+void * secure_realloc(void * ptr, size_t size) {
+    size_t num_blocks = secure_num_blocks(size), first, old_blocks, i;
+    char * new_ptr;
+
+    if (!ptr)
+        return secure_alloc(size);
+
+    first = secure_block_of(ptr);
+
+    pthread_mutex_lock(&secure_lock);
+    old_blocks = secure_length[first];
+
+    // shrink or grow in place if the blocks after it are free
+    for (i = old_blocks; i < num_blocks; ++i)
+        if ((first + i == SECURE_NUM_BLOCKS) || secure_is_used(first + i))
+            break;
+
+    if (num_blocks && (i >= num_blocks)) {
+        if (num_blocks < old_blocks) {
+            explicit_bzero(
+                    secure_arena + (first + num_blocks) * SECURE_BLOCK_SIZE,
+                    (old_blocks - num_blocks) * SECURE_BLOCK_SIZE);
+            secure_mark(first + num_blocks, old_blocks - num_blocks, 0);
+        }
+        else
+            secure_mark(first + old_blocks, num_blocks - old_blocks, 1);
+        secure_length[first] = num_blocks;
+        pthread_mutex_unlock(&secure_lock);
+        return ptr;
+    }
+    pthread_mutex_unlock(&secure_lock);
+
+    new_ptr = secure_alloc(size);
+    if (!new_ptr)
+        return NULL;
+
+    memcpy(new_ptr, ptr, old_blocks * SECURE_BLOCK_SIZE);
+    secure_free(ptr);
+    return new_ptr;
+}
+
+
+/** Wipe and free an allocation. */
+void secure_free(void * ptr) {
+    size_t first;
+
+    if (!ptr)
+        return;
+
+    first = secure_block_of(ptr);
+
+    pthread_mutex_lock(&secure_lock);
+    explicit_bzero(ptr, secure_length[first] * SECURE_BLOCK_SIZE);
+    secure_mark(first, secure_length[first], 0);
+    secure_length[first] = 0;
+    pthread_mutex_unlock(&secure_lock);
+}
+
@@ -0,0 +1,74 @@
+/** Locked memory for secrets and program output.
+ *
+ * Private keys, and anything that may contain them, like netlink messages
+ * setting or returning a key and the output of programs we run, are kept in
+ * a single arena of fixed size. The arena is locked into memory so that it is
+ * never written to swap, is excluded from core dumps, is not inherited by
+ * forked processes, and has inaccessible guard pages on either side to catch
+ * overruns. Memory is wiped when it is freed, and the whole arena is wiped
+ * once more when the process exits.
+ *
+ * Allocations are made in blocks of SECURE_BLOCK_SIZE bytes. The functions
+ * below may be called from any thread.
+ */
+#pragma once
+
+#include <stddef.h>
+
+
+/** Usable size of the arena in bytes. */
+#define SECURE_ARENA_SIZE (256 * 1024)
+
+/** Allocation granularity in bytes. */
+#define SECURE_BLOCK_SIZE 64
+
+
+/** Set up the arena.
+ *
+ * This must be called before any of the functions below, and before starting
+ * any threads.
+ *
+ * @return 0 on success, -1 on failure, in which case a message is printed.
+ */
+int secure_init(void);
+
+
+/** Lock the arena into memory again in a forked child.
+ *
+ * Memory locks are not inherited across fork(), and neither is the content of
+ * the arena, so the child starts out with an empty arena.
+ *
+ * @return 0 on success, -1 on failure, in which case a message is printed.
+ */
+int secure_relock(void);
+
+
+/** Allocate zeroed memory from the arena.
+ *
+ * @param size Number of bytes to allocate.
+ * @return The memory, or NULL if the arena is full, in which case a message is
+ *          printed.
+ */
+void * secure_alloc(size_t size);
+
+
+/** Change the size of an allocation.
+ *
+ * The allocation is grown in place if possible. Otherwise, the contents are
+ * moved to a new allocation and the old one is wiped, so no copies are left
+ * behind either way.
+ *
+ * @param ptr The allocation to resize, or NULL to allocate a new one.
+ * @param size The new size in bytes.
+ * @return The resized allocation, or NULL if the arena is full, in which case
+ *          ptr remains valid and a message is printed.
+ */
+void * secure_realloc(void * ptr, size_t size);
+
+
+/** Wipe and free an allocation.
+ *
+ * @param ptr The allocation to free, may be NULL.
+ */
+void secure_free(void * ptr);
+
@@ -0,0 +1,498 @@
+/** Running commands on request, received via a Unix socket.
+ *
+ * The server keeps a few spare worker processes around, each of which has
+ * already done the expensive setup work (locking memory, opening sockets,
+ * etc.) and is waiting for a connection. A worker handles a single request
+ * and then exits, so that anything a command does to its process (entering a
+ * namespace, calling exit(), etc.) does not affect other requests. The main
+ * process starts a new spare whenever a worker takes a connection, and limits
+ * the total number of workers.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "dispatch.h"
+#include "secure.h"
+#include "serve.h"
+#include "subprocess.h"
+
+
+#ifdef ENABLE_SERVE
+
+#define SERVE_MAX_REQUEST_SIZE 4096
+#define SERVE_MAX_ARGS 16
+
+// Time a client has to send its request after connecting, so that idle
+// connections cannot hold on to the workers
+#define SERVE_REQUEST_TIMEOUT_MS 1000
+
+
+// The lists may be empty, so we start them with a dummy
+static const long serve_allowed_uids[] = { -1, SERVE_ALLOWED_UIDS };
+static const long serve_allowed_gids[] = { -1, SERVE_ALLOWED_GIDS };
+
+static char serve_program_name[] = "net-admin-helper";
+
+// Connection to the client, for sending the exit code on exit
+static int serve_conn = -1;
+
+
+/** Create the listening socket.
+ *
+ * @param path Path of the socket to create.
+ * @return The socket's fd, or -1 on error.
+ */
+static int serve_listen(const char * path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        goto exit_0;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Error creating socket");
+        goto exit_0;
+    }
+
+    // remove a socket left behind by a previous run, but nothing else
+    if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "When binding to %s\n", path);
+        perror("Error binding socket");
+        goto exit_1;
+    }
+
+    // access is controlled using the peer credentials, see below
+    if (chmod(path, 0666) != 0) {
+        perror("Error setting socket permissions");
+        goto exit_1;
+    }
+
+    if (listen(fd, SOMAXCONN) != 0) {
+        perror("Error listening on socket");
+        goto exit_1;
+    }
+
+    return fd;
+
+exit_1:
+    close(fd);
+
+exit_0:
+    return -1;
+}
+
+
+/** Check whether the client is allowed to make requests.
+ *
+ * @param conn The connection to the client.
+ * @return 1 if the client is allowed, 0 if not.
+ */
+static int serve_peer_allowed(int conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    size_t i;
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        perror("Error getting peer credentials");
+        return 0;
+    }
+
+    for (i = 1; i < sizeof(serve_allowed_uids) / sizeof(long); ++i)
+        if (serve_allowed_uids[i] == (long)cred.uid)
+            return 1;
+
+    for (i = 1; i < sizeof(serve_allowed_gids) / sizeof(long); ++i)
+        if (serve_allowed_gids[i] == (long)cred.gid)
+            return 1;
+
+    fprintf(
+            stderr, "Rejected request from pid %d, uid %d, gid %d\n",
+            (int)cred.pid, (int)cred.uid, (int)cred.gid);
+    return 0;
+}
+
+
+/** Receive a request from the client.
+ *
+ * @param conn The connection to receive on.
+ * @param buf Buffer of SERVE_MAX_REQUEST_SIZE chars to receive into.
+ * @param args (out) Array of SERVE_MAX_ARGS + 1 pointers to set to the
+ *          received arguments, followed by NULL.
+ * @param num_args (out) The number of arguments received.
+ * @param fds (out) The received standard in, out and error fds.
+ * @return 0 on success, -1 on failure.
+ */
+static int serve_receive_request(
+        int conn, char * buf, char * args[], int * num_args, int fds[3])
+{
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr * cmsg;
+    struct timeval timeout;
+    ssize_t len, i;
+    int num_fds = 0, num_extra = 0, extra_fd, j, k;
+
+    timeout.tv_sec = SERVE_REQUEST_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (SERVE_REQUEST_TIMEOUT_MS % 1000) * 1000;
+    if (setsockopt(
+            conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0)
+    {
+        perror("Error setting request timeout");
+        return -1;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = SERVE_MAX_REQUEST_SIZE;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (len == -1 && errno == EINTR);
+
+    if ((len == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        fprintf(stderr, "Timed out waiting for request\n");
+        return -1;
+    }
+    if (len == -1) {
+        perror("Error receiving request");
+        return -1;
+    }
+
+    for (
+            cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (
+                (cmsg->cmsg_level != SOL_SOCKET) ||
+                (cmsg->cmsg_type != SCM_RIGHTS))
+            continue;
+
+        // Exactly three fds are taken, anything else we were sent is closed
+        // straight from the message, so it never touches fds.
+        if ((num_fds == 0) && (cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int))))
+        {
+            memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+            num_fds = 3;
+            continue;
+        }
+
+        k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (j = 0; j < k; ++j) {
+            memcpy(
+                    &extra_fd, CMSG_DATA(cmsg) + j * sizeof(int),
+                    sizeof(int));
+            close(extra_fd);
+        }
+        ++num_extra;
+    }
+
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        fprintf(stderr, "Received request is too large\n");
+        goto exit_fds;
+    }
+
+    if ((num_fds != 3) || (num_extra != 0)) {
+        fprintf(stderr, "Request did not contain in, out and err fds\n");
+        goto exit_fds;
+    }
+
+    if ((len == 0) || (buf[len - 1] != '\0')) {
+        fprintf(stderr, "Received invalid request\n");
+        goto exit_fds;
+    }
+
+    *num_args = 0;
+    args[0] = buf;
+    for (i = 0; i < len; ++i) {
+        if (buf[i] == '\0') {
+            if (*num_args == SERVE_MAX_ARGS) {
+                fprintf(stderr, "Received request has too many arguments\n");
+                goto exit_fds;
+            }
+            args[++*num_args] = buf + i + 1;
+        }
+    }
+    args[*num_args] = NULL;
+
+    return 0;
+
+exit_fds:
+    for (j = 0; j < num_fds; ++j)
+        close(fds[j]);
+    return -1;
+}
+
+
+/** Send the exit code to the client.
+ *
+ * This is registered with on_exit(), so that it also works for commands that
+ * call exit() themselves.
+ */
+static void serve_send_exit_code(int status, void * arg) {
+    unsigned char code = status & 0xff;
+    (void)arg;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    if (serve_conn != -1)
+        send(serve_conn, &code, 1, MSG_NOSIGNAL);
+}
+
+
+/** Handle a request.
+ *
+ * If the request is valid, this runs the requested command and exits. The
+ * exit code is sent to the client in either case, unless the client is not
+ * allowed to make requests.
+ *
+ * @param conn The connection to the client.
+ * @return EXIT_FAILURE if the request was invalid.
+ */
+static int serve_handle(int conn) {
+    char buf[SERVE_MAX_REQUEST_SIZE];
+    char * args[SERVE_MAX_ARGS + 2];
+    char ** argv = args;
+    int argc, fds[3], i, step_ms = -1, command_ms = -1, err;
+
+    if (!serve_peer_allowed(conn))
+        return EXIT_FAILURE;
+
+    serve_conn = conn;
+    if (on_exit(serve_send_exit_code, NULL) != 0)
+        return EXIT_FAILURE;
+
+    if (serve_receive_request(conn, buf, argv + 1, &argc, fds) != 0)
+        return EXIT_FAILURE;
+
+    // time limits for this request, given before the command
+    while ((argc >= 1) && !strncmp(argv[1], "--", 2)) {
+        err = dispatch_parse_limit(argv[1], &step_ms, &command_ms);
+        if (err < 0)
+            fprintf(stderr, "Unknown option %s\n", argv[1]);
+        if (err)
+            goto exit_fds;
+        --argc;
+        ++argv;
+    }
+
+    if (argc < 1) {
+        fprintf(stderr, "Request without a command\n");
+        goto exit_fds;
+    }
+
+    if (!strcmp(argv[1], "serve")) {
+        fprintf(stderr, "Refusing to start a server from a server\n");
+        goto exit_fds;
+    }
+
+    run_set_limits(step_ms, command_ms);
+
+    // connect the client's in, out and err
+    for (i = 0; i < 3; ++i) {
+        if (fds[i] != i) {
+            if (dup2(fds[i], i) == -1) {
+                perror("Error redirecting client input/output");
+                return EXIT_FAILURE;
+            }
+            close(fds[i]);
+        }
+    }
+
+    argv[0] = serve_program_name;
+    exit(dispatch(argc + 1, argv));
+
+exit_fds:
+    for (i = 0; i < 3; ++i)
+        close(fds[i]);
+    return EXIT_FAILURE;
+}
+
+
+/** Wait for a request and handle it.
+ *
+ * This runs in a newly forked worker process, and never returns.
+ *
+ * @param listen_fd The listening socket.
+ * @param notify_fd Pipe to tell the main process that we're busy.
+ */
+static void serve_worker(int listen_fd, int notify_fd) {
+    pid_t self = getpid();
+    int conn;
+
+    if (secure_relock())
+        exit(EXIT_FAILURE);
+
+    warm_up();
+
+    do {
+        conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (conn == -1 && errno == EINTR);
+
+    if (write(notify_fd, &self, sizeof(self)) != sizeof(self))
+        perror("Error notifying server");
+
+    close(notify_fd);
+    close(listen_fd);
+
+    if (conn == -1) {
+        perror("Error accepting connection");
+        exit(EXIT_FAILURE);
+    }
+
+    exit(serve_handle(conn));
+}
+
+
+int serve(int argc, char * argv[]) {
+    pid_t workers[SERVE_MAX_WORKERS];
+    char busy[SERVE_MAX_WORKERS];
+    int num_workers = 0, num_spare = 0;
+    int listen_fd, notify[2], sfd, i, status, timeout;
+    struct signalfd_siginfo siginfo;
+    struct pollfd pfds[2];
+    sigset_t sigchld;
+    pid_t pid;
+    (void)argv;
+
+    if (argc != 0) {
+        fprintf(stderr, "Incorrect number of command line arguments\n");
+        fprintf(stderr, "Usage: " SYNOPSIS_SERVE);
+        goto exit_0;
+    }
+
+    listen_fd = serve_listen(SERVE_SOCKET);
+    if (listen_fd == -1)
+        goto exit_0;
+
+    if (pipe2(notify, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("Error creating pipe");
+        goto exit_1;
+    }
+
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+
+    sfd = signalfd(-1, &sigchld, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sfd == -1) {
+        perror("Error creating signalfd");
+        goto exit_2;
+    }
+
+    for (i = 0; i < SERVE_MAX_WORKERS; ++i)
+        workers[i] = 0;
+
+    for (;;) {
+        // start spare workers, retrying in a second if that fails
+        timeout = -1;
+        while (
+                (num_spare < SERVE_SPARE_WORKERS) &&
+                (num_workers < SERVE_MAX_WORKERS))
+        {
+            pid = fork();
+            if (pid == 0) {
+                close(sfd);
+                close(notify[0]);
+                sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
+                serve_worker(listen_fd, notify[1]);
+            }
+
+            if (pid == -1) {
+                perror("Error starting worker");
+                timeout = 1000;
+                break;
+            }
+
+            for (i = 0; workers[i] != 0; ++i);
+            workers[i] = pid;
+            busy[i] = 0;
+            ++num_workers;
+            ++num_spare;
+        }
+
+        pfds[0].fd = notify[0];
+        pfds[0].events = POLLIN;
+        pfds[1].fd = sfd;
+        pfds[1].events = POLLIN;
+
+        if ((poll(pfds, 2, timeout) == -1) && (errno != EINTR)) {
+            perror("Error waiting for workers");
+            goto exit_3;
+        }
+
+        // Mark workers that took a connection as busy. This must be done
+        // before reaping, as they may have finished already.
+        while (read(notify[0], &pid, sizeof(pid)) == sizeof(pid)) {
+            for (i = 0; i < SERVE_MAX_WORKERS; ++i) {
+                if ((workers[i] == pid) && !busy[i]) {
+                    busy[i] = 1;
+                    --num_spare;
+                }
+            }
+        }
+
+        while (read(sfd, &siginfo, sizeof(siginfo)) == sizeof(siginfo));
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < SERVE_MAX_WORKERS; ++i) {
+                if (workers[i] == pid) {
+                    if (!busy[i])
+                        --num_spare;
+                    workers[i] = 0;
+                    --num_workers;
+                }
+            }
+        }
+    }
+
+exit_3:
+    close(sfd);
+
+exit_2:
+    close(notify[0]);
+    close(notify[1]);
+
+exit_1:
+    close(listen_fd);
+
+exit_0:
+    return EXIT_FAILURE;
+}
+
+#endif
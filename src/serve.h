@@ -0,0 +1,45 @@
+#pragma once
+
+#include "config.h"
+#include "dispatch.h"
+
+
+#ifdef ENABLE_SERVE
+
+#define SYNOPSIS_SERVE "serve\n"
+
+#define USAGE_SERVE \
+    "--------------------------------------------------------------------\n"\
+    "\n"                                                                    \
+    "NAME\n"                                                                \
+    "    serve - Run commands on request, received via a Unix socket.\n\n"  \
+    "SYNOPSIS\n"                                                            \
+    "    " SYNOPSIS_SERVE "\n"                                              \
+    "DESCRIPTION:\n"                                                        \
+    "    Listens on " SERVE_SOCKET " for requests from the\n"               \
+    "    configured users and groups. A request is a single message\n"      \
+    "    containing the command and its arguments, each terminated by\n"    \
+    "    a null character, with the client's standard input, output\n"      \
+    "    and error attached as SCM_RIGHTS file descriptors. The command\n"  \
+    "    may be preceded by --timeout and --step-timeout, which then\n"     \
+    "    apply instead of those given to serve. It is run as if given\n"    \
+    "    on the command line, with its input and output connected to\n"     \
+    "    those files. The reply is a single byte containing the exit\n"     \
+    "    code.\n\n"                                                         \
+    "OUTPUT:\n"                                                             \
+    "    Error messages about the server itself and rejected requests\n"    \
+    "    are printed on standard error.\n\n"                                \
+    "EXIT CODE:\n"                                                          \
+    "    1 on failure, does not exit otherwise.\n\n"
+
+#define DISPATCH_SERVE(CMD) DISPATCH(serve, CMD)
+
+int serve(int argc, char * argv[]);
+
+#else
+
+#define SYNOPSIS_SERVE ""
+#define USAGE_SERVE ""
+#define DISPATCH_SERVE(CMD)
+
+#endif
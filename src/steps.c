@@ -0,0 +1,275 @@
+/** Running the steps of a task, overlapping those that are independent. */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "secure.h"
+#include "steps.h"
+#include "subprocess.h"
+#include "trace.h"
+
+
+typedef enum {
+    STEP_PENDING,
+    STEP_READING,               // program running, reading its output
+    STEP_EXITING,               // output closed, waiting for it to exit
+    STEP_DONE,
+    STEP_FAILED
+} step_state_t;
+
+
+typedef struct {
+    const step_t * steps;
+    void * arg;
+    int epoll_fd;
+
+    run_t procs[STEPS_MAX];
+    step_state_t state[STEPS_MAX];
+    uint64_t start_ns[STEPS_MAX];
+
+    unsigned done;              // STEP_DEP()s of the finished steps
+    int num_running;
+    int failed;
+} steps_state_t;
+
+
+// Event data for a step's output pipe and pidfd
+#define STEPS_EV_OUT(index) ((uint64_t)(index) << 1)
+#define STEPS_EV_PID(index) (((uint64_t)(index) << 1) | 1)
+
+
+/** Record that a step has finished. */
+static void steps_end(steps_state_t * st, int i, int ret) {
+    if (ret == 0) {
+        st->state[i] = STEP_DONE;
+        st->done |= STEP_DEP(i);
+    }
+    else {
+        st->state[i] = STEP_FAILED;
+        st->failed = 1;
+    }
+}
+
+
+/** Wait for a step's program to exit, and check its result. */
+static void steps_finish(steps_state_t * st, int i) {
+    const step_t * step = &st->steps[i];
+    run_t * proc = &st->procs[i];
+    const char * out_buf = NULL;
+    ssize_t out_size = 0;
+    int exit_code = 255, ret;
+
+    if (run_finish(proc, &exit_code, &out_buf, &out_size) != 0) {
+        fprintf(stderr, "Error running %s\n", proc->filename);
+        ret = 1;
+    }
+    else if (step->finish)
+        ret = step->finish(st->arg, exit_code, out_buf, out_size);
+    else if (exit_code != 0) {
+        fprintf(stderr, "%s returned an error:\n", proc->filename);
+        print_error_output(out_buf, out_size);
+        if (step->error_msg)
+            fprintf(stderr, "%s\n", step->error_msg);
+        ret = 1;
+    }
+    else
+        ret = 0;
+
+    trace_record(st->steps[i].name, st->start_ns[i], exit_code, out_size);
+
+    secure_free((void*)out_buf);
+    --st->num_running;
+    steps_end(st, i, ret);
+}
+
+
+/** Add a file descriptor to the epoll set.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int steps_watch(steps_state_t * st, int fd, uint64_t data) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = data;
+    if (epoll_ctl(st->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("Error watching child process");
+        return -1;
+    }
+    return 0;
+}
+
+
+/** Start a step.
+ *
+ * If the step starts a program, its output is watched.
+ */
+static void steps_start(steps_state_t * st, int i) {
+    int ret;
+
+    // Steps that do their work here are traced like any other code, so
+    // that kernel requests are noted.
+    st->start_ns[i] = trace_now_ns();
+    trace_begin(st->steps[i].name);
+    ret = st->steps[i].start(st->arg, &st->procs[i]);
+
+    if (ret != STEP_RUNNING) {
+        trace_end(ret);
+        steps_end(st, i, ret);
+        return;
+    }
+
+    trace_discard();
+
+    st->state[i] = STEP_READING;
+    ++st->num_running;
+
+    // if we can't watch it, we'll just wait for it
+    if (steps_watch(st, st->procs[i].out_fd, STEPS_EV_OUT(i)))
+        steps_finish(st, i);
+}
+
+
+/** Handle an event for a running step. */
+static void steps_handle(steps_state_t * st, uint64_t data) {
+    int i = (int)(data >> 1);
+    run_t * proc = &st->procs[i];
+    step_state_t expected = (data & 1) ? STEP_EXITING : STEP_READING;
+
+    // A program started by another step inherits our pipes until its execve()
+    // closes them, which may happen after we've been resumed and closed ours.
+    // Until then, a closed pipe stays in the epoll set and keeps reporting end
+    // of file, so ignore events for steps that are past that stage.
+    if (st->state[i] != expected)
+        return;
+
+    if ((data & 1) == 0) {
+        if (run_read(proc) == 0)
+            return;
+
+        // At end of file, the pipe was closed, which also removed it from
+        // the epoll set. On error, run_finish() will deal with it.
+        if (proc->out_fd != -1)
+            epoll_ctl(st->epoll_fd, EPOLL_CTL_DEL, proc->out_fd, NULL);
+
+        if (
+                (proc->pidfd != -1) &&
+                !steps_watch(st, proc->pidfd, STEPS_EV_PID(i)))
+        {
+            st->state[i] = STEP_EXITING;
+            return;
+        }
+    }
+
+    steps_finish(st, i);
+}
+
+
+/** Get the timeout for waiting for the running steps.
+ *
+ * Returns the time in ms until the first deadline, or -1 if there is none.
+ */
+static int steps_timeout(steps_state_t * st, int num_steps) {
+    int timeout = -1, t, i;
+
+    for (i = 0; i < num_steps; ++i) {
+        if ((st->state[i] != STEP_READING) && (st->state[i] != STEP_EXITING))
+            continue;
+
+        t = run_timeout(&st->procs[i]);
+        if ((t != -1) && ((timeout == -1) || (t < timeout)))
+            timeout = t;
+    }
+    return timeout;
+}
+
+
+/** Stop the programs of running steps that have taken too long.
+ *
+ * Steps whose programs we've stopped waiting for are finished, and fail.
+ */
+static void steps_expire(steps_state_t * st, int num_steps) {
+    int i;
+
+    for (i = 0; i < num_steps; ++i)
+        if (
+                ((st->state[i] == STEP_READING) ||
+                 (st->state[i] == STEP_EXITING)) &&
+                run_expire(&st->procs[i]))
+            steps_finish(st, i);
+}
+
+
+/** Run the steps of a task. */
+int steps_run(const step_t steps[], int num_steps, void * arg) {
+    struct epoll_event events[STEPS_MAX];
+    steps_state_t st;
+    int next = 0, num_events, i;
+
+    st.steps = steps;
+    st.arg = arg;
+    st.done = 0;
+    st.num_running = 0;
+    st.failed = 0;
+
+    for (i = 0; i < num_steps; ++i)
+        st.state[i] = STEP_PENDING;
+
+    st.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (st.epoll_fd == -1) {
+        perror("Error creating epoll instance");
+        return 1;
+    }
+
+    for (;;) {
+        // start steps in order, as far as their dependencies allow
+        while (
+                !st.failed && (next < num_steps) &&
+                !(steps[next].deps & ~st.done))
+            steps_start(&st, next++);
+
+        if (st.num_running == 0)
+            break;
+
+        num_events = epoll_wait(
+                st.epoll_fd, events, STEPS_MAX,
+                steps_timeout(&st, num_steps));
+        if (num_events == -1) {
+            if (errno == EINTR)
+                continue;
+
+            // we can still wait for them one by one
+            perror("Error waiting for child processes");
+            st.failed = 1;
+            for (i = 0; i < num_steps; ++i)
+                if (
+                        (st.state[i] == STEP_READING) ||
+                        (st.state[i] == STEP_EXITING))
+                    steps_finish(&st, i);
+            break;
+        }
+
+        if (num_events == 0) {
+            steps_expire(&st, num_steps);
+            continue;
+        }
+
+        for (i = 0; i < num_events; ++i)
+            steps_handle(&st, events[i].data.u64);
+    }
+
+    close(st.epoll_fd);
+
+    if (!st.failed)
+        return 0;
+
+    for (i = num_steps - 1; i >= 0; --i)
+        if ((st.state[i] == STEP_DONE) && steps[i].undo)
+            steps[i].undo(arg);
+
+    return 1;
+}
+
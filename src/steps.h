@@ -0,0 +1,81 @@
+/** Running the steps of a task, overlapping those that are independent.
+ *
+ * A task is described as a list of steps, each of which may depend on some of
+ * the steps before it. Steps are started in order as soon as the steps they
+ * depend on have finished, so a step never starts before the steps listed
+ * above it. This matters for steps that change the namespace of the calling
+ * thread, as programs started before it keep running where they were started.
+ *
+ * A step either does its work directly, or starts a program with run_start()
+ * and returns STEP_RUNNING. Programs run concurrently, and their output is
+ * collected using epoll while waiting, so the time a task takes is that of its
+ * longest chain of dependent steps, rather than the sum of all of them.
+ *
+ * If a step fails, no further steps are started. Once the running programs
+ * have finished, the steps that completed successfully are undone, in reverse
+ * order. A program that takes longer than its time limit is stopped as
+ * described for run_expire(), and its step fails.
+ */
+#pragma once
+
+#include <sys/types.h>
+
+#include "subprocess.h"
+
+
+/** Maximum number of steps in a task. */
+#define STEPS_MAX 16
+
+/** Returned by a step's start function if it started a program. */
+#define STEP_RUNNING 2
+
+
+/** Bit for a step in step_t::deps. */
+#define STEP_DEP(index) (1u << (index))
+
+
+typedef struct {
+    /** Name of the step, for tracing. */
+    const char * name;
+
+    /** STEP_DEP()s of the steps that must have finished before this one. */
+    unsigned deps;
+
+    /** Start the step.
+     *
+     * @param arg The argument passed to steps_run().
+     * @param proc (out) The program, if one was started with run_start().
+     * @return 0 if the step was done successfully, 1 if it failed, in which
+     *          case an error message was printed, or STEP_RUNNING.
+     */
+    int (*start)(void * arg, run_t * proc);
+
+    /** Check the result of a program started by the step.
+     *
+     * May be NULL, in which case the step fails if the exit code is not zero,
+     * and the program's output is printed together with error_msg.
+     *
+     * @return 0 on success, 1 on failure, in which case an error message was
+     *          printed.
+     */
+    int (*finish)(
+            void * arg, int exit_code, const char * out_buf,
+            ssize_t out_size);
+
+    /** Message to print if the program fails, if finish is NULL. */
+    const char * error_msg;
+
+    /** Undo the step after a later one failed. May be NULL. */
+    void (*undo)(void * arg);
+} step_t;
+
+
+/** Run the steps of a task.
+ *
+ * @param steps The steps to run.
+ * @param num_steps The number of steps, at most STEPS_MAX.
+ * @param arg Argument to pass to the steps' functions.
+ * @return 0 if all steps succeeded, 1 otherwise.
+ */
+int steps_run(const step_t steps[], int num_steps, void * arg);
+
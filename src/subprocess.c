@@ -1,18 +1,47 @@
 /** Functions for starting a subprocess and communicating with it. */
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "config.h"
+
 #include "capabilities.h"
+#include "metrics.h"
+#include "probes.h"
+#include "secure.h"
 #include "subprocess.h"
+#include "trace.h"
 
 
 #define MAX_ERROR_OUTPUT_SIZE 1000
 
+// Stack size for the child, which only needs to make a few system calls
+#define CHILD_STACK_SIZE 16384
+
+// Added in Linux 5.2, older kernels ignore it
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+
+
+// Stages of stopping a program, see run_expire()
+#define RUN_STOP_NONE 0
+#define RUN_STOP_TERM 1
+#define RUN_STOP_KILL 2
+#define RUN_STOP_ABANDONED 3
+
+#define MS_NS UINT64_C(1000000)
+
 
 typedef struct {
     int parent_out, child_in;
@@ -20,7 +49,138 @@ typedef struct {
 } io_pipes_t;
 
 
+// Time limits in ns, 0 for none. These are set before any threads are
+// started, and only read afterwards.
+static uint64_t run_step_limit_ns = (uint64_t)TIMEOUT_STEP_MS * MS_NS;
+static uint64_t run_command_limit_ns = (uint64_t)TIMEOUT_COMMAND_MS * MS_NS;
+static uint64_t run_command_deadline_ns = 0;
+
+// Set by any thread that stops a program
+static atomic_int run_any_timed_out = 0;
+
+
+/** Get the current time for deadlines. */
+static uint64_t run_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
+/** Override the time limits set in config.h. */
+void run_set_limits(int step_ms, int command_ms) {
+    if (step_ms >= 0)
+        run_step_limit_ns = (uint64_t)step_ms * MS_NS;
+    if (command_ms >= 0)
+        run_command_limit_ns = (uint64_t)command_ms * MS_NS;
+}
+
+
+/** Start the clock for a command. */
+void run_begin_command(void) {
+    if (run_command_limit_ns)
+        run_command_deadline_ns = run_now_ns() + run_command_limit_ns;
+    else
+        run_command_deadline_ns = 0;
+
+    atomic_store(&run_any_timed_out, 0);
+}
+
+
+/** Check whether a program timed out. */
+int run_timed_out(void) {
+    return atomic_load(&run_any_timed_out);
+}
+
+
+/** Get the deadline for a program started now.
+ *
+ * Returns the deadline, or 0 if there is none.
+ */
+static uint64_t run_deadline(void) {
+    uint64_t now = run_now_ns(), deadline = 0;
+
+    if (run_step_limit_ns)
+        deadline = now + run_step_limit_ns;
+
+    // once the command's time is up, rollback gets the step limit only
+    if (run_command_deadline_ns > now)
+        if (!deadline || (run_command_deadline_ns < deadline))
+            deadline = run_command_deadline_ns;
+
+    return deadline;
+}
+
+
+/** Get the time until run_expire() needs to be called. */
+int run_timeout(const run_t * proc) {
+    uint64_t now, left_ms;
+
+    if (proc->deadline_ns == 0)
+        return -1;
+
+    now = run_now_ns();
+    if (now >= proc->deadline_ns)
+        return 0;
+
+    left_ms = (proc->deadline_ns - now + MS_NS - 1) / MS_NS;
+    return left_ms > INT32_MAX ? INT32_MAX : (int)left_ms;
+}
+
+
+/** Stop a program that has taken too long. */
+int run_expire(run_t * proc) {
+    const uint64_t grace_ns = (uint64_t)TIMEOUT_KILL_GRACE_MS * MS_NS;
+    uint64_t now = run_now_ns();
+    siginfo_t info;
+
+    if ((proc->deadline_ns == 0) || (now < proc->deadline_ns))
+        return proc->stop_stage == RUN_STOP_ABANDONED;
+
+    switch (proc->stop_stage) {
+        case RUN_STOP_NONE:
+            fprintf(stderr, "%s timed out, stopping it\n", proc->filename);
+            atomic_store(&run_any_timed_out, 1);
+            metrics_count(METRICS_TIMEOUTS);
+            if (grace_ns) {
+                // the pid is ours until we wait for it, so this is safe
+                kill(proc->pid, SIGTERM);
+                proc->stop_stage = RUN_STOP_TERM;
+                break;
+            }
+            // fall through
+        case RUN_STOP_TERM:
+            kill(proc->pid, SIGKILL);
+            metrics_count(METRICS_KILLS);
+            proc->stop_stage = RUN_STOP_KILL;
+            if (grace_ns)
+                break;
+
+            // without a grace period, wait for it instead of giving up on it
+            while ((waitid(P_PID, proc->pid, &info, WEXITED | WNOWAIT) == -1)
+                    && (errno == EINTR))
+                ;
+            proc->deadline_ns = 0;
+            return 0;
+        case RUN_STOP_KILL:
+            fprintf(
+                    stderr, "%s did not exit when killed, no longer waiting "
+                    "for it\n", proc->filename);
+            proc->stop_stage = RUN_STOP_ABANDONED;
+            metrics_count(METRICS_ABANDONED);
+            break;
+    }
+
+    proc->deadline_ns = now + grace_ns;
+    return proc->stop_stage == RUN_STOP_ABANDONED;
+}
+
+
 /** Create pipes for communicating with an external subprocess.
+ *
+ * The pipes are close-on-exec, so that they will not leak into any other
+ * child processes.
  *
  * @param pipes An io_pipes_t object that will be initialised to contain two
  *      pipes. Must be allocated, will be overwritten.
@@ -29,14 +189,14 @@ typedef struct {
 static int create_pipes(io_pipes_t * pipes) {
     int fds[2];
 
-    if (pipe(fds) != 0) {
+    if (pipe2(fds, O_CLOEXEC) != 0) {
         perror("Allocating first pipe");
         goto exit_0;
     }
     pipes->parent_out = fds[1];
     pipes->child_in = fds[0];
 
-    if (pipe(fds) != 0) {
+    if (pipe2(fds, O_CLOEXEC) != 0) {
         perror("Allocating second pipe");
         goto exit_1;
     }
@@ -57,53 +217,23 @@ exit_0:
 /** Set up pipes on the child process side.
  *
  * Reconfigures standard in, out and error to use the given pipes to
- * communicate, and closes the unused fds as appropriate.
+ * communicate. The original pipe fds are close-on-exec, so they don't need to
+ * be closed here.
  *
  * @param pipes Pipes to use to communicate with the parent.
- * @return 0 on success, -1 on error.
+ * @return 0 on success, -1 on error, in which case errno is set.
  */
 static int setup_pipes_for_child(io_pipes_t const * pipes) {
-    int ret = 0;
-
-    if (dup2(pipes->child_in, STDIN_FILENO) < 0) {
-        perror("Redirecting stdin");
-        goto exit_0;
-    }
-
-    if (dup2(pipes->child_out, STDOUT_FILENO) < 0) {
-        perror("Redirecting stdout");
-        goto exit_0;
-    }
-
-    if (dup2(pipes->child_out, STDERR_FILENO) < 0) {
-        perror("Redirecting stderr");
-        goto exit_0;
-    }
-
-    if (close(pipes->parent_out) != 0) {
-        perror("Closing pipe in child");
-        ret = -1;
-    }
-
-    if (close(pipes->child_in) != 0) {
-        perror("Closing pipe in child");
-        ret = -1;
-    }
-
-    if (close(pipes->child_out) != 0) {
-        perror("Closing pipe in child");
-        ret = -1;
-    }
+    if (dup2(pipes->child_in, STDIN_FILENO) < 0)
+        return -1;
 
-    if (close(pipes->parent_in) != 0) {
-        perror("Closing pipe in child");
-        ret = -1;
-    }
+    if (dup2(pipes->child_out, STDOUT_FILENO) < 0)
+        return -1;
 
-    return ret;
+    if (dup2(pipes->child_out, STDERR_FILENO) < 0)
+        return -1;
 
-exit_0:
-    return -1;
+    return 0;
 }
 
 
@@ -150,166 +280,342 @@ static int write_all(int fd, char const * data, ssize_t len) {
 }
 
 
-/** Read data from a file descriptor until it closes.
+/** Read the data that is available from the program's output.
+ *
+ * This makes a single read() call, so it blocks only if no data is available
+ * yet.
  *
- * @param fd The file descriptor to read from
- * @param buffer (out) The buffer the data has been written to. This must be
- *          freed by the caller using free(). Will be unchanged in case of
- *          error.
- * @param size The number of chars of data in the buffer. Will be unchanged in
- *          case of error
- * @return 0 on success, -1 on failure.
+ * @param proc The program to read from.
+ * @return 0 if there may be more data, 1 at end of file, in which case the
+ *          pipe has been closed, or -1 on error.
  */
-static int read_all(int fd, const char ** buffer, ssize_t * size) {
-    // Note: chunk_size must be larger than the size of any sensitive output
-    // the called program may print on standard out/error, to avoid realloc()
-    // spraying partial copies of it all over RAM. Currently, we only have
-    // Wireguard private keys, which are 44 bytes, so 1k is fine.
-    const ssize_t chunk_size = 1024;
-    ssize_t num_read, total_read = 0;
-    char *buf = NULL;
-    ssize_t buf_size = 0;
+int run_read(run_t * proc) {
+    // The output may contain secrets, so it goes into the secure arena,
+    // which wipes the old buffer if it has to move it when growing.
+    const ssize_t initial_size = 1024;
+    ssize_t new_size;
+    char * buf;
+    ssize_t num_read;
+
+    if (proc->out_fd == -1)
+        return 1;
+
+    if (proc->buf_size == proc->out_size) {
+        new_size = proc->buf_size ? 2 * proc->buf_size : initial_size;
+        buf = (char*)secure_realloc(proc->out_buf, new_size);
+        if (buf == NULL) {
+            fprintf(stderr, "When reading external program stdout/err\n");
+            return -1;
+        }
+        proc->out_buf = buf;
+        proc->buf_size = new_size;
+    }
 
     do {
-        if (buf_size == total_read) {
-            buf = (char*)realloc(buf, buf_size + chunk_size);
-            if (buf == NULL) {
-                perror("When reading external program stdout/err");
-                goto exit_0;
-            }
-            buf_size += chunk_size;
-        }
+        num_read = read(
+                proc->out_fd, proc->out_buf + proc->out_size,
+                proc->buf_size - proc->out_size);
+    } while ((num_read < 0) && (errno == EINTR));
 
-        num_read = read(fd, buf + total_read, buf_size - total_read);
-        if (num_read < 0) {
-            perror("Reading from external program stdout/err");
-            goto exit_0;
-        }
-        total_read += num_read;
-    } while (num_read > 0);
+    if (num_read < 0) {
+        perror("Reading from external program stdout/err");
+        return -1;
+    }
+
+    if (num_read == 0) {
+        close(proc->out_fd);
+        proc->out_fd = -1;
+        PROBE2(spawn_eof, (int)proc->pid, proc->out_size);
+        return 1;
+    }
 
-    *buffer = buf;
-    *size = total_read;
+    proc->out_size += num_read;
     return 0;
+}
 
-exit_0:
-    free(buf);
-    return -1;
+
+/** Wait for output from a program and receive it, within its time limit. */
+int run_read_timed(run_t * proc) {
+    struct pollfd pfd;
+    int err;
+
+    pfd.fd = proc->out_fd;
+    pfd.events = POLLIN;
+    while ((proc->out_fd != -1) && (proc->stop_stage != RUN_STOP_ABANDONED)) {
+        err = poll(&pfd, 1, run_timeout(proc));
+        if (err == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Waiting for output from child process");
+            return -1;
+        }
+
+        if (err == 1)
+            return run_read(proc);
+
+        run_expire(proc);
+    }
+    return 1;
 }
 
 
-/** Run a command and optionally communicate with it.
+/** Arguments for the child process, and errors passed back from it. */
+typedef struct {
+    const char * filename;
+    const char * const * argv;
+    const char * const * env;
+    io_pipes_t const * pipes;
+    const char * error_what;
+    int error;
+} child_args_t;
+
+
+/** Set up the child process and execute the command.
  *
- * Warning: if you may get more than 1kB of sensitive data on standard out
- * and/or standard error, see the comment at read_all().
+ * The child is started with CLONE_VM | CLONE_VFORK, which avoids copying our
+ * memory only to throw it away again on execve(). This means that it runs in
+ * our memory on a separate stack, while we are suspended until it has called
+ * execve() or exited. So it must not call anything that may allocate
+ * memory or take a lock, like malloc() or stdio. Errors are passed back via
+ * the arguments instead. The capabilities to pass on to the program are
+ * inherited from us, see prepare_ambient_capabilities().
  *
- * @param filename The file to execute.
- * @param argv Arguments to pass (may be NULL).
- * @param env Environment variables to set (may be NULL).
- * @param in_buf Data to send to stdin (may be NULL).
- * @param in_size Length of input data.
- * @param exit_code (out) The exit code of the process run, 255 if there was an
- *              error starting it, or -signal if it was terminated with a
- *              signal.
- * @param out_buf (out) Pointer to a buffer with output received from the
- *              command. This buffer will be allocated by this function, and
- *              must be freed using free() by the caller after use.
- * @param out_size (out) Pointer to a variable to store the number of chars in
- *              the output buffer in.
- * @return 0 on success, -1 on error.
+ * @param arg A child_args_t describing the command to run.
+ * @return Does not return on success, exits with code 255 on error.
  */
-int run(
-        const char * filename, const char * const argv[],
-        const char * const env[],
-        const char * in_buf, ssize_t in_size,
-        int * exit_code, const char ** out_buf, ssize_t * out_size)
+static int child_main(void * arg) {
+    child_args_t * args = (child_args_t *)arg;
+
+    if (setup_pipes_for_child(args->pipes) != 0) {
+        args->error_what = "Redirecting stdin/stdout/stderr";
+        goto exit_0;
+    }
+
+    // execve() is mistyped for backward compatibility,
+    // so need to const-cast here.
+    execve(args->filename, (char * const *)args->argv,
+            (char * const *)args->env);
+    args->error_what = "Executing command";
+
+exit_0:
+    args->error = errno;
+    _exit(255);
+}
+
+
+/** Start a program. */
+int run_start(
+        run_t * proc, const char * filename, const char * const argv[],
+        const char * const env[], const char * in_buf, ssize_t in_size)
 {
+    _Alignas(16) char child_stack[CHILD_STACK_SIZE];
+    const char * const none[] = { NULL };
+    child_args_t child_args;
     io_pipes_t pipes;
-    int child_pid;
+    int status;
 
-    const char *none = NULL;
+    proc->filename = filename;
+    proc->pid = -1;
+    proc->pidfd = -1;
+    proc->out_fd = -1;
+    proc->out_buf = NULL;
+    proc->out_size = 0;
+    proc->buf_size = 0;
+    proc->deadline_ns = run_deadline();
+    proc->stop_stage = RUN_STOP_NONE;
 
-    const char * out_buf_ = NULL;
-    ssize_t out_size_ = 0;
+    PROBE1(spawn_start, filename);
 
-    int status;
-    int ret = 0;
+    if (prepare_ambient_capabilities() != 0)
+        goto exit_failed;
 
     if (create_pipes(&pipes) != 0)
-        return -1;
+        goto exit_failed;
+
+    child_args.filename = filename;
+    child_args.argv = argv ? argv : none;
+    child_args.env = env ? env : none;
+    child_args.pipes = &pipes;
+    child_args.error_what = NULL;
+    child_args.error = 0;
+
+    // The stack grows down on all architectures we support. Kernels that
+    // don't know CLONE_PIDFD ignore it, and leave pidfd at -1.
+    proc->pid = clone(
+            child_main, child_stack + CHILD_STACK_SIZE,
+            CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &child_args,
+            &proc->pidfd);
+
+    if (proc->pid <= 0) {
+        perror("Starting child process");
+        goto exit_pipes;
+    }
 
-    child_pid = fork();
+    if (setup_pipes_for_parent(&pipes) != 0)
+        goto exit_child;
 
-    if (child_pid == 0) {
-        // child
-        if (setup_pipes_for_child(&pipes) != 0)
-            exit(255);
+    // the child has exec'd or exited by now, check for the latter
+    if (child_args.error_what) {
+        fprintf(
+                stderr, "%s: %s\n", child_args.error_what,
+                strerror(child_args.error));
+        goto exit_child;
+    }
 
-        if (argv == NULL)
-            argv = &none;
-        if (env == NULL)
-            env = &none;
+    PROBE2(spawn_exec, filename, (int)proc->pid);
 
-        if (set_ambient_capabilities() != 0) {
-            exit(255);
+    if (in_buf != NULL) {
+        if (write_all(pipes.parent_out, in_buf, in_size) != 0) {
+            perror("Writing to stdin in parent");
+            goto exit_child;
         }
+    }
 
-        // execve() is mistyped for backward compatibility,
-        // so need to const-cast here.
-        execve(filename, (char * const *)argv, (char * const *)env);
-        perror("Executing command");
-        exit(255);
+    if (close(pipes.parent_out) != 0) {
+        perror("Closing stdin pipe in parent");
+        close(pipes.parent_in);
+        goto exit_wait;
     }
-    else if (child_pid > 0) {
-        // parent
-        if (setup_pipes_for_parent(&pipes) != 0) {
-            goto exit_0;
-        }
 
-        if (in_buf != NULL) {
-            if (write_all(pipes.parent_out, in_buf, in_size) != 0) {
-                perror("Writing to stdin in parent");
-                ret = -1;
-            }
+    proc->out_fd = pipes.parent_in;
+    metrics_count(METRICS_SPAWNS);
+    return 0;
+
+exit_child:
+    close(pipes.parent_out);
+    close(pipes.parent_in);
+
+exit_wait:
+    waitpid(proc->pid, &status, 0);
+    if (proc->pidfd != -1)
+        close(proc->pidfd);
+    goto exit_failed;
+
+exit_pipes:
+    close(pipes.parent_out);
+    close(pipes.child_in);
+    close(pipes.child_out);
+    close(pipes.parent_in);
+
+exit_failed:
+    metrics_count(METRICS_SPAWN_FAILURES);
+    PROBE1(spawn_failed, filename);
+    return -1;
+}
+
+
+/** Wait for a program to finish and collect its output. */
+int run_finish(
+        run_t * proc, int * exit_code, const char ** out_buf,
+        ssize_t * out_size)
+{
+    struct pollfd pfds[2];
+    int exited = 0, status, err, ret = 0;
+    pid_t pid;
+
+    // Read its output until end of file, and watch for it exiting, until it
+    // times out. Negative fds are ignored by poll().
+    pfds[0].events = POLLIN;
+    pfds[1].events = POLLIN;
+    while (proc->stop_stage != RUN_STOP_ABANDONED) {
+        pfds[0].fd = proc->out_fd;
+        pfds[1].fd = exited ? -1 : proc->pidfd;
+        if ((pfds[0].fd == -1) && (pfds[1].fd == -1))
+            break;
+
+        err = poll(pfds, 2, run_timeout(proc));
+        if (err == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Waiting for child process");
+            break;
         }
 
-        if (close(pipes.parent_out) != 0) {
-            perror("Closing stdin pipe in parent");
-            ret = -1;
-        };
+        if (err == 0) {
+            run_expire(proc);
+            // anything it started may keep the pipe open, so stop here
+            if (exited)
+                break;
+            continue;
+        }
 
-        if (out_buf != NULL) {
-            if (read_all(pipes.parent_in, &out_buf_, &out_size_) != 0) {
-                fprintf(stderr, "Error reading from stdout/stderr");
-                ret = -1;
-            }
+        if (pfds[1].revents) {
+            exited = 1;
+            if (proc->stop_stage != RUN_STOP_NONE)
+                break;
         }
 
-        if (close(pipes.parent_in) != 0) {
-            perror("Closing stdout/err pipe in parent");
+        if (pfds[0].revents && (run_read(proc) == -1)) {
+            fprintf(stderr, "Error reading from stdout/err\n");
+            close(proc->out_fd);
+            proc->out_fd = -1;
             ret = -1;
         }
+    }
 
-        waitpid(child_pid, &status, 0);
-
-        if (WIFEXITED(status))
-            *exit_code = WEXITSTATUS(status);
-        else if (WIFSIGNALED(status))
-            *exit_code = -WTERMSIG(status);
+    if (proc->out_fd != -1) {
+        close(proc->out_fd);
+        proc->out_fd = -1;
+    }
 
-        *out_buf = out_buf_;
-        *out_size = out_size_;
-        return ret;
+    // if we gave up on it, reap it only if it has exited since
+    pid = waitpid(
+            proc->pid, &status,
+            proc->stop_stage == RUN_STOP_ABANDONED ? WNOHANG : 0);
 
+    if (pid == -1) {
+        perror("Waiting for child process");
+        *exit_code = 255;
+        ret = -1;
     }
-    // fork error if we get here, try to clean up
+    else if (pid == 0)
+        *exit_code = -SIGKILL;
+    else if (WIFEXITED(status))
+        *exit_code = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+        *exit_code = -WTERMSIG(status);
 
-exit_0:
-    close(pipes.parent_out);
-    close(pipes.child_in);
-    close(pipes.child_out);
-    close(pipes.parent_in);
-    return -1;
+    if (proc->pidfd != -1)
+        close(proc->pidfd);
+
+    PROBE2(spawn_done, (int)proc->pid, *exit_code);
+    trace_note(*exit_code, proc->out_size);
+
+    *out_buf = proc->out_buf;
+    *out_size = proc->out_size;
+    return ret;
+}
+
+
+/** Run a command and optionally communicate with it.
+ *
+ * @param filename The file to execute.
+ * @param argv Arguments to pass (may be NULL).
+ * @param env Environment variables to set (may be NULL).
+ * @param in_buf Data to send to stdin (may be NULL).
+ * @param in_size Length of input data.
+ * @param exit_code (out) The exit code of the process run, 255 if there was an
+ *              error starting it, or -signal if it was terminated with a
+ *              signal.
+ * @param out_buf (out) Pointer to a buffer with output received from the
+ *              command. This buffer will be allocated by this function, and
+ *              must be freed using secure_free() by the caller after use.
+ * @param out_size (out) Pointer to a variable to store the number of chars in
+ *              the output buffer in.
+ * @return 0 on success, -1 on error.
+ */
+int run(
+        const char * filename, const char * const argv[],
+        const char * const env[],
+        const char * in_buf, ssize_t in_size,
+        int * exit_code, const char ** out_buf, ssize_t * out_size)
+{
+    run_t proc;
+
+    if (run_start(&proc, filename, argv, env, in_buf, in_size) != 0)
+        return -1;
+
+    return run_finish(&proc, exit_code, out_buf, out_size);
 }
 
 
@@ -320,18 +626,12 @@ exit_0:
  *
  */
 void print_error_output(const char * out_buf, ssize_t out_size) {
-    char * err_buf;
-
     if (out_size > MAX_ERROR_OUTPUT_SIZE)
         out_size = MAX_ERROR_OUTPUT_SIZE;
 
-    err_buf = (char*)malloc(out_size + 1);
-    if (err_buf) {
-        strncpy(err_buf, out_buf, out_size);
-        err_buf[out_size] = '\0';
-        fprintf(stderr, "%s", err_buf);
-        free(err_buf);
-    }
+    // no copy, as the output may contain secrets
+    if (out_buf)
+        fprintf(stderr, "%.*s", (int)out_size, out_buf);
 }
 
 
@@ -342,9 +642,6 @@ void print_error_output(const char * out_buf, ssize_t out_size) {
  * be printed on stderr, and the output variables will not be assigned to.
  * Otherwise, the outputs are set and 0 is returned.
  *
- * Warning: if you may get more than 1kB of sensitive data on standard out
- * and/or standard error, see the comment at read_all().
- *
  * @param filename The file to execute.
  * @param argv Arguments to pass (may be NULL).
  * @param env Environment variables to set (may be NULL).
@@ -355,8 +652,8 @@ void print_error_output(const char * out_buf, ssize_t out_size) {
  *              signal.
  * @param out_buf (out) Pointer to a buffer with output received from the
  *              command. This buffer will be allocated by this function, and
- *              must be freed using free() by the caller after use. If NULL is
- *              passed, any output will be discarded.
+ *              must be freed using secure_free() by the caller after use.
+ *              If NULL is passed, any output will be discarded.
  * @param out_size (out) Pointer to a variable to store the number of chars in
  *              the output buffer in. May bu NULL if out_buf is NULL.
  * @return 0 on success, 1 on error.
@@ -389,13 +686,13 @@ int run_check(
         *out_size = out_size_;
     }
     else
-        free((void*)out_buf_);
+        secure_free((void*)out_buf_);
 
     return 0;
 
 exit_0:
     print_error_output(out_buf_, out_size_);
-    free((void*)out_buf_);
+    secure_free((void*)out_buf_);
     return 1;
 }
 
@@ -1,9 +1,160 @@
 /** Functions for starting a subprocess and communicating with it. */
 #pragma once
 
+#include <stdint.h>
 #include <sys/types.h>
 
 
+/** Exit code of a command that failed because a program timed out.
+ *
+ * This is what timeout(1) uses, so it will be familiar.
+ */
+#define RUN_TIMEOUT_EXIT_CODE 124
+
+
+/** A program started by run_start(). */
+typedef struct {
+    const char * filename;
+    pid_t pid;
+    int pidfd;                  // -1 if the kernel does not support pidfds
+    int out_fd;                 // stdout/stderr pipe, -1 after end of file
+    char * out_buf;             // output received so far
+    ssize_t out_size;
+    ssize_t buf_size;
+    uint64_t deadline_ns;       // CLOCK_MONOTONIC, 0 if there is none
+    int stop_stage;             // how far run_expire() has got
+} run_t;
+
+
+/** Override the time limits set in config.h.
+ *
+ * Limits are in milliseconds, with 0 meaning no limit, and -1 keeping the
+ * current one. Call this before run_begin_command().
+ *
+ * @param step_ms Maximum time a single program may take.
+ * @param command_ms Maximum time all programs of a command may take.
+ */
+void run_set_limits(int step_ms, int command_ms);
+
+
+/** Start the clock for a command.
+ *
+ * Programs started after this must have finished before the command's time
+ * limit is up, as well as their own. Once the command's time is up, any
+ * programs started to roll back what it did only get their own limit.
+ */
+void run_begin_command(void);
+
+
+/** Check whether a program timed out since run_begin_command().
+ *
+ * This may be called from any thread.
+ *
+ * @return 1 if a program was stopped because it took too long, 0 otherwise.
+ */
+int run_timed_out(void);
+
+
+/** Get the time until run_expire() needs to be called for a program.
+ *
+ * @param proc The program to check.
+ * @return The time in milliseconds, rounded up, or -1 if there is no limit,
+ *          as a timeout for poll() or epoll_wait().
+ */
+int run_timeout(const run_t * proc);
+
+
+/** Stop a program that has taken too long.
+ *
+ * Call this when run_timeout() has passed. The first call sends SIGTERM, and
+ * if the program is still running after the grace period set in config.h,
+ * the next one sends SIGKILL. A program stuck in the kernel may not even
+ * react to that, so if it still has not exited after another grace period,
+ * we stop waiting for it. run_finish() then reports it as killed without
+ * waiting. Without a grace period, SIGKILL is sent at once, and this waits
+ * until the program has exited, but leaves it for run_finish() to reap.
+ *
+ * @param proc The program to stop.
+ * @return 1 if we have stopped waiting for the program, 0 otherwise.
+ */
+int run_expire(run_t * proc);
+
+
+/** Start a program without waiting for it.
+ *
+ * This starts the program, sends it the input and closes its standard input.
+ * Use run_read() to receive its output as it becomes available, e.g. when
+ * polling out_fd says it's readable, and run_finish() to wait for it to exit.
+ * The pidfd, if available, becomes readable when the program exits.
+ *
+ * If the program has a time limit, see run_begin_command(), then whoever
+ * waits for it needs to call run_expire() when run_timeout() has passed.
+ * run_finish() does so itself.
+ *
+ * The input should fit into a pipe buffer, as it is written before reading
+ * any output.
+ *
+ * @param proc (out) The program, to pass to the functions below.
+ * @param filename The file to execute.
+ * @param argv Arguments to pass (may be NULL).
+ * @param env Environment variables to set (may be NULL).
+ * @param in_buf Data to send to stdin (may be NULL).
+ * @param in_size Length of input data.
+ * @return 0 on success, -1 on error, in which case the program is not
+ *          running and nothing needs to be cleaned up.
+ */
+int run_start(
+        run_t * proc, const char * filename, const char * const argv[],
+        const char * const env[], const char * in_buf, ssize_t in_size);
+
+
+/** Receive output from a program started with run_start().
+ *
+ * The output is kept in the secure arena, see secure.h, so it may contain
+ * secrets.
+ *
+ * @param proc The program to read from.
+ * @return 0 if there may be more output, 1 at end of file, -1 on error.
+ */
+int run_read(run_t * proc);
+
+
+/** Wait for output from a program and receive it, within its time limit.
+ *
+ * This is like run_read(), but for programs whose output is processed as it
+ * arrives. If the program takes too long, it is stopped as described for
+ * run_expire(), after which this keeps receiving any output it produces
+ * until we stop waiting for it.
+ *
+ * @param proc The program to read from.
+ * @return 0 if there may be more output, 1 at end of file or if we stopped
+ *          waiting, -1 on error.
+ */
+int run_read_timed(run_t * proc);
+
+
+/** Wait for a program started with run_start() to exit.
+ *
+ * This receives any remaining output first. It must be called exactly once
+ * for every successful run_start(). If the program takes too long, it is
+ * stopped as described for run_expire(). Without a pidfd, the time limit
+ * applies only until the program closes its output.
+ *
+ * @param proc The program to wait for.
+ * @param exit_code (out) The exit code of the process run, or -signal if it
+ *              was terminated with a signal.
+ * @param out_buf (out) Pointer to a buffer with the output received from the
+ *              program, which must be freed using secure_free() by the
+ *              caller.
+ * @param out_size (out) Pointer to a variable to store the number of chars in
+ *              the output buffer in.
+ * @return 0 on success, -1 on error.
+ */
+int run_finish(
+        run_t * proc, int * exit_code, const char ** out_buf,
+        ssize_t * out_size);
+
+
 /** Run a command and optionally communicate with it.
  *
  * @param filename The file to execute.
@@ -16,7 +167,7 @@
  *              signal.
  * @param out_buf (out) Pointer to a buffer with output received from the
  *              command. This buffer will be allocated by this function, and
- *              must be  freed using free() by the caller after use.
+ *              must be freed using secure_free() by the caller after use.
  * @param out_size (out) Pointer to a variable to store the number of chars in
  *              the output buffer in.
  * @return 0 on success, -1 on error.
@@ -53,8 +204,8 @@ void print_error_output(const char * out_buf, ssize_t out_size);
  *              signal.
  * @param out_buf (out) Pointer to a buffer with output received from the
  *              command. This buffer will be allocated by this function, and
- *              must be freed using free() by the caller after use. If NULL is
- *              passed, any output will be discarded.
+ *              must be freed using secure_free() by the caller after use.
+ *              If NULL is passed, any output will be discarded.
  * @param out_size (out) Pointer to a variable to store the number of chars in
  *              the output buffer in. May bu NULL if out_buf is NULL.
  * @return 0 on success, 1 on error.
@@ -0,0 +1,160 @@
+/** Tracing the steps of a command. */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
+
+
+typedef struct {
+    const char * step;          // NULL if no step is in progress
+    uint64_t start_ns;
+    int exit_code;
+    int ran_program;            // whether exit_code was set by trace_note()
+    ssize_t num_bytes;
+} trace_step_t;
+
+
+// File descriptor to write records to, or -1 if tracing is disabled
+static int trace_fd = -1;
+
+// Step in progress on this thread
+static _Thread_local trace_step_t trace_current;
+
+// Device of the task in progress on this thread, for probes
+static _Thread_local const char * trace_device = "";
+
+
+/** Check whether steps are timed, for records or for metrics. */
+static int trace_active(void) {
+    return (trace_fd != -1) || metrics_enabled();
+}
+
+
+/** Get the current time for a record. */
+uint64_t trace_now_ns(void) {
+    if (!trace_active())
+        return 0;
+
+    return metrics_now_ns();
+}
+
+
+/** Enable tracing. */
+int trace_open(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+
+    if ((flags == -1) || (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1)) {
+        perror("Invalid trace file descriptor");
+        return -1;
+    }
+
+    trace_fd = fd;
+    return 0;
+}
+
+
+/** Start a task on a single device. */
+void trace_task_begin(const char * device) {
+    trace_device = device;
+    PROBE1(task_start, device);
+}
+
+
+/** Finish the current task. */
+void trace_task_end(int result) {
+    PROBE2(task_done, trace_device, result);
+    trace_device = "";
+}
+
+
+/** Start a step. */
+void trace_begin(const char * step) {
+    PROBE2(step_start, trace_device, step);
+
+    // the step is remembered even if it is not timed, for its probe
+    trace_current.step = step;
+    trace_current.exit_code = 0;
+    trace_current.ran_program = 0;
+    trace_current.num_bytes = 0;
+    trace_current.start_ns = trace_now_ns();
+}
+
+
+/** Add the result of running a program or a kernel request to the step. */
+void trace_note(int exit_code, ssize_t num_bytes) {
+    if (!trace_current.step)
+        return;
+
+    // the first failure is the interesting one
+    if (!trace_current.ran_program || (trace_current.exit_code == 0))
+        trace_current.exit_code = exit_code;
+    trace_current.ran_program = 1;
+    trace_current.num_bytes += num_bytes;
+}
+
+
+/** Write a record for a step that ends now. */
+void trace_record(
+        const char * step, uint64_t start_ns, int exit_code,
+        ssize_t num_bytes)
+{
+    uint64_t end_ns;
+    struct rusage usage;
+    char record[256];
+    ssize_t written;
+    int len;
+
+    PROBE3(step_done, trace_device, step, exit_code);
+
+    if (!trace_active())
+        return;
+
+    end_ns = trace_now_ns();
+    metrics_step(step, end_ns - start_ns, exit_code);
+
+    if (trace_fd == -1)
+        return;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        usage.ru_maxrss = -1;
+
+    len = snprintf(
+            record, sizeof(record),
+            "step=%s start_ns=%llu end_ns=%llu exit=%d bytes=%zd"
+            " max_rss_kb=%ld\n",
+            step, (unsigned long long)start_ns, (unsigned long long)end_ns,
+            exit_code, num_bytes, usage.ru_maxrss);
+
+    // Tracing must not make the command fail, so errors are ignored
+    if ((len > 0) && (len < (int)sizeof(record))) {
+        written = write(trace_fd, record, len);
+        (void)written;
+    }
+}
+
+
+/** Finish the current step and write its record. */
+void trace_end(int result) {
+    if (!trace_current.step)
+        return;
+
+    trace_record(
+            trace_current.step, trace_current.start_ns,
+            trace_current.ran_program ? trace_current.exit_code : result,
+            trace_current.num_bytes);
+
+    trace_current.step = NULL;
+}
+
+
+/** Forget about the current step without writing a record. */
+void trace_discard(void) {
+    trace_current.step = NULL;
+}
+
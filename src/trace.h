@@ -0,0 +1,113 @@
+/** Tracing the steps of a command.
+ *
+ * When enabled with the --trace-fd=<fd> option, a record is written to the
+ * given file descriptor for each step a command takes, e.g. creating a device
+ * or entering a namespace. Records are single lines of space-separated
+ * key=value pairs:
+ *
+ *     step=link_add start_ns=... end_ns=... exit=0 bytes=0 max_rss_kb=...
+ *
+ * start_ns and end_ns are CLOCK_MONOTONIC timestamps. exit is the exit code of
+ * the program run for the step, or 0 on success and 1 on failure for steps
+ * done by the helper itself. bytes is the amount of output received from
+ * programs or from the kernel, and max_rss_kb is the peak resident set size of
+ * the helper so far.
+ *
+ * Each record is written with a single write(), so records from different
+ * threads do not mix if the fd is a pipe or a file opened for appending.
+ *
+ * Steps are also timed without --trace-fd if metrics are being collected,
+ * and each step that ends is counted in them, see metrics.h. The start and end
+ * of each step and task also fire probes, if they are enabled, see probes.h.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/** Enable tracing.
+ *
+ * @param fd File descriptor to write records to. It is set to close-on-exec,
+ *          so that programs we run do not inherit it.
+ * @return 0 on success, -1 if fd is not open, in which case a message is
+ *          printed.
+ */
+int trace_open(int fd);
+
+
+/** Start a task, which creates, connects or removes a single device.
+ *
+ * Tasks are only seen by probes, which include the device of the current
+ * task in those of its steps. Each thread has its own current task.
+ *
+ * @param device Name of the device. Must remain valid until
+ *          trace_task_end() is called.
+ */
+void trace_task_begin(const char * device);
+
+
+/** Finish the current task.
+ *
+ * @param result 0 if the task succeeded, 1 if it failed.
+ */
+void trace_task_end(int result);
+
+
+/** Start a step.
+ *
+ * Steps cannot be nested, and each thread has its own current step. Apart
+ * from firing probes, this does nothing if tracing and metrics are disabled,
+ * as do the other functions below.
+ *
+ * @param step Name of the step, without spaces. Must remain valid until
+ *          trace_end() is called.
+ */
+void trace_begin(const char * step);
+
+
+/** Add the result of running a program or a kernel request to the step.
+ *
+ * @param exit_code The exit code of the program, or 0 or 1 for success or
+ *          failure of a request.
+ * @param num_bytes Number of bytes received.
+ */
+void trace_note(int exit_code, ssize_t num_bytes);
+
+
+/** Finish the current step and write its record.
+ *
+ * @param result 0 if the step succeeded, 1 if it failed. Used as the exit code
+ *          if no program was run during the step.
+ */
+void trace_end(int result);
+
+
+/** Forget about the current step without writing a record.
+ *
+ * This is for steps that turn out to be traced with trace_record() instead.
+ */
+void trace_discard(void);
+
+
+/** Get the current time, for use with trace_record().
+ *
+ * @return The time in nanoseconds, or 0 if tracing and metrics are disabled.
+ */
+uint64_t trace_now_ns(void);
+
+
+/** Write a record for a step that ends now.
+ *
+ * This is for steps that overlap, which cannot use trace_begin() and
+ * trace_end().
+ *
+ * @param step Name of the step, without spaces.
+ * @param start_ns Start time of the step, from trace_now_ns().
+ * @param exit_code Exit code for the record, see above.
+ * @param num_bytes Number of bytes received.
+ */
+void trace_record(
+        const char * step, uint64_t start_ns, int exit_code,
+        ssize_t num_bytes);
+
@@ -0,0 +1,314 @@
+/** Functions for configuring WireGuard devices via generic netlink. */
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/genetlink.h>
+#include <linux/time_types.h>
+#include <linux/wireguard.h>
+
+#include "netlink.h"
+#include "parse.h"
+#include "wireguard.h"
+
+
+// Generic netlink family id for WireGuard, or 0 if not looked up yet
+static uint16_t wg_family_id = 0;
+
+
+/** Encode a value in [0, 63] as a base64 character, in constant time. */
+static char wg_b64_encode_char(int i) {
+    return i + 'A'
+        + (((25 - i) >> 8) & 6)
+        - (((51 - i) >> 8) & 75)
+        - (((61 - i) >> 8) & 15)
+        + (((62 - i) >> 8) & 3);
+}
+
+
+/** Decode a base64-encoded key. */
+int wg_key_from_base64(wg_key_t * key, const char * b64) {
+    return parse_key_base64(key->key, b64);
+}
+
+
+/** Encode a key as base64. */
+void wg_key_to_base64(char * b64, const wg_key_t * key) {
+    int i, val;
+
+    for (i = 0; i < 10; ++i) {
+        val = (key->key[i * 3] << 16) | (key->key[i * 3 + 1] << 8)
+            | key->key[i * 3 + 2];
+        b64[i * 4 + 0] = wg_b64_encode_char((val >> 18) & 63);
+        b64[i * 4 + 1] = wg_b64_encode_char((val >> 12) & 63);
+        b64[i * 4 + 2] = wg_b64_encode_char((val >> 6) & 63);
+        b64[i * 4 + 3] = wg_b64_encode_char(val & 63);
+    }
+
+    val = (key->key[30] << 8) | key->key[31];
+    b64[40] = wg_b64_encode_char((val >> 10) & 63);
+    b64[41] = wg_b64_encode_char((val >> 4) & 63);
+    b64[42] = wg_b64_encode_char((val << 2) & 63);
+    b64[43] = '=';
+    b64[44] = '\0';
+    explicit_bzero(&val, sizeof(val));
+}
+
+
+/** Extract the family id from a CTRL_CMD_GETFAMILY reply. */
+static int wg_family_id_cb(int index, const struct nlmsghdr * nlh, void * arg)
+{
+    const struct nlattr * tb[CTRL_ATTR_MAX + 1];
+    (void)index;
+
+    nl_msg_parse(nlh, GENL_HDRLEN, tb, CTRL_ATTR_MAX);
+    if (!tb[CTRL_ATTR_FAMILY_ID] || nl_attr_len(tb[CTRL_ATTR_FAMILY_ID]) < 2)
+        return 1;
+
+    memcpy(arg, nl_attr_data(tb[CTRL_ATTR_FAMILY_ID]), sizeof(uint16_t));
+    return 0;
+}
+
+
+/** Open a generic netlink socket for talking to WireGuard. */
+int wg_open(nl_sock_t * sock) {
+    struct genlmsghdr genl;
+    nl_batch_t batch;
+    uint16_t family_id = 0;
+
+    if (nl_open(sock, NETLINK_GENERIC))
+        goto exit_0;
+
+    if (wg_family_id == 0) {
+        memset(&genl, 0, sizeof(genl));
+        genl.cmd = CTRL_CMD_GETFAMILY;
+        genl.version = 1;
+
+        nl_batch_init(&batch);
+        nl_msg_begin(
+                &batch, GENL_ID_CTRL, 0, &genl, sizeof(genl),
+                "Error looking up WireGuard (is the kernel module loaded?)");
+        nl_attr_put_str(&batch, CTRL_ATTR_FAMILY_NAME, WG_GENL_NAME);
+
+        if (nl_batch_send_cb(sock, &batch, wg_family_id_cb, &family_id))
+            goto exit_1;
+
+        if (family_id == 0) {
+            fprintf(stderr, "Kernel did not return a WireGuard family id\n");
+            goto exit_1;
+        }
+        wg_family_id = family_id;
+    }
+
+    return 0;
+
+exit_1:
+    nl_close(sock);
+
+exit_0:
+    return -1;
+}
+
+
+/** Start a message for the given device. */
+static void wg_msg_begin(
+        nl_batch_t * batch, uint8_t cmd, uint16_t flags, const char * dev,
+        const char * what)
+{
+    struct genlmsghdr genl;
+
+    memset(&genl, 0, sizeof(genl));
+    genl.cmd = cmd;
+    genl.version = WG_GENL_VERSION;
+
+    nl_msg_begin(batch, wg_family_id, flags, &genl, sizeof(genl), what);
+    nl_attr_put_str(batch, WGDEVICE_A_IFNAME, dev);
+}
+
+
+/** Add a request to set the listen port and private key of a device. */
+void wg_set_device(
+        nl_batch_t * batch, const char * dev, uint16_t listen_port,
+        const wg_key_t * private_key, const char * what)
+{
+    wg_msg_begin(batch, WG_CMD_SET_DEVICE, 0, dev, what);
+    nl_attr_put_u16(batch, WGDEVICE_A_LISTEN_PORT, listen_port);
+    nl_attr_put(
+            batch, WGDEVICE_A_PRIVATE_KEY, private_key->key, WG_KEY_LEN);
+}
+
+
+/** Add a list with a single peer to a WG_CMD_SET_DEVICE message. */
+static void wg_put_peers(nl_batch_t * batch, const wg_peer_t * peer) {
+    size_t peers, peer_nest, allowed_ips, allowed_ip;
+    uint32_t allowed_ip_n = htonl(peer->allowed_ip);
+
+    peers = nl_nest_begin(batch, WGDEVICE_A_PEERS);
+    peer_nest = nl_nest_begin(batch, 0);
+
+    nl_attr_put(
+            batch, WGPEER_A_PUBLIC_KEY, peer->public_key->key, WG_KEY_LEN);
+    nl_attr_put_u32(batch, WGPEER_A_FLAGS, WGPEER_F_REPLACE_ALLOWEDIPS);
+    nl_attr_put(
+            batch, WGPEER_A_ENDPOINT, &peer->endpoint,
+            sizeof(peer->endpoint));
+
+    allowed_ips = nl_nest_begin(batch, WGPEER_A_ALLOWEDIPS);
+    allowed_ip = nl_nest_begin(batch, 0);
+    nl_attr_put_u16(batch, WGALLOWEDIP_A_FAMILY, AF_INET);
+    nl_attr_put(
+            batch, WGALLOWEDIP_A_IPADDR, &allowed_ip_n,
+            sizeof(allowed_ip_n));
+    nl_attr_put_u8(batch, WGALLOWEDIP_A_CIDR_MASK, peer->allowed_ip_cidr);
+    nl_nest_end(batch, allowed_ip);
+    nl_nest_end(batch, allowed_ips);
+
+    nl_nest_end(batch, peer_nest);
+    nl_nest_end(batch, peers);
+}
+
+
+/** Add a request to add or update a peer of a device. */
+void wg_set_peer(
+        nl_batch_t * batch, const char * dev, const wg_peer_t * peer,
+        const char * what)
+{
+    wg_msg_begin(batch, WG_CMD_SET_DEVICE, 0, dev, what);
+    wg_put_peers(batch, peer);
+}
+
+
+/** Add a request to update the listen port and the peer of a device. */
+void wg_update_device(
+        nl_batch_t * batch, const char * dev, uint16_t listen_port,
+        const wg_peer_t * peer, const char * what)
+{
+    wg_msg_begin(batch, WG_CMD_SET_DEVICE, 0, dev, what);
+    if (listen_port != 0)
+        nl_attr_put_u16(batch, WGDEVICE_A_LISTEN_PORT, listen_port);
+    nl_attr_put_u32(batch, WGDEVICE_A_FLAGS, WGDEVICE_F_REPLACE_PEERS);
+    if (peer)
+        wg_put_peers(batch, peer);
+}
+
+
+/** Add a request for the configuration of a device. */
+void wg_get_device(nl_batch_t * batch, const char * dev, const char * what) {
+    wg_msg_begin(batch, WG_CMD_GET_DEVICE, NLM_F_DUMP, dev, what);
+    batch->secret = 1;
+}
+
+
+/** Add the allowed IPs of the first peer to the description. */
+static void wg_parse_allowed_ips(
+        const struct nlattr * allowed_ips, wg_device_info_t * info)
+{
+    const struct nlattr * tb[WGALLOWEDIP_A_MAX + 1];
+    const struct nlattr * attr;
+    uint32_t ip;
+
+    nl_nest_for_each(attr, allowed_ips) {
+        nl_nest_parse(attr, tb, WGALLOWEDIP_A_MAX);
+        if (
+                !tb[WGALLOWEDIP_A_FAMILY] || !tb[WGALLOWEDIP_A_IPADDR] ||
+                !tb[WGALLOWEDIP_A_CIDR_MASK] ||
+                (nl_attr_len(tb[WGALLOWEDIP_A_FAMILY]) != sizeof(uint16_t)) ||
+                (nl_attr_len(tb[WGALLOWEDIP_A_CIDR_MASK]) != sizeof(uint8_t)))
+            continue;
+
+        ++info->peer_num_allowed_ips;
+
+        if (
+                (info->peer_num_allowed_ips == 1) &&
+                (*(const uint16_t *)nl_attr_data(tb[WGALLOWEDIP_A_FAMILY])
+                    == AF_INET) &&
+                (nl_attr_len(tb[WGALLOWEDIP_A_IPADDR]) == sizeof(ip)))
+        {
+            memcpy(&ip, nl_attr_data(tb[WGALLOWEDIP_A_IPADDR]), sizeof(ip));
+            info->peer_allowed_ip = ntohl(ip);
+            info->peer_allowed_ip_cidr =
+                *(const uint8_t *)nl_attr_data(tb[WGALLOWEDIP_A_CIDR_MASK]);
+        }
+    }
+}
+
+
+/** Get a 64-bit counter from an attribute, if it is there. */
+static void wg_parse_u64(const struct nlattr * attr, uint64_t * value) {
+    if (attr && (nl_attr_len(attr) == sizeof(uint64_t)))
+        memcpy(value, nl_attr_data(attr), sizeof(uint64_t));
+}
+
+
+/** Add the contents of a reply to wg_get_device() to a description. */
+int wg_device_parse(const struct nlmsghdr * nlh, wg_device_info_t * info) {
+    const struct nlattr * tb[WGDEVICE_A_MAX + 1];
+    const struct nlattr * peer_tb[WGPEER_A_MAX + 1];
+    const struct nlattr * peer, * key, * endpoint, * handshake;
+    struct __kernel_timespec ts;
+
+    if (
+            (nlh->nlmsg_type != wg_family_id) ||
+            (nlh->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)))
+        return 1;
+
+    nl_msg_parse(nlh, GENL_HDRLEN, tb, WGDEVICE_A_MAX);
+
+    if (
+            tb[WGDEVICE_A_PUBLIC_KEY] &&
+            (nl_attr_len(tb[WGDEVICE_A_PUBLIC_KEY]) == WG_KEY_LEN))
+        memcpy(
+                info->public_key.key, nl_attr_data(tb[WGDEVICE_A_PUBLIC_KEY]),
+                WG_KEY_LEN);
+
+    if (
+            tb[WGDEVICE_A_LISTEN_PORT] &&
+            (nl_attr_len(tb[WGDEVICE_A_LISTEN_PORT]) == sizeof(uint16_t)))
+        memcpy(
+                &info->listen_port, nl_attr_data(tb[WGDEVICE_A_LISTEN_PORT]),
+                sizeof(uint16_t));
+
+    if (!tb[WGDEVICE_A_PEERS])
+        return 0;
+
+    nl_nest_for_each(peer, tb[WGDEVICE_A_PEERS]) {
+        nl_nest_parse(peer, peer_tb, WGPEER_A_MAX);
+        key = peer_tb[WGPEER_A_PUBLIC_KEY];
+        if (!key || (nl_attr_len(key) != WG_KEY_LEN))
+            return 1;
+
+        // A peer with many allowed IPs continues in the next message, in
+        // which case it's repeated with the rest of them.
+        if (
+                (info->num_peers != 1) ||
+                memcmp(info->peer_key.key, nl_attr_data(key), WG_KEY_LEN))
+            ++info->num_peers;
+
+        if (info->num_peers != 1)
+            continue;
+
+        memcpy(info->peer_key.key, nl_attr_data(key), WG_KEY_LEN);
+
+        endpoint = peer_tb[WGPEER_A_ENDPOINT];
+        if (
+                endpoint &&
+                (nl_attr_len(endpoint) == sizeof(struct sockaddr_in)))
+            memcpy(
+                    &info->peer_endpoint, nl_attr_data(endpoint),
+                    sizeof(struct sockaddr_in));
+
+        if (peer_tb[WGPEER_A_ALLOWEDIPS])
+            wg_parse_allowed_ips(peer_tb[WGPEER_A_ALLOWEDIPS], info);
+
+        wg_parse_u64(peer_tb[WGPEER_A_RX_BYTES], &info->peer_rx_bytes);
+        wg_parse_u64(peer_tb[WGPEER_A_TX_BYTES], &info->peer_tx_bytes);
+
+        handshake = peer_tb[WGPEER_A_LAST_HANDSHAKE_TIME];
+        if (handshake && (nl_attr_len(handshake) == sizeof(ts))) {
+            memcpy(&ts, nl_attr_data(handshake), sizeof(ts));
+            info->peer_last_handshake = ts.tv_sec;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+/** Functions for configuring WireGuard devices via generic netlink.
+ *
+ * These talk to the kernel's WireGuard module directly, rather than via the
+ * `wg` program. Keys are passed around in binary form, in wg_key_t buffers,
+ * which should be wiped using explicit_bzero() after use if they contain a
+ * private key.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "netlink.h"
+
+
+/** Size of a WireGuard key in binary form. */
+#define WG_KEY_LEN 32
+
+/** Size of a WireGuard key in base64 form, excluding the terminating null. */
+#define WG_KEY_B64_LEN 44
+
+
+typedef struct {
+    uint8_t key[WG_KEY_LEN];
+} wg_key_t;
+
+
+/** Description of a peer to add to a device.
+ *
+ * allowed_ip is in host byte order, endpoint is a socket address as usual.
+ */
+typedef struct {
+    const wg_key_t * public_key;
+    struct sockaddr_in endpoint;
+    uint32_t allowed_ip;
+    uint8_t allowed_ip_cidr;
+} wg_peer_t;
+
+
+/** Configuration of a device, see wg_device_parse().
+ *
+ * Only the first peer is described in detail, as our devices have at most
+ * one. The allowed IP is in host byte order, and the first one of the peer's
+ * IPv4 allowed IPs. The endpoint has sin_family 0 if the peer has no IPv4
+ * endpoint. The last handshake is in seconds since the epoch, or 0 if there
+ * has not been one. The public key is all zeros if the device has no key.
+ */
+typedef struct {
+    wg_key_t public_key;
+    uint16_t listen_port;
+    int num_peers;
+    wg_key_t peer_key;
+    struct sockaddr_in peer_endpoint;
+    int peer_num_allowed_ips;
+    uint32_t peer_allowed_ip;
+    uint8_t peer_allowed_ip_cidr;
+    uint64_t peer_rx_bytes;
+    uint64_t peer_tx_bytes;
+    int64_t peer_last_handshake;
+} wg_device_info_t;
+
+
+/** Decode a base64-encoded key.
+ *
+ * The input must be a 44-character base64 string ending in =, as checked by
+ * validate_wireguard_key(). It need not be null-terminated.
+ *
+ * @param key (out) The decoded key.
+ * @param b64 The base64-encoded key.
+ * @return 0 on success, -1 if the input is not a valid key.
+ */
+int wg_key_from_base64(wg_key_t * key, const char * b64);
+
+
+/** Encode a key as base64.
+ *
+ * @param b64 (out) Buffer of at least WG_KEY_B64_LEN + 1 chars to write the
+ *          null-terminated encoded key to.
+ * @param key The key to encode.
+ */
+void wg_key_to_base64(char * b64, const wg_key_t * key);
+
+
+/** Open a generic netlink socket for talking to WireGuard.
+ *
+ * Like any netlink socket, the socket can only be used to configure devices
+ * in the network namespace it was opened in. The first call looks up the
+ * WireGuard generic netlink family, later calls reuse the result.
+ *
+ * @param sock The socket object to initialise.
+ * @return 0 on success, -1 on error.
+ */
+int wg_open(nl_sock_t * sock);
+
+
+/** Add a request to set the listen port and private key of a device.
+ *
+ * The private key is copied into the batch, which should be wiped after use.
+ *
+ * @param batch The batch to add the request to.
+ * @param dev Name of the device to configure.
+ * @param listen_port The UDP port to listen on.
+ * @param private_key The private key to use.
+ * @param what Description to use in error messages.
+ */
+void wg_set_device(
+        nl_batch_t * batch, const char * dev, uint16_t listen_port,
+        const wg_key_t * private_key, const char * what);
+
+
+/** Add a request to add or update a peer of a device.
+ *
+ * The peer's allowed IPs are replaced with the given ones.
+ *
+ * @param batch The batch to add the request to.
+ * @param dev Name of the device to configure.
+ * @param peer The peer to add or update.
+ * @param what Description to use in error messages.
+ */
+void wg_set_peer(
+        nl_batch_t * batch, const char * dev, const wg_peer_t * peer,
+        const char * what);
+
+
+/** Add a request to update the listen port and the peer of a device.
+ *
+ * The given peer replaces any peers the device has, or if none is given, all
+ * peers are removed.
+ *
+ * @param batch The batch to add the request to.
+ * @param dev Name of the device to configure.
+ * @param listen_port The UDP port to listen on, or 0 to keep the current one.
+ * @param peer The peer to set, or NULL.
+ * @param what Description to use in error messages.
+ */
+void wg_update_device(
+        nl_batch_t * batch, const char * dev, uint16_t listen_port,
+        const wg_peer_t * peer, const char * what);
+
+
+/** Add a request for the configuration of a device.
+ *
+ * Send it with nl_batch_send_cb(), and pass the replies to wg_device_parse().
+ * The replies include the private key, so they are received into the secure
+ * arena.
+ *
+ * @param batch The batch to add the request to.
+ * @param dev Name of the device to get.
+ * @param what Description to use in error messages.
+ */
+void wg_get_device(nl_batch_t * batch, const char * dev, const char * what);
+
+
+/** Add the contents of a reply to wg_get_device() to a description.
+ *
+ * Devices with many peers are described in several messages, which should all
+ * be passed to this function in turn. The private key is not stored.
+ *
+ * @param nlh The message to parse.
+ * @param info The description to add to, zeroed before the first message.
+ * @return 0 on success, 1 if the message is not a valid reply.
+ */
+int wg_device_parse(const struct nlmsghdr * nlh, wg_device_info_t * info);